@@ -25,6 +25,12 @@
 #define DESCALE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+
+#define DESCALE_VERSION_MAJOR 11
+#define DESCALE_VERSION_MINOR 0
+#define DESCALE_VERSION ((DESCALE_VERSION_MAJOR << 16) | DESCALE_VERSION_MINOR)
 
 
 typedef enum DescaleMode
@@ -37,6 +43,9 @@ typedef enum DescaleMode
     DESCALE_MODE_SPLINE64 = 6,
     DESCALE_MODE_POINT    = 7,
     DESCALE_MODE_CUSTOM   = 8,
+    // Radially symmetric kernels of both axes at once, only for DescaleAPI.create_ewa_core
+    DESCALE_MODE_EWA_LANCZOS = 9,   // jinc windowed by jinc
+    DESCALE_MODE_EWA_JINC    = 10,  // unwindowed jinc
 
     DESCALE_FLAG_SCALE    = 1 << 8
 } DescaleMode;
@@ -57,6 +66,36 @@ typedef enum DescaleBorder
 } DescaleBorder;
 
 
+// Sample types of DescaleAPI.process_vectors_format, integers are mapped to values between 0 and 1
+typedef enum DescaleSampleType
+{
+    DESCALE_SAMPLE_FLOAT = 0,   // 32-bit float
+    DESCALE_SAMPLE_HALF  = 1,   // IEEE half float
+    DESCALE_SAMPLE_U8    = 2,   // 8-bit integer
+    DESCALE_SAMPLE_U16   = 3    // 9 to 16-bit integer stored in 16 bits
+} DescaleSampleType;
+
+
+// Transfer functions of DescaleSampleFormat, linear light is normalized so that 1.0 is the peak of the curve
+typedef enum DescaleTransfer
+{
+    DESCALE_TRANSFER_LINEAR = 0,
+    DESCALE_TRANSFER_SRGB   = 1,    // IEC 61966-2-1 piecewise curve
+    DESCALE_TRANSFER_BT1886 = 2,    // pure 2.4 power with a black level of 0
+    DESCALE_TRANSFER_PQ     = 3,    // SMPTE ST 2084, 1.0 is 10000 cd/m2
+    DESCALE_TRANSFER_HLG    = 4     // ARIB STD-B67 OETF, scene light without the OOTF
+} DescaleTransfer;
+
+
+typedef struct DescaleSampleFormat
+{
+    enum DescaleSampleType type;
+    int bits;       // significant bits of DESCALE_SAMPLE_U16
+    bool dither;    // add an ordered dither before rounding stored integers
+    enum DescaleTransfer transfer;  // the samples are encoded with this curve and converted to linear light for the solver
+} DescaleSampleFormat;
+
+
 typedef enum DescaleOpt
 {
     DESCALE_OPT_AUTO = 0,
@@ -65,6 +104,16 @@ typedef enum DescaleOpt
 } DescaleOpt;
 
 
+// Kernel used by the process functions for one direction of a core, see DescaleAPI.autotune_core
+typedef enum DescaleKernel
+{
+    DESCALE_KERNEL_DEFAULT = 0,     // SIMD kernel of the API, specialized for the bandwidth if possible
+    DESCALE_KERNEL_GENERIC = 1,     // SIMD kernel for any bandwidth
+    DESCALE_KERNEL_C       = 2,     // plain C kernel
+    DESCALE_KERNEL_JIT     = 3      // code generated for the core, vertical only, falls back to DEFAULT if unavailable
+} DescaleKernel;
+
+
 typedef struct DescaleCustomKernel
 {
     double (*f)(double x, void *user_data);
@@ -77,7 +126,7 @@ typedef struct DescaleParams
 {
     enum DescaleMode mode;
     bool upscale;
-    int taps;           // required if mode is LANCZOS or CUSTOM
+    int taps;           // required if mode is LANCZOS, CUSTOM or one of the EWA modes, which cut the kernel at its taps-th zero
     double param1;      // required if mode is BICUBIC
     double param2;      // required if mode is BICUBIC
     double blur;        // optional
@@ -87,6 +136,8 @@ typedef struct DescaleParams
     double active_dim;  // always required; usually equal to dst_dim
     int has_ignore_mask;
     enum DescaleBorder border_handling;        // optional
+    double band_tolerance;                     // optional; drop outer LDLT band diagonals below this magnitude
+    int dense_threshold;                       // optional; use the dense solve matrix if dst_dim is smaller
     struct DescaleCustomKernel custom_kernel;  // required if mode is CUSTOM
 } DescaleParams;
 
@@ -96,7 +147,8 @@ typedef struct DescaleCore
     int src_dim;
     int dst_dim;
     bool upscale;
-    int bandwidth;
+    bool dense;         // weights hold the dense solve matrix (A' A)^-1 A'
+    int bandwidth;      // effective bandwidth of the LDLT factors, 1 if A' A is diagonal
     float **upper;
     float **lower;
     float *diagonal;
@@ -107,19 +159,225 @@ typedef struct DescaleCore
     int *weights_top_idx;
     int *weights_bot_idx;
     int weights_columns;
+    float *scale_weights;       // A in row-major order, for upscaling and the two-axis masked solver
+    int scale_weights_columns;
+    enum DescaleKernel kernel[2];   // per DescaleDir, only set by autotune_core
+    void *jit;                      // generated code for DESCALE_KERNEL_JIT
+
+    // Counters, the process functions update them atomically
+    unsigned long long build_time_ns;
+    unsigned long long process_calls;
+    unsigned long long process_vectors;
+    unsigned long long process_time_ns;
+    unsigned long long masked_refactorizations;
 } DescaleCore;
 
 
+/*
+ * Non-separable kernel of both axes, see DescaleAPI.create_ewa_core.
+ * The weight of an input sample only depends on the distance to the
+ * output position and the phases of the output row and column, so the
+ * weights of all outputs are stored once per phase pair in a table.
+ * A map lists the pairs of input and output rows that are connected with
+ * the table offset of their row phase, and the inputs of every output
+ * column with the table offset of their column phase.
+ */
+typedef struct DescaleEwaMap
+{
+    int rows, columns;          // of the output
+    int inputs;                 // samples per input row
+    int pair_count;
+    int *pairs;                 // (input row, output row, table offset, first entry, end entry), sorted by table offset
+    int entries;                // per output column, entry k of column x is at x * entries + k
+    int *column_index;
+    int *column_weight;
+    int extra_count;            // column entries that did not fit into entries, as (output, input, table offset) triples
+    int *extra;
+} DescaleEwaMap;
+
+
+typedef struct DescaleEwaCore
+{
+    int src_width, src_height;  // the larger size, also for upscale cores
+    int dst_width, dst_height;
+    bool upscale;
+    int taps_per_axis;          // filter size of both axes
+    int phases_h, phases_v;
+    float *table;               // weights, indexed by the offsets of the maps
+    struct DescaleEwaMap upscale_map;   // A, from the small to the large size
+    struct DescaleEwaMap descale_map;   // A', from the large to the small size
+    // Separable descale with a similar kernel, starting guess of the solver, NULL for upscale cores
+    struct DescaleCore *core_h, *core_v;
+    // Separable descale with a wider kernel and a damped diagonal, preconditioner of the solver, NULL for upscale cores
+    struct DescaleCore *precondition_h, *precondition_v;
+    struct DescaleCore solve_h, solve_v;    // views of them that only apply (A' A)^-1
+    int *solve_idx;
+    float *solve_weights;
+    unsigned long long build_time_ns;
+} DescaleEwaCore;
+
+
+// Snapshot of the counters of a core, filled by DescaleAPI.get_core_stats
+typedef struct DescaleCoreStats
+{
+    const char *variant;                // "b1", "b3", "b7", "generic", "dense", "upscale" or "masked"
+    enum DescaleOpt opt;                // instruction set used by the API that filled the stats
+    int bandwidth;
+    double build_time_ms;
+    unsigned long long calls;           // process_vectors calls, every plane of a batched call counts
+    unsigned long long vectors;
+    double process_time_ms;             // cumulative over all threads
+    unsigned long long masked_refactorizations;
+} DescaleCoreStats;
+
+
 typedef struct DescaleAPI
 {
     struct DescaleCore *(*create_core)(int src_dim, int dst_dim, struct DescaleParams *params);
     void (*free_core)(struct DescaleCore *core);
     void (*process_vectors)(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
                             int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
+    // Processes num_planes planes of identical dimensions with the same core at once, no ignore mask support
+    void (*process_vectors_planes)(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int num_planes,
+                                   const int *src_strides, const int *dst_strides, const float *const *srcps, float *const *dstps);
+    void (*get_core_stats)(const struct DescaleCore *core, struct DescaleCoreStats *stats);
+    // Times the kernels that can process the core in the given direction and keeps the fastest one for it.
+    // The choice is cached per CPU model, library version, opt and geometry class in a file, so later runs skip the measurement.
+    // Must not be called while the core is used by other threads.
+    void (*autotune_core)(struct DescaleCore *core, enum DescaleDir dir, int vector_count);
+    // Input samples [*src_first, *src_end) of a vector that process_vectors_window reads for the outputs [first, first + count)
+    void (*get_window_source_range)(const struct DescaleCore *core, int first, int count, double tolerance, int *src_first, int *src_end);
+    // Like process_vectors, but only computes the outputs [first, first + count) of every vector, dstp receives count samples per vector.
+    // The solve is restricted to a window around them, extended by a guard band that keeps the error caused by the
+    // rest of the vector below about tolerance relative to the signal (1e-5 if tolerance is not positive).
+    // srcp and imaskp point to input sample src_first, which must not be after the one given by get_window_source_range.
+    void (*process_vectors_window)(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int first, int count, double tolerance, int src_first,
+                                   int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
+    // Like process_vectors for the two passes of a descale, but the intermediate is stored as IEEE half floats:
+    // the horizontal direction writes dstp as halves, the vertical one reads srcp as halves. Strides are in samples.
+    // Descaling cores without ignore mask only. NULL if the API has no fast half float conversion.
+    void (*process_vectors_half)(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                 int src_stride, int dst_stride, const void *srcp, void *dstp);
+    // Like process_vectors, but srcp and dstp hold samples of the given formats and strides are in samples.
+    // Integers are rounded to nearest and clamped when stored. The conversions run on blocks of a few vectors
+    // right before and after the solver, so no converted copy of the whole input or output is made.
+    // Samples with a transfer function are decoded to linear light when loaded and encoded again when stored.
+    void (*process_vectors_format)(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                   int src_stride, int imask_stride, int dst_stride, const void *srcp, const unsigned char *imaskp, void *dstp,
+                                   const struct DescaleSampleFormat *src_format, const struct DescaleSampleFormat *dst_format);
+    // Descales a plane along both axes with an ignore mask by solving the masked least squares problem of both axes at once.
+    // It uses conjugate gradients preconditioned by the separable descale of core_h and core_v, which must be descaling cores
+    // created without has_ignore_mask. Stops after max_iterations or once the preconditioned residual of the normal equations
+    // is below tolerance relative to the unmasked input. With warm_start dstp holds the starting guess, for example the
+    // solution of the previous frame. Returns the number of iterations, or -1 without touching dstp if the mask hides more
+    // than a quarter of the plane, which leaves too many outputs determined by little but the masked inputs to converge.
+    int (*process_plane_masked)(struct DescaleCore *core_h, struct DescaleCore *core_v, int max_iterations, double tolerance, bool warm_start,
+                                int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
+    // Creates a core for the EWA modes, which resample both axes at once. The mode, taps, blur, border handling and upscale
+    // are taken from params_h, shift and active_dim from the parameters of the respective axis. post_conv is not supported.
+    struct DescaleEwaCore *(*create_ewa_core)(int src_width, int src_height, int dst_width, int dst_height,
+                                              const struct DescaleParams *params_h, const struct DescaleParams *params_v);
+    void (*free_ewa_core)(struct DescaleEwaCore *core);
+    // Descales a plane with an EWA core by solving the least squares problem with conjugate gradients, started from and
+    // preconditioned by separable Lanczos descales. max_iterations, tolerance, warm_start and the optional ignore mask work
+    // like in process_plane_masked, a tolerance below the float precision is raised to it. Upscale cores just resample srcp.
+    // Returns the number of iterations, or -1 without touching dstp if the mask hides more than a quarter of the plane.
+    int (*process_plane_ewa)(struct DescaleEwaCore *core, int max_iterations, double tolerance, bool warm_start,
+                             int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
 } DescaleAPI;
 
 
 struct DescaleAPI get_descale_api(enum DescaleOpt opt);
 
 
+// Statistics of the per-thread scratch arenas used by the process functions
+typedef struct DescaleScratchStats
+{
+    size_t high_water;                  // largest amount of scratch memory a single thread needed at once
+    size_t reserved;                    // bytes currently reserved by all arenas
+    unsigned long long allocations;     // number of heap allocations done by all arenas so far
+    int arenas;                         // number of live arenas (one per thread that processed something)
+} DescaleScratchStats;
+
+
+void descale_get_scratch_stats(struct DescaleScratchStats *stats);
+
+
+// DESCALE_VERSION of the library, for checking it against the header at runtime
+int descale_version(void);
+
+
+// Optional struct members must be initialized to 0 if not used
+typedef struct DescaleFrameParams
+{
+    int src_width, src_height;          // of the first plane
+    int dst_width, dst_height;
+    int num_planes;                     // 1 to 3
+    int subsampling_h, subsampling_v;   // log2 of the subsampling of the second and third plane
+    double shift_h, shift_v;            // optional
+    double active_width, active_height; // optional; 0 selects dst_width/dst_height, or src_width/src_height when upscaling
+    bool force_h, force_v;              // optional; process an axis even if it would not change the image
+    bool parallel_planes;               // optional; process the planes of a frame on the shared worker pool
+    bool autotune;                      // optional; see DescaleAPI.autotune_core
+    bool half_intermediate;             // optional; store the intermediate as half floats, see DescaleAPI.process_vectors_half
+    enum DescaleOpt opt;                // optional
+    struct DescaleParams params;        // shift, active_dim and has_ignore_mask are ignored
+} DescaleFrameParams;
+
+
+typedef struct DescaleContext DescaleContext;
+
+
+// Builds the cores for both axes and all planes once, returns NULL if the parameters are invalid or the cores can not be created
+struct DescaleContext *descale_context_create(const struct DescaleFrameParams *params);
+
+// Descales one frame from the caller's buffers into the caller's buffers, strides are in samples.
+// The intermediate image of two-axis processing never leaves the library. Frames whose pointers
+// are 32 byte aligned and whose strides are multiples of 8 use the SIMD kernels, others the C kernels.
+// May be called from several threads at once with the same context.
+void descale_context_process(struct DescaleContext *ctx, const float *const *srcps, const int *src_strides,
+                             float *const *dstps, const int *dst_strides);
+
+// Out-of-core version of descale_context_process for images larger than the memory. Descales every frame of a raw planar
+// file into a new file through memory mappings. Samples have depth bits (16 bit little endian above 8 bits, float for 32),
+// integer samples are processed as values between 0 and 1. Buffers stay below about memory_limit bytes (256 MiB if 0),
+// the intermediate image is kept in a temporary file. Returns the number of frames, or -1 if depth is not between 8 and 16
+// or 32, if the source file ends in a partial frame or if a file could not be mapped or a buffer allocated.
+long long descale_context_process_file(struct DescaleContext *ctx, const char *src_path, const char *dst_path, int depth, size_t memory_limit);
+
+void descale_context_free(struct DescaleContext *ctx);
+
+
+/*
+ * Line-based API for scanline pipelines, it descales a single plane of a frame described by DescaleFrameParams.
+ * Input rows are pushed one at a time and output rows can be pulled as soon as they are final.
+ * The horizontal pass runs right away. With tolerance 0 the vertical pass is exact and waits for the last input row,
+ * otherwise the output rows are computed in blocks from a window of input rows around them, which keeps the difference
+ * to the exact result below about tolerance relative to the signal (see DescaleAPI.process_vectors_window).
+ * descale_line_input_needed() tells how many input rows have to be pushed before an output row is final, and at most
+ * descale_line_buffer_rows() rows of intermediate and output data are buffered.
+ */
+typedef struct DescaleLineContext DescaleLineContext;
+
+
+// Returns NULL if the parameters are invalid or the context or its buffers can not be allocated
+struct DescaleLineContext *descale_line_create(const struct DescaleFrameParams *params, int plane, double tolerance);
+
+int descale_line_input_needed(const struct DescaleLineContext *lc, int row);
+
+int descale_line_buffer_rows(const struct DescaleLineContext *lc);
+
+// Returns the number of output rows that are ready, or -1 if the buffer is full and they have to be pulled first
+// or if all rows of the frame were already pushed
+int descale_line_push(struct DescaleLineContext *lc, const float *row);
+
+// Copies the next output row, returns false if it is not final yet
+bool descale_line_pull(struct DescaleLineContext *lc, float *row);
+
+// Starts the next frame
+void descale_line_reset(struct DescaleLineContext *lc);
+
+void descale_line_free(struct DescaleLineContext *lc);
+
+
 #endif  // DESCALE_H
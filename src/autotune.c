@@ -0,0 +1,257 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "autotune.h"
+#include "common.h"
+#include "trace.h"
+
+#ifdef DESCALE_X86
+    #include "x86/cpuinfo_x86.h"
+#endif
+
+
+#define AUTOTUNE_MAX_ENTRIES 256
+#define AUTOTUNE_KEY_SIZE 96
+#define AUTOTUNE_MAX_VECTORS 256    // vectors of the measured sample
+#define AUTOTUNE_RUNS 5
+#define AUTOTUNE_MARGIN 0.97        // another kernel has to be at least 3% faster than the default one
+
+
+static const char *const kernel_names[] = {"default", "generic", "c", "jit"};
+
+
+struct AutotuneEntry
+{
+    char key[AUTOTUNE_KEY_SIZE];
+    enum DescaleKernel kernel;
+};
+
+
+static pthread_once_t autotune_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t autotune_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct AutotuneEntry autotune_entries[AUTOTUNE_MAX_ENTRIES];
+static int autotune_count;
+static char autotune_cpu[64];
+static char autotune_path[1024];
+
+
+static void get_cache_path(char *path, size_t size)
+{
+    const char *dir = getenv("DESCALE_AUTOTUNE_CACHE");
+    if (dir) {
+        snprintf(path, size, "%s", dir);
+        return;
+    }
+
+#ifdef _WIN32
+    if ((dir = getenv("LOCALAPPDATA")) && *dir)
+        snprintf(path, size, "%s\\descale-autotune.txt", dir);
+#else
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        snprintf(path, size, "%s/descale-autotune.txt", dir);
+    else if ((dir = getenv("HOME")) && *dir)
+        snprintf(path, size, "%s/.cache/descale-autotune.txt", dir);
+#endif
+}
+
+
+// Has to be called with autotune_lock held
+static void add_entry(const char *key, enum DescaleKernel kernel)
+{
+    for (int i = 0; i < autotune_count; i++) {
+        if (!strcmp(autotune_entries[i].key, key)) {
+            autotune_entries[i].kernel = kernel;
+            return;
+        }
+    }
+    if (autotune_count == AUTOTUNE_MAX_ENTRIES)
+        return;
+    snprintf(autotune_entries[autotune_count].key, AUTOTUNE_KEY_SIZE, "%s", key);
+    autotune_entries[autotune_count].kernel = kernel;
+    autotune_count++;
+}
+
+
+/*
+ * The cache file has one line per result: CPU model, geometry class and
+ * kernel name, separated by tabs. The geometry class starts with the
+ * library version and the instruction set, so results of other builds
+ * are not reused. Later lines win, lines of other CPUs are ignored, so
+ * one file can be shared between machines.
+ */
+static void autotune_load(void)
+{
+#ifdef DESCALE_X86
+    query_x86_cpu_model(autotune_cpu, sizeof autotune_cpu);
+#else
+    snprintf(autotune_cpu, sizeof autotune_cpu, "unknown");
+#endif
+    get_cache_path(autotune_path, sizeof autotune_path);
+
+    FILE *f = autotune_path[0] ? fopen(autotune_path, "r") : NULL;
+    if (!f)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof line, f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *key = strchr(line, '\t');
+        char *name = key ? strchr(key + 1, '\t') : NULL;
+        if (!name)
+            continue;
+        *key++ = '\0';
+        *name++ = '\0';
+        if (strcmp(line, autotune_cpu))
+            continue;
+        for (int k = 0; k < 4; k++) {
+            if (!strcmp(name, kernel_names[k]))
+                add_entry(key, (enum DescaleKernel)k);
+        }
+    }
+    fclose(f);
+}
+
+
+static int size_class(int x)
+{
+    int c = 16;
+    while (c < x)
+        c *= 2;
+    return c;
+}
+
+
+static double measure_kernel(struct DescaleCore *core, enum DescaleDir dir, int vector_count, DescaleProcessVectors process_vectors,
+                             int src_stride, int dst_stride, const float *srcp, float *dstp)
+{
+    double best = 0.0;
+
+    // The first run only warms up the caches
+    for (int run = 0; run <= AUTOTUNE_RUNS; run++) {
+        unsigned long long start = descale_time_ns();
+        process_vectors(core, dir, vector_count, src_stride, 0, dst_stride, srcp, NULL, dstp);
+        double time = (double)(descale_time_ns() - start);
+        if (run == 1 || (run > 1 && time < best))
+            best = time;
+    }
+
+    return best;
+}
+
+
+void descale_autotune(struct DescaleCore *core, enum DescaleDir dir, int vector_count, enum DescaleOpt opt,
+                      const enum DescaleKernel *candidates, int num_candidates, DescaleProcessVectors process_vectors)
+{
+    if (num_candidates < 2)
+        return;
+
+    pthread_once(&autotune_once, &autotune_load);
+
+    char key[AUTOTUNE_KEY_SIZE];
+    snprintf(key, sizeof key, "v%d.%d %s %c %s bw%d src%d dst%d n%d", DESCALE_VERSION_MAJOR, DESCALE_VERSION_MINOR,
+             opt == DESCALE_OPT_AVX2 ? "avx2" : "c", dir == DESCALE_DIR_HORIZONTAL ? 'h' : 'v',
+             core->upscale ? "upscale" : core->dense ? "dense" : "ldlt", core->bandwidth, size_class(core->src_dim), size_class(core->dst_dim), size_class(vector_count));
+
+    pthread_mutex_lock(&autotune_lock);
+    int cached = -1;
+    for (int i = 0; i < autotune_count; i++) {
+        if (!strcmp(autotune_entries[i].key, key))
+            cached = autotune_entries[i].kernel;
+    }
+    pthread_mutex_unlock(&autotune_lock);
+
+    for (int i = 0; i < num_candidates; i++) {
+        if ((int)candidates[i] == cached) {
+            core->kernel[dir] = candidates[i];
+            return;
+        }
+    }
+
+    unsigned long long start = descale_time_ns();
+
+    // The sample is processed like a plane of the real geometry with fewer vectors
+    int n = DSMAX(8, DSMIN(vector_count, AUTOTUNE_MAX_VECTORS));
+    int src_stride, dst_stride;
+    size_t src_size, dst_size;
+    if (dir == DESCALE_DIR_HORIZONTAL) {
+        src_stride = ceil_n(core->src_dim, 16);
+        dst_stride = ceil_n(core->dst_dim, 16);
+        src_size = (size_t)src_stride * n;
+        dst_size = (size_t)dst_stride * n;
+    } else {
+        src_stride = dst_stride = ceil_n(n, 16);
+        src_size = (size_t)src_stride * core->src_dim;
+        dst_size = (size_t)dst_stride * core->dst_dim;
+    }
+
+    float *srcp, *dstp;
+    descale_aligned_malloc((void **)&srcp, src_size * sizeof (float), 64);
+    descale_aligned_malloc((void **)&dstp, dst_size * sizeof (float), 64);
+    if (!srcp || !dstp) {
+        descale_aligned_free(srcp);
+        descale_aligned_free(dstp);
+        return;
+    }
+    for (size_t i = 0; i < src_size; i++)
+        srcp[i] = (float)((i * 7919) % 1024) / 1023.0f;
+
+    // Keep the measurement out of the counters of the core
+    unsigned long long calls = core->process_calls, vectors = core->process_vectors, time_ns = core->process_time_ns;
+
+    enum DescaleKernel best = DESCALE_KERNEL_DEFAULT;
+    double best_time = 0.0;
+    for (int i = 0; i < num_candidates; i++) {
+        core->kernel[dir] = candidates[i];
+        double time = measure_kernel(core, dir, n, process_vectors, src_stride, dst_stride, srcp, dstp);
+        if (candidates[i] != DESCALE_KERNEL_DEFAULT)
+            time /= AUTOTUNE_MARGIN;
+        if (i == 0 || time < best_time) {
+            best = candidates[i];
+            best_time = time;
+        }
+    }
+    core->kernel[dir] = best;
+
+    core->process_calls = calls;
+    core->process_vectors = vectors;
+    core->process_time_ns = time_ns;
+
+    descale_aligned_free(srcp);
+    descale_aligned_free(dstp);
+
+    pthread_mutex_lock(&autotune_lock);
+    add_entry(key, best);
+    FILE *f = autotune_path[0] ? fopen(autotune_path, "a") : NULL;
+    if (f) {
+        fprintf(f, "%s\t%s\t%s\n", autotune_cpu, key, kernel_names[best]);
+        fclose(f);
+    }
+    pthread_mutex_unlock(&autotune_lock);
+
+    descale_trace_event("autotune", "core", start, descale_time_ns(), best);
+}
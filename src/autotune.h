@@ -0,0 +1,26 @@
+#ifndef DESCALE_AUTOTUNE_H
+#define DESCALE_AUTOTUNE_H
+
+
+#include "descale.h"
+
+
+typedef void (*DescaleProcessVectors)(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                      int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
+
+
+/*
+ * Sets core->kernel[dir] to the fastest of the candidate kernels.
+ *
+ * Every candidate is timed on a sample of the core's geometry with
+ * process_vectors, which has to dispatch on core->kernel. The winner
+ * is remembered per CPU model, library version, opt and geometry
+ * class, in memory and in the file named by DESCALE_AUTOTUNE_CACHE
+ * (by default descale-autotune.txt in the user's cache directory), so
+ * it is only measured once per machine and build.
+ */
+void descale_autotune(struct DescaleCore *core, enum DescaleDir dir, int vector_count, enum DescaleOpt opt,
+                      const enum DescaleKernel *candidates, int num_candidates, DescaleProcessVectors process_vectors);
+
+
+#endif  // DESCALE_AUTOTUNE_H
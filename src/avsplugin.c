@@ -43,7 +43,9 @@ static AVS_VideoFrame * AVSC_CC avs_descale_get_frame(AVS_FilterInfo *fi, int n)
     struct AVSDescaleData *d = (struct AVSDescaleData *)fi->user_data;
 
     if (!d->initialized) {
+        unsigned long long wait_start = descale_time_ns();
         pthread_mutex_lock(&d->lock);
+        descale_trace_event("wait for initialization", "wait", wait_start, descale_time_ns(), -1);
         if (!d->initialized) {
             initialize_descale_data(&d->dd);
             d->initialized = true;
@@ -65,30 +67,18 @@ static AVS_VideoFrame * AVSC_CC avs_descale_get_frame(AVS_FilterInfo *fi, int n)
     // So we manually copy the frame properties later.
     AVS_VideoFrame *dst = avs_new_video_frame_a(fi->env, &fi->vi, 32);
 
+    struct DescalePlane dplanes[3] = {0};
     for (int i = 0; i < d->dd.num_planes; i++) {
         int plane = planes[i];
-        int src_stride = avs_get_pitch_p(src, plane) / sizeof (float);
-        int dst_stride = avs_get_pitch_p(dst, plane) / sizeof (float);
-        const float *srcp = (const float *)avs_get_read_ptr_p(src, plane);
-        float *dstp = (float *)avs_get_write_ptr_p(dst, plane);
-
-        if (d->dd.process_h && d->dd.process_v) {
-            int intermediate_stride = avs_get_pitch_p(dst, plane);
-            float *intermediatep = avs_pool_allocate(fi->env, intermediate_stride * d->dd.src_height * sizeof (float), 32, AVS_ALLOCTYPE_POOLED_ALLOC);
-
-            d->dd.dsapi.process_vectors(d->dd.dscore_h[i && d->dd.subsampling_h], DESCALE_DIR_HORIZONTAL, d->dd.src_height >> (i ? d->dd.subsampling_v : 0), src_stride, 0, intermediate_stride, srcp, NULL, intermediatep);
-            d->dd.dsapi.process_vectors(d->dd.dscore_v[i && d->dd.subsampling_v], DESCALE_DIR_VERTICAL, d->dd.dst_width >> (i ? d->dd.subsampling_h : 0), intermediate_stride, 0, dst_stride, intermediatep, NULL, dstp);
-
-            avs_pool_free(fi->env, intermediatep);
-
-        } else if (d->dd.process_h) {
-            d->dd.dsapi.process_vectors(d->dd.dscore_h[i && d->dd.subsampling_h], DESCALE_DIR_HORIZONTAL, d->dd.src_height >> (i ? d->dd.subsampling_v : 0), src_stride, 0, dst_stride, srcp, NULL, dstp);
-
-        } else if (d->dd.process_v) {
-            d->dd.dsapi.process_vectors(d->dd.dscore_v[i && d->dd.subsampling_v], DESCALE_DIR_VERTICAL, d->dd.src_width >> (i ? d->dd.subsampling_h : 0), src_stride, 0, dst_stride, srcp, NULL, dstp);
-        }
+        dplanes[i].index = i;
+        dplanes[i].src_stride = avs_get_pitch_p(src, plane) / sizeof (float);
+        dplanes[i].dst_stride = avs_get_pitch_p(dst, plane) / sizeof (float);
+        dplanes[i].srcp = (const float *)avs_get_read_ptr_p(src, plane);
+        dplanes[i].dstp = (float *)avs_get_write_ptr_p(dst, plane);
     }
 
+    process_planes(&d->dd, dplanes);
+
     avs_copy_frame_props(fi->env, src, dst);
     avs_release_video_frame(src);
 
@@ -106,18 +96,8 @@ static void AVSC_CC avs_descale_free(AVS_FilterInfo *fi)
 {
     struct AVSDescaleData *d = (struct AVSDescaleData *)fi->user_data;
 
-    if (d->initialized) {
-        if (d->dd.process_h) {
-            d->dd.dsapi.free_core(d->dd.dscore_h[0]);
-            if (d->dd.num_planes > 1 && d->dd.subsampling_h > 0)
-                d->dd.dsapi.free_core(d->dd.dscore_h[1]);
-        }
-        if (d->dd.process_v) {
-            d->dd.dsapi.free_core(d->dd.dscore_v[0]);
-            if (d->dd.num_planes > 1 && d->dd.subsampling_v > 0)
-                d->dd.dsapi.free_core(d->dd.dscore_v[1]);
-        }
-    }
+    if (d->initialized)
+        free_descale_data(&d->dd);
 
     pthread_mutex_destroy(&d->lock);
 
@@ -319,18 +299,17 @@ static AVS_Value AVSC_CC avs_descale_create(AVS_ScriptEnvironment *env, AVS_Valu
     }
 
     struct DescaleParams params = {mode, taps, b, c, 0, 0, border_handling_enum};
+    // The fields that are not named here default to zero
     struct DescaleData dd = {
-        src_width, src_height,
-        dst_width, dst_height,
-        subsampling_h, subsampling_v,
-        num_planes,
-        process_h, process_v,
-        shift_h, shift_v,
-        active_width, active_height,
-        get_descale_api(opt_enum),
-        params,
-        {NULL, NULL},
-        {NULL, NULL}
+        .src_width = src_width, .src_height = src_height,
+        .dst_width = dst_width, .dst_height = dst_height,
+        .subsampling_h = subsampling_h, .subsampling_v = subsampling_v,
+        .num_planes = num_planes,
+        .process_h = process_h, .process_v = process_v,
+        .shift_h = shift_h, .shift_v = shift_v,
+        .active_width = active_width, .active_height = active_height,
+        .dsapi = get_descale_api(opt_enum),
+        .params = params
     };
 
     struct AVSDescaleData *data = calloc(1, sizeof (struct AVSDescaleData));
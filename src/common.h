@@ -2,17 +2,39 @@
 #define DESCALE_COMMON_H
 
 
+#include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #ifdef _WIN32
     #include <malloc.h>
 #endif
+#include "descale.h"
 
 
 #define DSMAX(a, b) ((a) > (b) ? (a) : (b))
 #define DSMIN(a, b) ((a) > (b) ? (b) : (a))
 
 
+static inline unsigned long long descale_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+
+// Adds finished process calls to the counters of a core, which may be shared by many threads
+static inline void descale_count_process(struct DescaleCore *core, int calls, int vector_count, unsigned long long start_ns)
+{
+    __atomic_add_fetch(&core->process_time_ns, descale_time_ns() - start_ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&core->process_calls, calls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&core->process_vectors, (unsigned long long)calls * vector_count, __ATOMIC_RELAXED);
+}
+
+
 static inline int ceil_n(int x, int n)
 {
     return (x + (n - 1)) & ~(n - 1);
@@ -47,4 +69,168 @@ static inline void descale_aligned_free(void *ptr)
 }
 
 
+// IEEE half precision conversions for code that can not use F16C
+static inline float descale_half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else {
+        // Subnormals are exact in single precision
+        float f = (float)mantissa * (1.0f / 16777216.0f);
+        return sign ? -f : f;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+
+// Rounds to nearest even like the F16C instructions, overflows become infinity
+static inline uint16_t descale_float_to_half(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof bits);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if (bits >= 0x7f800000)
+        return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+    if (bits >= 0x477ff000)
+        return sign | 0x7c00;
+    if (bits < 0x38800000) {
+        // Subnormal or zero, the integer conversion rounds to nearest even
+        float magnitude;
+        memcpy(&magnitude, &bits, sizeof magnitude);
+        return sign | (uint16_t)lrintf(magnitude * 16777216.0f);
+    }
+    uint32_t rounded = bits + 0xfff + ((bits >> 13) & 1);
+    return sign | (uint16_t)((rounded - 0x38000000) >> 13);
+}
+
+
+static inline size_t descale_sample_size(enum DescaleSampleType type)
+{
+    return type == DESCALE_SAMPLE_FLOAT ? 4 : type == DESCALE_SAMPLE_U8 ? 1 : 2;
+}
+
+
+// Integer value that maps to 1.0
+static inline float descale_sample_peak(const struct DescaleSampleFormat *format)
+{
+    if (format->type == DESCALE_SAMPLE_FLOAT || format->type == DESCALE_SAMPLE_HALF)
+        return 1.0f;
+    return format->type == DESCALE_SAMPLE_U8 ? 255.0f : (float)((1 << format->bits) - 1);
+}
+
+
+// Offset between -0.5 and 0.5 of an 8x8 Bayer matrix
+static inline float descale_dither_offset(int x, int y)
+{
+    int xy = x ^ y, index = 0;
+    for (int bit = 0; bit < 3; bit++) {
+        index = (index << 1) | ((xy >> bit) & 1);
+        index = (index << 1) | ((y >> bit) & 1);
+    }
+    return ((float)index + 0.5f) * (1.0f / 64.0f) - 0.5f;
+}
+
+
+#define DESCALE_PQ_M1 0.1593017578125f
+#define DESCALE_PQ_M2 78.84375f
+#define DESCALE_PQ_C1 0.8359375f
+#define DESCALE_PQ_C2 18.8515625f
+#define DESCALE_PQ_C3 18.6875f
+#define DESCALE_HLG_A 0.17883277f
+#define DESCALE_HLG_B 0.28466892f
+#define DESCALE_HLG_C 0.55991073f
+
+/*
+ * Reference conversions of a sample value between a transfer function
+ * and linear light. The power curves are mirrored at 0, PQ and HLG are
+ * only defined for non-negative values and clamp the rest to 0, PQ also
+ * clamps to its peak of 1.0.
+ */
+static inline float descale_to_linear(float v, enum DescaleTransfer transfer)
+{
+    switch (transfer) {
+        case DESCALE_TRANSFER_SRGB:
+            return v <= 0.04045f ? v * (1.0f / 12.92f) : powf((v + 0.055f) * (1.0f / 1.055f), 2.4f);
+        case DESCALE_TRANSFER_BT1886:
+            return copysignf(powf(fabsf(v), 2.4f), v);
+        case DESCALE_TRANSFER_PQ: {
+            float p = powf(v > 0.0f ? DSMIN(v, 1.0f) : 0.0f, 1.0f / DESCALE_PQ_M2);
+            return powf(DSMAX(p - DESCALE_PQ_C1, 0.0f) / (DESCALE_PQ_C2 - DESCALE_PQ_C3 * p), 1.0f / DESCALE_PQ_M1);
+        }
+        case DESCALE_TRANSFER_HLG:
+            v = v > 0.0f ? v : 0.0f;
+            return v <= 0.5f ? v * v * (1.0f / 3.0f) : (expf((v - DESCALE_HLG_C) * (1.0f / DESCALE_HLG_A)) + DESCALE_HLG_B) * (1.0f / 12.0f);
+        default:
+            return v;
+    }
+}
+
+
+static inline float descale_from_linear(float v, enum DescaleTransfer transfer)
+{
+    switch (transfer) {
+        case DESCALE_TRANSFER_SRGB:
+            return v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+        case DESCALE_TRANSFER_BT1886:
+            return copysignf(powf(fabsf(v), 1.0f / 2.4f), v);
+        case DESCALE_TRANSFER_PQ: {
+            float y = powf(v > 0.0f ? DSMIN(v, 1.0f) : 0.0f, DESCALE_PQ_M1);
+            return powf((DESCALE_PQ_C1 + DESCALE_PQ_C2 * y) / (1.0f + DESCALE_PQ_C3 * y), DESCALE_PQ_M2);
+        }
+        case DESCALE_TRANSFER_HLG:
+            v = v > 0.0f ? v : 0.0f;
+            return v <= 1.0f / 12.0f ? sqrtf(3.0f * v) : DESCALE_HLG_A * logf(12.0f * v - DESCALE_HLG_B) + DESCALE_HLG_C;
+        default:
+            return v;
+    }
+}
+
+
+// Sample x of a row, integers are scaled by 1 / peak
+static inline float descale_load_sample(const void *srcp, int x, const struct DescaleSampleFormat *format, float scale)
+{
+    switch (format->type) {
+        case DESCALE_SAMPLE_U8:
+            return (float)((const uint8_t *)srcp)[x] * scale;
+        case DESCALE_SAMPLE_U16:
+            return (float)((const uint16_t *)srcp)[x] * scale;
+        case DESCALE_SAMPLE_HALF:
+            return descale_half_to_float(((const uint16_t *)srcp)[x]);
+        default:
+            return ((const float *)srcp)[x];
+    }
+}
+
+
+// Stores sample x of a row, integers are scaled by peak and dithered, rounded to nearest even and clamped
+static inline void descale_store_sample(void *dstp, int x, float value, const struct DescaleSampleFormat *format, float peak, float dither)
+{
+    switch (format->type) {
+        case DESCALE_SAMPLE_HALF:
+            ((uint16_t *)dstp)[x] = descale_float_to_half(value);
+            break;
+        case DESCALE_SAMPLE_FLOAT:
+            ((float *)dstp)[x] = value;
+            break;
+        default:
+            value = value * peak + dither;
+            // Also maps NaN to 0
+            value = value > 0.0f ? DSMIN(value, peak) : 0.0f;
+            if (format->type == DESCALE_SAMPLE_U8)
+                ((uint8_t *)dstp)[x] = (uint8_t)lrintf(value);
+            else
+                ((uint16_t *)dstp)[x] = (uint16_t)lrintf(value);
+    }
+}
+
+
 #endif  // DESCALE_COMMON_H
@@ -0,0 +1,660 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mapfile.h"
+#include "plugin.h"
+
+
+#define OUT_OF_CORE_MEMORY_LIMIT ((size_t)256 << 20)
+
+
+struct DescaleContext
+{
+    struct DescaleData dd;      // kernels selected by DescaleFrameParams.opt
+    struct DescaleData dd_c;    // the same cores with the C kernels, for unaligned frames
+};
+
+
+int descale_version(void)
+{
+    return DESCALE_VERSION;
+}
+
+
+static bool check_frame_params(const struct DescaleFrameParams *p)
+{
+    const struct DescaleParams *params = &p->params;
+
+    if (p->num_planes < 1 || p->num_planes > 3)
+        return false;
+    if (p->src_width < 1 || p->src_height < 1 || p->dst_width < 1 || p->dst_height < 8)
+        return false;
+    if (p->subsampling_h < 0 || p->subsampling_v < 0 || p->subsampling_h > 2 || p->subsampling_v > 2)
+        return false;
+    if (p->num_planes > 1) {
+        int mask_h = (1 << p->subsampling_h) - 1, mask_v = (1 << p->subsampling_v) - 1;
+        if ((p->src_width & mask_h) || (p->dst_width & mask_h) || (p->src_height & mask_v) || (p->dst_height & mask_v))
+            return false;
+    }
+    if (!params->upscale && (p->dst_width > p->src_width || p->dst_height > p->src_height))
+        return false;
+    if (params->upscale && (p->dst_width < p->src_width || p->dst_height < p->src_height))
+        return false;
+    if ((params->mode == DESCALE_MODE_LANCZOS || params->mode == DESCALE_MODE_CUSTOM) && params->taps < 1)
+        return false;
+    // The context only drives separable cores, EWA kernels go through DescaleAPI.create_ewa_core
+    if (params->mode == DESCALE_MODE_EWA_LANCZOS || params->mode == DESCALE_MODE_EWA_JINC)
+        return false;
+    if (params->blur >= p->src_width >> p->subsampling_h || params->blur >= p->src_height >> p->subsampling_v || params->blur < 0)
+        return false;
+    if (params->post_conv_size && (params->post_conv_size % 2 != 1 || !params->post_conv))
+        return false;
+
+    return true;
+}
+
+
+// False if a core that one of the passes needs could not be created
+static bool has_cores(const struct DescaleData *dd)
+{
+    bool chroma_h = dd->num_planes > 1 && dd->subsampling_h > 0;
+    bool chroma_v = dd->num_planes > 1 && dd->subsampling_v > 0;
+
+    if (dd->process_h && (!dd->dscore_h[0] || (chroma_h && !dd->dscore_h[1])))
+        return false;
+    if (dd->process_v && (!dd->dscore_v[0] || (chroma_v && !dd->dscore_v[1])))
+        return false;
+
+    return true;
+}
+
+
+struct DescaleContext *descale_context_create(const struct DescaleFrameParams *params)
+{
+    if (!check_frame_params(params))
+        return NULL;
+
+    struct DescaleContext *ctx = calloc(1, sizeof (struct DescaleContext));
+    if (!ctx)
+        return NULL;
+    struct DescaleData *dd = &ctx->dd;
+    bool upscale = params->params.upscale;
+
+    dd->src_width = params->src_width;
+    dd->src_height = params->src_height;
+    dd->dst_width = params->dst_width;
+    dd->dst_height = params->dst_height;
+    dd->num_planes = params->num_planes;
+    dd->subsampling_h = params->num_planes > 1 ? params->subsampling_h : 0;
+    dd->subsampling_v = params->num_planes > 1 ? params->subsampling_v : 0;
+    dd->shift_h = params->shift_h;
+    dd->shift_v = params->shift_v;
+    dd->active_width = params->active_width != 0.0 ? params->active_width : (double)(upscale ? dd->src_width : dd->dst_width);
+    dd->active_height = params->active_height != 0.0 ? params->active_height : (double)(upscale ? dd->src_height : dd->dst_height);
+    dd->parallel_planes = params->parallel_planes;
+    dd->autotune = params->autotune;
+    dd->half_intermediate = params->half_intermediate;
+
+    dd->params = params->params;
+    dd->params.has_ignore_mask = 0;
+    if (dd->params.blur == 0.0)
+        dd->params.blur = 1.0;
+
+    dd->process_h = dd->dst_width != dd->src_width || dd->shift_h != 0.0 || dd->active_width != (double)dd->dst_width || params->force_h;
+    dd->process_v = dd->dst_height != dd->src_height || dd->shift_v != 0.0 || dd->active_height != (double)dd->dst_height || params->force_v;
+
+    // The SIMD horizontal pass works on blocks of 8 rows
+    enum DescaleOpt opt = params->opt;
+    if (upscale && dd->src_height >> dd->subsampling_v < 8)
+        opt = DESCALE_OPT_NONE;
+    dd->dsapi = get_descale_api(opt);
+
+    initialize_descale_data(dd);
+    if (!has_cores(dd)) {
+        free_descale_data(dd);
+        free(ctx);
+        return NULL;
+    }
+    if (dd->parallel_planes)
+        descale_pool_acquire();
+
+    // The cores don't depend on the API that created them
+    ctx->dd_c = *dd;
+    ctx->dd_c.dsapi = get_descale_api(DESCALE_OPT_NONE);
+
+    return ctx;
+}
+
+
+// The SIMD kernels use aligned loads and stores of 8 samples, also in the padding of every row
+static bool is_simd_plane(const void *p, int stride)
+{
+    return ((uintptr_t)p & 31) == 0 && stride % 8 == 0;
+}
+
+
+void descale_context_process(struct DescaleContext *ctx, const float *const *srcps, const int *src_strides,
+                             float *const *dstps, const int *dst_strides)
+{
+    struct DescaleData *dd = &ctx->dd;
+    struct DescalePlane planes[3] = {{0}};
+    bool simd = true;
+
+    if (!dd->process_h && !dd->process_v) {
+        for (int i = 0; i < dd->num_planes; i++) {
+            int width = dd->src_width >> (i ? dd->subsampling_h : 0);
+            int height = dd->src_height >> (i ? dd->subsampling_v : 0);
+            for (int y = 0; y < height; y++)
+                memcpy(dstps[i] + (size_t)y * dst_strides[i], srcps[i] + (size_t)y * src_strides[i], width * sizeof (float));
+        }
+        return;
+    }
+
+    for (int i = 0; i < dd->num_planes; i++) {
+        planes[i].index = i;
+        planes[i].src_stride = src_strides[i];
+        planes[i].dst_stride = dst_strides[i];
+        planes[i].srcp = srcps[i];
+        planes[i].dstp = dstps[i];
+        simd = simd && is_simd_plane(srcps[i], src_strides[i]) && is_simd_plane(dstps[i], dst_strides[i]);
+    }
+
+    process_planes(simd ? &ctx->dd : &ctx->dd_c, planes);
+}
+
+
+static int sample_size(int depth)
+{
+    return depth == 8 ? 1 : depth <= 16 ? 2 : 4;
+}
+
+
+static void load_row(const unsigned char *src, int depth, int width, float *dstp)
+{
+    float scale = 1.0f / (float)((1 << DSMIN(depth, 16)) - 1);
+    if (depth == 8) {
+        for (int x = 0; x < width; x++)
+            dstp[x] = src[x] * scale;
+    } else if (depth <= 16) {
+        for (int x = 0; x < width; x++)
+            dstp[x] = (src[2 * x] | src[2 * x + 1] << 8) * scale;
+    } else {
+        memcpy(dstp, src, width * sizeof (float));
+    }
+}
+
+
+// Rounds like the solvers' own integer output, 16 bit samples are written little endian
+static void store_row(const float *srcp, int depth, int width, unsigned char *dst)
+{
+    struct DescaleSampleFormat format = { depth == 8 ? DESCALE_SAMPLE_U8 : DESCALE_SAMPLE_U16, depth };
+    float peak = descale_sample_peak(&format);
+    if (depth == 8) {
+        for (int x = 0; x < width; x++)
+            descale_store_sample(dst, x, srcp[x], &format, peak, 0.0f);
+    } else if (depth <= 16) {
+        for (int x = 0; x < width; x++) {
+            uint16_t v;
+            descale_store_sample(&v, 0, srcp[x], &format, peak, 0.0f);
+            dst[2 * x] = (unsigned char)v;
+            dst[2 * x + 1] = (unsigned char)(v >> 8);
+        }
+    } else {
+        memcpy(dst, srcp, width * sizeof (float));
+    }
+}
+
+
+static size_t file_frame_size(const struct DescaleData *dd, bool dst, int depth)
+{
+    size_t size = 0;
+    for (int plane = 0; plane < dd->num_planes; plane++) {
+        int width = (dst ? dd->dst_width : dd->src_width) >> (plane ? dd->subsampling_h : 0);
+        int height = (dst ? dd->dst_height : dd->src_height) >> (plane ? dd->subsampling_v : 0);
+        size += (size_t)width * height * sample_size(depth);
+    }
+    return size;
+}
+
+
+/*
+ * Descales one plane between two mapped files. The rows are converted
+ * and run through the horizontal pass in blocks, into a temporary
+ * mapped file if the vertical pass follows. That one then works on
+ * column strips of the intermediate, and only a strip of the output is
+ * buffered before it is converted into the destination file.
+ */
+static bool process_plane_file(struct DescaleData *dd, int plane, const unsigned char *src, unsigned char *dst, int depth, size_t memory_limit)
+{
+    int src_width = dd->src_width >> (plane ? dd->subsampling_h : 0);
+    int src_height = dd->src_height >> (plane ? dd->subsampling_v : 0);
+    int dst_width = dd->dst_width >> (plane ? dd->subsampling_h : 0);
+    int dst_height = dd->dst_height >> (plane ? dd->subsampling_v : 0);
+    struct DescaleCore *core_h = dd->dscore_h[plane && dd->subsampling_h];
+    struct DescaleCore *core_v = dd->dscore_v[plane && dd->subsampling_v];
+    size_t bytes = sample_size(depth);
+
+    if (!dd->process_h && !dd->process_v) {
+        memcpy(dst, src, (size_t)src_width * src_height * bytes);
+        return true;
+    }
+
+    // Rows of the vertical pass, the horizontal output or the converted input
+    int intermediate_width = dd->process_h ? dst_width : src_width;
+    int intermediate_stride = ceil_n(intermediate_width, 16);
+    struct DescaleMappedFile intermediate = {0};
+    if (dd->process_v && !descale_map_temp(&intermediate, (size_t)intermediate_stride * src_height * sizeof (float)))
+        return false;
+    float *intermediatep = (float *)intermediate.data;
+
+    int in_stride = ceil_n(src_width, 16), out_stride = ceil_n(dst_width, 16);
+    size_t row_size = ((dd->process_h ? in_stride : 0) + (dd->process_v ? 0 : out_stride)) * sizeof (float);
+    int rows = DSMAX(floor_n((int)DSMIN(memory_limit / DSMAX(row_size, 1), (size_t)src_height), 8), 8);
+    float *in_buffer = NULL, *out_buffer = NULL;
+    if (dd->process_h)
+        descale_aligned_malloc((void **)&in_buffer, (size_t)in_stride * rows * sizeof (float), 64);
+    if (!dd->process_v)
+        descale_aligned_malloc((void **)&out_buffer, (size_t)out_stride * rows * sizeof (float), 64);
+    if ((dd->process_h && !in_buffer) || (!dd->process_v && !out_buffer)) {
+        descale_aligned_free(in_buffer);
+        descale_aligned_free(out_buffer);
+        if (dd->process_v)
+            descale_unmap_file(&intermediate);
+        return false;
+    }
+
+    for (int y = 0; y < src_height; y += rows) {
+        int count = DSMIN(rows, src_height - y);
+        // The SIMD horizontal pass needs blocks of at least 8 rows, so the last one overlaps the one before
+        if (dd->process_h && count < 8 && src_height >= 8) {
+            y = src_height - 8;
+            count = 8;
+        }
+
+        if (!dd->process_h) {
+            for (int r = 0; r < count; r++)
+                load_row(src + (size_t)(y + r) * src_width * bytes, depth, src_width, intermediatep + (size_t)(y + r) * intermediate_stride);
+            continue;
+        }
+
+        for (int r = 0; r < count; r++)
+            load_row(src + (size_t)(y + r) * src_width * bytes, depth, src_width, in_buffer + (size_t)r * in_stride);
+        if (dd->process_v) {
+            dd->dsapi.process_vectors(core_h, DESCALE_DIR_HORIZONTAL, count, in_stride, 0, intermediate_stride, in_buffer, NULL,
+                                      intermediatep + (size_t)y * intermediate_stride);
+        } else {
+            dd->dsapi.process_vectors(core_h, DESCALE_DIR_HORIZONTAL, count, in_stride, 0, out_stride, in_buffer, NULL, out_buffer);
+            for (int r = 0; r < count; r++)
+                store_row(out_buffer + (size_t)r * out_stride, depth, dst_width, dst + (size_t)(y + r) * dst_width * bytes);
+        }
+    }
+    descale_aligned_free(in_buffer);
+    descale_aligned_free(out_buffer);
+
+    if (dd->process_v) {
+        // Wide strips read whole pages of the intermediate
+        int columns = DSMAX(floor_n((int)DSMIN(memory_limit / ((size_t)dst_height * sizeof (float)), (size_t)ceil_n(intermediate_width, 8)), 8), 8);
+        float *strip;
+        descale_aligned_malloc((void **)&strip, (size_t)columns * dst_height * sizeof (float), 64);
+        if (!strip) {
+            descale_unmap_file(&intermediate);
+            return false;
+        }
+
+        for (int x = 0; x < intermediate_width; x += columns) {
+            int count = DSMIN(columns, intermediate_width - x);
+            dd->dsapi.process_vectors(core_v, DESCALE_DIR_VERTICAL, count, intermediate_stride, 0, columns, intermediatep + x, NULL, strip);
+            for (int y = 0; y < dst_height; y++)
+                store_row(strip + (size_t)y * columns, depth, count, dst + ((size_t)y * dst_width + x) * bytes);
+        }
+
+        descale_aligned_free(strip);
+        descale_unmap_file(&intermediate);
+    }
+
+    return true;
+}
+
+
+long long descale_context_process_file(struct DescaleContext *ctx, const char *src_path, const char *dst_path, int depth, size_t memory_limit)
+{
+    struct DescaleData *dd = &ctx->dd;
+    if ((depth < 8 || depth > 16) && depth != 32)
+        return -1;
+
+    size_t src_frame = file_frame_size(dd, false, depth), dst_frame = file_frame_size(dd, true, depth);
+    struct DescaleMappedFile src, dst;
+    if (!memory_limit)
+        memory_limit = OUT_OF_CORE_MEMORY_LIMIT;
+
+    if (!descale_map_file(&src, src_path, 0, false))
+        return -1;
+    // A partial frame at the end means the dimensions or the depth don't match the file
+    if (src.size % src_frame) {
+        descale_unmap_file(&src);
+        return -1;
+    }
+    long long frames = (long long)(src.size / src_frame);
+    if (!descale_map_file(&dst, dst_path, (size_t)frames * dst_frame, true)) {
+        descale_unmap_file(&src);
+        return -1;
+    }
+    descale_map_sequential(&src);
+
+    bool ok = true;
+    for (long long n = 0; n < frames && ok; n++) {
+        const unsigned char *srcp = src.data + n * src_frame;
+        unsigned char *dstp = dst.data + n * dst_frame;
+        for (int plane = 0; plane < dd->num_planes && ok; plane++) {
+            ok = process_plane_file(dd, plane, srcp, dstp, depth, memory_limit);
+            srcp += (size_t)(dd->src_width >> (plane ? dd->subsampling_h : 0)) * (dd->src_height >> (plane ? dd->subsampling_v : 0)) * sample_size(depth);
+            dstp += (size_t)(dd->dst_width >> (plane ? dd->subsampling_h : 0)) * (dd->dst_height >> (plane ? dd->subsampling_v : 0)) * sample_size(depth);
+        }
+    }
+
+    descale_unmap_file(&src);
+    descale_unmap_file(&dst);
+    return ok ? frames : -1;
+}
+
+
+void descale_context_free(struct DescaleContext *ctx)
+{
+    if (!ctx)
+        return;
+
+    free_descale_data(&ctx->dd);
+    if (ctx->dd.parallel_planes)
+        descale_pool_release();
+    free(ctx);
+}
+
+
+/*
+ * Line-based processing
+ *
+ * Input rows go through the horizontal pass as soon as 8 of them are
+ * there (right away if there is no vertical pass), into a buffer of
+ * intermediate rows. The vertical pass produces blocks of output rows.
+ * In exact mode it waits for the whole column, otherwise every block
+ * is computed with the windowed solver from the input rows its window
+ * reads, and the buffer only keeps the rows later blocks still need.
+ */
+#define LINE_BLOCK_ROWS 32
+
+
+struct DescaleLineContext
+{
+    struct DescaleContext *ctx;
+    struct DescaleCore *core_h, *core_v;
+    int src_width, src_height;
+    int dst_width, dst_height;
+    double tolerance;       // 0 for the exact mode
+
+    float *stage;           // input rows waiting for the horizontal pass
+    int stage_stride;
+    int staged;
+    int rows_in;            // input rows pushed so far
+    int rows_h;             // input rows that went through the horizontal pass
+
+    float *intermediate;    // rows [base, rows_h) of the input of the vertical pass
+    int intermediate_width, intermediate_stride;
+    int capacity;
+    int base;
+
+    float *out;             // output rows [out_first, out_end), the next one to pull is out_next
+    int out_stride;
+    int out_first, out_end, out_next;
+
+    int num_blocks;         // of the vertical pass
+    int block_rows;
+    int *block_src_first, *block_src_end;
+    int next_block;
+};
+
+
+struct DescaleLineContext *descale_line_create(const struct DescaleFrameParams *params, int plane, double tolerance)
+{
+    if (plane < 0 || plane >= params->num_planes || tolerance < 0.0)
+        return NULL;
+    struct DescaleContext *ctx = descale_context_create(params);
+    if (!ctx)
+        return NULL;
+
+    struct DescaleData *dd = &ctx->dd;
+    struct DescaleLineContext *lc = calloc(1, sizeof (struct DescaleLineContext));
+    if (!lc) {
+        descale_context_free(ctx);
+        return NULL;
+    }
+    lc->ctx = ctx;
+    lc->core_h = dd->process_h ? dd->dscore_h[plane && dd->subsampling_h] : NULL;
+    lc->core_v = dd->process_v ? dd->dscore_v[plane && dd->subsampling_v] : NULL;
+    lc->src_width = dd->src_width >> (plane ? dd->subsampling_h : 0);
+    lc->src_height = dd->src_height >> (plane ? dd->subsampling_v : 0);
+    lc->dst_width = dd->dst_width >> (plane ? dd->subsampling_h : 0);
+    lc->dst_height = dd->dst_height >> (plane ? dd->subsampling_v : 0);
+    lc->tolerance = tolerance;
+
+    lc->stage_stride = ceil_n(lc->src_width, 16);
+    descale_aligned_malloc((void **)&lc->stage, (size_t)lc->stage_stride * 8 * sizeof (float), 64);
+    lc->intermediate_width = dd->process_h ? lc->dst_width : lc->src_width;
+    lc->intermediate_stride = ceil_n(lc->intermediate_width, 16);
+    lc->out_stride = ceil_n(lc->dst_width, 16);
+
+    if (!lc->core_v) {
+        // Every row is final right after the horizontal pass
+        lc->num_blocks = 0;
+        lc->block_rows = 1;
+        lc->capacity = 0;
+    } else if (tolerance == 0.0) {
+        lc->num_blocks = 1;
+        lc->block_rows = lc->dst_height;
+        lc->capacity = lc->src_height;
+    } else {
+        lc->block_rows = LINE_BLOCK_ROWS;
+        lc->num_blocks = (lc->dst_height + lc->block_rows - 1) / lc->block_rows;
+    }
+
+    lc->block_src_first = calloc(DSMAX(lc->num_blocks, 1), sizeof (int));
+    lc->block_src_end = calloc(DSMAX(lc->num_blocks, 1), sizeof (int));
+    if (!lc->block_src_first || !lc->block_src_end) {
+        descale_line_free(lc);
+        return NULL;
+    }
+    if (lc->core_v && tolerance == 0.0) {
+        lc->block_src_end[0] = lc->src_height;
+    } else if (lc->core_v) {
+        for (int k = 0; k < lc->num_blocks; k++) {
+            int first = k * lc->block_rows;
+            dd->dsapi.get_window_source_range(lc->core_v, first, DSMIN(lc->block_rows, lc->dst_height - first), tolerance,
+                                              &lc->block_src_first[k], &lc->block_src_end[k]);
+            // The buffer never goes back, so later windows may only start later
+            if (k > 0)
+                lc->block_src_first[k] = DSMAX(lc->block_src_first[k], lc->block_src_first[k - 1]);
+        }
+        // Some room to push rows while the previous block is still being pulled
+        for (int k = 0; k < lc->num_blocks; k++)
+            lc->capacity = DSMAX(lc->capacity, lc->block_src_end[k] - lc->block_src_first[k] + 8);
+        lc->capacity = DSMIN(lc->capacity, lc->src_height);
+    }
+
+    if (lc->core_v)
+        descale_aligned_malloc((void **)&lc->intermediate, (size_t)lc->intermediate_stride * lc->capacity * sizeof (float), 64);
+    descale_aligned_malloc((void **)&lc->out, (size_t)lc->out_stride * lc->block_rows * sizeof (float), 64);
+    if (!lc->stage || (lc->core_v && !lc->intermediate) || !lc->out) {
+        descale_line_free(lc);
+        return NULL;
+    }
+
+    return lc;
+}
+
+
+int descale_line_input_needed(const struct DescaleLineContext *lc, int row)
+{
+    if (!lc->core_v)
+        return row + 1;
+    return lc->block_src_end[row / lc->block_rows];
+}
+
+
+int descale_line_buffer_rows(const struct DescaleLineContext *lc)
+{
+    return 8 + lc->capacity + lc->block_rows;
+}
+
+
+// Runs the horizontal pass on the staged rows, the SIMD kernels need blocks of 8 rows
+static void line_flush_stage(struct DescaleLineContext *lc)
+{
+    if (!lc->staged)
+        return;
+
+    struct DescaleData *dd = lc->staged == 8 ? &lc->ctx->dd : &lc->ctx->dd_c;
+    float *dstp = lc->intermediate + (size_t)(lc->rows_h - lc->base) * lc->intermediate_stride;
+    dd->dsapi.process_vectors(lc->core_h, DESCALE_DIR_HORIZONTAL, lc->staged, lc->stage_stride, 0, lc->intermediate_stride, lc->stage, NULL, dstp);
+    lc->rows_h += lc->staged;
+    lc->staged = 0;
+}
+
+
+// Drops the buffered rows the remaining windows don't read
+static void line_drop_rows(struct DescaleLineContext *lc)
+{
+    int keep = lc->next_block < lc->num_blocks ? lc->block_src_first[lc->next_block] : lc->rows_h;
+    int drop = DSMIN(keep, lc->rows_h) - lc->base;
+    if (drop <= 0)
+        return;
+
+    memmove(lc->intermediate, lc->intermediate + (size_t)drop * lc->intermediate_stride,
+            (size_t)(lc->rows_h - lc->base - drop) * lc->intermediate_stride * sizeof (float));
+    lc->base += drop;
+}
+
+
+// Computes the next block of output rows once the previous one is pulled and its input is there
+static void line_compute_block(struct DescaleLineContext *lc)
+{
+    struct DescaleData *dd = &lc->ctx->dd;
+    int k = lc->next_block;
+    if (lc->out_next < lc->out_end || k >= lc->num_blocks || lc->block_src_end[k] > lc->rows_in)
+        return;
+
+    if (lc->block_src_end[k] > lc->rows_h)
+        line_flush_stage(lc);
+
+    int first = k * lc->block_rows;
+    int count = DSMIN(lc->block_rows, lc->dst_height - first);
+    if (lc->tolerance == 0.0) {
+        dd->dsapi.process_vectors(lc->core_v, DESCALE_DIR_VERTICAL, lc->intermediate_width, lc->intermediate_stride, 0, lc->out_stride,
+                                  lc->intermediate, NULL, lc->out);
+    } else {
+        dd->dsapi.process_vectors_window(lc->core_v, DESCALE_DIR_VERTICAL, lc->intermediate_width, first, count, lc->tolerance, lc->base,
+                                         lc->intermediate_stride, 0, lc->out_stride, lc->intermediate, NULL, lc->out);
+    }
+    lc->out_first = lc->out_next = first;
+    lc->out_end = first + count;
+    lc->next_block++;
+    line_drop_rows(lc);
+}
+
+
+int descale_line_push(struct DescaleLineContext *lc, const float *row)
+{
+    if (lc->rows_in == lc->src_height)
+        return -1;
+
+    if (!lc->core_v) {
+        // One row at a time, so it can be pulled right away
+        if (lc->out_next < lc->out_end)
+            return -1;
+        if (lc->core_h)
+            lc->ctx->dd_c.dsapi.process_vectors(lc->core_h, DESCALE_DIR_HORIZONTAL, 1, lc->stage_stride, 0, lc->out_stride, row, NULL, lc->out);
+        else
+            memcpy(lc->out, row, lc->src_width * sizeof (float));
+        lc->out_first = lc->out_next = lc->rows_in;
+        lc->out_end = ++lc->rows_in;
+        return 1;
+    }
+
+    // Full, the caller has to pull the rows that are ready first
+    if (lc->rows_in - lc->base >= lc->capacity)
+        return -1;
+
+    if (lc->core_h) {
+        memcpy(lc->stage + (size_t)lc->staged * lc->stage_stride, row, lc->src_width * sizeof (float));
+        lc->staged++;
+        lc->rows_in++;
+        if (lc->staged == 8 || lc->rows_in == lc->src_height)
+            line_flush_stage(lc);
+    } else {
+        memcpy(lc->intermediate + (size_t)(lc->rows_in - lc->base) * lc->intermediate_stride, row, lc->src_width * sizeof (float));
+        lc->rows_h = ++lc->rows_in;
+    }
+
+    line_drop_rows(lc);
+    line_compute_block(lc);
+    return lc->out_end - lc->out_next;
+}
+
+
+bool descale_line_pull(struct DescaleLineContext *lc, float *row)
+{
+    if (lc->core_v)
+        line_compute_block(lc);
+    if (lc->out_next == lc->out_end)
+        return false;
+
+    memcpy(row, lc->out + (size_t)(lc->out_next - lc->out_first) * lc->out_stride, lc->dst_width * sizeof (float));
+    lc->out_next++;
+    return true;
+}
+
+
+void descale_line_reset(struct DescaleLineContext *lc)
+{
+    lc->staged = 0;
+    lc->rows_in = lc->rows_h = 0;
+    lc->base = 0;
+    lc->out_first = lc->out_end = lc->out_next = 0;
+    lc->next_block = 0;
+}
+
+
+void descale_line_free(struct DescaleLineContext *lc)
+{
+    if (!lc)
+        return;
+
+    descale_context_free(lc->ctx);
+    descale_aligned_free(lc->stage);
+    descale_aligned_free(lc->intermediate);
+    descale_aligned_free(lc->out);
+    free(lc->block_src_first);
+    free(lc->block_src_end);
+    free(lc);
+}
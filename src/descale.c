@@ -22,16 +22,21 @@
 
 
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "autotune.h"
 #include "common.h"
 #include "descale.h"
+#include "scratch.h"
+#include "trace.h"
 
 #if defined(DESCALE_X86) || defined(__ARM_NEON__)
     #include "x86/cpuinfo_x86.h"
     #include "x86/descale_avx2.h"
+    #include "x86/jit_x86.h"
 #endif
 
 
@@ -80,6 +85,67 @@ static void banded_ldlt_decomposition(int n, int bandwidth, double *matrix)
 }
 
 
+/*
+ * Check whether all off-diagonal entries inside the band
+ * are numerically zero compared to the main diagonal.
+ */
+static bool is_banded_matrix_diagonal(int n, int bandwidth, const double *matrix)
+{
+    int c = bandwidth / 2;
+
+    for (int i = 0; i < n; i++) {
+        int end = DSMIN(i + c, n - 1);
+        for (int j = i + 1; j <= end; j++) {
+            double limit = DBL_EPSILON * (fabs(matrix[i * n + i]) + fabs(matrix[j * n + j]));
+            if (fabs(matrix[i * n + j]) > limit)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Compute the explicit solve matrix (A' A)^-1 A' from the LDLT decomposition
+ * by solving L D L' x = A' e_k for every column k.
+ * Entries below FLT_MIN are flushed to zero, so the float copy of the
+ * matrix holds no denormals, which would slow down the products. The
+ * rows keep their full length, the zeros are multiplied like any other
+ * entry.
+ */
+static void dense_solve_matrix(int n, int bandwidth, const double *ldlt, int columns, const double *transposed_weights, double **solve)
+{
+    int c = bandwidth / 2;
+    double eps = DBL_EPSILON;
+    double *x = calloc(n, sizeof (double));
+    *solve = calloc(n * columns, sizeof (double));
+
+    for (int k = 0; k < columns; k++) {
+        // Solve L z = A' e_k
+        for (int i = 0; i < n; i++) {
+            double sum = transposed_weights[i * columns + k];
+            for (int j = DSMAX(0, i - c); j < i; j++)
+                sum -= ldlt[j * n + i] * x[j];
+            x[i] = sum;
+        }
+
+        // Solve D L' x = z
+        for (int i = n - 1; i >= 0; i--) {
+            double sum = x[i] / (ldlt[i * n + i] + eps);
+            for (int j = i + 1; j <= DSMIN(n - 1, i + c); j++)
+                sum -= ldlt[i * n + j] * x[j];
+            x[i] = sum;
+        }
+
+        for (int i = 0; i < n; i++)
+            (*solve)[i * columns + k] = fabs(x[i]) < FLT_MIN ? 0.0 : x[i];
+    }
+
+    free(x);
+}
+
+
 static void multiply_sparse_matrices(int rows, int columns, const int *lidx, const int *ridx, const double *lm, const double *rm, double **multiplied)
 {
     *multiplied = calloc(rows * columns, sizeof (double));
@@ -143,6 +209,38 @@ static void extract_compressed_lower_upper_diagonal(int n, int bandwidth, const
 }
 
 
+/*
+ * Drop the outermost band diagonals of the compressed factors whose
+ * entries are all below the given tolerance. L' is unit triangular,
+ * so its entries can be compared against the tolerance directly. The
+ * entries of LD are those of L' scaled by the pivot of their column,
+ * so the same diagonals are dropped from both without checking LD.
+ */
+static void trim_compressed_lower_upper(int n, int *bandwidth, double tolerance, float **compressed_lower, float **compressed_upper)
+{
+    int c = *bandwidth / 2;
+    int effective_c = 0;
+
+    for (int d = c; d > 0; d--) {
+        double max = 0.0;
+        for (int i = 0; i < n; i++)
+            max = DSMAX(max, fabs(compressed_upper[d - 1][i]));
+        if (max >= tolerance) {
+            effective_c = d;
+            break;
+        }
+    }
+
+    for (int i = 0; i < c - effective_c; i++) {
+        free(compressed_lower[i]);
+        free(compressed_upper[effective_c + i]);
+    }
+    memmove(compressed_lower, compressed_lower + c - effective_c, effective_c * sizeof (float *));
+
+    *bandwidth = effective_c * 2 + 1;
+}
+
+
 #define PI 3.14159265358979323846
 
 
@@ -316,6 +414,29 @@ static void convolve_weights(int src_dim, int dst_dim, int kernel_size, double *
 }
 
 
+/*
+ * Solver for diagonal systems (bandwidth 1). There is no recurrence,
+ * every output sample is just a weighted box average of its inputs.
+ */
+static void process_plane_h_b1_c(int width, int current_width, int current_height, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                 int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
+                                 float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
+{
+    for (int i = 0; i < current_height; i++) {
+        for (int j = 0; j < width; j++) {
+            float sum = 0.0f;
+            for (int k = weights_left_idx[j]; k < weights_right_idx[j]; k++)
+                sum += weights[j * weights_columns + k - weights_left_idx[j]] * srcp[k];
+
+            dstp[j] = sum * diagonal[j];
+        }
+
+        srcp += src_stride;
+        dstp += dst_stride;
+    }
+}
+
+
 static void process_plane_h_b3_c(int width, int current_width, int current_height, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
                                  int weights_columns, float * restrict weights, float * restrict * restrict lower2, float * restrict * restrict upper2,
                                  float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
@@ -440,6 +561,22 @@ static void process_plane_h_c(int width, int current_width, int current_height,
 }
 
 
+static void process_plane_v_b1_c(int height, int current_height, int current_width, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                 int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
+                                 float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
+{
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < current_width; j++) {
+            float sum = 0.0f;
+            for (int k = weights_left_idx[i]; k < weights_right_idx[i]; k++)
+                sum += weights[i * weights_columns + k - weights_left_idx[i]] * srcp[k * src_stride + j];
+
+            dstp[i * dst_stride + j] = sum * diagonal[i];
+        }
+    }
+}
+
+
 static void process_plane_v_b3_c(int height, int current_height, int current_width, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
                                  int weights_columns, float * restrict weights, float * restrict * restrict lower2, float * restrict * restrict upper2, float * restrict diagonal,
                                  int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
@@ -566,12 +703,14 @@ static inline int check_imask(unsigned char value) {
     return value >= 128;
 }
 
-static void process_plane_masked(int dst_dim, int src_dim, int vector_count, enum DescaleDir dir, int bandwidth,
+// Returns how often the LDLT decomposition had to be redone
+static int process_plane_masked(int dst_dim, int src_dim, int vector_count, enum DescaleDir dir, int bandwidth,
                               int * restrict weights_left_idx, int * restrict weights_right_idx, int * restrict weights_top_idx, int * restrict weights_bot_idx,
                               int weights_columns, float * restrict weights, double * restrict multiplied_weights,
                               int src_stride, int imask_stride, int dst_stride, const float * restrict srcp, const unsigned char * restrict imaskp, float * restrict dstp)
 {
-    double *modified_ldlt = calloc(dst_dim * bandwidth, sizeof (double));
+    size_t mark = descale_scratch_mark();
+    double *modified_ldlt = descale_scratch_alloc(dst_dim * bandwidth * sizeof (double), 64);
     int c = bandwidth / 2;
 
     int imuls = dir == DESCALE_DIR_HORIZONTAL ? src_stride : 1;
@@ -584,6 +723,8 @@ static void process_plane_masked(int dst_dim, int src_dim, int vector_count, enu
     int jmuld = dir == DESCALE_DIR_HORIZONTAL ? 1 : dst_stride;
 
     double eps = DBL_EPSILON;
+    int refactorizations = 0;
+    bool trace = descale_trace_enabled();
 
     for (int i = 0; i < vector_count; i++) {
 
@@ -598,7 +739,9 @@ static void process_plane_masked(int dst_dim, int src_dim, int vector_count, enu
         }
 
         if (!same_mask) {
+            unsigned long long trace_start = trace ? descale_time_ns() : 0;
             int imask_start = 0;
+            refactorizations++;
 
             for (int j = 0; j < src_dim; j++) {
                 imask_start = j;
@@ -641,6 +784,9 @@ static void process_plane_masked(int dst_dim, int src_dim, int vector_count, enu
                     modified_ldlt[i * bandwidth + j] *= e;
                 }
             }
+
+            if (trace)
+                descale_trace_event("refactorize", "masked", trace_start, descale_time_ns(), i);
         }
 
         // Now we can do the usual forward/backward substitution
@@ -673,14 +819,14 @@ static void process_plane_masked(int dst_dim, int src_dim, int vector_count, enu
         }
     }
 
-    free(modified_ldlt);
+    descale_scratch_release(mark);
+
+    return refactorizations;
 }
 
 
-static void process_plane_upscale_c(int dst_dim, int src_dim, int vector_count, enum DescaleDir dir, int bandwidth,
-                              int * restrict weights_left_idx, int * restrict weights_right_idx, int * restrict weights_top_idx, int * restrict weights_bot_idx,
-                              int weights_columns, float * restrict weights, double * restrict multiplied_weights,
-                              int src_stride, int imask_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
+static void process_plane_upscale_c(int dst_dim, int src_dim, int vector_count, enum DescaleDir dir, int * restrict weights_top_idx, int * restrict weights_bot_idx,
+                                    int scale_weights_columns, float * restrict scale_weights, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
 {
     int imuls = dir == DESCALE_DIR_HORIZONTAL ? src_stride : 1;
     int jmuls = dir == DESCALE_DIR_HORIZONTAL ? 1 : src_stride;
@@ -692,7 +838,7 @@ static void process_plane_upscale_c(int dst_dim, int src_dim, int vector_count,
         for (int j = 0; j < src_dim; j++) {
             float sum = 0.0f;
             for (int k = weights_top_idx[j]; k < weights_bot_idx[j]; k++)
-                sum += weights[k * weights_columns + j - weights_left_idx[k]] * srcp[k * jmuls];
+                sum += scale_weights[j * scale_weights_columns + k - weights_top_idx[j]] * srcp[k * jmuls];
 
             dstp[j * jmuld] = sum;
         }
@@ -706,17 +852,22 @@ static void process_plane_upscale_c(int dst_dim, int src_dim, int vector_count,
 static void descale_process_vectors_c(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
                                       int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
 {
+    unsigned long long start = descale_time_ns();
 
     if (core->upscale) {
-        process_plane_upscale_c(core->dst_dim, core->src_dim, vector_count, dir, core->bandwidth,
-                             core->weights_left_idx, core->weights_right_idx, core->weights_top_idx, core->weights_bot_idx,
-                             core->weights_columns, core->weights, core->multiplied_weights, src_stride, imask_stride, dst_stride, srcp, dstp);
+        process_plane_upscale_c(core->dst_dim, core->src_dim, vector_count, dir, core->weights_top_idx, core->weights_bot_idx,
+                                core->scale_weights_columns, core->scale_weights, src_stride, dst_stride, srcp, dstp);
     } else if (imaskp) {
-        process_plane_masked(core->dst_dim, core->src_dim, vector_count, dir, core->bandwidth,
-                             core->weights_left_idx, core->weights_right_idx, core->weights_top_idx, core->weights_bot_idx,
-                             core->weights_columns, core->weights, core->multiplied_weights, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+        int refactorizations = process_plane_masked(core->dst_dim, core->src_dim, vector_count, dir, core->bandwidth,
+                                                    core->weights_left_idx, core->weights_right_idx, core->weights_top_idx, core->weights_bot_idx,
+                                                    core->weights_columns, core->weights, core->multiplied_weights,
+                                                    src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+        __atomic_add_fetch(&core->masked_refactorizations, refactorizations, __ATOMIC_RELAXED);
     } else if (dir == DESCALE_DIR_HORIZONTAL) {
-        if (core->bandwidth == 3)
+        if (core->bandwidth == 1)
+            process_plane_h_b1_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
+                                 core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
+        else if (core->bandwidth == 3)
             process_plane_h_b3_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                  core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
         else if (core->bandwidth == 7)
@@ -726,7 +877,10 @@ static void descale_process_vectors_c(struct DescaleCore *core, enum DescaleDir
             process_plane_h_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                               core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
     } else {
-        if (core->bandwidth == 3)
+        if (core->bandwidth == 1)
+            process_plane_v_b1_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
+                                 core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
+        else if (core->bandwidth == 3)
             process_plane_v_b3_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                  core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
         else if (core->bandwidth == 7)
@@ -736,11 +890,27 @@ static void descale_process_vectors_c(struct DescaleCore *core, enum DescaleDir
             process_plane_v_c(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                               core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
     }
+
+    descale_count_process(core, 1, vector_count, start);
 }
 
 
-static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleParams *params)
+static void descale_process_vectors_planes_c(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int num_planes,
+                                             const int *src_strides, const int *dst_strides, const float *const *srcps, float *const *dstps)
+{
+    for (int p = 0; p < num_planes; p++)
+        descale_process_vectors_c(core, dir, vector_count, src_strides[p], 0, dst_strides[p], srcps[p], NULL, dstps[p]);
+}
+
+
+/*
+ * Adds damping times the identity to A' A before it is factorized, which
+ * only the preconditioner of the EWA solver uses, to keep a wide kernel
+ * from making its factors nearly singular.
+ */
+static struct DescaleCore *create_damped_core(int src_dim, int dst_dim, struct DescaleParams *params, double damping)
 {
+    unsigned long long start = descale_time_ns();
     int support;
     struct DescaleCore core = {0};
 
@@ -826,11 +996,45 @@ static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleP
     }
 
     multiply_sparse_matrices(dst_dim, src_dim, core.weights_left_idx, core.weights_right_idx, transposed_weights, weights, &multiplied_weights);
+    for (int i = 0; i < dst_dim && damping > 0.0; i++)
+        multiplied_weights[i * dst_dim + i] += damping;
+
+    // Depoint and some integer ratios give a diagonal A' A, in that case
+    // there is nothing to factorize and no recurrence needs to be solved.
+    if (!params->has_ignore_mask && !core.upscale && is_banded_matrix_diagonal(dst_dim, core.bandwidth, multiplied_weights))
+        core.bandwidth = 1;
 
     ldlt = calloc(dst_dim * dst_dim, sizeof (double));
     memcpy(ldlt, multiplied_weights, dst_dim * dst_dim * sizeof (double));
     banded_ldlt_decomposition(dst_dim, core.bandwidth, ldlt);
 
+    // For small systems, replace A' by the dense solve matrix (A' A)^-1 A'.
+    // Processing is then a plain matrix product without any recurrence.
+    core.dense = params->dense_threshold > 0 && dst_dim < params->dense_threshold && !params->has_ignore_mask && !core.upscale;
+    if (core.dense) {
+        double *solve;
+        dense_solve_matrix(dst_dim, core.bandwidth, ldlt, src_dim, transposed_weights, &solve);
+        free(transposed_weights);
+        transposed_weights = solve;
+
+        for (int i = 0; i < dst_dim; i++) {
+            core.weights_left_idx[i] = 0;
+            core.weights_right_idx[i] = 0;
+            for (int j = 0; j < src_dim; j++) {
+                if (transposed_weights[i * src_dim + j] != 0.0) {
+                    core.weights_left_idx[i] = j;
+                    break;
+                }
+            }
+            for (int j = src_dim - 1; j >= 0; j--) {
+                if (transposed_weights[i * src_dim + j] != 0.0) {
+                    core.weights_right_idx[i] = j + 1;
+                    break;
+                }
+            }
+        }
+    }
+
     int max = 0;
     for (int i = 0; i < dst_dim; i++) {
         int diff = core.weights_right_idx[i] - core.weights_left_idx[i];
@@ -845,6 +1049,20 @@ static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleP
         }
     }
 
+    // Descaling cores keep A as well for the two-axis masked solver
+    if (core.upscale || !params->has_ignore_mask) {
+        max = 0;
+        for (int i = 0; i < src_dim; i++)
+            max = DSMAX(max, core.weights_bot_idx[i] - core.weights_top_idx[i]);
+        core.scale_weights_columns = max;
+        core.scale_weights = calloc(ceil_n(src_dim, 8) * max, sizeof (float));
+        for (int i = 0; i < src_dim; i++) {
+            for (int j = 0; j < core.weights_bot_idx[i] - core.weights_top_idx[i]; j++) {
+                core.scale_weights[i * max + j] = (float)weights[i * dst_dim + core.weights_top_idx[i] + j];
+            }
+        }
+    }
+
     if (params->has_ignore_mask) {
         core.multiplied_weights = calloc(dst_dim * core.bandwidth, sizeof (double));
         for (int i = 0; i < dst_dim; i++) {
@@ -852,11 +1070,18 @@ static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleP
                 core.multiplied_weights[i * core.bandwidth + j] = multiplied_weights[i * dst_dim + i + j];
             }
         }
+    } else if (core.dense) {
+        core.bandwidth = 1;
+        core.diagonal = calloc(ceil_n(dst_dim, 8), sizeof (float));
+        for (int i = 0; i < dst_dim; i++)
+            core.diagonal[i] = 1.0f;
     } else if (!core.upscale) {
         double *lower;
         transpose_matrix(dst_dim, dst_dim, ldlt, &lower);
         multiply_banded_matrix_with_diagonal(dst_dim, core.bandwidth, lower);
         extract_compressed_lower_upper_diagonal(dst_dim, core.bandwidth, lower, ldlt, &core.lower, &core.upper, &core.diagonal);
+        if (params->band_tolerance > 0.0)
+            trim_compressed_lower_upper(dst_dim, &core.bandwidth, params->band_tolerance, core.lower, core.upper);
         free(lower);
     }
     free(weights);
@@ -864,6 +1089,9 @@ static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleP
     free(multiplied_weights);
     free(ldlt);
 
+    core.build_time_ns = descale_time_ns() - start;
+    descale_trace_event("build core", "core", start, start + core.build_time_ns, dst_dim);
+
     struct DescaleCore *corep = malloc(sizeof core);
     *corep = core;
 
@@ -871,9 +1099,19 @@ static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleP
 }
 
 
+static struct DescaleCore *create_core(int src_dim, int dst_dim, struct DescaleParams *params)
+{
+    return create_damped_core(src_dim, dst_dim, params, 0.0);
+}
+
+
 static void free_core(struct DescaleCore *core)
 {
+    if (!core)
+        return;
+
     free(core->weights);
+    free(core->scale_weights);
     free(core->weights_left_idx);
     free(core->weights_right_idx);
     free(core->weights_top_idx);
@@ -886,15 +1124,1380 @@ static void free_core(struct DescaleCore *core)
     }
     free(core->lower);
     free(core->upper);
+#ifdef DESCALE_X86
+    descale_jit_free(core->jit);
+#endif
+    free(core);
+}
+
+
+/*
+ * Windowed solve
+ *
+ * The inverse of the banded A' A decays exponentially away from its
+ * diagonal, so an output sample hardly depends on input samples that
+ * are far away from it. To get a range of outputs, the solvers run on
+ * a view of the core that only covers a window around them, extended
+ * by a guard band on both sides. The view shares the weights and the
+ * factors of the full core, the recurrences just start and end at the
+ * borders of the window instead of the borders of the vector.
+ */
+struct DescaleWindow
+{
+    int out_first, out_end;     // window in the output dimension, out_first is a multiple of 8
+    int in_first, in_end;       // input samples the window reads
+};
+
+
+// Size of the guard band, estimated from columns of (A' A)^-1
+static int window_guard(const struct DescaleCore *core, double tolerance)
+{
+    int n = core->dst_dim;
+    int bandwidth = core->bandwidth;
+    int c = bandwidth / 2;
+
+    if (core->upscale || core->dense || c == 0)
+        return 0;
+
+    // Masking can make the system close to singular locally, which slows the decay
+    // down by an amount that is only known per vector, so the whole vector is solved
+    if (core->multiplied_weights)
+        return n;
+
+    size_t mark = descale_scratch_mark();
+    double *x = descale_scratch_alloc((size_t)n * sizeof (double), 64);
+
+    // The decay can differ along the vector, so a few columns are probed.
+    // upper[k - j - 1][j] is the entry (k, j) of L, the diagonal holds D^-1.
+    int guard = 0;
+    for (int probe = 1; probe <= 3; probe++) {
+        int p = n * probe / 4;
+        memset(x, 0, n * sizeof (double));
+        x[p] = 1.0;
+
+        for (int j = p + 1; j < n; j++) {
+            for (int k = DSMAX(p, j - c); k < j; k++)
+                x[j] -= core->upper[j - k - 1][k] * x[k];
+        }
+        for (int j = p; j < n; j++)
+            x[j] *= core->diagonal[j];
+        for (int j = n - 2; j >= 0; j--) {
+            int end = DSMIN(n - 1, j + c);
+            for (int k = j + 1; k <= end; k++)
+                x[j] -= core->upper[k - j - 1][j] * x[k];
+        }
+
+        double total = 0.0;
+        for (int j = 0; j < n; j++)
+            total += fabs(x[j]);
+
+        // Grow the band until the part of the column outside of it is small enough.
+        // The truncated recurrences at both ends of the window add up, so there is some margin.
+        double outside = total - fabs(x[p]);
+        int g = 0;
+        while (outside > 0.25 * tolerance * total && g < n) {
+            g++;
+            if (p - g >= 0)
+                outside -= fabs(x[p - g]);
+            if (p + g < n)
+                outside -= fabs(x[p + g]);
+        }
+        guard = DSMAX(guard, g);
+    }
+
+    descale_scratch_release(mark);
+
+    return guard;
+}
+
+
+static void get_window(const struct DescaleCore *core, int first, int count, double tolerance, struct DescaleWindow *w)
+{
+    // For upscaling cores the roles of src_dim and dst_dim are swapped
+    int out_dim = core->upscale ? core->src_dim : core->dst_dim;
+    const int *lo = core->upscale ? core->weights_top_idx : core->weights_left_idx;
+    const int *hi = core->upscale ? core->weights_bot_idx : core->weights_right_idx;
+    int guard = window_guard(core, tolerance > 0.0 ? tolerance : 1e-5);
+
+    w->out_first = floor_n(DSMAX(0, first - guard), 8);
+    w->out_end = DSMIN(out_dim, first + count + guard);
+
+    // The SIMD solvers process the outputs in blocks of 8, the rows they add at the end have to be readable too
+    int end = DSMIN(out_dim, w->out_first + ceil_n(w->out_end - w->out_first, 8));
+    w->in_first = INT_MAX;
+    w->in_end = 0;
+    for (int i = w->out_first; i < end; i++) {
+        if (hi[i] <= lo[i])
+            continue;
+        w->in_first = DSMIN(w->in_first, lo[i]);
+        w->in_end = DSMAX(w->in_end, hi[i]);
+    }
+    if (w->in_first > w->in_end)
+        w->in_first = w->in_end;
+}
+
+
+static void get_window_source_range(const struct DescaleCore *core, int first, int count, double tolerance, int *src_first, int *src_end)
+{
+    struct DescaleWindow w;
+    get_window(core, first, count, tolerance, &w);
+    *src_first = w.in_first;
+    *src_end = w.in_end;
+}
+
+
+static void process_vectors_window(struct DescaleCore *core, DescaleProcessVectors process_vectors, enum DescaleDir dir, int vector_count,
+                                   int first, int count, double tolerance, int src_first,
+                                   int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    unsigned long long start = descale_time_ns();
+    struct DescaleWindow w;
+    get_window(core, first, count, tolerance, &w);
+
+    int out_dim = core->upscale ? core->src_dim : core->dst_dim;
+    int n = w.out_end - w.out_first;
+    int padded = ceil_n(n, 8);
+    // Keeps the alignment of srcp for the SIMD loads
+    int in_first = src_first + floor_n(w.in_first - src_first, 8);
+    int m = w.in_end - in_first;
+    int c = core->bandwidth / 2;
+
+    size_t mark = descale_scratch_mark();
+    struct DescaleCore view = *core;
+    view.jit = NULL;
+    if (view.kernel[dir] == DESCALE_KERNEL_JIT)
+        view.kernel[dir] = DESCALE_KERNEL_DEFAULT;
+    view.masked_refactorizations = 0;
+
+    int *lo = descale_scratch_alloc(padded * sizeof (int), 64);
+    int *hi = descale_scratch_alloc(padded * sizeof (int), 64);
+    const int *core_lo = core->upscale ? core->weights_top_idx : core->weights_left_idx;
+    const int *core_hi = core->upscale ? core->weights_bot_idx : core->weights_right_idx;
+    for (int i = 0; i < padded; i++) {
+        int row = w.out_first + i;
+        lo[i] = hi[i] = 0;
+        if (row < out_dim && core_hi[row] > core_lo[row]) {
+            lo[i] = core_lo[row] - in_first;
+            hi[i] = core_hi[row] - in_first;
+        }
+    }
+
+    if (core->upscale) {
+        view.src_dim = n;
+        view.dst_dim = m;
+        view.weights_top_idx = lo;
+        view.weights_bot_idx = hi;
+        view.scale_weights = core->scale_weights + (size_t)w.out_first * core->scale_weights_columns;
+    } else {
+        view.src_dim = m;
+        view.dst_dim = n;
+        view.weights_left_idx = lo;
+        view.weights_right_idx = hi;
+        view.weights = core->weights + (size_t)w.out_first * core->weights_columns;
+        view.diagonal = core->diagonal ? core->diagonal + w.out_first : NULL;
+        if (core->lower) {
+            view.lower = descale_scratch_alloc(c * sizeof (float *), 64);
+            view.upper = descale_scratch_alloc(c * sizeof (float *), 64);
+            for (int i = 0; i < c; i++) {
+                view.lower[i] = core->lower[i] + w.out_first;
+                view.upper[i] = core->upper[i] + w.out_first;
+            }
+        }
+        if (core->multiplied_weights) {
+            // The masked solver also needs the outputs every input sample contributes to
+            view.multiplied_weights = core->multiplied_weights + (size_t)w.out_first * core->bandwidth;
+            view.weights_top_idx = descale_scratch_alloc(ceil_n(m, 8) * sizeof (int), 64);
+            view.weights_bot_idx = descale_scratch_alloc(ceil_n(m, 8) * sizeof (int), 64);
+            for (int i = 0; i < m; i++) {
+                view.weights_top_idx[i] = DSMIN(n, DSMAX(0, core->weights_top_idx[in_first + i] - w.out_first));
+                view.weights_bot_idx[i] = DSMIN(n, DSMAX(0, core->weights_bot_idx[in_first + i] - w.out_first));
+            }
+        }
+    }
+
+    int src_offset = (in_first - src_first) * (dir == DESCALE_DIR_HORIZONTAL ? 1 : src_stride);
+    int imask_offset = (in_first - src_first) * (dir == DESCALE_DIR_HORIZONTAL ? 1 : imask_stride);
+    const float *view_srcp = srcp + src_offset;
+    int view_src_stride = src_stride;
+    int view_vectors = vector_count;
+
+    // The SIMD horizontal pass works on blocks of 8 rows, fewer rows are padded
+    if (dir == DESCALE_DIR_HORIZONTAL && vector_count < 8 && !imaskp) {
+        view_src_stride = ceil_n(m, 16);
+        float *padded_srcp = descale_scratch_alloc((size_t)view_src_stride * 8 * sizeof (float), 64);
+        memset(padded_srcp, 0, (size_t)view_src_stride * 8 * sizeof (float));
+        for (int i = 0; i < vector_count; i++)
+            memcpy(padded_srcp + i * view_src_stride, view_srcp + (size_t)i * src_stride, m * sizeof (float));
+        view_srcp = padded_srcp;
+        view_vectors = 8;
+    }
+
+    int buffer_stride = dir == DESCALE_DIR_HORIZONTAL ? ceil_n(padded, 16) : ceil_n(view_vectors, 16);
+    int buffer_lines = dir == DESCALE_DIR_HORIZONTAL ? view_vectors : padded;
+    float *buffer = descale_scratch_alloc((size_t)buffer_stride * buffer_lines * sizeof (float), 64);
+
+    process_vectors(&view, dir, view_vectors, view_src_stride, imask_stride, buffer_stride,
+                    view_srcp, imaskp ? imaskp + imask_offset : NULL, buffer);
+
+    if (dir == DESCALE_DIR_HORIZONTAL) {
+        for (int i = 0; i < vector_count; i++)
+            memcpy(dstp + (size_t)i * dst_stride, buffer + (size_t)i * buffer_stride + first - w.out_first, count * sizeof (float));
+    } else {
+        for (int j = 0; j < count; j++)
+            memcpy(dstp + (size_t)j * dst_stride, buffer + (size_t)(first - w.out_first + j) * buffer_stride, vector_count * sizeof (float));
+    }
+
+    descale_scratch_release(mark);
+
+    __atomic_add_fetch(&core->masked_refactorizations, view.masked_refactorizations, __ATOMIC_RELAXED);
+    descale_count_process(core, 1, vector_count, start);
+}
+
+
+static void process_vectors_window_c(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int first, int count, double tolerance, int src_first,
+                                     int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    process_vectors_window(core, &descale_process_vectors_c, dir, vector_count, first, count, tolerance, src_first,
+                           src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+typedef void (*DescaleProcessVectorsHalf)(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                          int src_stride, int dst_stride, const void *srcp, void *dstp);
+
+// Converts n samples of a row to floats
+typedef void (*DescaleLoadRow)(const void *srcp, float *dstp, int n, const struct DescaleSampleFormat *format);
+
+// Converts n floats to samples of a row that starts at column x of row y of the output, which anchor the dither pattern
+typedef void (*DescaleStoreRow)(const float *srcp, void *dstp, int n, int x, int y, const struct DescaleSampleFormat *format);
+
+
+static void load_row_c(const void *srcp, float *dstp, int n, const struct DescaleSampleFormat *format)
+{
+    float scale = 1.0f / descale_sample_peak(format);
+    for (int x = 0; x < n; x++)
+        dstp[x] = descale_to_linear(descale_load_sample(srcp, x, format, scale), format->transfer);
+}
+
+
+static void store_row_c(const float *srcp, void *dstp, int n, int x, int y, const struct DescaleSampleFormat *format)
+{
+    float peak = descale_sample_peak(format);
+    for (int i = 0; i < n; i++)
+        descale_store_sample(dstp, i, descale_from_linear(srcp[i], format->transfer), format, peak, format->dither ? descale_dither_offset(x + i, y) : 0.0f);
+}
+
+
+#define FORMAT_BLOCK_ROWS 16
+#define FORMAT_STRIP_COLUMNS 64
+
+/*
+ * Solves vectors stored in other sample formats than float. The
+ * horizontal direction converts blocks of 16 rows and the vertical one
+ * strips of 64 columns, each right before the solver reads them and
+ * right after it wrote them, while they are still in the cache. Float
+ * samples with a transfer function take the same way, so decoding to
+ * linear light costs no extra pass over the plane either.
+ */
+static void process_vectors_format(struct DescaleCore *core, DescaleProcessVectors process_vectors, DescaleProcessVectorsHalf process_vectors_half,
+                                   DescaleLoadRow load_row, DescaleStoreRow store_row, enum DescaleDir dir, int vector_count,
+                                   int src_stride, int imask_stride, int dst_stride, const void *srcp, const unsigned char *imaskp, void *dstp,
+                                   const struct DescaleSampleFormat *src_format, const struct DescaleSampleFormat *dst_format)
+{
+    bool src_float = src_format->type == DESCALE_SAMPLE_FLOAT && src_format->transfer == DESCALE_TRANSFER_LINEAR;
+    bool dst_float = dst_format->type == DESCALE_SAMPLE_FLOAT && dst_format->transfer == DESCALE_TRANSFER_LINEAR;
+
+    if (src_float && dst_float) {
+        process_vectors(core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+        return;
+    }
+
+    // The half float solvers convert the intermediate of a descale themselves, cores tuned to C convert it below
+    if (process_vectors_half && core->kernel[dir] != DESCALE_KERNEL_C && !imaskp && !core->upscale && !core->multiplied_weights &&
+        ((dir == DESCALE_DIR_HORIZONTAL && src_float && dst_format->type == DESCALE_SAMPLE_HALF && dst_format->transfer == DESCALE_TRANSFER_LINEAR) ||
+         (dir == DESCALE_DIR_VERTICAL && src_format->type == DESCALE_SAMPLE_HALF && src_format->transfer == DESCALE_TRANSFER_LINEAR && dst_float))) {
+        process_vectors_half(core, dir, vector_count, src_stride, dst_stride, srcp, dstp);
+        return;
+    }
+
+    // For upscaling cores the roles of src_dim and dst_dim are swapped
+    int in_dim = core->upscale ? core->dst_dim : core->src_dim;
+    int out_dim = core->upscale ? core->src_dim : core->dst_dim;
+    size_t src_size = descale_sample_size(src_format->type);
+    size_t dst_size = descale_sample_size(dst_format->type);
+    const unsigned char *src_bytes = srcp;
+    unsigned char *dst_bytes = dstp;
+    size_t mark = descale_scratch_mark();
+
+    if (dir == DESCALE_DIR_HORIZONTAL) {
+        int rows = DSMIN(FORMAT_BLOCK_ROWS, vector_count);
+        int in_stride = ceil_n(in_dim, 16);
+        int out_stride = ceil_n(out_dim, 16);
+        float *in = src_float ? NULL : descale_scratch_alloc((size_t)in_stride * rows * sizeof (float), 64);
+        float *out = dst_float ? NULL : descale_scratch_alloc((size_t)out_stride * rows * sizeof (float), 64);
+
+        for (int i = 0; i < vector_count; i += rows) {
+            // The last block overlaps the previous one, because the SIMD solvers need full blocks of 8 rows
+            int row = DSMIN(i, vector_count - rows);
+            if (!src_float) {
+                for (int r = 0; r < rows; r++)
+                    load_row(src_bytes + (size_t)(row + r) * src_stride * src_size, in + (size_t)r * in_stride, in_dim, src_format);
+            }
+
+            process_vectors(core, dir, rows, src_float ? src_stride : in_stride, imask_stride, dst_float ? dst_stride : out_stride,
+                            src_float ? (const float *)srcp + (size_t)row * src_stride : in, imaskp ? imaskp + (size_t)row * imask_stride : NULL,
+                            dst_float ? (float *)dstp + (size_t)row * dst_stride : out);
+
+            if (!dst_float) {
+                for (int r = 0; r < rows; r++)
+                    store_row(out + (size_t)r * out_stride, dst_bytes + (size_t)(row + r) * dst_stride * dst_size, out_dim, 0, row + r, dst_format);
+            }
+        }
+
+    } else {
+        int columns = DSMIN(FORMAT_STRIP_COLUMNS, ceil_n(vector_count, 8));
+        float *in = src_float ? NULL : descale_scratch_alloc((size_t)columns * in_dim * sizeof (float), 64);
+        float *out = dst_float ? NULL : descale_scratch_alloc((size_t)columns * out_dim * sizeof (float), 64);
+
+        for (int j = 0; j < vector_count; j += columns) {
+            int n = DSMIN(columns, vector_count - j);
+            if (!src_float) {
+                for (int y = 0; y < in_dim; y++) {
+                    load_row(src_bytes + ((size_t)y * src_stride + j) * src_size, in + (size_t)y * columns, n, src_format);
+                    // The SIMD solvers process whole vectors of 8 columns
+                    memset(in + (size_t)y * columns + n, 0, (ceil_n(n, 8) - n) * sizeof (float));
+                }
+            }
+
+            process_vectors(core, dir, n, src_float ? src_stride : columns, imask_stride, dst_float ? dst_stride : columns,
+                            src_float ? (const float *)srcp + j : in, imaskp ? imaskp + j : NULL, dst_float ? (float *)dstp + j : out);
+
+            if (!dst_float) {
+                for (int y = 0; y < out_dim; y++)
+                    store_row(out + (size_t)y * columns, dst_bytes + ((size_t)y * dst_stride + j) * dst_size, n, j, y, dst_format);
+            }
+        }
+    }
+
+    descale_scratch_release(mark);
+}
+
+
+static void process_vectors_format_c(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                     int src_stride, int imask_stride, int dst_stride, const void *srcp, const unsigned char *imaskp, void *dstp,
+                                     const struct DescaleSampleFormat *src_format, const struct DescaleSampleFormat *dst_format)
+{
+    process_vectors_format(core, &descale_process_vectors_c, NULL, &load_row_c, &store_row_c, dir, vector_count,
+                           src_stride, imask_stride, dst_stride, srcp, imaskp, dstp, src_format, dst_format);
+}
+
+
+/*
+ * Two-axis masked solve
+ *
+ * With an ignore mask M the descale has to minimize |M (A x - b)| with
+ * the two-dimensional A = Av (x) Ah, whose masked normal matrix
+ * A' M A is not separable anymore. It is solved with conjugate
+ * gradients, preconditioned by P = Av' Av (x) Ah' Ah, the normal matrix
+ * without mask. The residual of the normal equations is r = A' s with
+ * the masked residual s = M (b - A x) of the input, so the preconditioned
+ * residual P^-1 r = P^-1 A' s is just the ordinary separable descale of s,
+ * and r' P^-1 r = s' A P^-1 r needs its upscale. Every iteration thus
+ * costs one descale and one upscale with the SIMD solvers of the cores.
+ * Since A p follows from A P^-1 r by the same recurrence as p, the
+ * upscale of the search direction never has to be computed separately.
+ *
+ * Outputs whose inputs are all masked are not determined by the problem,
+ * so masked inputs are pulled towards 0 with a small weight. That keeps
+ * the preconditioned system well conditioned and, like the single-axis
+ * masked solver, gives 0 where nothing is known.
+ *
+ * The solver stops once the preconditioned residual r' P^-1 r = s' A P^-1 A' s
+ * is below the tolerance relative to the unmasked input, whose own
+ * r' P^-1 r is at most b' M b because A P^-1 A' is a projection. The
+ * more outputs depend mostly on masked inputs, the more the damping
+ * dominates and the slower the convergence. A random mask over a fifth
+ * of the plane takes about 70 iterations to reach 1e-5, so masks hiding
+ * more than MASKED_MAX_FRACTION of the inputs are rejected.
+ */
+#define MASKED_DAMPING 1e-4f
+#define MASKED_MAX_FRACTION 0.25
+
+struct DescaleMaskedPlane
+{
+    struct DescaleCore *core_h, *core_v;
+    struct DescaleCore up_h, up_v;  // the cores as upscalers, to apply A
+    DescaleProcessVectors process_vectors;
+    int src_height, dst_width;
+    int mid_stride;
+    float *mid;
+};
+
+
+static inline float masked_weight(unsigned char value)
+{
+    return check_imask(value) ? MASKED_DAMPING : 1.0f;
+}
+
+
+// Separable descale of a source sized plane
+static void masked_descale(struct DescaleMaskedPlane *mp, int src_stride, const float *srcp, int dst_stride, float *dstp)
+{
+    mp->process_vectors(mp->core_h, DESCALE_DIR_HORIZONTAL, mp->src_height, src_stride, 0, mp->mid_stride, srcp, NULL, mp->mid);
+    mp->process_vectors(mp->core_v, DESCALE_DIR_VERTICAL, mp->dst_width, mp->mid_stride, 0, dst_stride, mp->mid, NULL, dstp);
+}
+
+
+// Separable upscale of a descaled plane by A
+static void masked_upscale(struct DescaleMaskedPlane *mp, int src_stride, const float *srcp, int dst_stride, float *dstp)
+{
+    mp->process_vectors(&mp->up_v, DESCALE_DIR_VERTICAL, mp->dst_width, src_stride, 0, mp->mid_stride, srcp, NULL, mp->mid);
+    mp->process_vectors(&mp->up_h, DESCALE_DIR_HORIZONTAL, mp->src_height, mp->mid_stride, 0, dst_stride, mp->mid, NULL, dstp);
+}
+
+
+static double masked_fraction(int width, int height, int imask_stride, const unsigned char *imaskp)
+{
+    size_t masked = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            masked += check_imask(imaskp[(size_t)y * imask_stride + x]);
+    }
+    return (double)masked / ((double)width * height);
+}
+
+
+static double dot_product(int width, int height, int stride, const float *a, const float *b)
+{
+    double dot = 0.0;
+    for (int y = 0; y < height; y++) {
+        float sum = 0.0f;
+        for (int x = 0; x < width; x++)
+            sum += a[(size_t)y * stride + x] * b[(size_t)y * stride + x];
+        dot += sum;
+    }
+    return dot;
+}
+
+
+static int process_plane_masked_2d(struct DescaleCore *core_h, struct DescaleCore *core_v, DescaleProcessVectors process_vectors,
+                                   int max_iterations, double tolerance, bool warm_start,
+                                   int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    unsigned long long start = descale_time_ns();
+    int sw = core_h->src_dim, sh = core_v->src_dim;
+    int dw = core_h->dst_dim, dh = core_v->dst_dim;
+    int ss = ceil_n(sw, 16), ds = ceil_n(dw, 16);
+
+    if (masked_fraction(sw, sh, imask_stride, imaskp) > MASKED_MAX_FRACTION)
+        return -1;
+
+    struct DescaleMaskedPlane mp = { core_h, core_v, *core_h, *core_v, process_vectors, sh, dw, ds };
+    mp.up_h.upscale = mp.up_v.upscale = true;
+    mp.up_h.kernel[0] = mp.up_h.kernel[1] = mp.up_v.kernel[0] = mp.up_v.kernel[1] = DESCALE_KERNEL_DEFAULT;
+
+    size_t mark = descale_scratch_mark();
+    size_t src_size = (size_t)ss * sh * sizeof (float);
+    size_t dst_size = (size_t)ds * dh * sizeof (float);
+    // The padding columns are never read back, but they must not hold NaNs that the vertical solvers carry around
+    mp.mid = memset(descale_scratch_alloc((size_t)ds * sh * sizeof (float), 64), 0, (size_t)ds * sh * sizeof (float));
+    float *s = memset(descale_scratch_alloc(src_size, 64), 0, src_size);    // weighted residual of the input
+    float *q = memset(descale_scratch_alloc(src_size, 64), 0, src_size);    // A p
+    float *t = memset(descale_scratch_alloc(src_size, 64), 0, src_size);    // A z
+    float *z = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // P^-1 r
+    float *p = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // search direction
+
+    if (warm_start) {
+        masked_upscale(&mp, dst_stride, dstp, ss, q);
+    } else {
+        for (int y = 0; y < dh; y++)
+            memset(dstp + (size_t)y * dst_stride, 0, dw * sizeof (float));
+    }
+
+    double signal = 0.0;
+    for (int y = 0; y < sh; y++) {
+        const float *b = srcp + (size_t)y * src_stride;
+        const unsigned char *m = imaskp + (size_t)y * imask_stride;
+        float *sy = s + (size_t)y * ss;
+        const float *qy = q + (size_t)y * ss;
+        float sum = 0.0f;
+        for (int x = 0; x < sw; x++) {
+            bool masked = check_imask(m[x]);
+            sy[x] = masked ? -MASKED_DAMPING * qy[x] : b[x] - qy[x];
+            sum += masked ? 0.0f : b[x] * b[x];
+        }
+        signal += sum;
+    }
+    double threshold = tolerance * tolerance * signal;
+
+    masked_descale(&mp, ss, s, ds, z);
+    masked_upscale(&mp, ds, z, ss, t);
+    double rz = dot_product(sw, sh, ss, s, t);
+    memcpy(p, z, dst_size);
+    memcpy(q, t, src_size);
+
+    double qmq = 0.0;
+    for (int y = 0; y < sh; y++) {
+        const unsigned char *m = imaskp + (size_t)y * imask_stride;
+        const float *qy = q + (size_t)y * ss;
+        float sum = 0.0f;
+        for (int x = 0; x < sw; x++)
+            sum += masked_weight(m[x]) * qy[x] * qy[x];
+        qmq += sum;
+    }
+
+    int iterations = 0;
+    // qmq is 0 once x is exact
+    while (iterations < max_iterations && qmq > 0.0 && rz > threshold) {
+        float alpha = (float)(rz / qmq);
+        for (int y = 0; y < dh; y++) {
+            float *xy = dstp + (size_t)y * dst_stride;
+            const float *py = p + (size_t)y * ds;
+            for (int x = 0; x < dw; x++)
+                xy[x] += alpha * py[x];
+        }
+        iterations++;
+        if (iterations == max_iterations)
+            break;
+
+        for (int y = 0; y < sh; y++) {
+            const unsigned char *m = imaskp + (size_t)y * imask_stride;
+            float *sy = s + (size_t)y * ss;
+            const float *qy = q + (size_t)y * ss;
+            for (int x = 0; x < sw; x++)
+                sy[x] -= alpha * masked_weight(m[x]) * qy[x];
+        }
+
+        masked_descale(&mp, ss, s, ds, z);
+        masked_upscale(&mp, ds, z, ss, t);
+        double rz_next = dot_product(sw, sh, ss, s, t);
+        if (rz_next <= threshold)
+            break;
+
+        float beta = (float)(rz_next / rz);
+        for (int y = 0; y < dh; y++) {
+            float *py = p + (size_t)y * ds;
+            const float *zy = z + (size_t)y * ds;
+            for (int x = 0; x < dw; x++)
+                py[x] = zy[x] + beta * py[x];
+        }
+
+        qmq = 0.0;
+        for (int y = 0; y < sh; y++) {
+            const unsigned char *m = imaskp + (size_t)y * imask_stride;
+            float *qy = q + (size_t)y * ss;
+            const float *ty = t + (size_t)y * ss;
+            float sum = 0.0f;
+            for (int x = 0; x < sw; x++) {
+                qy[x] = ty[x] + beta * qy[x];
+                sum += masked_weight(m[x]) * qy[x] * qy[x];
+            }
+            qmq += sum;
+        }
+        rz = rz_next;
+    }
+
+    descale_scratch_release(mark);
+    descale_trace_event("masked solve", "masked", start, descale_time_ns(), iterations);
+
+    return iterations;
+}
+
+
+static int process_plane_masked_2d_c(struct DescaleCore *core_h, struct DescaleCore *core_v, int max_iterations, double tolerance, bool warm_start,
+                                     int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    return process_plane_masked_2d(core_h, core_v, &descale_process_vectors_c, max_iterations, tolerance, warm_start,
+                                   src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+
+/*
+ * EWA kernels
+ *
+ * Elliptical weighted averaging, as done by mpv and libplacebo, weights
+ * the inputs around an output position by a radially symmetric kernel
+ * of their distance and normalizes the weights of every output to 1.
+ * The resulting A does not factor into the two axes, so A' A has no
+ * banded LDLT. The normal equations are instead solved with conjugate
+ * gradients that only apply A and A' as sparse products, starting from
+ * a separable Lanczos descale of the same geometry.
+ *
+ * The input positions of an output and thus its weights only depend on
+ * the phases of its row and column, so the weights are stored once per
+ * pair of phases. Rational ratios have few distinct phases, otherwise
+ * the phases are rounded to multiples of 1 / EWA_PHASE_STEPS, 1/32 of
+ * a sample, which moves the kernel by at most 1/64 of a sample. That
+ * leaves up to 33 phases per axis, within EWA_MAX_PHASES.
+ *
+ * A radially symmetric kernel passes much less of the diagonal high
+ * frequencies than a separable one, so A' A is nearly singular there.
+ * The solve adds EWA_DAMPING times the identity to it, which only damps
+ * what the input barely determines.
+ *
+ * The preconditioner P is the normal matrix of a separable Lanczos,
+ * whose inverse the LDLT factors of its cores apply to the residual in
+ * every iteration. With the kernel of the starting guess, P keeps much
+ * of the diagonal high frequencies that A' A loses, so they converge as
+ * slowly as the damping allows and noise took about 150 iterations.
+ * Widening the kernel by EWA_PRECONDITION_BLUR moves P closer to A' A
+ * there, and EWA_PRECONDITION_DAMPING on its diagonal keeps the wider
+ * kernel from making P nearly singular. The solve then stops on the
+ * relative residual like the two-axis masked solver, which takes 10 to
+ * 15 iterations for natural images and about 30 for noise at 1e-5.
+ */
+#define EWA_MAX_PHASES 64
+#define EWA_PHASE_STEPS 32
+#define EWA_DAMPING 1e-4f
+#define EWA_PRECONDITION_BLUR 1.2
+#define EWA_PRECONDITION_DAMPING 1e-2
+
+typedef void (*DescaleEwaProduct)(const struct DescaleEwaMap *map, const float *table,
+                                  int src_stride, const float *srcp, int dst_stride, float *dstp);
+
+
+// Zeros of jinc, the radii of the EWA kernels for 1 to 8 taps
+static const double jinc_zeros[] = {
+    1.2196698912665045, 2.2331305943815286, 3.2383154841662362, 4.2410628637960699,
+    5.2427643768701817, 6.2439216898644877, 7.2447598687199570, 8.2453949139520427
+};
+
+
+static inline double jinc(double x)
+{
+    return x < 1e-8 ? 1.0 : 2.0 * j1(x * PI) / (x * PI);
+}
+
+
+static double calculate_ewa_weight(enum DescaleMode mode, int taps, double distance, double blur)
+{
+    double radius = jinc_zeros[taps - 1];
+    distance /= blur;
+
+    if (distance >= radius)
+        return 0.0;
+    if (mode == DESCALE_MODE_EWA_LANCZOS)
+        return jinc(distance) * jinc(distance * jinc_zeros[0] / radius);
+    return jinc(distance);
+}
+
+
+/*
+ * Same positions as scaling_weights. For every position of the large
+ * dimension, base receives the input index of its first tap and phase
+ * the index of the distance of that tap in offsets. Returns the number
+ * of phases or 0 if there are more than EWA_MAX_PHASES.
+ */
+static int ewa_axis_phases(int small_dim, int large_dim, double shift, double active_dim, int support, double quantum,
+                           int *base, int *phase, double *offsets)
+{
+    double ratio = (double)large_dim / active_dim;
+    int count = 0;
+
+    for (int i = 0; i < large_dim; i++) {
+        double pos = (i + 0.5) / ratio + shift;
+        double begin_pos = round_halfup(pos - support) + 0.5;
+        double offset = begin_pos - pos;
+        if (quantum > 0.0)
+            offset = round(offset / quantum) * quantum;
+
+        int p = 0;
+        while (p < count && fabs(offsets[p] - offset) > 1e-9)
+            p++;
+        if (p == count) {
+            if (count == EWA_MAX_PHASES)
+                return 0;
+            offsets[count++] = offset;
+        }
+        base[i] = (int)floor(begin_pos);
+        phase[i] = p;
+    }
+
+    return count;
+}
+
+
+// Input index that a tap at idx reads after the border handling of scaling_weights, -1 if it is dropped
+static int ewa_border_index(int idx, int dim, enum DescaleBorder border_handling)
+{
+    if (idx >= 0 && idx < dim)
+        return idx;
+    if (border_handling == DESCALE_BORDER_ZERO)
+        return -1;
+
+    double xpos = idx + 0.5;
+    double real_pos;
+    if (border_handling == DESCALE_BORDER_REPEAT)
+        real_pos = xpos < 0.0 ? 0.0 : dim - 0.5;
+    else
+        real_pos = xpos < 0.0 ? -xpos : DSMIN(2.0 * dim - xpos, dim - 0.5);
+
+    return DSMIN(DSMAX((int)floor(real_pos), 0), dim - 1);
+}
+
+
+/*
+ * Lists the taps of the horizontal axis by the small position they read:
+ * the taps of small position j are [start[j], start[j + 1]) in pairs, as
+ * (large position, table offset). The table offset of tap d of a large
+ * position with phase p is p * taps + d.
+ */
+static void ewa_column_lists(int small_dim, int large_dim, int taps, const int *base, const int *phase, enum DescaleBorder border_handling,
+                             int **start, int **pairs)
+{
+    int *count = calloc(small_dim + 1, sizeof (int));
+    for (int i = 0; i < large_dim; i++) {
+        for (int d = 0; d < taps; d++) {
+            int j = ewa_border_index(base[i] + d, small_dim, border_handling);
+            if (j >= 0)
+                count[j + 1]++;
+        }
+    }
+    for (int j = 0; j < small_dim; j++)
+        count[j + 1] += count[j];
+
+    *start = malloc((small_dim + 1) * sizeof (int));
+    memcpy(*start, count, (small_dim + 1) * sizeof (int));
+    *pairs = malloc(2 * (size_t)DSMAX(count[small_dim], 1) * sizeof (int));
+    for (int i = 0; i < large_dim; i++) {
+        for (int d = 0; d < taps; d++) {
+            int j = ewa_border_index(base[i] + d, small_dim, border_handling);
+            if (j >= 0) {
+                (*pairs)[2 * count[j]] = i;
+                (*pairs)[2 * count[j] + 1] = phase[i] * taps + d;
+                count[j]++;
+            }
+        }
+    }
+    free(count);
+}
+
+
+/*
+ * The pairs of small and large rows that A connects, as (small row, large
+ * row, table offset), sorted by the table offset. The table offset of tap
+ * d of a large row with phase p is (p * taps + d) * row_size.
+ */
+static int *ewa_row_pairs(int small_dim, int large_dim, int taps, const int *base, const int *phase, int phases, int row_size,
+                          enum DescaleBorder border_handling, int *pair_count)
+{
+    int *count = calloc(phases * taps + 1, sizeof (int));
+    for (int i = 0; i < large_dim; i++) {
+        for (int d = 0; d < taps; d++) {
+            if (ewa_border_index(base[i] + d, small_dim, border_handling) >= 0)
+                count[phase[i] * taps + d + 1]++;
+        }
+    }
+    for (int o = 0; o < phases * taps; o++)
+        count[o + 1] += count[o];
+
+    *pair_count = count[phases * taps];
+    int *pairs = malloc(3 * (size_t)DSMAX(*pair_count, 1) * sizeof (int));
+    for (int i = 0; i < large_dim; i++) {
+        for (int d = 0; d < taps; d++) {
+            int j = ewa_border_index(base[i] + d, small_dim, border_handling);
+            if (j >= 0) {
+                int o = phase[i] * taps + d;
+                pairs[3 * count[o]] = j;
+                pairs[3 * count[o] + 1] = i;
+                pairs[3 * count[o] + 2] = o * row_size;
+                count[o]++;
+            }
+        }
+    }
+    free(count);
+
+    return pairs;
+}
+
+
+/*
+ * Copies the row pairs into a map, swapped for A', and keeps for every
+ * pair only the column entries that can have a nonzero weight. Most of
+ * the square of taps around an output lies outside the radius of the
+ * kernel, and which entries do only depends on the table offset.
+ */
+static void ewa_map_pairs(struct DescaleEwaMap *map, const float *table, const int *pairs, int pair_count, bool swap)
+{
+    map->pair_count = pair_count;
+    map->pairs = malloc(5 * (size_t)DSMAX(pair_count, 1) * sizeof (int));
+
+    for (int p = 0; p < pair_count; p++) {
+        int *pair = map->pairs + 5 * p;
+        pair[0] = pairs[3 * p + (swap ? 1 : 0)];
+        pair[1] = pairs[3 * p + (swap ? 0 : 1)];
+        pair[2] = pairs[3 * p + 2];
+
+        if (p > 0 && pair[2] == pair[-3]) {
+            pair[3] = pair[-2];
+            pair[4] = pair[-1];
+            continue;
+        }
+        pair[3] = map->entries;
+        pair[4] = 0;
+        for (int k = 0; k < map->entries; k++) {
+            for (int x = 0; x < map->columns; x++) {
+                if (table[pair[2] + map->column_weight[x * map->entries + k]] != 0.0f) {
+                    pair[3] = DSMIN(pair[3], k);
+                    pair[4] = k + 1;
+                    break;
+                }
+            }
+        }
+        pair[4] = DSMAX(pair[3], pair[4]);
+    }
+}
+
+
+/*
+ * The product with A, from the small to the large size. Every output
+ * column has the same number of taps, taps that the border drops read
+ * the zero phase at the end of every table row.
+ */
+static void ewa_upscale_map(struct DescaleEwaMap *map, struct DescaleEwaCore *core, const int *base_h, const int *phase_h,
+                            const int *pairs, int pair_count, enum DescaleBorder border_handling)
+{
+    int taps = core->taps_per_axis;
+
+    map->rows = core->src_height;
+    map->columns = core->src_width;
+    map->inputs = core->dst_width;
+    map->entries = taps;
+    map->column_index = malloc((size_t)taps * map->columns * sizeof (int));
+    map->column_weight = malloc((size_t)taps * map->columns * sizeof (int));
+    for (int x = 0; x < map->columns; x++) {
+        for (int d = 0; d < taps; d++) {
+            int j = ewa_border_index(base_h[x] + d, core->dst_width, border_handling);
+            map->column_index[x * map->entries + d] = DSMAX(j, 0);
+            map->column_weight[x * map->entries + d] = j >= 0 ? phase_h[x] * taps + d : core->phases_h * taps;
+        }
+    }
+
+    ewa_map_pairs(map, core->table, pairs, pair_count, false);
+}
+
+
+/*
+ * The product with A', from the large to the small size. Near the borders
+ * the columns read more inputs than in the middle, the entries that do
+ * not fit into the common number of entries are kept in the extra list.
+ */
+static void ewa_descale_map(struct DescaleEwaMap *map, struct DescaleEwaCore *core, const int *base_h, const int *phase_h,
+                            const int *pairs, int pair_count, enum DescaleBorder border_handling)
+{
+    int taps = core->taps_per_axis;
+    int *start, *entries;
+
+    map->rows = core->dst_height;
+    map->columns = core->dst_width;
+    map->inputs = core->src_width;
+    ewa_column_lists(core->dst_width, core->src_width, taps, base_h, phase_h, border_handling, &start, &entries);
+    int first = map->columns > 2 * taps ? taps : 0;
+    int end = map->columns > 2 * taps ? map->columns - taps : map->columns;
+    map->entries = 0;
+    for (int x = first; x < end; x++)
+        map->entries = DSMAX(map->entries, start[x + 1] - start[x]);
+
+    map->column_index = malloc((size_t)DSMAX(map->entries, 1) * map->columns * sizeof (int));
+    map->column_weight = malloc((size_t)DSMAX(map->entries, 1) * map->columns * sizeof (int));
+    map->extra = malloc(3 * (size_t)DSMAX(start[map->columns], 1) * sizeof (int));
+    map->extra_count = 0;
+    for (int x = 0; x < map->columns; x++) {
+        int k = 0;
+        for (int e = start[x]; e < start[x + 1]; e++, k++) {
+            if (k < map->entries) {
+                map->column_index[x * map->entries + k] = entries[2 * e];
+                map->column_weight[x * map->entries + k] = entries[2 * e + 1];
+            } else {
+                map->extra[3 * map->extra_count] = x;
+                map->extra[3 * map->extra_count + 1] = entries[2 * e];
+                map->extra[3 * map->extra_count + 2] = entries[2 * e + 1];
+                map->extra_count++;
+            }
+        }
+        for (; k < map->entries; k++) {
+            map->column_index[x * map->entries + k] = 0;
+            map->column_weight[x * map->entries + k] = core->phases_h * taps;
+        }
+    }
+    free(start);
+    free(entries);
+
+    ewa_map_pairs(map, core->table, pairs, pair_count, true);
+}
+
+
+static void free_ewa_map(struct DescaleEwaMap *map)
+{
+    free(map->pairs);
+    free(map->column_index);
+    free(map->column_weight);
+    free(map->extra);
+}
+
+
+// View of a descaling core that skips A' and only solves with the LDLT factors, vectors have dst_dim samples
+static void ewa_solve_view(const struct DescaleCore *core, int *left_idx, float *weights, struct DescaleCore *view)
+{
+    *view = *core;
+    view->src_dim = core->dst_dim;
+    view->weights = weights;
+    view->weights_columns = 1;
+    view->weights_left_idx = left_idx;
+    view->weights_right_idx = left_idx + ceil_n(core->dst_dim, 8);
+    for (int i = 0; i < core->dst_dim; i++) {
+        view->weights_left_idx[i] = i;
+        view->weights_right_idx[i] = i + 1;
+    }
+    view->kernel[0] = view->kernel[1] = DESCALE_KERNEL_DEFAULT;
+    view->jit = NULL;
+}
+
+
+static struct DescaleEwaCore *create_ewa_core(int src_width, int src_height, int dst_width, int dst_height,
+                                              const struct DescaleParams *params_h, const struct DescaleParams *params_v)
+{
+    unsigned long long start = descale_time_ns();
+    enum DescaleMode mode = params_h->mode;
+    int taps = params_h->taps;
+
+    if ((mode != DESCALE_MODE_EWA_LANCZOS && mode != DESCALE_MODE_EWA_JINC) || taps < 1 || taps > (int)(sizeof jinc_zeros / sizeof jinc_zeros[0])
+            || params_h->blur <= 0.0 || params_h->post_conv_size)
+        return NULL;
+
+    if (params_h->upscale) {
+        int tmp = dst_width;
+        dst_width = src_width;
+        src_width = tmp;
+        tmp = dst_height;
+        dst_height = src_height;
+        src_height = tmp;
+    }
+
+    struct DescaleEwaCore *core = calloc(1, sizeof (struct DescaleEwaCore));
+    core->src_width = src_width;
+    core->src_height = src_height;
+    core->dst_width = dst_width;
+    core->dst_height = dst_height;
+    core->upscale = params_h->upscale;
+
+    int support = (int)ceil(jinc_zeros[taps - 1] * params_h->blur);
+    core->taps_per_axis = 2 * support;
+    int *base_h = malloc(src_width * sizeof (int));
+    int *phase_h = malloc(src_width * sizeof (int));
+    int *base_v = malloc(src_height * sizeof (int));
+    int *phase_v = malloc(src_height * sizeof (int));
+    double offsets_h[EWA_MAX_PHASES], offsets_v[EWA_MAX_PHASES];
+
+    core->phases_h = ewa_axis_phases(dst_width, src_width, params_h->shift, params_h->active_dim, support, 0.0, base_h, phase_h, offsets_h);
+    if (!core->phases_h)
+        core->phases_h = ewa_axis_phases(dst_width, src_width, params_h->shift, params_h->active_dim, support, 1.0 / EWA_PHASE_STEPS, base_h, phase_h, offsets_h);
+    core->phases_v = ewa_axis_phases(dst_height, src_height, params_v->shift, params_v->active_dim, support, 0.0, base_v, phase_v, offsets_v);
+    if (!core->phases_v)
+        core->phases_v = ewa_axis_phases(dst_height, src_height, params_v->shift, params_v->active_dim, support, 1.0 / EWA_PHASE_STEPS, base_v, phase_v, offsets_v);
+
+    // Rows of the table are (vertical phase, vertical tap), columns (horizontal phase, horizontal tap) and a zero phase
+    int t = core->taps_per_axis;
+    int row_size = (core->phases_h + 1) * t;
+    core->table = calloc((size_t)core->phases_v * t * row_size, sizeof (float));
+    for (int pv = 0; pv < core->phases_v; pv++) {
+        for (int ph = 0; ph < core->phases_h; ph++) {
+            double total = 0.0;
+            for (int dv = 0; dv < t; dv++) {
+                for (int dh = 0; dh < t; dh++)
+                    total += calculate_ewa_weight(mode, taps, hypot(offsets_h[ph] + dh, offsets_v[pv] + dv), params_h->blur);
+            }
+            if (total == 0)
+                total = DBL_EPSILON;
+            for (int dv = 0; dv < t; dv++) {
+                for (int dh = 0; dh < t; dh++) {
+                    double w = calculate_ewa_weight(mode, taps, hypot(offsets_h[ph] + dh, offsets_v[pv] + dv), params_h->blur);
+                    core->table[(size_t)(pv * t + dv) * row_size + ph * t + dh] = (float)(w / total);
+                }
+            }
+        }
+    }
+
+    int pair_count;
+    int *pairs = ewa_row_pairs(dst_height, src_height, t, base_v, phase_v, core->phases_v, row_size, params_h->border_handling, &pair_count);
+    ewa_upscale_map(&core->upscale_map, core, base_h, phase_h, pairs, pair_count, params_h->border_handling);
+    if (!core->upscale)
+        ewa_descale_map(&core->descale_map, core, base_h, phase_h, pairs, pair_count, params_h->border_handling);
+    free(pairs);
+    free(base_h);
+    free(phase_h);
+    free(base_v);
+    free(phase_v);
+
+    if (!core->upscale) {
+
+        struct DescaleParams separable = *params_h;
+        separable.mode = DESCALE_MODE_LANCZOS;
+        separable.has_ignore_mask = 0;
+        separable.band_tolerance = 0.0;
+        separable.dense_threshold = 0;
+        core->core_h = create_core(src_width, dst_width, &separable);
+        separable.shift = params_v->shift;
+        separable.active_dim = params_v->active_dim;
+        core->core_v = create_core(src_height, dst_height, &separable);
+        separable.blur *= EWA_PRECONDITION_BLUR;
+        core->precondition_v = create_damped_core(src_height, dst_height, &separable, EWA_PRECONDITION_DAMPING);
+        separable.shift = params_h->shift;
+        separable.active_dim = params_h->active_dim;
+        core->precondition_h = create_damped_core(src_width, dst_width, &separable, EWA_PRECONDITION_DAMPING);
+
+        int size_h = ceil_n(dst_width, 8), size_v = ceil_n(dst_height, 8);
+        core->solve_idx = calloc(2 * (size_t)(size_h + size_v), sizeof (int));
+        core->solve_weights = malloc(DSMAX(size_h, size_v) * sizeof (float));
+        for (int i = 0; i < DSMAX(size_h, size_v); i++)
+            core->solve_weights[i] = 1.0f;
+        ewa_solve_view(core->precondition_h, core->solve_idx, core->solve_weights, &core->solve_h);
+        ewa_solve_view(core->precondition_v, core->solve_idx + 2 * size_h, core->solve_weights, &core->solve_v);
+    }
+
+    core->build_time_ns = descale_time_ns() - start;
+
+    return core;
+}
+
+
+static void free_ewa_core(struct DescaleEwaCore *core)
+{
+    free(core->table);
+    free_ewa_map(&core->upscale_map);
+    free_ewa_map(&core->descale_map);
+    if (core->core_h) {
+        free_core(core->core_h);
+        free_core(core->core_v);
+        free_core(core->precondition_h);
+        free_core(core->precondition_v);
+    }
+    free(core->solve_idx);
+    free(core->solve_weights);
     free(core);
 }
 
 
+/*
+ * Every pair of rows adds the products of the input row with the weights
+ * of its table offset to the output row, every output column reads the
+ * inputs of its column entries.
+ */
+static void ewa_product_c(const struct DescaleEwaMap *map, const float *table, int src_stride, const float *srcp, int dst_stride, float *dstp)
+{
+    for (int y = 0; y < map->rows; y++)
+        memset(dstp + (size_t)y * dst_stride, 0, map->columns * sizeof (float));
+
+    for (int p = 0; p < map->pair_count; p++) {
+        const int *pair = map->pairs + 5 * p;
+        const float *src = srcp + (size_t)pair[0] * src_stride;
+        float *dst = dstp + (size_t)pair[1] * dst_stride;
+        const float *w = table + pair[2];
+
+        for (int x = 0; x < map->columns; x++) {
+            float sum = 0.0f;
+            for (int k = pair[3]; k < pair[4]; k++)
+                sum += w[map->column_weight[x * map->entries + k]] * src[map->column_index[x * map->entries + k]];
+            dst[x] += sum;
+        }
+        for (int k = 0; k < map->extra_count; k++) {
+            const int *extra = map->extra + 3 * k;
+            dst[extra[0]] += w[extra[2]] * src[extra[1]];
+        }
+    }
+}
+
+
+// Residual of the damped normal equations, r = A' s - damping x
+static void ewa_damp_residual(int width, int height, int stride, const float *x, float *r)
+{
+    for (int y = 0; y < height; y++) {
+        for (int i = 0; i < width; i++)
+            r[(size_t)y * stride + i] -= EWA_DAMPING * x[(size_t)y * stride + i];
+    }
+}
+
+
+// z = P^-1 r of two descaled planes, tmp holds the intermediate
+static void ewa_precondition(struct DescaleEwaCore *core, DescaleProcessVectors process_vectors, int stride, const float *r, float *tmp, float *z)
+{
+    process_vectors(&core->solve_h, DESCALE_DIR_HORIZONTAL, core->dst_height, stride, 0, stride, r, NULL, tmp);
+    process_vectors(&core->solve_v, DESCALE_DIR_VERTICAL, core->dst_width, stride, 0, stride, tmp, NULL, z);
+}
+
+
+static int process_plane_ewa(struct DescaleEwaCore *core, DescaleProcessVectors process_vectors, DescaleEwaProduct product,
+                             int max_iterations, double tolerance, bool warm_start,
+                             int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    unsigned long long start = descale_time_ns();
+
+    if (core->upscale) {
+        product(&core->upscale_map, core->table, src_stride, srcp, dst_stride, dstp);
+        descale_trace_event("ewa upscale", "ewa", start, descale_time_ns(), 0);
+        return 0;
+    }
+
+    int sw = core->src_width, sh = core->src_height;
+    int dw = core->dst_width, dh = core->dst_height;
+    int ss = ceil_n(sw, 16), ds = ceil_n(dw, 16);
+
+    if (imaskp && masked_fraction(sw, sh, imask_stride, imaskp) > MASKED_MAX_FRACTION)
+        return -1;
+
+    size_t mark = descale_scratch_mark();
+    size_t src_size = (size_t)ss * sh * sizeof (float);
+    size_t dst_size = (size_t)ds * dh * sizeof (float);
+    // The padding columns are never read back, but they must not hold NaNs that the vertical solvers carry around
+    float *mid = memset(descale_scratch_alloc((size_t)ds * sh * sizeof (float), 64), 0, (size_t)ds * sh * sizeof (float));
+    float *s = memset(descale_scratch_alloc(src_size, 64), 0, src_size);    // weighted residual of the input
+    float *q = memset(descale_scratch_alloc(src_size, 64), 0, src_size);    // A p
+    float *x = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // solution
+    float *r = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // A' s
+    float *z = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // P^-1 r
+    float *p = memset(descale_scratch_alloc(dst_size, 64), 0, dst_size);    // search direction
+
+    if (warm_start) {
+        for (int y = 0; y < dh; y++)
+            memcpy(x + (size_t)y * ds, dstp + (size_t)y * dst_stride, dw * sizeof (float));
+    } else {
+        process_vectors(core->core_h, DESCALE_DIR_HORIZONTAL, sh, src_stride, 0, ds, srcp, NULL, mid);
+        process_vectors(core->core_v, DESCALE_DIR_VERTICAL, dw, ds, 0, ds, mid, NULL, x);
+    }
+
+    product(&core->upscale_map, core->table, ds, x, ss, q);
+    double signal = 0.0;
+    for (int y = 0; y < sh; y++) {
+        const float *b = srcp + (size_t)y * src_stride;
+        const unsigned char *m = imaskp ? imaskp + (size_t)y * imask_stride : NULL;
+        float *sy = s + (size_t)y * ss;
+        const float *qy = q + (size_t)y * ss;
+        float sum = 0.0f;
+        for (int i = 0; i < sw; i++) {
+            bool masked = m && check_imask(m[i]);
+            sy[i] = masked ? -MASKED_DAMPING * qy[i] : b[i] - qy[i];
+            sum += masked ? 0.0f : b[i] * b[i];
+        }
+        signal += sum;
+    }
+    // Below the precision of the float samples the residual is rounding noise that the iteration amplifies
+    double threshold = DSMAX(tolerance * tolerance, FLT_EPSILON * FLT_EPSILON) * signal;
+
+    product(&core->descale_map, core->table, ss, s, ds, r);
+    ewa_damp_residual(dw, dh, ds, x, r);
+    ewa_precondition(core, process_vectors, ds, r, mid, z);
+    double rz = dot_product(dw, dh, ds, r, z);
+    memcpy(p, z, dst_size);
+
+    int iterations = 0;
+    while (iterations < max_iterations && rz > threshold) {
+        product(&core->upscale_map, core->table, ds, p, ss, q);
+        double qmq = 0.0;
+        for (int y = 0; y < sh; y++) {
+            const unsigned char *m = imaskp ? imaskp + (size_t)y * imask_stride : NULL;
+            const float *qy = q + (size_t)y * ss;
+            float sum = 0.0f;
+            for (int i = 0; i < sw; i++)
+                sum += (m ? masked_weight(m[i]) : 1.0f) * qy[i] * qy[i];
+            qmq += sum;
+        }
+        qmq += EWA_DAMPING * dot_product(dw, dh, ds, p, p);
+        // qmq is 0 once x is exact
+        if (qmq <= 0.0)
+            break;
+
+        float alpha = (float)(rz / qmq);
+        for (int y = 0; y < dh; y++) {
+            float *xy = x + (size_t)y * ds;
+            const float *py = p + (size_t)y * ds;
+            for (int i = 0; i < dw; i++)
+                xy[i] += alpha * py[i];
+        }
+        iterations++;
+        if (iterations == max_iterations)
+            break;
+
+        for (int y = 0; y < sh; y++) {
+            const unsigned char *m = imaskp ? imaskp + (size_t)y * imask_stride : NULL;
+            float *sy = s + (size_t)y * ss;
+            const float *qy = q + (size_t)y * ss;
+            for (int i = 0; i < sw; i++)
+                sy[i] -= alpha * (m ? masked_weight(m[i]) : 1.0f) * qy[i];
+        }
+
+        product(&core->descale_map, core->table, ss, s, ds, r);
+        ewa_damp_residual(dw, dh, ds, x, r);
+        ewa_precondition(core, process_vectors, ds, r, mid, z);
+        double rz_next = dot_product(dw, dh, ds, r, z);
+        if (rz_next <= threshold)
+            break;
+
+        float beta = (float)(rz_next / rz);
+        for (int y = 0; y < dh; y++) {
+            float *py = p + (size_t)y * ds;
+            const float *zy = z + (size_t)y * ds;
+            for (int i = 0; i < dw; i++)
+                py[i] = zy[i] + beta * py[i];
+        }
+        rz = rz_next;
+    }
+
+    for (int y = 0; y < dh; y++)
+        memcpy(dstp + (size_t)y * dst_stride, x + (size_t)y * ds, dw * sizeof (float));
+
+    descale_scratch_release(mark);
+    descale_trace_event("ewa solve", "ewa", start, descale_time_ns(), iterations);
+
+    return iterations;
+}
+
+
+static int process_plane_ewa_c(struct DescaleEwaCore *core, int max_iterations, double tolerance, bool warm_start,
+                               int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    return process_plane_ewa(core, &descale_process_vectors_c, &ewa_product_c, max_iterations, tolerance, warm_start,
+                             src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+
+static void fill_core_stats(const struct DescaleCore *core, enum DescaleOpt opt, struct DescaleCoreStats *stats)
+{
+    if (core->upscale)
+        stats->variant = "upscale";
+    else if (core->multiplied_weights)
+        stats->variant = "masked";
+    else if (core->dense)
+        stats->variant = "dense";
+    else if (core->bandwidth == 1)
+        stats->variant = "b1";
+    else if (core->bandwidth == 3)
+        stats->variant = "b3";
+    else if (core->bandwidth == 7)
+        stats->variant = "b7";
+    else
+        stats->variant = "generic";
+
+    stats->opt = opt;
+    stats->bandwidth = core->bandwidth;
+    stats->build_time_ms = (double)core->build_time_ns * 1e-6;
+    stats->calls = __atomic_load_n(&core->process_calls, __ATOMIC_RELAXED);
+    stats->vectors = __atomic_load_n(&core->process_vectors, __ATOMIC_RELAXED);
+    stats->process_time_ms = (double)__atomic_load_n(&core->process_time_ns, __ATOMIC_RELAXED) * 1e-6;
+    stats->masked_refactorizations = __atomic_load_n(&core->masked_refactorizations, __ATOMIC_RELAXED);
+}
+
+
+static void get_core_stats_c(const struct DescaleCore *core, struct DescaleCoreStats *stats)
+{
+    fill_core_stats(core, DESCALE_OPT_NONE, stats);
+}
+
+
+static void autotune_core_c(struct DescaleCore *core, enum DescaleDir dir, int vector_count)
+{
+    // There is only one kernel to choose from
+}
+
+
+#if defined(DESCALE_X86) || defined(__ARM_NEON__)
+static void get_core_stats_avx2(const struct DescaleCore *core, struct DescaleCoreStats *stats)
+{
+    fill_core_stats(core, DESCALE_OPT_AVX2, stats);
+}
+
+
+// The SIMD entry points, which fall back to C for cores that were tuned to it
+static void process_vectors_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                 int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    if (core->kernel[dir] == DESCALE_KERNEL_C)
+        descale_process_vectors_c(core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+    else
+        descale_process_vectors_avx2(core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+
+static void process_vectors_planes_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int num_planes,
+                                        const int *src_strides, const int *dst_strides, const float *const *srcps, float *const *dstps)
+{
+    if (core->kernel[dir] == DESCALE_KERNEL_C)
+        descale_process_vectors_planes_c(core, dir, vector_count, num_planes, src_strides, dst_strides, srcps, dstps);
+    else
+        descale_process_vectors_planes_avx2(core, dir, vector_count, num_planes, src_strides, dst_strides, srcps, dstps);
+}
+
+
+static void autotune_core_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count)
+{
+    enum DescaleKernel candidates[4] = {DESCALE_KERNEL_DEFAULT};
+    int num_candidates = 1;
+
+    // Masked cores are always processed in C
+    if (core->multiplied_weights)
+        return;
+    if (!core->upscale && (core->bandwidth == 3 || core->bandwidth == 7))
+        candidates[num_candidates++] = DESCALE_KERNEL_GENERIC;
+    candidates[num_candidates++] = DESCALE_KERNEL_C;
+#ifdef DESCALE_X86
+    if (descale_jit_supported(core, dir))
+        candidates[num_candidates++] = DESCALE_KERNEL_JIT;
+#endif
+
+    descale_autotune(core, dir, vector_count, DESCALE_OPT_AVX2, candidates, num_candidates, &process_vectors_avx2);
+}
+
+
+static void process_vectors_window_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int first, int count, double tolerance, int src_first,
+                                        int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    process_vectors_window(core, &process_vectors_avx2, dir, vector_count, first, count, tolerance, src_first,
+                           src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+
+static void process_vectors_format_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                        int src_stride, int imask_stride, int dst_stride, const void *srcp, const unsigned char *imaskp, void *dstp,
+                                        const struct DescaleSampleFormat *src_format, const struct DescaleSampleFormat *dst_format)
+{
+    process_vectors_format(core, &process_vectors_avx2, &descale_process_vectors_half_avx2, &descale_load_row_avx2, &descale_store_row_avx2, dir, vector_count,
+                           src_stride, imask_stride, dst_stride, srcp, imaskp, dstp, src_format, dst_format);
+}
+
+
+static int process_plane_masked_2d_avx2(struct DescaleCore *core_h, struct DescaleCore *core_v, int max_iterations, double tolerance, bool warm_start,
+                                        int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    return process_plane_masked_2d(core_h, core_v, &process_vectors_avx2, max_iterations, tolerance, warm_start,
+                                   src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+
+
+static int process_plane_ewa_avx2(struct DescaleEwaCore *core, int max_iterations, double tolerance, bool warm_start,
+                                  int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
+{
+    // The SIMD horizontal solvers work on blocks of 8 rows
+    DescaleProcessVectors process_vectors = core->dst_height < 8 ? &descale_process_vectors_c : &process_vectors_avx2;
+    return process_plane_ewa(core, process_vectors, &descale_ewa_product_avx2, max_iterations, tolerance, warm_start,
+                             src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+}
+#endif
+
+
 struct DescaleAPI get_descale_api(enum DescaleOpt opt)
 {
     struct DescaleAPI dsapi = {
         &create_core,
         &free_core,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        &get_window_source_range,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        &create_ewa_core,
+        &free_ewa_core,
         NULL
     };
 
@@ -903,17 +2506,42 @@ struct DescaleAPI get_descale_api(enum DescaleOpt opt)
     if (opt == DESCALE_OPT_AUTO)
         caps = query_x86_capabilities();
     if ((opt == DESCALE_OPT_AUTO && caps.avx2 && caps.fma) || opt == DESCALE_OPT_AVX2) {
-        dsapi.process_vectors = &descale_process_vectors_avx2;
+        dsapi.process_vectors = &process_vectors_avx2;
+        dsapi.process_vectors_planes = &process_vectors_planes_avx2;
+        dsapi.get_core_stats = &get_core_stats_avx2;
+        dsapi.autotune_core = &autotune_core_avx2;
+        dsapi.process_vectors_window = &process_vectors_window_avx2;
+        dsapi.process_vectors_format = &process_vectors_format_avx2;
+        dsapi.process_plane_masked = &process_plane_masked_2d_avx2;
+        dsapi.process_plane_ewa = &process_plane_ewa_avx2;
+        // Forcing AVX2 also assumes F16C, which every AVX2 CPU has
+        if (caps.f16c || opt == DESCALE_OPT_AVX2)
+            dsapi.process_vectors_half = &descale_process_vectors_half_avx2;
     } else {
 #endif
 
 #if defined(__ARM_NEON__)
     if (opt == DESCALE_OPT_AUTO) {
-        dsapi.process_vectors = &descale_process_vectors_avx2;
+        dsapi.process_vectors = &process_vectors_avx2;
+        dsapi.process_vectors_planes = &process_vectors_planes_avx2;
+        dsapi.get_core_stats = &get_core_stats_avx2;
+        dsapi.autotune_core = &autotune_core_avx2;
+        dsapi.process_vectors_window = &process_vectors_window_avx2;
+        dsapi.process_vectors_format = &process_vectors_format_avx2;
+        dsapi.process_plane_masked = &process_plane_masked_2d_avx2;
+        dsapi.process_plane_ewa = &process_plane_ewa_avx2;
+        dsapi.process_vectors_half = &descale_process_vectors_half_avx2;
     } else {
 #endif
 
         dsapi.process_vectors = &descale_process_vectors_c;
+        dsapi.process_vectors_planes = &descale_process_vectors_planes_c;
+        dsapi.get_core_stats = &get_core_stats_c;
+        dsapi.autotune_core = &autotune_core_c;
+        dsapi.process_vectors_window = &process_vectors_window_c;
+        dsapi.process_vectors_format = &process_vectors_format_c;
+        dsapi.process_plane_masked = &process_plane_masked_2d_c;
+        dsapi.process_plane_ewa = &process_plane_ewa_c;
 
 #if defined(__ARM_NEON__)
     }
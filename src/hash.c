@@ -0,0 +1,151 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "simde/x86/sse2.h"
+#include "hash.h"
+
+
+#define HASH_STRIPE 64
+#define HASH_STRIPES_PER_SCRAMBLE 16
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+
+// Taken from the XXH3 default secret
+static const uint64_t hash_key[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+
+static inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+
+/*
+ * Processes whole stripes. Each 128 bit vector holds two lanes, the
+ * product of the low and high half of the keyed word is added to its
+ * own lane and the plain word to the neighbouring one.
+ */
+static void accumulate(DescaleHashState *state, const unsigned char *p, size_t stripes)
+{
+    simde__m128i acc[4], key[4];
+    const simde__m128i prime = simde_mm_set1_epi32((int)PRIME32_1);
+    for (int i = 0; i < 4; i++) {
+        acc[i] = simde_mm_loadu_si128((const simde__m128i *)(state->acc + 2 * i));
+        key[i] = simde_mm_loadu_si128((const simde__m128i *)(state->key + 2 * i));
+    }
+
+    for (size_t s = 0; s < stripes; s++, p += HASH_STRIPE) {
+        for (int i = 0; i < 4; i++) {
+            simde__m128i value = simde_mm_loadu_si128((const simde__m128i *)(p + 16 * i));
+            simde__m128i keyed = simde_mm_xor_si128(value, key[i]);
+            simde__m128i product = simde_mm_mul_epu32(keyed, simde_mm_shuffle_epi32(keyed, SIMDE_MM_SHUFFLE(0, 3, 0, 1)));
+            acc[i] = simde_mm_add_epi64(acc[i], simde_mm_shuffle_epi32(value, SIMDE_MM_SHUFFLE(1, 0, 3, 2)));
+            acc[i] = simde_mm_add_epi64(acc[i], product);
+        }
+
+        // Mixes the high bits back in from time to time, the products alone would only ever move information upwards
+        if (++state->stripes == HASH_STRIPES_PER_SCRAMBLE) {
+            for (int i = 0; i < 4; i++) {
+                simde__m128i a = simde_mm_xor_si128(acc[i], simde_mm_srli_epi64(acc[i], 47));
+                a = simde_mm_xor_si128(a, key[i]);
+                simde__m128i lo = simde_mm_mul_epu32(a, prime);
+                simde__m128i hi = simde_mm_mul_epu32(simde_mm_srli_epi64(a, 32), prime);
+                acc[i] = simde_mm_add_epi64(lo, simde_mm_slli_epi64(hi, 32));
+            }
+            state->stripes = 0;
+        }
+    }
+
+    for (int i = 0; i < 4; i++)
+        simde_mm_storeu_si128((simde__m128i *)(state->acc + 2 * i), acc[i]);
+}
+
+
+void descale_hash_init(DescaleHashState *state, uint64_t seed)
+{
+    static const uint64_t init[8] = {
+        PRIME32_1, PRIME64_1, PRIME64_2, 0x165667B19E3779F9ULL,
+        0x85EBCA77C2B2AE63ULL, 0x27D4EB2F165667C5ULL, 0x85EBCA6BULL, 0xC2B2AE35ULL
+    };
+    memset(state, 0, sizeof *state);
+    for (int i = 0; i < 8; i++) {
+        state->acc[i] = init[i];
+        state->key[i] = hash_key[i] + (i & 1 ? -seed : seed);
+    }
+}
+
+
+void descale_hash_update(DescaleHashState *state, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    state->length += size;
+
+    if (state->buffered) {
+        size_t n = HASH_STRIPE - state->buffered < size ? HASH_STRIPE - state->buffered : size;
+        memcpy(state->buffer + state->buffered, p, n);
+        state->buffered += n;
+        p += n;
+        size -= n;
+        if (state->buffered < HASH_STRIPE)
+            return;
+        accumulate(state, state->buffer, 1);
+        state->buffered = 0;
+    }
+
+    accumulate(state, p, size / HASH_STRIPE);
+    p += size / HASH_STRIPE * HASH_STRIPE;
+    size %= HASH_STRIPE;
+
+    memcpy(state->buffer, p, size);
+    state->buffered = size;
+}
+
+
+void descale_hash_final(DescaleHashState *state, uint64_t hash[2])
+{
+    // The tail is zero padded, the length distinguishes it from real zeros
+    if (state->buffered) {
+        memset(state->buffer + state->buffered, 0, HASH_STRIPE - state->buffered);
+        accumulate(state, state->buffer, 1);
+    }
+
+    uint64_t lo = state->length * PRIME64_1;
+    uint64_t hi = ~state->length * PRIME64_2;
+    for (int i = 0; i < 8; i++) {
+        lo = (lo ^ avalanche(state->acc[i] ^ state->key[i])) * PRIME64_1;
+        hi = (hi + avalanche(state->acc[7 - i] + state->key[i])) * PRIME64_2;
+        hi ^= hi >> 29;
+    }
+    hash[0] = avalanche(lo);
+    hash[1] = avalanche(hi ^ lo);
+}
@@ -0,0 +1,35 @@
+#ifndef DESCALE_HASH_H
+#define DESCALE_HASH_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Fast non-cryptographic 128 bit hash for comparing frame contents,
+ * modelled on the XXH3 accumulator: eight independent 64 bit lanes
+ * take a 32x32 -> 64 bit product per word (pmuludq), which keeps up
+ * with memory bandwidth.
+ * Data can be fed in pieces of any size, like the rows of a plane,
+ * and gives the same result as hashing it in one piece.
+ */
+typedef struct DescaleHashState
+{
+    uint64_t acc[8];
+    uint64_t key[8];
+    unsigned char buffer[64];
+    size_t buffered;
+    uint64_t length;
+    int stripes;        // since the last scramble
+} DescaleHashState;
+
+
+void descale_hash_init(DescaleHashState *state, uint64_t seed);
+
+void descale_hash_update(DescaleHashState *state, const void *data, size_t size);
+
+void descale_hash_final(DescaleHashState *state, uint64_t hash[2]);
+
+
+#endif  // DESCALE_HASH_H
@@ -0,0 +1,159 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mapfile.h"
+
+
+#ifdef _WIN32
+
+static bool map_handle(struct DescaleMappedFile *map, HANDLE file, size_t size, bool writable)
+{
+    LARGE_INTEGER file_size;
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    if (!GetFileSizeEx(file, &file_size) || (!writable && (unsigned long long)file_size.QuadPart < size)) {
+        CloseHandle(file);
+        return false;
+    }
+    if ((unsigned long long)file_size.QuadPart > size)
+        size = (size_t)file_size.QuadPart;
+
+    // Mapping a writable file beyond its end extends it
+    HANDLE mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                        (DWORD)((unsigned long long)size >> 32), (DWORD)size, NULL);
+    void *data = mapping ? MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size) : NULL;
+    if (!data) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->file = file;
+    map->mapping = mapping;
+    return true;
+}
+
+
+bool descale_map_file(struct DescaleMappedFile *map, const char *path, size_t size, bool writable)
+{
+    HANDLE file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                              writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return map_handle(map, file, size, writable);
+}
+
+
+bool descale_map_temp(struct DescaleMappedFile *map, size_t size)
+{
+    char dir[MAX_PATH], path[MAX_PATH];
+    if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "dsc", 0, path))
+        return false;
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    return map_handle(map, file, size, true);
+}
+
+
+void descale_map_sequential(struct DescaleMappedFile *map)
+{
+    (void)map;
+}
+
+
+void descale_unmap_file(struct DescaleMappedFile *map)
+{
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+}
+
+#else
+
+static bool map_fd(struct DescaleMappedFile *map, int fd, size_t size, bool writable)
+{
+    struct stat st;
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) || (!writable && (size_t)st.st_size < size) || (writable && (size_t)st.st_size < size && ftruncate(fd, (off_t)size))) {
+        close(fd);
+        return false;
+    }
+    if ((size_t)st.st_size > size)
+        size = (size_t)st.st_size;
+
+    void *data = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    map->data = data;
+    map->size = size;
+    return true;
+}
+
+
+bool descale_map_file(struct DescaleMappedFile *map, const char *path, size_t size, bool writable)
+{
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    return map_fd(map, fd, size, writable);
+}
+
+
+bool descale_map_temp(struct DescaleMappedFile *map, size_t size)
+{
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof path, "%s/descale-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return map_fd(map, fd, size, true);
+}
+
+
+void descale_map_sequential(struct DescaleMappedFile *map)
+{
+    posix_madvise(map->data, map->size, POSIX_MADV_SEQUENTIAL);
+}
+
+
+void descale_unmap_file(struct DescaleMappedFile *map)
+{
+    munmap(map->data, map->size);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef DESCALE_MAPFILE_H
+#define DESCALE_MAPFILE_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef struct DescaleMappedFile
+{
+    unsigned char *data;
+    size_t size;
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#endif
+} DescaleMappedFile;
+
+
+/*
+ * Maps a whole file into memory. Writable files are created or
+ * truncated and then sized to size bytes, read-only files must not be
+ * smaller than size (0 maps the whole file). Returns false on errors.
+ */
+bool descale_map_file(struct DescaleMappedFile *map, const char *path, size_t size, bool writable);
+
+// Maps a new temporary file of size bytes that is deleted again when it is unmapped
+bool descale_map_temp(struct DescaleMappedFile *map, size_t size);
+
+// Tells the OS that the mapping will be read from start to end
+void descale_map_sequential(struct DescaleMappedFile *map);
+
+void descale_unmap_file(struct DescaleMappedFile *map);
+
+
+#endif  // DESCALE_MAPFILE_H
@@ -23,7 +23,12 @@
 
 #include <ctype.h>
 #include <stdbool.h>
+#include <string.h>
+#include "common.h"
 #include "descale.h"
+#include "scratch.h"
+#include "threadpool.h"
+#include "trace.h"
 
 
 struct DescaleData
@@ -33,6 +38,16 @@ struct DescaleData
     int subsampling_h, subsampling_v;
     int num_planes;
     bool process_h, process_v;
+    bool parallel_planes;
+    bool stats;
+    bool autotune;
+    bool half_intermediate; // store the intermediate of two-axis descales as half floats if the API can
+    struct DescaleSampleFormat format;  // of the input and output planes, roi, batching and two-axis masks need linear DESCALE_SAMPLE_FLOAT
+    int masked_iterations;      // limits of the two-axis masked and EWA solvers, see DescaleAPI.process_plane_masked
+    double masked_tolerance;
+    bool roi;           // only compute this rectangle of the output, in output coordinates
+    int roi_left, roi_top, roi_width, roi_height;
+    double roi_tolerance;
     double shift_h, shift_v;
     double active_width, active_height;
 
@@ -40,10 +55,32 @@ struct DescaleData
     struct DescaleParams params;
     struct DescaleCore *dscore_h[2];
     struct DescaleCore *dscore_v[2];
+    struct DescaleEwaCore *ewa_core[2];     // instead of the separable cores for the EWA modes
+    size_t scratch_reserved;    // for the intermediate of every frame, see descale_scratch_reserve
 };
 
 
-static bool string_is_equal_ignore_case(const char *s1, const char *s2)
+struct DescalePlane
+{
+    int index;  // 0 for luma or the first RGB plane, only used to pick the core
+    int src_stride, dst_stride, imask_stride;
+    const void *srcp;   // samples of DescaleData.format
+    const unsigned char *imaskp;
+    void *dstp;
+    bool warm_start;    // dstp holds a starting guess for the two-axis masked or EWA solver
+    int iterations;     // of the two-axis masked or EWA solver
+    unsigned long long time_ns[2];  // time spent in the horizontal and vertical pass
+};
+
+
+struct DescalePlaneJob
+{
+    struct DescaleData *dd;
+    struct DescalePlane *planes;
+};
+
+
+static inline bool string_is_equal_ignore_case(const char *s1, const char *s2)
 {
     int i;
     for (i = 0; s1[i] != '\0'; i++) {
@@ -54,27 +91,369 @@ static bool string_is_equal_ignore_case(const char *s1, const char *s2)
 }
 
 
+static bool is_ewa_mode(enum DescaleMode mode)
+{
+    return mode == DESCALE_MODE_EWA_LANCZOS || mode == DESCALE_MODE_EWA_JINC;
+}
+
+
+// EWA cores always process both axes, chroma uses the same shifts as the separable cores
+static void initialize_ewa_data(struct DescaleData *dd)
+{
+    struct DescaleParams params_v = dd->params;
+    dd->params.shift = dd->shift_h;
+    dd->params.active_dim = dd->active_width;
+    params_v.shift = dd->shift_v;
+    params_v.active_dim = dd->active_height;
+    dd->ewa_core[0] = dd->dsapi.create_ewa_core(dd->src_width, dd->src_height, dd->dst_width, dd->dst_height, &dd->params, &params_v);
+
+    if (dd->num_planes > 1 && (dd->subsampling_h > 0 || dd->subsampling_v > 0)) {
+        int src_width = dd->src_width >> dd->subsampling_h, src_height = dd->src_height >> dd->subsampling_v;
+        if (dd->subsampling_h > 0) {
+            dd->params.shift = 0.25 - 0.25 * (double)dd->dst_width / (double)dd->src_width;  // For now always assume left-aligned chroma
+            dd->params.shift += dd->shift_h * (double)src_width / (double)dd->src_width;
+        }
+        dd->params.active_dim = dd->active_width * (double)src_width / (double)dd->src_width;
+        params_v.shift = dd->shift_v * (double)src_height / (double)dd->src_height;
+        params_v.active_dim = dd->active_height * (double)src_height / (double)dd->src_height;
+        dd->ewa_core[1] = dd->dsapi.create_ewa_core(src_width, src_height, dd->dst_width >> dd->subsampling_h, dd->dst_height >> dd->subsampling_v,
+                                                    &dd->params, &params_v);
+    }
+}
+
+
+static bool use_half_intermediate(const struct DescaleData *dd)
+{
+    return dd->half_intermediate && dd->process_h && dd->process_v && !dd->params.upscale && !dd->params.has_ignore_mask && dd->dsapi.process_vectors_half;
+}
+
+
+// Whether frames without ignore mask or roi go through process_planes_batched
+static bool use_batched_planes(const struct DescaleData *dd)
+{
+    return dd->num_planes > 1 && !dd->parallel_planes && !dd->subsampling_h && !dd->subsampling_v && !use_half_intermediate(dd) &&
+           dd->format.type == DESCALE_SAMPLE_FLOAT && dd->format.transfer == DESCALE_TRANSFER_LINEAR && !is_ewa_mode(dd->params.mode);
+}
+
+
+/*
+ * The intermediate of a two-axis descale is allocated from the scratch
+ * arena of the processing thread in every frame. It is reserved, so
+ * the arenas keep it between frames instead of going to the heap.
+ */
+static void reserve_intermediate(struct DescaleData *dd)
+{
+    dd->scratch_reserved = 0;
+    if (!dd->process_h || !dd->process_v || is_ewa_mode(dd->params.mode))
+        return;
+
+    size_t sample_size = descale_sample_size(use_half_intermediate(dd) ? DESCALE_SAMPLE_HALF : DESCALE_SAMPLE_FLOAT);
+    dd->scratch_reserved = (size_t)ceil_n(dd->dst_width, 16) * dd->src_height * sample_size;
+    if (use_batched_planes(dd))
+        dd->scratch_reserved *= dd->num_planes;
+    descale_scratch_reserve(dd->scratch_reserved);
+}
+
+
 static void initialize_descale_data(struct DescaleData *dd)
 {
+    reserve_intermediate(dd);
+
+    if (is_ewa_mode(dd->params.mode)) {
+        initialize_ewa_data(dd);
+        return;
+    }
+
+    // The two-axis masked solver works with the cores of an unmasked descale
+    int has_ignore_mask = dd->params.has_ignore_mask;
+    if (dd->process_h && dd->process_v)
+        dd->params.has_ignore_mask = 0;
+
     if (dd->process_h) {
         dd->params.shift = dd->shift_h;
         dd->params.active_dim = dd->active_width;
         dd->dscore_h[0] = dd->dsapi.create_core(dd->src_width, dd->dst_width, &dd->params);
+        if (dd->autotune)
+            dd->dsapi.autotune_core(dd->dscore_h[0], DESCALE_DIR_HORIZONTAL, dd->src_height);
         if (dd->num_planes > 1 && dd->subsampling_h > 0) {
             dd->params.shift = 0.25 - 0.25 * (double)dd->dst_width / (double)dd->src_width;  // For now always assume left-aligned chroma
             dd->params.shift += dd->shift_h * (double)(dd->src_width >> dd->subsampling_h) / (double)dd->src_width;
             dd->params.active_dim = dd->active_width * (double)(dd->src_width >> dd->subsampling_h) / (double)dd->src_width;
             dd->dscore_h[1] = dd->dsapi.create_core(dd->src_width >> dd->subsampling_h, dd->dst_width >> dd->subsampling_h, &dd->params);
+            if (dd->autotune)
+                dd->dsapi.autotune_core(dd->dscore_h[1], DESCALE_DIR_HORIZONTAL, dd->src_height >> dd->subsampling_v);
         }
     }
     if (dd->process_v) {
+        // The vertical pass runs on the output of the horizontal one
+        int width = dd->process_h ? dd->dst_width : dd->src_width;
         dd->params.shift = dd->shift_v;
         dd->params.active_dim = dd->active_height;
         dd->dscore_v[0] = dd->dsapi.create_core(dd->src_height, dd->dst_height, &dd->params);
+        if (dd->autotune)
+            dd->dsapi.autotune_core(dd->dscore_v[0], DESCALE_DIR_VERTICAL, width);
         if (dd->num_planes > 1 && dd->subsampling_v > 0) {
             dd->params.shift = dd->shift_v * (double)(dd->src_height >> dd->subsampling_v) / (double)dd->src_height;
             dd->params.active_dim = dd->active_height * (double)(dd->src_height >> dd->subsampling_v) / (double)dd->src_height;
             dd->dscore_v[1] = dd->dsapi.create_core(dd->src_height >> dd->subsampling_v, dd->dst_height >> dd->subsampling_v, &dd->params);
+            if (dd->autotune)
+                dd->dsapi.autotune_core(dd->dscore_v[1], DESCALE_DIR_VERTICAL, width >> dd->subsampling_h);
+        }
+    }
+
+    dd->params.has_ignore_mask = has_ignore_mask;
+}
+
+
+// Frees the cores created by initialize_descale_data
+static void free_descale_data(struct DescaleData *dd)
+{
+    descale_scratch_unreserve(dd->scratch_reserved);
+
+    if (is_ewa_mode(dd->params.mode)) {
+        dd->dsapi.free_ewa_core(dd->ewa_core[0]);
+        if (dd->num_planes > 1 && (dd->subsampling_h > 0 || dd->subsampling_v > 0))
+            dd->dsapi.free_ewa_core(dd->ewa_core[1]);
+        return;
+    }
+
+    if (dd->process_h) {
+        dd->dsapi.free_core(dd->dscore_h[0]);
+        if (dd->num_planes > 1 && dd->subsampling_h > 0)
+            dd->dsapi.free_core(dd->dscore_h[1]);
+    }
+    if (dd->process_v) {
+        dd->dsapi.free_core(dd->dscore_v[0]);
+        if (dd->num_planes > 1 && dd->subsampling_v > 0)
+            dd->dsapi.free_core(dd->dscore_v[1]);
+    }
+}
+
+
+static void trace_passes(const char *name_h, const char *name_v, unsigned long long start, const unsigned long long time_ns[2], int arg)
+{
+    if (!descale_trace_enabled())
+        return;
+    if (time_ns[0])
+        descale_trace_event(name_h, "plane", start, start + time_ns[0], arg);
+    if (time_ns[1])
+        descale_trace_event(name_v, "plane", start + time_ns[0], start + time_ns[0] + time_ns[1], arg);
+}
+
+
+/*
+ * Computes only the region of interest of a plane with the windowed
+ * solvers. When both axes are processed, the horizontal pass only
+ * produces the rows of the intermediate that the vertical window reads.
+ */
+static void process_plane_roi(struct DescaleData *dd, struct DescalePlane *p)
+{
+    int i = p->index;
+    int sub_h = i ? dd->subsampling_h : 0;
+    int sub_v = i ? dd->subsampling_v : 0;
+    int left = dd->roi_left >> sub_h, width = dd->roi_width >> sub_h;
+    int top = dd->roi_top >> sub_v, height = dd->roi_height >> sub_v;
+    struct DescaleCore *core_h = dd->dscore_h[i && dd->subsampling_h];
+    struct DescaleCore *core_v = dd->dscore_v[i && dd->subsampling_v];
+    unsigned long long start = descale_time_ns();
+    size_t mark = descale_scratch_mark();
+
+    if (dd->process_h && dd->process_v) {
+        int row_first, row_end;
+        dd->dsapi.get_window_source_range(core_v, top, height, dd->roi_tolerance, &row_first, &row_end);
+        int intermediate_stride = ceil_n(width, 16);
+        float *intermediatep = descale_scratch_alloc((size_t)intermediate_stride * (row_end - row_first) * sizeof (float), 64);
+
+        dd->dsapi.process_vectors_window(core_h, DESCALE_DIR_HORIZONTAL, row_end - row_first, left, width, dd->roi_tolerance, 0,
+                                         p->src_stride, 0, intermediate_stride, (const float *)p->srcp + (size_t)row_first * p->src_stride, NULL, intermediatep);
+        unsigned long long end_h = descale_time_ns();
+        dd->dsapi.process_vectors_window(core_v, DESCALE_DIR_VERTICAL, width, top, height, dd->roi_tolerance, row_first,
+                                         intermediate_stride, 0, p->dst_stride, intermediatep, NULL, p->dstp);
+
+        p->time_ns[0] = end_h - start;
+        p->time_ns[1] = descale_time_ns() - end_h;
+
+    } else if (dd->process_h) {
+        dd->dsapi.process_vectors_window(core_h, DESCALE_DIR_HORIZONTAL, height, left, width, dd->roi_tolerance, 0,
+                                         p->src_stride, p->imask_stride, p->dst_stride, (const float *)p->srcp + (size_t)top * p->src_stride,
+                                         p->imaskp ? p->imaskp + (size_t)top * p->imask_stride : NULL, p->dstp);
+        p->time_ns[0] = descale_time_ns() - start;
+
+    } else if (dd->process_v) {
+        // The SIMD vertical pass needs aligned columns, so it starts a few columns early if necessary
+        int column = floor_n(left, 8);
+        int columns = left + width - column;
+        int buffer_stride = ceil_n(columns, 16);
+        float *bufferp = descale_scratch_alloc((size_t)buffer_stride * height * sizeof (float), 64);
+
+        dd->dsapi.process_vectors_window(core_v, DESCALE_DIR_VERTICAL, columns, top, height, dd->roi_tolerance, 0,
+                                         p->src_stride, p->imask_stride, buffer_stride, (const float *)p->srcp + column,
+                                         p->imaskp ? p->imaskp + column : NULL, bufferp);
+        for (int y = 0; y < height; y++)
+            memcpy((float *)p->dstp + (size_t)y * p->dst_stride, bufferp + (size_t)y * buffer_stride + left - column, width * sizeof (float));
+        p->time_ns[1] = descale_time_ns() - start;
+    }
+
+    descale_scratch_release(mark);
+}
+
+
+static void process_plane(struct DescaleData *dd, struct DescalePlane *p)
+{
+    int i = p->index;
+    unsigned long long start = descale_time_ns();
+    p->time_ns[0] = p->time_ns[1] = 0;
+
+    if (is_ewa_mode(dd->params.mode)) {
+        // The EWA cores process both axes at once, so the time is split evenly
+        p->iterations = dd->dsapi.process_plane_ewa(dd->ewa_core[i && (dd->subsampling_h || dd->subsampling_v)],
+                                                    dd->masked_iterations, dd->masked_tolerance, p->warm_start,
+                                                    p->src_stride, p->imask_stride, p->dst_stride, p->srcp, p->imaskp, p->dstp);
+        p->time_ns[0] = p->time_ns[1] = (descale_time_ns() - start) / 2;
+
+    } else if (dd->roi) {
+        process_plane_roi(dd, p);
+
+    } else if (dd->process_h && dd->process_v && p->imaskp) {
+        // Both passes run in every iteration, so the time is split evenly
+        p->iterations = dd->dsapi.process_plane_masked(dd->dscore_h[i && dd->subsampling_h], dd->dscore_v[i && dd->subsampling_v],
+                                                       dd->masked_iterations, dd->masked_tolerance, p->warm_start,
+                                                       p->src_stride, p->imask_stride, p->dst_stride, p->srcp, p->imaskp, p->dstp);
+        p->time_ns[0] = p->time_ns[1] = (descale_time_ns() - start) / 2;
+
+    } else if (dd->process_h && dd->process_v) {
+        int intermediate_width = dd->dst_width >> (i ? dd->subsampling_h : 0);
+        int intermediate_height = dd->src_height >> (i ? dd->subsampling_v : 0);
+        int intermediate_stride = ceil_n(intermediate_width, 16);
+        struct DescaleSampleFormat intermediate_format = { use_half_intermediate(dd) ? DESCALE_SAMPLE_HALF : DESCALE_SAMPLE_FLOAT };
+        size_t mark = descale_scratch_mark();
+        void *intermediatep = descale_scratch_alloc((size_t)intermediate_stride * intermediate_height * descale_sample_size(intermediate_format.type), 64);
+
+        dd->dsapi.process_vectors_format(dd->dscore_h[i && dd->subsampling_h], DESCALE_DIR_HORIZONTAL, intermediate_height, p->src_stride, 0, intermediate_stride,
+                                         p->srcp, NULL, intermediatep, &dd->format, &intermediate_format);
+        unsigned long long end_h = descale_time_ns();
+        dd->dsapi.process_vectors_format(dd->dscore_v[i && dd->subsampling_v], DESCALE_DIR_VERTICAL, intermediate_width, intermediate_stride, 0, p->dst_stride,
+                                         intermediatep, NULL, p->dstp, &intermediate_format, &dd->format);
+
+        descale_scratch_release(mark);
+        p->time_ns[0] = end_h - start;
+        p->time_ns[1] = descale_time_ns() - end_h;
+
+    } else if (dd->process_h) {
+        dd->dsapi.process_vectors_format(dd->dscore_h[i && dd->subsampling_h], DESCALE_DIR_HORIZONTAL, dd->src_height >> (i ? dd->subsampling_v : 0), p->src_stride, p->imask_stride, p->dst_stride,
+                                         p->srcp, p->imaskp, p->dstp, &dd->format, &dd->format);
+        p->time_ns[0] = descale_time_ns() - start;
+
+    } else if (dd->process_v) {
+        dd->dsapi.process_vectors_format(dd->dscore_v[i && dd->subsampling_v], DESCALE_DIR_VERTICAL, dd->src_width >> (i ? dd->subsampling_h : 0), p->src_stride, p->imask_stride, p->dst_stride,
+                                         p->srcp, p->imaskp, p->dstp, &dd->format, &dd->format);
+        p->time_ns[1] = descale_time_ns() - start;
+    }
+
+    trace_passes("horizontal pass", "vertical pass", start, p->time_ns, i);
+}
+
+
+static void process_plane_job(void *arg, int index)
+{
+    struct DescalePlaneJob *job = (struct DescalePlaneJob *)arg;
+    process_plane(job->dd, &job->planes[index]);
+}
+
+
+/*
+ * Planes without subsampling all use the first cores, so they are
+ * handed to the batched kernels together. The horizontal pass
+ * interleaves the row blocks of all planes, so the coefficients are
+ * still in cache for the next plane, the vertical pass solves the
+ * planes one after another with the kernel the core was tuned to.
+ * The time of a batched pass is split evenly between the planes.
+ */
+static void process_planes_batched(struct DescaleData *dd, struct DescalePlane *planes)
+{
+    int n = dd->num_planes;
+    unsigned long long time_ns[2] = {0, 0};
+    unsigned long long start = descale_time_ns();
+    int src_strides[3], dst_strides[3], intermediate_strides[3];
+    const float *srcps[3];
+    const float *intermediateps[3];
+    float *dstps[3];
+    float *intermediatep[3];
+
+    for (int i = 0; i < n; i++) {
+        src_strides[i] = planes[i].src_stride;
+        dst_strides[i] = planes[i].dst_stride;
+        srcps[i] = (const float *)planes[i].srcp;
+        dstps[i] = (float *)planes[i].dstp;
+    }
+
+    if (dd->process_h && dd->process_v) {
+        size_t mark = descale_scratch_mark();
+        for (int i = 0; i < n; i++) {
+            intermediate_strides[i] = ceil_n(dd->dst_width, 16);
+            intermediatep[i] = descale_scratch_alloc((size_t)intermediate_strides[i] * dd->src_height * sizeof (float), 64);
+            intermediateps[i] = intermediatep[i];
         }
+
+        dd->dsapi.process_vectors_planes(dd->dscore_h[0], DESCALE_DIR_HORIZONTAL, dd->src_height, n, src_strides, intermediate_strides, srcps, intermediatep);
+        unsigned long long end_h = descale_time_ns();
+        dd->dsapi.process_vectors_planes(dd->dscore_v[0], DESCALE_DIR_VERTICAL, dd->dst_width, n, intermediate_strides, dst_strides, intermediateps, dstps);
+
+        descale_scratch_release(mark);
+        time_ns[0] = end_h - start;
+        time_ns[1] = descale_time_ns() - end_h;
+
+    } else if (dd->process_h) {
+        dd->dsapi.process_vectors_planes(dd->dscore_h[0], DESCALE_DIR_HORIZONTAL, dd->src_height, n, src_strides, dst_strides, srcps, dstps);
+        time_ns[0] = descale_time_ns() - start;
+
+    } else if (dd->process_v) {
+        dd->dsapi.process_vectors_planes(dd->dscore_v[0], DESCALE_DIR_VERTICAL, dd->src_width, n, src_strides, dst_strides, srcps, dstps);
+        time_ns[1] = descale_time_ns() - start;
+    }
+
+    trace_passes("batched horizontal pass", "batched vertical pass", start, time_ns, n);
+
+    for (int i = 0; i < n; i++) {
+        planes[i].time_ns[0] = time_ns[0] / n;
+        planes[i].time_ns[1] = time_ns[1] / n;
+    }
+}
+
+
+/*
+ * Processes all planes of a frame. The planes are independent of each
+ * other, so with parallel_planes they are spread over the shared worker
+ * pool and joined before returning.
+ */
+static void process_planes(struct DescaleData *dd, struct DescalePlane *planes)
+{
+    if (use_batched_planes(dd) && !planes[0].imaskp && !dd->roi) {
+        process_planes_batched(dd, planes);
+    } else if (dd->parallel_planes && dd->num_planes > 1) {
+        struct DescalePlaneJob job = { dd, planes };
+        descale_pool_run(dd->num_planes, &process_plane_job, &job);
+    } else {
+        for (int i = 0; i < dd->num_planes; i++)
+            process_plane(dd, &planes[i]);
+    }
+}
+
+
+// Sums up the counters of all cores of an instance, counting shared cores only once
+static inline void get_descale_data_stats(struct DescaleData *dd, bool horizontal, struct DescaleCoreStats *stats)
+{
+    struct DescaleCore **cores = horizontal ? dd->dscore_h : dd->dscore_v;
+    bool subsampled = dd->num_planes > 1 && (horizontal ? dd->subsampling_h : dd->subsampling_v) > 0;
+
+    dd->dsapi.get_core_stats(cores[0], stats);
+    if (subsampled) {
+        struct DescaleCoreStats chroma;
+        dd->dsapi.get_core_stats(cores[1], &chroma);
+        stats->build_time_ms += chroma.build_time_ms;
+        stats->calls += chroma.calls;
+        stats->vectors += chroma.vectors;
+        stats->process_time_ms += chroma.process_time_ms;
+        stats->masked_refactorizations += chroma.masked_refactorizations;
     }
 }
@@ -0,0 +1,274 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "descale.h"
+#include "scratch.h"
+
+
+#define SCRATCH_ALIGNMENT 64
+
+// Most an arena keeps between calls on top of the largest reservation,
+// larger buffers come from the heap every time so idle threads do not hold them
+#define SCRATCH_RETAIN_LIMIT ((size_t)4 << 20)
+
+
+// Heap block that serves a request which did not fit into the arena
+struct ScratchOverflow
+{
+    struct ScratchOverflow *next;
+    size_t mark;
+    size_t size;
+    void *ptr;
+};
+
+
+struct Scratch
+{
+    unsigned char *buffer;
+    size_t capacity;
+    size_t used;
+    size_t high_water;          // of used plus the live overflow blocks
+    size_t overflow_bytes;
+    struct ScratchOverflow *overflow;
+};
+
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t *reservations;
+static int num_reservations;
+static int reservations_capacity;
+static size_t retain_limit = SCRATCH_RETAIN_LIMIT;
+
+static size_t stats_high_water;
+static size_t stats_reserved;
+static unsigned long long stats_allocations;
+static int stats_arenas;
+
+
+static void stats_add_reserved(long long bytes)
+{
+    __atomic_add_fetch(&stats_reserved, (size_t)bytes, __ATOMIC_RELAXED);
+}
+
+
+static void stats_update_high_water(size_t high_water)
+{
+    size_t old = __atomic_load_n(&stats_high_water, __ATOMIC_RELAXED);
+    while (high_water > old && !__atomic_compare_exchange_n(&stats_high_water, &old, high_water, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+static void *scratch_heap_alloc(size_t size)
+{
+    void *ptr;
+    descale_aligned_malloc(&ptr, size, SCRATCH_ALIGNMENT);
+    if (ptr) {
+        __atomic_add_fetch(&stats_allocations, 1, __ATOMIC_RELAXED);
+        stats_add_reserved((long long)size);
+    }
+    return ptr;
+}
+
+
+static void scratch_heap_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    descale_aligned_free(ptr);
+    stats_add_reserved(-(long long)size);
+}
+
+
+static void scratch_destroy(void *data)
+{
+    struct Scratch *scratch = (struct Scratch *)data;
+
+    while (scratch->overflow) {
+        struct ScratchOverflow *next = scratch->overflow->next;
+        scratch_heap_free(scratch->overflow->ptr, scratch->overflow->size);
+        free(scratch->overflow);
+        scratch->overflow = next;
+    }
+    scratch_heap_free(scratch->buffer, scratch->capacity);
+    free(scratch);
+
+    __atomic_sub_fetch(&stats_arenas, 1, __ATOMIC_RELAXED);
+}
+
+
+static void scratch_init_key(void)
+{
+    pthread_key_create(&scratch_key, &scratch_destroy);
+}
+
+
+static struct Scratch *get_scratch(void)
+{
+    pthread_once(&scratch_once, &scratch_init_key);
+
+    struct Scratch *scratch = pthread_getspecific(scratch_key);
+    if (!scratch) {
+        scratch = calloc(1, sizeof (struct Scratch));
+        pthread_setspecific(scratch_key, scratch);
+        __atomic_add_fetch(&stats_arenas, 1, __ATOMIC_RELAXED);
+    }
+
+    return scratch;
+}
+
+
+size_t descale_scratch_mark(void)
+{
+    return get_scratch()->used;
+}
+
+
+void *descale_scratch_alloc(size_t size, size_t alignment)
+{
+    struct Scratch *scratch = get_scratch();
+
+    if (alignment < SCRATCH_ALIGNMENT)
+        alignment = SCRATCH_ALIGNMENT;
+    size_t start = (scratch->used + alignment - 1) & ~(alignment - 1);
+    size_t end = start + size;
+
+    void *ptr;
+    if (end <= scratch->capacity) {
+        ptr = scratch->buffer + start;
+        scratch->used = end;
+    } else {
+        // Does not fit, serve it from the heap. It only takes one byte of the arena
+        // to keep later marks apart, so the buffers allocated after it can still fit.
+        struct ScratchOverflow *overflow = malloc(sizeof (struct ScratchOverflow));
+        overflow->mark = scratch->used;
+        overflow->size = size;
+        overflow->ptr = scratch_heap_alloc(size);
+        overflow->next = scratch->overflow;
+        scratch->overflow = overflow;
+        ptr = overflow->ptr;
+        scratch->used++;
+        scratch->overflow_bytes += size;
+    }
+
+    size_t demand = scratch->used + scratch->overflow_bytes;
+    if (demand > scratch->high_water) {
+        scratch->high_water = demand;
+        stats_update_high_water(demand);
+    }
+
+    return ptr;
+}
+
+
+void descale_scratch_release(size_t mark)
+{
+    struct Scratch *scratch = get_scratch();
+
+    while (scratch->overflow && scratch->overflow->mark >= mark) {
+        struct ScratchOverflow *next = scratch->overflow->next;
+        scratch->overflow_bytes -= scratch->overflow->size;
+        scratch_heap_free(scratch->overflow->ptr, scratch->overflow->size);
+        free(scratch->overflow);
+        scratch->overflow = next;
+    }
+
+    scratch->used = mark;
+
+    // Grow the arena once nothing is in use anymore, up to the retain limit,
+    // and shrink it again when the reservation that allowed its size is gone
+    size_t limit = __atomic_load_n(&retain_limit, __ATOMIC_RELAXED);
+    size_t target = DSMIN((scratch->high_water + 4095) & ~(size_t)4095, limit);
+    if (mark == 0 && (target > scratch->capacity || scratch->capacity > limit)) {
+        scratch_heap_free(scratch->buffer, scratch->capacity);
+        scratch->capacity = target;
+        scratch->buffer = scratch_heap_alloc(scratch->capacity);
+        if (!scratch->buffer)
+            scratch->capacity = 0;
+    }
+}
+
+
+// Has to be called with reserve_lock held
+static void update_retain_limit(void)
+{
+    size_t largest = 0;
+    for (int i = 0; i < num_reservations; i++)
+        largest = DSMAX(largest, reservations[i]);
+    __atomic_store_n(&retain_limit, SCRATCH_RETAIN_LIMIT + largest, __ATOMIC_RELAXED);
+}
+
+
+void descale_scratch_reserve(size_t size)
+{
+    if (size == 0)
+        return;
+
+    pthread_mutex_lock(&reserve_lock);
+    if (num_reservations == reservations_capacity) {
+        int capacity = DSMAX(16, reservations_capacity * 2);
+        size_t *grown = realloc(reservations, capacity * sizeof (size_t));
+        if (!grown) {
+            // The arenas just keep less, which only costs speed
+            pthread_mutex_unlock(&reserve_lock);
+            return;
+        }
+        reservations = grown;
+        reservations_capacity = capacity;
+    }
+    reservations[num_reservations++] = size;
+    update_retain_limit();
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+
+void descale_scratch_unreserve(size_t size)
+{
+    if (size == 0)
+        return;
+
+    pthread_mutex_lock(&reserve_lock);
+    for (int i = 0; i < num_reservations; i++) {
+        if (reservations[i] == size) {
+            reservations[i] = reservations[--num_reservations];
+            break;
+        }
+    }
+    update_retain_limit();
+    pthread_mutex_unlock(&reserve_lock);
+}
+
+
+void descale_get_scratch_stats(struct DescaleScratchStats *stats)
+{
+    stats->high_water = __atomic_load_n(&stats_high_water, __ATOMIC_RELAXED);
+    stats->reserved = __atomic_load_n(&stats_reserved, __ATOMIC_RELAXED);
+    stats->allocations = __atomic_load_n(&stats_allocations, __ATOMIC_RELAXED);
+    stats->arenas = __atomic_load_n(&stats_arenas, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,39 @@
+#ifndef DESCALE_SCRATCH_H
+#define DESCALE_SCRATCH_H
+
+
+#include <stddef.h>
+
+
+/*
+ * Per-thread scratch arena for temporary buffers of the process paths.
+ *
+ * Allocations are stack-like: remember the current position with
+ * descale_scratch_mark(), allocate, and give everything allocated
+ * after the mark back with descale_scratch_release().
+ * If a thread needs more memory than its arena holds, the excess is
+ * served from the heap and the arena grows to the high-water mark
+ * once it is fully released, so steady-state processing does not
+ * touch the allocator for the small buffers of the solvers. Arenas
+ * stop growing at a few MiB plus the largest reservation, buffers
+ * that do not fit then always come from the heap and are freed again
+ * when they are released.
+ */
+size_t descale_scratch_mark(void);
+
+void *descale_scratch_alloc(size_t size, size_t alignment);
+
+void descale_scratch_release(size_t mark);
+
+/*
+ * Lets the arenas keep size more bytes between calls while the
+ * reservation exists, for users that know they allocate a buffer like
+ * a frame-sized intermediate in every call. Every reservation has to
+ * be given back with descale_scratch_unreserve() and the same size.
+ */
+void descale_scratch_reserve(size_t size);
+
+void descale_scratch_unreserve(size_t size);
+
+
+#endif  // DESCALE_SCRATCH_H
@@ -0,0 +1,272 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "common.h"
+#include "threadpool.h"
+#include "trace.h"
+
+
+#define POOL_MAX_WORKERS 16
+
+
+struct PoolBatch
+{
+    void (*func)(void *arg, int index);
+    void *arg;
+    int pending;
+    bool detached;      // submitted, nobody waits for it
+};
+
+
+struct PoolTask
+{
+    struct PoolTask *next;
+    struct PoolBatch *batch;
+    int index;
+};
+
+
+struct Pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct PoolTask *head, *tail;
+    bool shutdown;
+
+    int num_workers;
+    pthread_t workers[POOL_MAX_WORKERS];
+};
+
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Pool *pool;
+static int pool_refcount;
+
+
+static int get_num_workers(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cpus = info.dwNumberOfProcessors;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cpus < 2)
+        return 1;
+    return cpus - 1 < POOL_MAX_WORKERS ? (int)(cpus - 1) : POOL_MAX_WORKERS;
+}
+
+
+// Unlinks the first queued task, or the first one of the given batch if batch is not NULL
+static struct PoolTask *pop_task(struct Pool *p, struct PoolBatch *batch)
+{
+    struct PoolTask *prev = NULL;
+    struct PoolTask *task = p->head;
+    while (task && batch && task->batch != batch) {
+        prev = task;
+        task = task->next;
+    }
+    if (!task)
+        return NULL;
+
+    if (prev)
+        prev->next = task->next;
+    else
+        p->head = task->next;
+    if (p->tail == task)
+        p->tail = prev;
+
+    return task;
+}
+
+
+// A detached task and its batch share one allocation
+struct PoolDetached
+{
+    struct PoolTask task;
+    struct PoolBatch batch;
+};
+
+
+static void finish_task(struct Pool *p, struct PoolTask *task)
+{
+    if (task->batch->detached)
+        free(task);
+    else if (--task->batch->pending == 0)
+        pthread_cond_broadcast(&p->done);
+}
+
+
+static void *worker_main(void *data)
+{
+    struct Pool *p = (struct Pool *)data;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        struct PoolTask *task = pop_task(p, NULL);
+        if (!task) {
+            if (p->shutdown)
+                break;
+            pthread_cond_wait(&p->work, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+        task->batch->func(task->batch->arg, task->index);
+        pthread_mutex_lock(&p->lock);
+        finish_task(p, task);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+
+void descale_pool_acquire(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (pool_refcount++ == 0) {
+        pool = calloc(1, sizeof (struct Pool));
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+
+        int num_workers = get_num_workers();
+        for (int i = 0; i < num_workers; i++) {
+            if (pthread_create(&pool->workers[i], NULL, &worker_main, pool))
+                break;
+            pool->num_workers++;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+void descale_pool_release(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_refcount == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 0; i < pool->num_workers; i++)
+            pthread_join(pool->workers[i], NULL);
+
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        pool = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+
+void descale_pool_run(int count, void (*func)(void *arg, int index), void *arg)
+{
+    struct Pool *p = pool;
+
+    if (count < 2 || !p || p->num_workers == 0) {
+        for (int i = 0; i < count; i++)
+            func(arg, i);
+        return;
+    }
+
+    // The tasks live on this stack frame, which is fine since we do not return before all of them are done
+    struct PoolTask tasks[POOL_MAX_WORKERS + 1];
+    int queued = count - 1 < POOL_MAX_WORKERS + 1 ? count - 1 : POOL_MAX_WORKERS + 1;
+    struct PoolBatch batch = { func, arg, queued };
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < queued; i++) {
+        tasks[i].next = NULL;
+        tasks[i].batch = &batch;
+        tasks[i].index = i + 1;
+        if (p->tail)
+            p->tail->next = &tasks[i];
+        else
+            p->head = &tasks[i];
+        p->tail = &tasks[i];
+    }
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    func(arg, 0);
+
+    // Anything beyond what fit into the queue runs here as well
+    for (int i = queued + 1; i < count; i++)
+        func(arg, i);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        struct PoolTask *task = pop_task(p, &batch);
+        if (task) {
+            pthread_mutex_unlock(&p->lock);
+            func(arg, task->index);
+            pthread_mutex_lock(&p->lock);
+            finish_task(p, task);
+        } else if (batch.pending > 0) {
+            unsigned long long wait_start = descale_time_ns();
+            pthread_cond_wait(&p->done, &p->lock);
+            descale_trace_event("wait for workers", "wait", wait_start, descale_time_ns(), batch.pending);
+        } else {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+
+void descale_pool_submit(void (*func)(void *arg, int index), void *arg)
+{
+    struct Pool *p = pool;
+    struct PoolDetached *detached = p && p->num_workers > 0 ? malloc(sizeof (struct PoolDetached)) : NULL;
+
+    if (!detached) {
+        func(arg, 0);
+        return;
+    }
+
+    detached->batch = (struct PoolBatch){ func, arg, 1, true };
+    detached->task = (struct PoolTask){ NULL, &detached->batch, 0 };
+
+    pthread_mutex_lock(&p->lock);
+    if (p->tail)
+        p->tail->next = &detached->task;
+    else
+        p->head = &detached->task;
+    p->tail = &detached->task;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef DESCALE_THREADPOOL_H
+#define DESCALE_THREADPOOL_H
+
+
+/*
+ * Process-wide worker pool shared by all filter instances.
+ *
+ * Every user holds a reference through descale_pool_acquire() and
+ * descale_pool_release(); the workers are started with the first
+ * reference and joined when the last one is dropped.
+ * descale_pool_run() calls func(arg, 0) ... func(arg, count - 1),
+ * running index 0 on the calling thread, and returns once all calls
+ * have finished. The caller picks up its own queued tasks while it
+ * waits, so nested or concurrent runs from many threads cannot
+ * starve each other.
+ * descale_pool_submit() queues a single call func(arg, 0) and returns
+ * without waiting for it. It runs on the calling thread if there are
+ * no workers, the workers finish every submitted call before they are
+ * joined.
+ */
+void descale_pool_acquire(void);
+
+void descale_pool_release(void);
+
+void descale_pool_run(int count, void (*func)(void *arg, int index), void *arg);
+
+void descale_pool_submit(void (*func)(void *arg, int index), void *arg);
+
+
+#endif  // DESCALE_THREADPOOL_H
@@ -0,0 +1,205 @@
+/* 
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "trace.h"
+
+
+#define TRACE_CAPACITY 65536    // events per thread, the oldest ones are overwritten
+
+
+/*
+ * Threads can still record events while the dump runs on exit, and a
+ * full ring overwrites the oldest slot, which the dump may be reading.
+ * Every slot carries a sequence number, odd while the event with that
+ * index is written and even once it is complete, so the dump skips
+ * slots that were torn or already hold a newer event.
+ */
+struct TraceEvent
+{
+    unsigned long long seq;     // 2 * index + 1 while written, 2 * index + 2 once complete
+    const char *name;
+    const char *category;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+    int arg;
+};
+
+
+struct TraceBuffer
+{
+    struct TraceBuffer *next;
+    int tid;
+    unsigned long long count;   // total number of recorded events
+    struct TraceEvent events[TRACE_CAPACITY];
+};
+
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static bool trace_on;
+static char *trace_path;
+
+// Buffers are only ever added, and outlive their threads until the dump
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceBuffer *trace_buffers;
+static int trace_threads;
+
+
+static void trace_init(void)
+{
+    const char *path = getenv("DESCALE_TRACE");
+    if (!path || !*path)
+        return;
+    trace_path = strdup(path);
+    pthread_key_create(&trace_key, NULL);
+    trace_on = true;
+}
+
+
+bool descale_trace_enabled(void)
+{
+    pthread_once(&trace_once, &trace_init);
+    return trace_on;
+}
+
+
+static struct TraceBuffer *get_buffer(void)
+{
+    struct TraceBuffer *buffer = pthread_getspecific(trace_key);
+    if (buffer)
+        return buffer;
+
+    buffer = calloc(1, sizeof (struct TraceBuffer));
+    if (!buffer)
+        return NULL;
+    pthread_mutex_lock(&trace_lock);
+    buffer->tid = ++trace_threads;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setspecific(trace_key, buffer);
+
+    return buffer;
+}
+
+
+void descale_trace_event(const char *name, const char *category, unsigned long long start_ns, unsigned long long end_ns, int arg)
+{
+    if (!descale_trace_enabled())
+        return;
+
+    struct TraceBuffer *buffer = get_buffer();
+    if (!buffer)
+        return;
+
+    // Only this thread writes the count and the slots of its buffer
+    unsigned long long index = buffer->count;
+    struct TraceEvent *e = &buffer->events[index % TRACE_CAPACITY];
+    __atomic_store_n(&e->seq, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->category, category, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->start_ns, start_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->end_ns, end_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, 2 * index + 2, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&buffer->count, index + 1, __ATOMIC_RELEASE);
+}
+
+
+// Copies the event with the given index, false if its slot is being written or was reused
+static bool read_event(const struct TraceEvent *slot, unsigned long long index, struct TraceEvent *e)
+{
+    e->seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    e->name = __atomic_load_n(&slot->name, __ATOMIC_RELAXED);
+    e->category = __atomic_load_n(&slot->category, __ATOMIC_RELAXED);
+    e->start_ns = __atomic_load_n(&slot->start_ns, __ATOMIC_RELAXED);
+    e->end_ns = __atomic_load_n(&slot->end_ns, __ATOMIC_RELAXED);
+    e->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return e->seq == 2 * index + 2 && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == e->seq;
+}
+
+
+__attribute__((destructor)) static void trace_dump(void)
+{
+    if (!trace_on)
+        return;
+
+    FILE *f = fopen(trace_path, "w");
+    if (!f) {
+        fprintf(stderr, "descale: could not write the trace to %s\n", trace_path);
+        return;
+    }
+
+    // Formatting is slow, so the events of a buffer are copied out first to lose fewer of them to running threads
+    struct TraceEvent *events = malloc(TRACE_CAPACITY * sizeof (struct TraceEvent));
+    if (!events) {
+        fclose(f);
+        return;
+    }
+
+    int pid = (int)getpid();
+    bool first = true;
+    fprintf(f, "{\"traceEvents\": [");
+
+    pthread_mutex_lock(&trace_lock);
+    for (struct TraceBuffer *buffer = trace_buffers; buffer; buffer = buffer->next) {
+        fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"descale thread %d\"}}",
+                first ? "" : ",", pid, buffer->tid, buffer->tid);
+        first = false;
+
+        unsigned long long count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        unsigned long long begin = count > TRACE_CAPACITY ? count - TRACE_CAPACITY : 0;
+        int copied = 0;
+        for (unsigned long long i = begin; i < count; i++)
+            copied += read_event(&buffer->events[i % TRACE_CAPACITY], i, &events[copied]);
+
+        for (int i = 0; i < copied; i++) {
+            const struct TraceEvent *e = &events[i];
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    e->name, e->category, pid, buffer->tid, (double)e->start_ns * 1e-3, (double)(e->end_ns - e->start_ns) * 1e-3);
+            if (e->arg >= 0)
+                fprintf(f, ", \"args\": {\"value\": %d}", e->arg);
+            fprintf(f, "}");
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(events);
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
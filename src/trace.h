@@ -0,0 +1,25 @@
+#ifndef DESCALE_TRACE_H
+#define DESCALE_TRACE_H
+
+
+#include <stdbool.h>
+
+
+/*
+ * Timeline tracing in the Chrome trace event format.
+ *
+ * Setting the environment variable DESCALE_TRACE to a file name enables it.
+ * Every thread records complete events into its own ring buffer without
+ * any locking, and all buffers are written to the file as JSON when the
+ * library is unloaded or the process exits. Events that threads still
+ * overwrite during that are left out. The file can be opened in
+ * Perfetto or chrome://tracing.
+ * When tracing is disabled, recording an event is a single branch.
+ */
+bool descale_trace_enabled(void);
+
+// start_ns and end_ns come from descale_time_ns(), arg is shown as the event argument if it is not negative
+void descale_trace_event(const char *name, const char *category, unsigned long long start_ns, unsigned long long end_ns, int arg);
+
+
+#endif  // DESCALE_TRACE_H
@@ -29,13 +29,94 @@
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
 #include "descale.h"
+#include "hash.h"
 #include "plugin.h"
 #include <stdio.h>
 
+struct FrameCacheEntry
+{
+    uint64_t hash[2];
+    const VSFrame *frame;       // NULL if the entry is unused
+    unsigned long long last_use;
+};
+
+
+// Output frames of recently seen input frames, the least recently used one is replaced
+struct FrameCache
+{
+    pthread_mutex_t lock;
+    int size;
+    struct FrameCacheEntry *entries;
+    unsigned long long clock;
+    unsigned long long lookups, hits;
+};
+
+
+// Solution of the two-axis masked solver for a recent frame, the starting guess for the following ones
+struct WarmStart
+{
+    pthread_mutex_t lock;
+    int n;              // frame of the stored solution, -1 if there is none
+    float *planes[3];
+};
+
+
+#define WARM_START_DISTANCE 4
+
+
+#define GEOMETRY_CACHE_SIZE 8
+#define GEOMETRY_PREFETCH_DISTANCE 8
+
+
+// Everything that frame properties can change about the descale of a frame
+struct DescaleGeometry
+{
+    int dst_width, dst_height;
+    double shift_h, shift_v;
+    double active_width, active_height;     // 0 in the defaults if not passed as arguments
+    double param1, param2;
+    int taps;
+    double blur;
+};
+
+
+struct GeometryEntry
+{
+    bool used;
+    bool ready;         // false while the cores are being built
+    bool temporary;     // not part of the cache, freed by the last user
+    int users;          // frames and builds currently using the cores
+    unsigned long long last_use;
+    struct DescaleGeometry geometry;
+    struct DescaleData dd;
+};
+
+
+// Cores of recently seen geometries, the least recently used unused one is replaced
+struct GeometryCache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t built;
+    struct GeometryEntry entries[GEOMETRY_CACHE_SIZE];
+    unsigned long long clock;
+    int building;       // background builds that are not finished yet
+    int lookaheads;     // asynchronous requests of later frames that are not finished yet
+};
+
+
 struct VSDescaleData
 {
     bool initialized;
     pthread_mutex_t lock;
+    struct FrameCache cache;
+    struct WarmStart warm;  // only used by the two-axis masked solver with a fixed geometry
+
+    // Per-frame geometry
+    bool frame_props;
+    bool force_h, force_v;
+    struct DescaleGeometry geometry;    // defaults from the arguments
+    struct GeometryCache *geometries;
+    const VSAPI *vsapi;                 // for the callbacks of the lookahead requests
 
     VSNode *node;
     VSNode *ignore_mask_node;
@@ -67,6 +148,529 @@ static const char *VS_CC get_error(const char *funcname, const char *error) {
     return out;
 }
 
+static void hash_frame(const struct VSDescaleData *d, const VSFrame *src, const VSFrame *ignore_mask, const struct DescaleGeometry *geometry,
+                       uint64_t hash[2], const VSAPI *vsapi)
+{
+    DescaleHashState state;
+    descale_hash_init(&state, 0);
+
+    // The same content gives a different output if the frame properties ask for another geometry
+    if (geometry) {
+        double key[10] = {
+            geometry->dst_width, geometry->dst_height, geometry->shift_h, geometry->shift_v, geometry->active_width,
+            geometry->active_height, geometry->param1, geometry->param2, geometry->taps, geometry->blur
+        };
+        descale_hash_update(&state, key, sizeof key);
+    }
+
+    for (int plane = 0; plane < d->dd.num_planes; plane++) {
+        int width = d->dd.src_width >> (plane ? d->dd.subsampling_h : 0);
+        int height = d->dd.src_height >> (plane ? d->dd.subsampling_v : 0);
+        ptrdiff_t stride = vsapi->getStride(src, plane);
+        const uint8_t *srcp = vsapi->getReadPtr(src, plane);
+        for (int y = 0; y < height; y++)
+            descale_hash_update(&state, srcp + y * stride, width * d->vi.format.bytesPerSample);
+
+        if (ignore_mask) {
+            stride = vsapi->getStride(ignore_mask, plane);
+            srcp = vsapi->getReadPtr(ignore_mask, plane);
+            for (int y = 0; y < height; y++)
+                descale_hash_update(&state, srcp + y * stride, width);
+        }
+    }
+
+    descale_hash_final(&state, hash);
+}
+
+
+static const VSFrame *frame_cache_find(struct FrameCache *cache, const uint64_t hash[2], const VSAPI *vsapi)
+{
+    const VSFrame *frame = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->lookups++;
+    for (int i = 0; i < cache->size; i++) {
+        struct FrameCacheEntry *e = &cache->entries[i];
+        if (e->frame && e->hash[0] == hash[0] && e->hash[1] == hash[1]) {
+            e->last_use = ++cache->clock;
+            frame = vsapi->addFrameRef(e->frame);
+            cache->hits++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return frame;
+}
+
+
+static void frame_cache_insert(struct FrameCache *cache, const uint64_t hash[2], const VSFrame *frame, const VSAPI *vsapi)
+{
+    const VSFrame *evicted = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    struct FrameCacheEntry *oldest = &cache->entries[0];
+    for (int i = 0; i < cache->size; i++) {
+        struct FrameCacheEntry *e = &cache->entries[i];
+        // Another thread may have processed the same content in the meantime
+        if (e->frame && e->hash[0] == hash[0] && e->hash[1] == hash[1]) {
+            oldest = NULL;
+            break;
+        }
+        if (!e->frame || (oldest->frame && e->last_use < oldest->last_use))
+            oldest = e;
+    }
+    if (oldest) {
+        evicted = oldest->frame;
+        oldest->hash[0] = hash[0];
+        oldest->hash[1] = hash[1];
+        oldest->frame = vsapi->addFrameRef(frame);
+        oldest->last_use = ++cache->clock;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    vsapi->freeFrame(evicted);
+}
+
+
+// Reads the geometry of a frame from its properties, anything that is not set keeps the value of the filter arguments
+static void read_geometry(const struct VSDescaleData *d, const VSMap *props, struct DescaleGeometry *g, const VSAPI *vsapi)
+{
+    int err;
+    *g = d->geometry;
+
+    int64_t i = vsapi->mapGetInt(props, "DescaleWidth", 0, &err);
+    if (!err)
+        g->dst_width = (int)i;
+    i = vsapi->mapGetInt(props, "DescaleHeight", 0, &err);
+    if (!err)
+        g->dst_height = (int)i;
+
+    double f = vsapi->mapGetFloat(props, "DescaleSrcLeft", 0, &err);
+    if (!err)
+        g->shift_h = f;
+    f = vsapi->mapGetFloat(props, "DescaleSrcTop", 0, &err);
+    if (!err)
+        g->shift_v = f;
+    f = vsapi->mapGetFloat(props, "DescaleSrcWidth", 0, &err);
+    if (!err)
+        g->active_width = f;
+    f = vsapi->mapGetFloat(props, "DescaleSrcHeight", 0, &err);
+    if (!err)
+        g->active_height = f;
+
+    if (d->dd.params.mode == DESCALE_MODE_BICUBIC) {
+        f = vsapi->mapGetFloat(props, "DescaleB", 0, &err);
+        if (!err)
+            g->param1 = f;
+        f = vsapi->mapGetFloat(props, "DescaleC", 0, &err);
+        if (!err)
+            g->param2 = f;
+    } else if (d->dd.params.mode == DESCALE_MODE_LANCZOS || d->dd.params.mode == DESCALE_MODE_CUSTOM) {
+        i = vsapi->mapGetInt(props, "DescaleTaps", 0, &err);
+        if (!err)
+            g->taps = (int)i;
+    }
+    f = vsapi->mapGetFloat(props, "DescaleBlur", 0, &err);
+    if (!err)
+        g->blur = f;
+
+    if (g->active_width == 0.0)
+        g->active_width = (double)(d->dd.params.upscale ? d->dd.src_width : g->dst_width);
+    if (g->active_height == 0.0)
+        g->active_height = (double)(d->dd.params.upscale ? d->dd.src_height : g->dst_height);
+}
+
+
+static void geometry_axes(const struct VSDescaleData *d, const struct DescaleGeometry *g, bool *process_h, bool *process_v)
+{
+    *process_h = g->dst_width != d->dd.src_width || g->shift_h != 0.0 || g->active_width != (double)g->dst_width || d->force_h;
+    *process_v = g->dst_height != d->dd.src_height || g->shift_v != 0.0 || g->active_height != (double)g->dst_height || d->force_v;
+}
+
+
+// Same checks as descale_create does for the arguments, returns NULL if the geometry is usable
+static const char *check_geometry(const struct VSDescaleData *d, const struct DescaleGeometry *g)
+{
+    const struct DescaleData *dd = &d->dd;
+    bool process_h, process_v;
+
+    if (d->vi.width && (g->dst_width != d->vi.width || g->dst_height != d->vi.height))
+        return "Frame properties change the output size, pass width=0 and height=0 for variable size output.";
+    if (g->dst_width < 1)
+        return "DescaleWidth must be greater than 0.";
+    if (g->dst_height < 8)
+        return "DescaleHeight must be greater than or equal to 8.";
+    if (g->dst_width % (1 << dd->subsampling_h) != 0 || g->dst_height % (1 << dd->subsampling_v) != 0)
+        return "Output size from the frame properties and output subsampling are not compatible.";
+    if (!dd->params.upscale && (g->dst_width > dd->src_width || g->dst_height > dd->src_height))
+        return "Output dimension must be less than or equal to input dimension.";
+    if (dd->params.upscale && (g->dst_width < dd->src_width || g->dst_height < dd->src_height))
+        return "Output dimension must be larger than or equal to input dimension.";
+    if ((dd->params.mode == DESCALE_MODE_LANCZOS || dd->params.mode == DESCALE_MODE_CUSTOM) && g->taps < 1)
+        return "DescaleTaps must be greater than 0.";
+    if (g->blur >= dd->src_width >> dd->subsampling_h || g->blur >= dd->src_height >> dd->subsampling_v || g->blur <= 0)
+        return "DescaleBlur is out of bounds.";
+
+    geometry_axes(d, g, &process_h, &process_v);
+    if (process_h && process_v && d->ignore_mask_node && dd->format.type != DESCALE_SAMPLE_FLOAT)
+        return "Ignore mask along both axes only supports float32 input.";
+    if ((process_h && dd->params.post_conv_size > 2 * g->dst_width + 1) || (process_v && dd->params.post_conv_size > 2 * g->dst_height + 1))
+        return "Post-convolution kernel is too large, exceeds clip dimensions.";
+
+    return NULL;
+}
+
+
+static bool geometry_equal(const struct DescaleGeometry *a, const struct DescaleGeometry *b)
+{
+    return a->dst_width == b->dst_width && a->dst_height == b->dst_height
+        && a->shift_h == b->shift_h && a->shift_v == b->shift_v
+        && a->active_width == b->active_width && a->active_height == b->active_height
+        && a->param1 == b->param1 && a->param2 == b->param2
+        && a->taps == b->taps && a->blur == b->blur;
+}
+
+
+static void geometry_build(struct VSDescaleData *d, struct GeometryEntry *e)
+{
+    const struct DescaleGeometry *g = &e->geometry;
+    struct DescaleData *dd = &e->dd;
+
+    *dd = d->dd;
+    dd->dst_width = g->dst_width;
+    dd->dst_height = g->dst_height;
+    dd->shift_h = g->shift_h;
+    dd->shift_v = g->shift_v;
+    dd->active_width = g->active_width;
+    dd->active_height = g->active_height;
+    dd->params.param1 = g->param1;
+    dd->params.param2 = g->param2;
+    dd->params.taps = g->taps;
+    dd->params.blur = g->blur;
+    geometry_axes(d, g, &dd->process_h, &dd->process_v);
+    initialize_descale_data(dd);
+
+    pthread_mutex_lock(&d->geometries->lock);
+    e->ready = true;
+    pthread_cond_broadcast(&d->geometries->built);
+    pthread_mutex_unlock(&d->geometries->lock);
+}
+
+
+// Must be called with the lock held
+static struct GeometryEntry *geometry_find(struct GeometryCache *c, const struct DescaleGeometry *g)
+{
+    for (int i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+        if (c->entries[i].used && geometry_equal(&c->entries[i].geometry, g))
+            return &c->entries[i];
+    }
+    return NULL;
+}
+
+
+// Must be called with the lock held, returns NULL if all entries are in use
+static struct GeometryEntry *geometry_claim(struct GeometryCache *c, const struct DescaleGeometry *g)
+{
+    struct GeometryEntry *oldest = NULL;
+    for (int i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+        struct GeometryEntry *e = &c->entries[i];
+        if (e->users > 0)
+            continue;
+        if (!e->used) {
+            oldest = e;
+            break;
+        }
+        if (!oldest || e->last_use < oldest->last_use)
+            oldest = e;
+    }
+
+    if (oldest) {
+        if (oldest->used)
+            free_descale_data(&oldest->dd);
+        oldest->used = true;
+        oldest->ready = false;
+        oldest->geometry = *g;
+        oldest->last_use = ++c->clock;
+    }
+
+    return oldest;
+}
+
+
+/*
+ * Returns the entry of a geometry with a reference, its cores are built
+ * first if nobody did that yet. Returns NULL if every entry is busy and
+ * there is no memory for one outside of the cache.
+ */
+static struct GeometryEntry *geometry_acquire(struct VSDescaleData *d, const struct DescaleGeometry *g)
+{
+    struct GeometryCache *c = d->geometries;
+
+    pthread_mutex_lock(&c->lock);
+    struct GeometryEntry *e = geometry_find(c, g);
+    bool build = !e;
+    if (build) {
+        e = geometry_claim(c, g);
+        // Every entry is busy, use one outside of the cache
+        if (!e) {
+            e = calloc(1, sizeof (struct GeometryEntry));
+            if (!e) {
+                pthread_mutex_unlock(&c->lock);
+                return NULL;
+            }
+            e->used = true;
+            e->temporary = true;
+            e->geometry = *g;
+        }
+    }
+    e->users++;
+    e->last_use = ++c->clock;
+
+    if (!e->ready && !build) {
+        unsigned long long wait_start = descale_time_ns();
+        while (!e->ready)
+            pthread_cond_wait(&c->built, &c->lock);
+        descale_trace_event("wait for cores", "wait", wait_start, descale_time_ns(), -1);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (build)
+        geometry_build(d, e);
+
+    return e;
+}
+
+
+static void geometry_release(struct VSDescaleData *d, struct GeometryEntry *e)
+{
+    pthread_mutex_lock(&d->geometries->lock);
+    bool free_entry = --e->users == 0 && e->temporary;
+    pthread_mutex_unlock(&d->geometries->lock);
+
+    if (free_entry) {
+        free_descale_data(&e->dd);
+        free(e);
+    }
+}
+
+
+struct GeometryPrefetch
+{
+    struct VSDescaleData *d;
+    struct GeometryEntry *entry;
+};
+
+
+static void geometry_prefetch_job(void *arg, int index)
+{
+    struct GeometryPrefetch *job = (struct GeometryPrefetch *)arg;
+    struct GeometryCache *c = job->d->geometries;
+
+    geometry_build(job->d, job->entry);
+
+    pthread_mutex_lock(&c->lock);
+    job->entry->users--;
+    c->building--;
+    pthread_cond_broadcast(&c->built);
+    pthread_mutex_unlock(&c->lock);
+
+    free(job);
+}
+
+
+/*
+ * Starts building the cores of a geometry on the worker pool if they are
+ * not cached yet, so they are ready when its first frame arrives.
+ * Nothing happens if every entry of the cache is in use.
+ */
+static void geometry_prefetch(struct VSDescaleData *d, const struct DescaleGeometry *g)
+{
+    struct GeometryCache *c = d->geometries;
+    struct GeometryPrefetch *job = malloc(sizeof (struct GeometryPrefetch));
+    if (!job)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    struct GeometryEntry *e = geometry_find(c, g) ? NULL : geometry_claim(c, g);
+    if (e) {
+        e->users++;
+        c->building++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (!e) {
+        free(job);
+        return;
+    }
+
+    job->d = d;
+    job->entry = e;
+    descale_pool_submit(&geometry_prefetch_job, job);
+}
+
+
+struct GeometryLookahead
+{
+    struct VSDescaleData *d;
+    struct DescaleGeometry geometry;    // of the frame that made the request
+};
+
+
+static void VS_CC geometry_lookahead_done(void *user_data, const VSFrame *f, int n, VSNode *node, const char *error_msg)
+{
+    struct GeometryLookahead *lookahead = (struct GeometryLookahead *)user_data;
+    struct VSDescaleData *d = lookahead->d;
+    struct GeometryCache *c = d->geometries;
+
+    // Errors are reported when the frame itself is descaled
+    if (f) {
+        struct DescaleGeometry next;
+        read_geometry(d, d->vsapi->getFramePropertiesRO(f), &next, d->vsapi);
+        if (!geometry_equal(&next, &lookahead->geometry) && !check_geometry(d, &next))
+            geometry_prefetch(d, &next);
+        d->vsapi->freeFrame(f);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->lookaheads--;
+    pthread_cond_broadcast(&c->built);
+    pthread_mutex_unlock(&c->lock);
+
+    free(lookahead);
+}
+
+
+/*
+ * Every GEOMETRY_PREFETCH_DISTANCE frames, asks for the frame that many
+ * frames later without waiting for it. If its geometry differs, a scene
+ * with other cores is coming and they are built in the background.
+ */
+static void geometry_lookahead(struct VSDescaleData *d, int n, const struct DescaleGeometry *g)
+{
+    struct GeometryCache *c = d->geometries;
+
+    if (n % GEOMETRY_PREFETCH_DISTANCE != 0 || n + GEOMETRY_PREFETCH_DISTANCE >= d->vi.numFrames)
+        return;
+
+    struct GeometryLookahead *lookahead = malloc(sizeof (struct GeometryLookahead));
+    if (!lookahead)
+        return;
+    lookahead->d = d;
+    lookahead->geometry = *g;
+
+    pthread_mutex_lock(&c->lock);
+    c->lookaheads++;
+    pthread_mutex_unlock(&c->lock);
+
+    d->vsapi->getFrameAsync(n + GEOMETRY_PREFETCH_DISTANCE, d->node, &geometry_lookahead_done, lookahead);
+}
+
+
+static void set_stats_props(struct VSDescaleData *d, struct DescaleData *dd, const struct DescalePlane *planes, unsigned long long time_ns, bool cache_hit,
+                            VSMap *props, const VSAPI *vsapi)
+{
+    vsapi->mapSetFloat(props, "DescaleTimeUs", (double)time_ns * 1e-3, maReplace);
+
+    if (d->cache.size > 0) {
+        pthread_mutex_lock(&d->cache.lock);
+        vsapi->mapSetInt(props, "DescaleCacheHits", (int64_t)d->cache.hits, maReplace);
+        vsapi->mapSetInt(props, "DescaleCacheLookups", (int64_t)d->cache.lookups, maReplace);
+        pthread_mutex_unlock(&d->cache.lock);
+        vsapi->mapSetInt(props, "DescaleCacheHit", cache_hit, maReplace);
+    }
+
+    for (int dir = 0; dir < 2; dir++) {
+        bool horizontal = dir == DESCALE_DIR_HORIZONTAL;
+        if (!(horizontal ? dd->process_h : dd->process_v))
+            continue;
+
+        double times[3];
+        for (int plane = 0; plane < dd->num_planes; plane++)
+            times[plane] = (double)planes[plane].time_ns[dir] * 1e-3;
+        vsapi->mapSetFloatArray(props, horizontal ? "DescaleTimeUsH" : "DescaleTimeUsV", times, dd->num_planes);
+
+        // The EWA cores have no separable cores to report on
+        if (is_ewa_mode(dd->params.mode))
+            continue;
+
+        const char *kernel_key = horizontal ? "DescaleKernelH" : "DescaleKernelV";
+        vsapi->mapDeleteKey(props, kernel_key);
+        for (int plane = 0; plane < dd->num_planes; plane++) {
+            struct DescaleCore *core = horizontal ? dd->dscore_h[plane && dd->subsampling_h] : dd->dscore_v[plane && dd->subsampling_v];
+            struct DescaleCoreStats stats;
+            char kernel[32];
+            dd->dsapi.get_core_stats(core, &stats);
+            const char *opt = stats.opt == DESCALE_OPT_AVX2 && core->kernel[dir] != DESCALE_KERNEL_C ? "avx2" : "c";
+            if (core->kernel[dir] == DESCALE_KERNEL_JIT && core->jit)
+                opt = "jit";
+            snprintf(kernel, sizeof kernel, "%s/%s", opt, core->kernel[dir] == DESCALE_KERNEL_GENERIC ? "generic" : stats.variant);
+            vsapi->mapSetData(props, kernel_key, kernel, -1, dtUtf8, maAppend);
+        }
+
+        struct DescaleCoreStats stats;
+        get_descale_data_stats(dd, horizontal, &stats);
+        vsapi->mapSetFloat(props, horizontal ? "DescaleBuildTimeUsH" : "DescaleBuildTimeUsV", stats.build_time_ms * 1e3, maReplace);
+        vsapi->mapSetInt(props, horizontal ? "DescaleRefactorizationsH" : "DescaleRefactorizationsV", (int64_t)stats.masked_refactorizations, maReplace);
+    }
+
+    if (is_ewa_mode(dd->params.mode) && !dd->params.upscale && !cache_hit) {
+        int64_t iterations[3];
+        for (int plane = 0; plane < dd->num_planes; plane++)
+            iterations[plane] = planes[plane].iterations;
+        vsapi->mapSetIntArray(props, "DescaleEwaIterations", iterations, dd->num_planes);
+    } else if (dd->process_h && dd->process_v && d->ignore_mask_node && !cache_hit) {
+        int64_t iterations[3];
+        for (int plane = 0; plane < dd->num_planes; plane++)
+            iterations[plane] = planes[plane].iterations;
+        vsapi->mapSetIntArray(props, "DescaleMaskedIterations", iterations, dd->num_planes);
+    }
+
+    struct DescaleScratchStats scratch;
+    descale_get_scratch_stats(&scratch);
+    vsapi->mapSetInt(props, "DescaleScratchBytes", (int64_t)scratch.high_water, maReplace);
+}
+
+
+static void warm_start_copy(const struct DescaleData *dd, struct DescalePlane *planes, bool load, float *const *warm_planes)
+{
+    for (int plane = 0; plane < dd->num_planes; plane++) {
+        int width = dd->dst_width >> (plane ? dd->subsampling_h : 0);
+        int height = dd->dst_height >> (plane ? dd->subsampling_v : 0);
+        for (int y = 0; y < height; y++) {
+            float *row = (float *)planes[plane].dstp + (size_t)y * planes[plane].dst_stride;
+            if (load)
+                memcpy(row, warm_planes[plane] + (size_t)y * width, width * sizeof (float));
+            else
+                memcpy(warm_planes[plane] + (size_t)y * width, row, width * sizeof (float));
+        }
+        planes[plane].warm_start = load;
+    }
+}
+
+
+// Starts from the stored solution if it belongs to a frame shortly before n
+static void warm_start_load(struct WarmStart *w, const struct DescaleData *dd, int n, struct DescalePlane *planes)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->n >= 0 && w->n < n && n - w->n <= WARM_START_DISTANCE)
+        warm_start_copy(dd, planes, true, w->planes);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+// Keeps the solution of the latest frame, or of any frame after a seek
+static void warm_start_store(struct WarmStart *w, const struct DescaleData *dd, int n, struct DescalePlane *planes)
+{
+    pthread_mutex_lock(&w->lock);
+    if (n > w->n || w->n - n > WARM_START_DISTANCE) {
+        warm_start_copy(dd, planes, false, w->planes);
+        w->n = n;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+
 static const VSFrame *VS_CC descale_get_frame(int n, int activation_reason, void *instance_data, void **frame_data, VSFrameContext *frame_ctx, VSCore *core, const VSAPI *vsapi)
 {
     struct VSDescaleData *d = (struct VSDescaleData *)instance_data;
@@ -77,53 +681,139 @@ static const VSFrame *VS_CC descale_get_frame(int n, int activation_reason, void
             vsapi->requestFrameFilter(n, d->ignore_mask_node, frame_ctx);
 
     } else if (activation_reason == arAllFramesReady) {
-        if (!d->initialized) {
-            pthread_mutex_lock(&d->lock);
-            if (!d->initialized) {
-                initialize_descale_data(&d->dd);
-                d->initialized = true;
-            }
-            pthread_mutex_unlock(&d->lock);
-        }
-
         const VSVideoFormat fmt = d->vi.format;
         const VSFrame *src = vsapi->getFrameFilter(n, d->node, frame_ctx);
         const VSFrame *ignore_mask = NULL;
         if (d->ignore_mask_node)
             ignore_mask = vsapi->getFrameFilter(n, d->ignore_mask_node, frame_ctx);
 
-        VSFrame *intermediate = vsapi->newVideoFrame(&fmt, d->dd.dst_width, d->dd.src_height, NULL, core);
-        VSFrame *dst = vsapi->newVideoFrame(&fmt, d->dd.dst_width, d->dd.dst_height, src, core);
+        struct DescaleData *dd = &d->dd;
+        struct GeometryEntry *entry = NULL;
+        struct DescaleGeometry geometry;
+
+        if (d->frame_props) {
+            read_geometry(d, vsapi->getFramePropertiesRO(src), &geometry, vsapi);
+            const char *error = check_geometry(d, &geometry);
+            if (error) {
+                vsapi->setFilterError(error, frame_ctx);
+                vsapi->freeFrame(src);
+                vsapi->freeFrame(ignore_mask);
+                return NULL;
+            }
 
-        for (int plane = 0; plane < d->dd.num_planes; plane++) {
-            int src_stride = vsapi->getStride(src, plane) / sizeof (float);
-            int dst_stride = vsapi->getStride(dst, plane) / sizeof (float);
-            const float *srcp = (const float *)vsapi->getReadPtr(src, plane);
-            float *dstp = (float *)vsapi->getWritePtr(dst, plane);
+            geometry_lookahead(d, n, &geometry);
+
+            entry = geometry_acquire(d, &geometry);
+            if (!entry) {
+                vsapi->setFilterError("Out of memory for the cores of a new geometry.", frame_ctx);
+                vsapi->freeFrame(src);
+                vsapi->freeFrame(ignore_mask);
+                return NULL;
+            }
+            dd = &entry->dd;
 
-            int imask_stride = 0;
-            const unsigned char *imaskp = NULL;
-            if (ignore_mask) {
-                imask_stride = vsapi->getStride(ignore_mask, plane);
-                imaskp = vsapi->getReadPtr(ignore_mask, plane);
+            // Nothing to do for this geometry
+            if (!dd->process_h && !dd->process_v) {
+                geometry_release(d, entry);
+                vsapi->freeFrame(ignore_mask);
+                return src;
             }
 
-            if (d->dd.process_h && d->dd.process_v) {
-                int intermediate_stride = vsapi->getStride(intermediate, plane) / sizeof (float);
-                float *intermediatep = (float *)vsapi->getWritePtr(intermediate, plane);
+        } else if (!d->initialized) {
+            unsigned long long wait_start = descale_time_ns();
+            pthread_mutex_lock(&d->lock);
+            descale_trace_event("wait for initialization", "wait", wait_start, descale_time_ns(), -1);
+            if (!d->initialized) {
+                initialize_descale_data(&d->dd);
+                d->initialized = true;
+            }
+            pthread_mutex_unlock(&d->lock);
+        }
 
-                d->dd.dsapi.process_vectors(d->dd.dscore_h[plane && d->dd.subsampling_h], DESCALE_DIR_HORIZONTAL, d->dd.src_height >> (plane ? d->dd.subsampling_v : 0), src_stride, 0, intermediate_stride, srcp, NULL, intermediatep);
-                d->dd.dsapi.process_vectors(d->dd.dscore_v[plane && d->dd.subsampling_v], DESCALE_DIR_VERTICAL, d->dd.dst_width >> (plane ? d->dd.subsampling_h : 0), intermediate_stride, 0, dst_stride, intermediatep, NULL, dstp);
+        unsigned long long start = descale_time_ns();
+        uint64_t hash[2];
+        const VSFrame *cached = NULL;
+        if (d->cache.size > 0) {
+            hash_frame(d, src, ignore_mask, entry ? &geometry : NULL, hash, vsapi);
+            cached = frame_cache_find(&d->cache, hash, vsapi);
+        }
 
-            } else if (d->dd.process_h) {
-                d->dd.dsapi.process_vectors(d->dd.dscore_h[plane && d->dd.subsampling_h], DESCALE_DIR_HORIZONTAL, d->dd.src_height >> (plane ? d->dd.subsampling_v : 0), src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+        VSFrame *dst;
+        struct DescalePlane planes[3] = {{0}};
+
+        if (cached) {
+            // Shares the data of the cached frame, but the properties have to come from the current source frame
+            dst = vsapi->copyFrame(cached, core);
+            VSMap *props = vsapi->getFramePropertiesRW(dst);
+            vsapi->clearMap(props);
+            vsapi->copyMap(vsapi->getFramePropertiesRO(src), props);
+
+        } else {
+            int width = dd->roi ? dd->roi_width : dd->dst_width;
+            int height = dd->roi ? dd->roi_height : dd->dst_height;
+            dst = vsapi->newVideoFrame(&fmt, width, height, src, core);
+
+            for (int plane = 0; plane < dd->num_planes; plane++) {
+                planes[plane].index = plane;
+                planes[plane].src_stride = vsapi->getStride(src, plane) / fmt.bytesPerSample;
+                planes[plane].dst_stride = vsapi->getStride(dst, plane) / fmt.bytesPerSample;
+                planes[plane].srcp = vsapi->getReadPtr(src, plane);
+                planes[plane].dstp = vsapi->getWritePtr(dst, plane);
+
+                planes[plane].imask_stride = 0;
+                planes[plane].imaskp = NULL;
+                if (ignore_mask) {
+                    planes[plane].imask_stride = vsapi->getStride(ignore_mask, plane);
+                    planes[plane].imaskp = vsapi->getReadPtr(ignore_mask, plane);
+                }
+            }
 
-            } else if (d->dd.process_v) {
-                d->dd.dsapi.process_vectors(d->dd.dscore_v[plane && d->dd.subsampling_v], DESCALE_DIR_VERTICAL, d->dd.src_width >> (plane ? d->dd.subsampling_h : 0), src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+            if (d->warm.planes[0])
+                warm_start_load(&d->warm, dd, n, planes);
+            process_planes(dd, planes);
+
+            bool rejected = false;
+            for (int plane = 0; plane < dd->num_planes; plane++)
+                rejected |= planes[plane].iterations < 0;
+            if (rejected) {
+                vsapi->setFilterError("Ignore mask hides more than a quarter of a plane, which is too much to descale along both axes.", frame_ctx);
+                vsapi->freeFrame(dst);
+                if (entry)
+                    geometry_release(d, entry);
+                vsapi->freeFrame(src);
+                vsapi->freeFrame(ignore_mask);
+                return NULL;
             }
+
+            if (d->warm.planes[0])
+                warm_start_store(&d->warm, dd, n, planes);
         }
 
-        vsapi->freeFrame(intermediate);
+        if (dd->stats)
+            set_stats_props(d, dd, planes, descale_time_ns() - start, cached != NULL, vsapi->getFramePropertiesRW(dst), vsapi);
+
+        // Report the effective bandwidth of the trimmed LDLT factors
+        if (dd->params.band_tolerance > 0.0 && !is_ewa_mode(dd->params.mode)) {
+            VSMap *props = vsapi->getFramePropertiesRW(dst);
+            int64_t bandwidth[3];
+            if (dd->process_h) {
+                for (int plane = 0; plane < dd->num_planes; plane++)
+                    bandwidth[plane] = dd->dscore_h[plane && dd->subsampling_h]->bandwidth;
+                vsapi->mapSetIntArray(props, "DescaleBandwidthH", bandwidth, dd->num_planes);
+            }
+            if (dd->process_v) {
+                for (int plane = 0; plane < dd->num_planes; plane++)
+                    bandwidth[plane] = dd->dscore_v[plane && dd->subsampling_v]->bandwidth;
+                vsapi->mapSetIntArray(props, "DescaleBandwidthV", bandwidth, dd->num_planes);
+            }
+        }
+
+        if (d->cache.size > 0 && !cached)
+            frame_cache_insert(&d->cache, hash, dst, vsapi);
+
+        if (entry)
+            geometry_release(d, entry);
+        vsapi->freeFrame(cached);
         vsapi->freeFrame(src);
         vsapi->freeFrame(ignore_mask);
 
@@ -142,21 +832,45 @@ static void VS_CC descale_free(void *instance_data, VSCore *core, const VSAPI *v
     vsapi->freeNode(d->ignore_mask_node);
     free(d->dd.params.post_conv);
 
-    if (d->initialized) {
-        if (d->dd.process_h) {
-            d->dd.dsapi.free_core(d->dd.dscore_h[0]);
-            if (d->dd.num_planes > 1 && d->dd.subsampling_h > 0)
-                d->dd.dsapi.free_core(d->dd.dscore_h[1]);
-        }
-        if (d->dd.process_v) {
-            d->dd.dsapi.free_core(d->dd.dscore_v[0]);
-            if (d->dd.num_planes > 1 && d->dd.subsampling_v > 0)
-                d->dd.dsapi.free_core(d->dd.dscore_v[1]);
+    if (d->initialized)
+        free_descale_data(&d->dd);
+
+    if (d->geometries) {
+        struct GeometryCache *c = d->geometries;
+        pthread_mutex_lock(&c->lock);
+        while (c->building > 0 || c->lookaheads > 0)
+            pthread_cond_wait(&c->built, &c->lock);
+        pthread_mutex_unlock(&c->lock);
+
+        for (int i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+            if (c->entries[i].used)
+                free_descale_data(&c->entries[i].dd);
         }
+        pthread_mutex_destroy(&c->lock);
+        pthread_cond_destroy(&c->built);
+        free(c);
     }
 
     pthread_mutex_destroy(&d->lock);
 
+    if (d->warm.planes[0]) {
+        for (int plane = 0; plane < d->dd.num_planes; plane++)
+            free(d->warm.planes[plane]);
+        pthread_mutex_destroy(&d->warm.lock);
+    }
+
+    if (d->cache.entries) {
+        for (int i = 0; i < d->cache.size; i++)
+            vsapi->freeFrame(d->cache.entries[i].frame);
+        free(d->cache.entries);
+        pthread_mutex_destroy(&d->cache.lock);
+    }
+
+    if (d->dd.parallel_planes)
+        descale_pool_release();
+    if (d->frame_props)
+        descale_pool_release();
+
     if (d->dd.params.mode == DESCALE_MODE_CUSTOM) {
         struct VSCustomKernelData *kd = (struct VSCustomKernelData *)d->dd.params.custom_kernel.user_data;
         vsapi->freeFunction(kd->custom_kernel);
@@ -245,6 +959,12 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
         case DESCALE_MODE_CUSTOM:
             funcname = params.upscale ? "ScaleCustom" : "Decustom";
             break;
+        case DESCALE_MODE_EWA_LANCZOS:
+            funcname = params.upscale ? "EwaLanczos" : "Deewalanczos";
+            break;
+        case DESCALE_MODE_EWA_JINC:
+            funcname = params.upscale ? "EwaJinc" : "Deewajinc";
+            break;
         default:
             vsapi->mapSetError(out, get_error("Descale", "Wrong API use!"));
             return;
@@ -259,8 +979,9 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
         return;
     }
 
-    if (vi.format.sampleType != stFloat || vi.format.bitsPerSample != 32) {
-        vsapi->mapSetError(out, get_error(funcname, "Only float32 input is supported."));
+    if ((vi.format.sampleType == stInteger && vi.format.bitsPerSample > 16)
+            || (vi.format.sampleType == stFloat && vi.format.bitsPerSample != 16 && vi.format.bitsPerSample != 32)) {
+        vsapi->mapSetError(out, get_error(funcname, "Only 8-16 bit integer, half float and float32 input is supported."));
         vsapi->freeNode(node);
         return;
     }
@@ -311,6 +1032,13 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
 
     int err;
 
+    d.frame_props = !!vsapi->mapGetInt(in, "frame_props", 0, &err);
+    if (err)
+        d.frame_props = false;
+
+    // With frame properties the output size may change from frame to frame
+    bool variable_size = d.frame_props && vi.width == 0 && vi.height == 0;
+
     d.ignore_mask_node = vsapi->mapGetNode(in, "ignore_mask", 0, &err);
     if (err) {
         d.ignore_mask_node = NULL;
@@ -348,10 +1076,12 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
     d.dd.active_width = vsapi->mapGetFloat(in, "src_width", 0, &err);
     if (err)
         d.dd.active_width = (double)(params.upscale ? d.dd.src_width : d.dd.dst_width);
+    d.geometry.active_width = err ? 0.0 : d.dd.active_width;
 
     d.dd.active_height = vsapi->mapGetFloat(in, "src_height", 0, &err);
     if (err)
         d.dd.active_height = (double)(params.upscale ? d.dd.src_height : d.dd.dst_height);
+    d.geometry.active_height = err ? 0.0 : d.dd.active_height;
 
     int border_handling = vsapi->mapGetIntSaturated(in, "border_handling", 0, &err);
     if (err)
@@ -374,31 +1104,28 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
     else
         opt_enum = DESCALE_OPT_AUTO;
 
-    if (d.ignore_mask_node || params.upscale)
-        opt_enum = DESCALE_OPT_NONE;
-
-    if (d.dd.dst_width < 1) {
+    if (!variable_size && d.dd.dst_width < 1) {
         vsapi->mapSetError(out, get_error(funcname, "width must be greater than 0."));
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
         return;
     }
 
-    if (d.dd.dst_height < 8) {
+    if (!variable_size && d.dd.dst_height < 8) {
         vsapi->mapSetError(out, get_error(funcname, "Output height must be greater than or equal to 8."));
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
         return;
     }
 
-    if (!params.upscale && (d.dd.dst_width > d.dd.src_width || d.dd.dst_height > d.dd.src_height)) {
+    if (!variable_size && !params.upscale && (d.dd.dst_width > d.dd.src_width || d.dd.dst_height > d.dd.src_height)) {
         vsapi->mapSetError(out, get_error(funcname, "Output dimension must be less than or equal to input dimension."));
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
         return;
     }
 
-    if (params.upscale && (d.dd.dst_width < d.dd.src_width || d.dd.dst_height < d.dd.src_height)) {
+    if (!variable_size && params.upscale && (d.dd.dst_width < d.dd.src_width || d.dd.dst_height < d.dd.src_height)) {
         vsapi->mapSetError(out, get_error(funcname, "Output dimension must be larger than or equal to input dimension."));
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
@@ -435,6 +1162,17 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
             vsapi->freeNode(d.ignore_mask_node);
             return;
         }
+    } else if (is_ewa_mode(params.mode)) {
+        params.taps = vsapi->mapGetIntSaturated(in, "taps", 0, &err);
+        if (err)
+            params.taps = 3;
+
+        if (params.taps < 1 || params.taps > 8) {
+            vsapi->mapSetError(out, get_error(funcname, "taps must be between 1 and 8."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
     }
 
     params.blur = vsapi->mapGetFloat(in, "blur", 0, &err);
@@ -458,17 +1196,154 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
 
     d.dd.process_h = d.dd.process_h || force_h;
     d.dd.process_v = d.dd.process_v || force_v;
+    // An EWA kernel does not factor into the axes, so there is no single-axis descale
+    if (is_ewa_mode(params.mode))
+        d.dd.process_h = d.dd.process_v = true;
+    d.force_h = force_h;
+    d.force_v = force_v;
+
+    // The single-axis masked solver and the horizontal upscaler for less than 8 rows only exist in C,
+    // the two-axis masked solver uses the SIMD solvers. Upscales without a horizontal pass keep SIMD,
+    // unless frame properties can add one.
+    bool upscale_h = params.upscale && (d.dd.process_h || d.frame_props);
+    if ((d.ignore_mask_node && (d.frame_props || !d.dd.process_h || !d.dd.process_v)) || (upscale_h && d.dd.src_height >> d.dd.subsampling_v < 8))
+        opt_enum = DESCALE_OPT_NONE;
+
+    // The arguments are the defaults for frames without descale properties
+    d.geometry.dst_width = d.dd.dst_width;
+    d.geometry.dst_height = d.dd.dst_height;
+    d.geometry.shift_h = d.dd.shift_h;
+    d.geometry.shift_v = d.dd.shift_v;
+    d.geometry.param1 = params.param1;
+    d.geometry.param2 = params.param2;
+    d.geometry.taps = params.taps;
+    d.geometry.blur = params.blur;
+
+    // The samples are converted while the solvers load and store them, so the output keeps the input format
+    if (vi.format.sampleType == stFloat)
+        d.dd.format.type = vi.format.bitsPerSample == 16 ? DESCALE_SAMPLE_HALF : DESCALE_SAMPLE_FLOAT;
+    else
+        d.dd.format.type = vi.format.bitsPerSample == 8 ? DESCALE_SAMPLE_U8 : DESCALE_SAMPLE_U16;
+    d.dd.format.bits = vi.format.bitsPerSample;
+    d.dd.format.dither = !!vsapi->mapGetInt(in, "dither", 0, &err);
+    if (err)
+        d.dd.format.dither = false;
+
+    const char *transfer = vsapi->mapGetData(in, "transfer", 0, &err);
+    if (err || string_is_equal_ignore_case(transfer, "linear")) {
+        d.dd.format.transfer = DESCALE_TRANSFER_LINEAR;
+    } else if (string_is_equal_ignore_case(transfer, "srgb")) {
+        d.dd.format.transfer = DESCALE_TRANSFER_SRGB;
+    } else if (string_is_equal_ignore_case(transfer, "bt1886")) {
+        d.dd.format.transfer = DESCALE_TRANSFER_BT1886;
+    } else if (string_is_equal_ignore_case(transfer, "pq")) {
+        d.dd.format.transfer = DESCALE_TRANSFER_PQ;
+    } else if (string_is_equal_ignore_case(transfer, "hlg")) {
+        d.dd.format.transfer = DESCALE_TRANSFER_HLG;
+    } else {
+        vsapi->mapSetError(out, get_error(funcname, "transfer must be linear, srgb, bt1886, pq or hlg."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        return;
+    }
+
+    // The curve is applied to every plane, which is only meaningful for RGB and gray
+    if (d.dd.format.transfer != DESCALE_TRANSFER_LINEAR && vi.format.colorFamily != cfRGB && vi.format.colorFamily != cfGray) {
+        vsapi->mapSetError(out, get_error(funcname, "transfer only supports RGB and gray input."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        return;
+    }
+
+    int roi_size = vsapi->mapNumElements(in, "roi");
+    if (roi_size > 0) {
+        if (d.dd.format.type != DESCALE_SAMPLE_FLOAT) {
+            vsapi->mapSetError(out, get_error(funcname, "roi only supports float32 input."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+        if (d.frame_props) {
+            vsapi->mapSetError(out, get_error(funcname, "roi can not be combined with frame_props."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+        if (roi_size != 4) {
+            vsapi->mapSetError(out, get_error(funcname, "roi must be [left, top, width, height]."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+        d.dd.roi = true;
+        d.dd.roi_left = vsapi->mapGetIntSaturated(in, "roi", 0, NULL);
+        d.dd.roi_top = vsapi->mapGetIntSaturated(in, "roi", 1, NULL);
+        d.dd.roi_width = vsapi->mapGetIntSaturated(in, "roi", 2, NULL);
+        d.dd.roi_height = vsapi->mapGetIntSaturated(in, "roi", 3, NULL);
+
+        if (d.dd.roi_left < 0 || d.dd.roi_top < 0 || d.dd.roi_width < 1 || d.dd.roi_height < 1
+                || d.dd.roi_left + d.dd.roi_width > d.dd.dst_width || d.dd.roi_top + d.dd.roi_height > d.dd.dst_height) {
+            vsapi->mapSetError(out, get_error(funcname, "roi must lie within the output frame."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+
+        int mask_h = (1 << d.dd.subsampling_h) - 1, mask_v = (1 << d.dd.subsampling_v) - 1;
+        if ((d.dd.roi_left & mask_h) || (d.dd.roi_width & mask_h) || (d.dd.roi_top & mask_v) || (d.dd.roi_height & mask_v)) {
+            vsapi->mapSetError(out, get_error(funcname, "roi and output subsampling are not compatible."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+
+        if (!d.dd.process_h && !d.dd.process_v) {
+            vsapi->mapSetError(out, get_error(funcname, "roi needs at least one axis to be processed, crop the clip instead."));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+
+        d.dd.roi_tolerance = vsapi->mapGetFloat(in, "roi_tolerance", 0, &err);
+        if (err)
+            d.dd.roi_tolerance = 1e-5;
+
+        d.vi.width = d.dd.roi_width;
+        d.vi.height = d.dd.roi_height;
+    }
 
     // Return the input clip if no processing is necessary
-    if (!d.dd.process_h && !d.dd.process_v) {
+    if (!d.dd.process_h && !d.dd.process_v && !d.frame_props) {
         vsapi->mapSetNode(out, "clip", d.node, maReplace);
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
         return;
     }
 
-    if (d.dd.process_h && d.dd.process_v && d.ignore_mask_node) {
-        vsapi->mapSetError(out, get_error(funcname, "Ignore mask is not supported when descaling along both axes."));
+    if (!variable_size && d.dd.process_h && d.dd.process_v && d.ignore_mask_node && d.dd.format.type != DESCALE_SAMPLE_FLOAT) {
+        vsapi->mapSetError(out, get_error(funcname, "Ignore mask along both axes only supports float32 input."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        return;
+    }
+
+    if (d.dd.roi && d.dd.process_h && d.dd.process_v && d.ignore_mask_node) {
+        vsapi->mapSetError(out, get_error(funcname, "roi can not be combined with an ignore mask along both axes."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        return;
+    }
+
+    d.dd.masked_iterations = vsapi->mapGetIntSaturated(in, "masked_iterations", 0, &err);
+    if (err)
+        d.dd.masked_iterations = 32;
+
+    d.dd.masked_tolerance = vsapi->mapGetFloat(in, "masked_tolerance", 0, &err);
+    if (err)
+        d.dd.masked_tolerance = 1e-5;
+
+    if (d.dd.masked_iterations < 1 || d.dd.masked_tolerance < 0.0) {
+        vsapi->mapSetError(out, get_error(funcname, "masked_iterations must be positive and masked_tolerance must not be negative."));
         vsapi->freeNode(d.node);
         vsapi->freeNode(d.ignore_mask_node);
         return;
@@ -486,6 +1361,28 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
         params.post_conv_size = 0;
     }
 
+    if (is_ewa_mode(params.mode)) {
+        const char *error = NULL;
+        if (d.dd.format.type != DESCALE_SAMPLE_FLOAT)
+            error = "EWA kernels only support float32 input.";
+        else if (d.dd.roi || d.frame_props || params.post_conv_size)
+            error = "EWA kernels can not be combined with roi, frame_props or post_conv.";
+        if (error) {
+            vsapi->mapSetError(out, get_error(funcname, error));
+            vsapi->freeNode(d.node);
+            vsapi->freeNode(d.ignore_mask_node);
+            return;
+        }
+    }
+
+    if (d.dd.format.transfer != DESCALE_TRANSFER_LINEAR
+            && (d.dd.roi || is_ewa_mode(params.mode) || (d.ignore_mask_node && d.dd.process_h && d.dd.process_v))) {
+        vsapi->mapSetError(out, get_error(funcname, "transfer can not be combined with roi, EWA kernels or an ignore mask along both axes."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        return;
+    }
+
     if (params.post_conv_size) {
         if (params.post_conv_size % 2 != 1) {
             vsapi->mapSetError(out, get_error(funcname, "Post-convolution kernel must have odd length."));
@@ -494,7 +1391,7 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
             return;
         }
 
-        if ((d.dd.process_h && params.post_conv_size > 2 * vi.width + 1) || (d.dd.process_v && params.post_conv_size > 2 * vi.height + 1)) {
+        if (!variable_size && ((d.dd.process_h && params.post_conv_size > 2 * vi.width + 1) || (d.dd.process_v && params.post_conv_size > 2 * vi.height + 1))) {
             vsapi->mapSetError(out, get_error(funcname, "Post-convolution kernel is too large, exceeds clip dimensions."));
             vsapi->freeNode(d.node);
             vsapi->freeNode(d.ignore_mask_node);
@@ -507,12 +1404,110 @@ static void VS_CC descale_create(const VSMap *in, VSMap *out, void *user_data, V
         }
     }
 
+    params.band_tolerance = vsapi->mapGetFloat(in, "band_tolerance", 0, &err);
+    if (err)
+        params.band_tolerance = 0.0;
+
+    if (params.band_tolerance < 0.0) {
+        vsapi->mapSetError(out, get_error(funcname, "band_tolerance must not be negative."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        free(params.post_conv);
+        return;
+    }
+
+    params.dense_threshold = vsapi->mapGetIntSaturated(in, "dense_threshold", 0, &err);
+    if (err)
+        params.dense_threshold = 0;
+
+    d.dd.stats = !!vsapi->mapGetInt(in, "stats", 0, &err);
+    if (err)
+        d.dd.stats = false;
+
+    d.dd.autotune = !!vsapi->mapGetInt(in, "autotune", 0, &err);
+    if (err)
+        d.dd.autotune = false;
+
+    d.cache.size = vsapi->mapGetIntSaturated(in, "cache_size", 0, &err);
+    if (err || d.cache.size < 0)
+        d.cache.size = 0;
+
+    d.dd.half_intermediate = !!vsapi->mapGetInt(in, "half_intermediate", 0, &err);
+    if (err)
+        d.dd.half_intermediate = false;
+
+    d.dd.parallel_planes = !!vsapi->mapGetInt(in, "parallel_planes", 0, &err);
+    if (err)
+        d.dd.parallel_planes = false;
+    if (d.dd.parallel_planes)
+        descale_pool_acquire();
+    // The cores of upcoming geometries are built on the workers
+    if (d.frame_props)
+        descale_pool_acquire();
+
     d.dd.dsapi = get_descale_api(opt_enum);
+    d.vsapi = vsapi;
     pthread_mutex_init(&d.lock, NULL);
 
     struct VSDescaleData *data = malloc(sizeof d);
+    if (!data) {
+        vsapi->mapSetError(out, get_error(funcname, "Out of memory for the filter state."));
+        vsapi->freeNode(d.node);
+        vsapi->freeNode(d.ignore_mask_node);
+        free(params.post_conv);
+        pthread_mutex_destroy(&d.lock);
+        if (d.dd.parallel_planes)
+            descale_pool_release();
+        if (d.frame_props)
+            descale_pool_release();
+        return;
+    }
     *data = d;
     data->dd.params = params;
+
+    // Only what was allocated gets a lock, so descale_free can clean up after a failure
+    bool allocated = true;
+    if (data->cache.size > 0) {
+        data->cache.entries = calloc(data->cache.size, sizeof (struct FrameCacheEntry));
+        if (data->cache.entries)
+            pthread_mutex_init(&data->cache.lock, NULL);
+        else
+            allocated = false;
+    }
+    if (data->ignore_mask_node && data->dd.process_h && data->dd.process_v && !data->frame_props) {
+        bool warm = true;
+        for (int plane = 0; plane < data->dd.num_planes; plane++) {
+            int width = data->dd.dst_width >> (plane ? data->dd.subsampling_h : 0);
+            int height = data->dd.dst_height >> (plane ? data->dd.subsampling_v : 0);
+            data->warm.planes[plane] = malloc((size_t)width * height * sizeof (float));
+            warm = warm && data->warm.planes[plane];
+        }
+        if (warm) {
+            data->warm.n = -1;
+            pthread_mutex_init(&data->warm.lock, NULL);
+        } else {
+            for (int plane = 0; plane < data->dd.num_planes; plane++) {
+                free(data->warm.planes[plane]);
+                data->warm.planes[plane] = NULL;
+            }
+            allocated = false;
+        }
+    }
+    if (data->frame_props) {
+        data->geometries = calloc(1, sizeof (struct GeometryCache));
+        if (data->geometries) {
+            pthread_mutex_init(&data->geometries->lock, NULL);
+            pthread_cond_init(&data->geometries->built, NULL);
+        } else {
+            allocated = false;
+        }
+    }
+    if (!allocated) {
+        vsapi->mapSetError(out, get_error(funcname, "Out of memory for the filter state."));
+        descale_free(data, core, vsapi);
+        return;
+    }
+
     VSFilterDependency deps[] = {{data->node, rpStrictSpatial}, {data->ignore_mask_node, rpStrictSpatial}};
     vsapi->createVideoFilter(out, funcname, &data->vi, descale_get_frame, descale_free, fmParallel, deps, data->ignore_mask_node ? 2 : 1, data, core);
 }
@@ -530,7 +1525,20 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
     "border_handling:int:opt;" \
     "ignore_mask:vnode:opt;" \
     "force:int:opt;force_h:int:opt;force_v:int:opt;" \
-    "opt:int:opt;", \
+    "opt:int:opt;" \
+    "band_tolerance:float:opt;" \
+    "dense_threshold:int:opt;" \
+    "parallel_planes:int:opt;" \
+    "half_intermediate:int:opt;" \
+    "dither:int:opt;" \
+    "transfer:data:opt;" \
+    "masked_iterations:int:opt;" \
+    "masked_tolerance:float:opt;" \
+    "stats:int:opt;" \
+    "autotune:int:opt;" \
+    "cache_size:int:opt;" \
+    "roi:int[]:opt;roi_tolerance:float:opt;" \
+    "frame_props:int:opt;", \
     "clip:vnode;"
 #define DESCALE_ALL_ARGS DESCALE_BASE_ARGS DESCALE_COM_OUT_ARGS
 
@@ -554,6 +1562,10 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
 
     DESCALE_REGISTER_FUNCTION("Decustom", "ScaleCustom", DESCALE_BASE_ARGS "custom_kernel:func;taps:int;" DESCALE_COM_OUT_ARGS, DESCALE_MODE_CUSTOM);
 
+    DESCALE_REGISTER_FUNCTION("Deewalanczos", "EwaLanczos", DESCALE_BASE_ARGS "taps:int:opt;" DESCALE_COM_OUT_ARGS, DESCALE_MODE_EWA_LANCZOS);
+
+    DESCALE_REGISTER_FUNCTION("Deewajinc", "EwaJinc", DESCALE_BASE_ARGS "taps:int:opt;" DESCALE_COM_OUT_ARGS, DESCALE_MODE_EWA_JINC);
+
 #undef DESCALE_REGISTER_FUNCTION
 #undef DESCALE_BASE_ARGS
 #undef DESCALE_COM_OUT_ARGS
@@ -13,6 +13,8 @@
     #include <cpuid.h>
 #endif
 
+#include <stdio.h>
+#include <string.h>
 #include "x86/cpuinfo_x86.h"
 
 
@@ -133,4 +135,35 @@ struct X86Capabilities query_x86_capabilities(void)
 }
 
 
+void query_x86_cpu_model(char *model, size_t size)
+{
+    int regs[4];
+    char name[49] = {0};
+
+    do_cpuid(regs, 0x80000000U, 0);
+    if ((unsigned)regs[0] >= 0x80000004U) {
+        for (int i = 0; i < 3; i++) {
+            do_cpuid(regs, 0x80000002U + i, 0);
+            memcpy(name + 16 * i, regs, 16);
+        }
+    } else {
+        do_cpuid(regs, 0, 0);
+        memcpy(name, regs + 1, 4);
+        memcpy(name + 4, regs + 3, 4);
+        memcpy(name + 8, regs + 2, 4);
+    }
+
+    // The brand string is padded with spaces on some CPUs
+    char *begin = name;
+    while (*begin == ' ')
+        begin++;
+    size_t length = strlen(begin);
+    while (length > 0 && begin[length - 1] == ' ')
+        length--;
+    begin[length] = '\0';
+
+    snprintf(model, size, "%s", begin);
+}
+
+
 #endif  // DESCALE_X86
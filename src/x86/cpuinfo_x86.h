@@ -10,6 +10,9 @@
 #define DESCALE_CPUINFO_X86_H
 
 
+#include <stddef.h>
+
+
 /*
  * Bitfield of selected x86 feature flags.
  */
@@ -51,6 +54,15 @@ struct X86Capabilities {
 struct X86Capabilities query_x86_capabilities(void);
 
 
+/*
+ * Get the processor brand string, or the vendor if there is none.
+ *
+ * @param model buffer to receive the name
+ * @param size size of the buffer
+ */
+void query_x86_cpu_model(char *model, size_t size);
+
+
 #endif  // DESCALE_CPUINFO_X86_H
 
 #endif  // DESCALE_X86
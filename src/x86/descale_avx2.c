@@ -24,12 +24,17 @@
 #if defined(DESCALE_X86) || defined(__ARM_NEON__)
 
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "simde/x86/avx2.h"
+#include "simde/x86/f16c.h"
 #include "simde/x86/fma.h"
 #include "simde/x86/sse.h"
 #include "common.h"
+#include "scratch.h"
 #include "x86/descale_avx2.h"
+#include "x86/jit_x86.h"
 
 
 // Taken from zimg https://github.com/sekrit-twc/zimg
@@ -98,6 +103,87 @@ static inline __attribute__((always_inline)) void transpose_line_8x8_ps(float *
 }
 
 
+/*
+ * Stores 8 rows of a block that was transposed back. With halfp they
+ * are converted to half floats and written there instead of to dstp.
+ */
+static inline __attribute__((always_inline)) void store_line8_ps(float * restrict dstp, uint16_t * restrict halfp, int dst_stride, int half_stride, int j,
+                                                                 simde__m256 x0, simde__m256 x1, simde__m256 x2, simde__m256 x3,
+                                                                 simde__m256 x4, simde__m256 x5, simde__m256 x6, simde__m256 x7)
+{
+    if (halfp) {
+        simde_mm_store_si128((simde__m128i *)(halfp + j), simde_mm256_cvtps_ph(x0, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 1 * half_stride + j), simde_mm256_cvtps_ph(x1, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 2 * half_stride + j), simde_mm256_cvtps_ph(x2, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 3 * half_stride + j), simde_mm256_cvtps_ph(x3, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 4 * half_stride + j), simde_mm256_cvtps_ph(x4, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 5 * half_stride + j), simde_mm256_cvtps_ph(x5, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 6 * half_stride + j), simde_mm256_cvtps_ph(x6, SIMDE_MM_FROUND_TO_NEAREST_INT));
+        simde_mm_store_si128((simde__m128i *)(halfp + 7 * half_stride + j), simde_mm256_cvtps_ph(x7, SIMDE_MM_FROUND_TO_NEAREST_INT));
+    } else {
+        simde_mm256_store_ps(dstp + j, x0);
+        simde_mm256_store_ps(dstp + 1 * dst_stride + j, x1);
+        simde_mm256_store_ps(dstp + 2 * dst_stride + j, x2);
+        simde_mm256_store_ps(dstp + 3 * dst_stride + j, x3);
+        simde_mm256_store_ps(dstp + 4 * dst_stride + j, x4);
+        simde_mm256_store_ps(dstp + 5 * dst_stride + j, x5);
+        simde_mm256_store_ps(dstp + 6 * dst_stride + j, x6);
+        simde_mm256_store_ps(dstp + 7 * dst_stride + j, x7);
+    }
+}
+
+
+/*
+ * Horizontal solver for diagonal systems (bandwidth 1).
+ * No forward or back substitution is needed, so the rows
+ * are transposed back right after the weighted sums.
+ */
+static void process_line8_h_b1_avx2(int width, int current_width, int current_height, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                    int weights_columns, float * restrict weights, float * restrict diagonal,
+                                    int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp,
+                                    uint16_t * restrict halfp, int half_stride)
+{
+    transpose_line_8x8_ps(temp, srcp, src_stride, 0, ceil_n(current_width, 8));
+    simde__m256 x0, x1, x2, x3, x4, x5, x6, x7;
+    simde__m256 a0, a1, di;
+    for (int j = 0; j < width; j += 8) {
+        x0 = simde_mm256_setzero_ps();
+        x1 = x0;
+        x2 = x0;
+        x3 = x0;
+        x4 = x0;
+        x5 = x0;
+        x6 = x0;
+        x7 = x0;
+
+#define MATMULT(x, a0, a1, wl_idx, wr_idx, w_col, weights, temp, j, m)\
+        for (int k = wl_idx[j + m]; k < wr_idx[j + m]; k++) {\
+            a0 = simde_mm256_set1_ps(weights[(j + m) * w_col + k - wl_idx[j + m]]);\
+            a1 = simde_mm256_load_ps(temp + k * 8);\
+            x = simde_mm256_fmadd_ps(a0, a1, x);\
+        }\
+        di = simde_mm256_set1_ps(diagonal[j + m]);\
+        x = simde_mm256_mul_ps(x, di);
+
+        // D^-1 A' b
+        MATMULT(x0, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 0);
+        MATMULT(x1, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 1);
+        MATMULT(x2, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 2);
+        MATMULT(x3, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 3);
+        MATMULT(x4, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 4);
+        MATMULT(x5, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 5);
+        MATMULT(x6, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 6);
+        MATMULT(x7, a0, a1, weights_left_idx, weights_right_idx, weights_columns, weights, temp, j, 7);
+
+#undef MATMULT
+
+        mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
+
+        store_line8_ps(dstp, halfp, dst_stride, half_stride, j, x0, x1, x2, x3, x4, x5, x6, x7);
+    }
+}
+
+
 /*
  * Horizontal solver that is specialized for systems with bandwidth 3.
  * It is faster than the generalized version, because it uses much
@@ -105,7 +191,8 @@ static inline __attribute__((always_inline)) void transpose_line_8x8_ps(float *
  */
 static void process_line8_h_b3_avx2(int width, int current_width, int current_height, int * restrict weights_left_idx, int * restrict weights_right_idx,
                                     int weights_columns, float * restrict weights, float * restrict lower, float * restrict upper, float * restrict diagonal,
-                                    int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+                                    int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp,
+                                    uint16_t * restrict halfp, int half_stride)
 {
     transpose_line_8x8_ps(temp, srcp, src_stride, 0, ceil_n(current_width, 8));
     simde__m256 x0, x1, x2, x3, x4, x5, x6, x7;
@@ -201,14 +288,7 @@ static void process_line8_h_b3_avx2(int width, int current_width, int current_he
 
         mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
 
-        simde_mm256_store_ps(dstp + j, x0);
-        simde_mm256_store_ps(dstp + 1 * dst_stride + j, x1);
-        simde_mm256_store_ps(dstp + 2 * dst_stride + j, x2);
-        simde_mm256_store_ps(dstp + 3 * dst_stride + j, x3);
-        simde_mm256_store_ps(dstp + 4 * dst_stride + j, x4);
-        simde_mm256_store_ps(dstp + 5 * dst_stride + j, x5);
-        simde_mm256_store_ps(dstp + 6 * dst_stride + j, x6);
-        simde_mm256_store_ps(dstp + 7 * dst_stride + j, x7);
+        store_line8_ps(dstp, halfp, dst_stride, half_stride, j, x0, x1, x2, x3, x4, x5, x6, x7);
     }
 }
 
@@ -220,7 +300,8 @@ static void process_line8_h_b3_avx2(int width, int current_width, int current_he
  */
 static void process_line8_h_b7_avx2(int width, int current_width, int current_height, int * restrict weights_left_idx, int * restrict weights_right_idx,
                                     int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
-                                    float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+                                    float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp,
+                                    uint16_t * restrict halfp, int half_stride)
 {
     transpose_line_8x8_ps(temp, srcp, src_stride, 0, ceil_n(current_width, 8));
     simde__m256 x0, x1, x2, x3, x4, x5, x6, x7;
@@ -348,14 +429,7 @@ static void process_line8_h_b7_avx2(int width, int current_width, int current_he
 
         mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
 
-        simde_mm256_store_ps(dstp + j, x0);
-        simde_mm256_store_ps(dstp + 1 * dst_stride + j, x1);
-        simde_mm256_store_ps(dstp + 2 * dst_stride + j, x2);
-        simde_mm256_store_ps(dstp + 3 * dst_stride + j, x3);
-        simde_mm256_store_ps(dstp + 4 * dst_stride + j, x4);
-        simde_mm256_store_ps(dstp + 5 * dst_stride + j, x5);
-        simde_mm256_store_ps(dstp + 6 * dst_stride + j, x6);
-        simde_mm256_store_ps(dstp + 7 * dst_stride + j, x7);
+        store_line8_ps(dstp, halfp, dst_stride, half_stride, j, x0, x1, x2, x3, x4, x5, x6, x7);
     }
 }
 
@@ -370,7 +444,8 @@ static void process_line8_h_b7_avx2(int width, int current_width, int current_he
 */
 static void process_line8_h_avx2(int width, int current_width, int current_height, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
                                  int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
-                                 float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+                                 float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp,
+                                 uint16_t * restrict halfp, int half_stride)
 {
     simde__m256 x0, x1, x2, x3, x4, x5, x6, x7;
     simde__m256 a0, a1, lo, up, di, x_last;
@@ -468,14 +543,31 @@ static void process_line8_h_avx2(int width, int current_width, int current_heigh
 
         mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
 
-        simde_mm256_store_ps(dstp + j, x0);
-        simde_mm256_store_ps(dstp + 1 * dst_stride + j, x1);
-        simde_mm256_store_ps(dstp + 2 * dst_stride + j, x2);
-        simde_mm256_store_ps(dstp + 3 * dst_stride + j, x3);
-        simde_mm256_store_ps(dstp + 4 * dst_stride + j, x4);
-        simde_mm256_store_ps(dstp + 5 * dst_stride + j, x5);
-        simde_mm256_store_ps(dstp + 6 * dst_stride + j, x6);
-        simde_mm256_store_ps(dstp + 7 * dst_stride + j, x7);
+        store_line8_ps(dstp, halfp, dst_stride, half_stride, j, x0, x1, x2, x3, x4, x5, x6, x7);
+    }
+}
+
+
+static void process_plane_h_b1_avx2(int width, int current_width, int current_height, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                    int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
+                                    float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+{
+    for (int i = 0; i < floor_n(current_height, 8); i += 8) {
+
+        process_line8_h_b1_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
+                                diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
+
+        srcp += src_stride * 8;
+        dstp += dst_stride * 8;
+    }
+
+    if (floor_n(current_height, 8) != current_height) {
+
+        srcp -= src_stride * (8 - (current_height - floor_n(current_height, 8)));
+        dstp -= dst_stride * (8 - (current_height - floor_n(current_height, 8)));
+
+        process_line8_h_b1_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
+                                diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
     }
 }
 
@@ -487,7 +579,7 @@ static void process_plane_h_b3_avx2(int width, int current_width, int current_he
     for (int i = 0; i < floor_n(current_height, 8); i += 8) {
 
         process_line8_h_b3_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
-                                lower[0], upper[0], diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                                lower[0], upper[0], diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
 
         srcp += src_stride * 8;
         dstp += dst_stride * 8;
@@ -499,7 +591,7 @@ static void process_plane_h_b3_avx2(int width, int current_width, int current_he
         dstp -= dst_stride * (8 - (current_height - floor_n(current_height, 8)));
 
         process_line8_h_b3_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
-                                lower[0], upper[0], diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                                lower[0], upper[0], diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
     }
 }
 
@@ -511,7 +603,7 @@ static void process_plane_h_b7_avx2(int width, int current_width, int current_he
     for (int i = 0; i < floor_n(current_height, 8); i += 8) {
 
         process_line8_h_b7_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
-                                lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                                lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
 
         srcp += src_stride * 8;
         dstp += dst_stride * 8;
@@ -523,7 +615,7 @@ static void process_plane_h_b7_avx2(int width, int current_width, int current_he
         dstp -= dst_stride * (8 - (current_height - floor_n(current_height, 8)));
 
         process_line8_h_b7_avx2(width, current_width, current_height, weights_left_idx, weights_right_idx, weights_columns, weights,
-                                lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                                lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
     }
 }
 
@@ -535,7 +627,7 @@ static void process_plane_h_avx2(int width, int current_width, int current_heigh
     for (int i = 0; i < floor_n(current_height, 8); i += 8) {
 
         process_line8_h_avx2(width, current_width, current_height, bandwidth, weights_left_idx, weights_right_idx, weights_columns, weights,
-                             lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                             lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
 
         srcp += src_stride * 8;
         dstp += dst_stride * 8;
@@ -547,7 +639,59 @@ static void process_plane_h_avx2(int width, int current_width, int current_heigh
         dstp -= dst_stride * (8 - (current_height - floor_n(current_height, 8)));
 
         process_line8_h_avx2(width, current_width, current_height, bandwidth, weights_left_idx, weights_right_idx, weights_columns, weights,
-                             lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp);
+                             lower, upper, diagonal, src_stride, dst_stride, srcp, dstp, temp, NULL, 0);
+    }
+}
+
+
+/*
+ * Vertical solver for diagonal systems (bandwidth 1).
+ * Every row only depends on the input, so there is no back substitution.
+ * This also processes dense cores, which can have very long rows,
+ * so four vectors share every weight broadcast.
+ */
+static void process_plane_v_b1_avx2(int height, int current_height, int current_width, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                    int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
+                                    float * restrict diagonal, int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
+{
+    simde__m256 x0, x1, x2, x3, a0, di;
+    for (int i = 0; i < height; i++) {
+        const float *w = weights + i * weights_columns - weights_left_idx[i];
+        di = simde_mm256_set1_ps(diagonal[i]);
+
+        int j = 0;
+        for (; j + 24 < current_width; j += 32) {
+            x0 = simde_mm256_setzero_ps();
+            x1 = x0;
+            x2 = x0;
+            x3 = x0;
+
+            // A' b
+            for (int k = weights_left_idx[i]; k < weights_right_idx[i]; k++) {
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j), x0);
+                x1 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 8), x1);
+                x2 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 16), x2);
+                x3 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 24), x3);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, simde_mm256_mul_ps(x0, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 8, simde_mm256_mul_ps(x1, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 16, simde_mm256_mul_ps(x2, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 24, simde_mm256_mul_ps(x3, di));
+        }
+
+        for (; j < current_width; j += 8) {
+            x0 = simde_mm256_setzero_ps();
+
+            // A' b
+            for (int k = weights_left_idx[i]; k < weights_right_idx[i]; k++) {
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j), x0);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, simde_mm256_mul_ps(x0, di));
+        }
     }
 }
 
@@ -746,37 +890,814 @@ static void process_plane_v_avx2(int height, int current_height, int current_wid
 }
 
 
+/*
+ * Horizontal upscaler. Like the descaling solvers it works on blocks of
+ * 8 rows that are transposed into temp, so every output sample is a dot
+ * product of contiguous weights and vectors, instead of a strided gather.
+ */
+static void process_line8_h_upscale_avx2(int width, int current_width, int * restrict weights_top_idx, int * restrict weights_bot_idx,
+                                         int scale_weights_columns, float * restrict scale_weights,
+                                         int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+{
+    transpose_line_8x8_ps(temp, srcp, src_stride, 0, ceil_n(current_width, 8));
+    simde__m256 x0, x1, x2, x3, x4, x5, x6, x7;
+    simde__m256 a0, a1;
+    for (int j = 0; j < width; j += 8) {
+        x0 = simde_mm256_setzero_ps();
+        x1 = x0;
+        x2 = x0;
+        x3 = x0;
+        x4 = x0;
+        x5 = x0;
+        x6 = x0;
+        x7 = x0;
+
+#define MATMULT(x, a0, a1, wt_idx, wb_idx, w_col, weights, temp, j, m)\
+        for (int k = wt_idx[j + m]; k < wb_idx[j + m]; k++) {\
+            a0 = simde_mm256_set1_ps(weights[(j + m) * w_col + k - wt_idx[j + m]]);\
+            a1 = simde_mm256_load_ps(temp + k * 8);\
+            x = simde_mm256_fmadd_ps(a0, a1, x);\
+        }
+
+        // A x
+        MATMULT(x0, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 0);
+        MATMULT(x1, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 1);
+        MATMULT(x2, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 2);
+        MATMULT(x3, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 3);
+        MATMULT(x4, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 4);
+        MATMULT(x5, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 5);
+        MATMULT(x6, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 6);
+        MATMULT(x7, a0, a1, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights, temp, j, 7);
+
+#undef MATMULT
+
+        mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
+
+        simde_mm256_store_ps(dstp + j, x0);
+        simde_mm256_store_ps(dstp + 1 * dst_stride + j, x1);
+        simde_mm256_store_ps(dstp + 2 * dst_stride + j, x2);
+        simde_mm256_store_ps(dstp + 3 * dst_stride + j, x3);
+        simde_mm256_store_ps(dstp + 4 * dst_stride + j, x4);
+        simde_mm256_store_ps(dstp + 5 * dst_stride + j, x5);
+        simde_mm256_store_ps(dstp + 6 * dst_stride + j, x6);
+        simde_mm256_store_ps(dstp + 7 * dst_stride + j, x7);
+    }
+}
+
+
+static void process_plane_h_upscale_avx2(int width, int current_width, int current_height, int * restrict weights_top_idx, int * restrict weights_bot_idx,
+                                         int scale_weights_columns, float * restrict scale_weights,
+                                         int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp, float * restrict temp)
+{
+    for (int i = 0; i < floor_n(current_height, 8); i += 8) {
+
+        process_line8_h_upscale_avx2(width, current_width, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights,
+                                     src_stride, dst_stride, srcp, dstp, temp);
+
+        srcp += src_stride * 8;
+        dstp += dst_stride * 8;
+    }
+
+    if (floor_n(current_height, 8) != current_height) {
+
+        srcp -= src_stride * (8 - (current_height - floor_n(current_height, 8)));
+        dstp -= dst_stride * (8 - (current_height - floor_n(current_height, 8)));
+
+        process_line8_h_upscale_avx2(width, current_width, weights_top_idx, weights_bot_idx, scale_weights_columns, scale_weights,
+                                     src_stride, dst_stride, srcp, dstp, temp);
+    }
+}
+
+
+/*
+ * Vertical upscaler. Every output row is a weighted sum of
+ * full input rows, so it simply streams rows with FMAs.
+ */
+static void process_plane_v_upscale_avx2(int height, int current_width, int * restrict weights_top_idx, int * restrict weights_bot_idx,
+                                         int scale_weights_columns, float * restrict scale_weights,
+                                         int src_stride, int dst_stride, const float * restrict srcp, float * restrict dstp)
+{
+    simde__m256 x0, x1, x2, x3, a0;
+    for (int i = 0; i < height; i++) {
+        const float *w = scale_weights + i * scale_weights_columns - weights_top_idx[i];
+
+        int j = 0;
+        for (; j + 24 < current_width; j += 32) {
+            x0 = simde_mm256_setzero_ps();
+            x1 = x0;
+            x2 = x0;
+            x3 = x0;
+
+            for (int k = weights_top_idx[i]; k < weights_bot_idx[i]; k++) {
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j), x0);
+                x1 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 8), x1);
+                x2 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 16), x2);
+                x3 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j + 24), x3);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, x0);
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 8, x1);
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 16, x2);
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 24, x3);
+        }
+
+        for (; j < current_width; j += 8) {
+            x0 = simde_mm256_setzero_ps();
+
+            for (int k = weights_top_idx[i]; k < weights_bot_idx[i]; k++) {
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, simde_mm256_load_ps(srcp + k * src_stride + j), x0);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, x0);
+        }
+    }
+}
+
+
 void descale_process_vectors_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
                                   int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp)
 {
-    if (dir == DESCALE_DIR_HORIZONTAL) {
-        float *temp;
+    unsigned long long start = descale_time_ns();
+    // Only picks a specialized solver if the core was not tuned to the generic one
+    int bandwidth = core->kernel[dir] == DESCALE_KERNEL_GENERIC ? 0 : core->bandwidth;
+
+    if (core->upscale) {
+        if (dir == DESCALE_DIR_HORIZONTAL) {
+            size_t mark = descale_scratch_mark();
+            float *temp = descale_scratch_alloc(ceil_n(core->dst_dim, 8) * 8 * sizeof (float), 32);
+
+            process_plane_h_upscale_avx2(core->src_dim, core->dst_dim, vector_count, core->weights_top_idx, core->weights_bot_idx,
+                                         core->scale_weights_columns, core->scale_weights, src_stride, dst_stride, srcp, dstp, temp);
+
+            descale_scratch_release(mark);
+        } else {
+            process_plane_v_upscale_avx2(core->src_dim, vector_count, core->weights_top_idx, core->weights_bot_idx,
+                                         core->scale_weights_columns, core->scale_weights, src_stride, dst_stride, srcp, dstp);
+        }
 
-        descale_aligned_malloc((void **)(&temp), ceil_n(core->src_dim, 8) * 8 * sizeof (float), 32);
+    } else if (dir == DESCALE_DIR_HORIZONTAL) {
+        size_t mark = descale_scratch_mark();
+        float *temp = descale_scratch_alloc(ceil_n(core->src_dim, 8) * 8 * sizeof (float), 32);
 
-        if (core->bandwidth == 3)
+        if (bandwidth == 1)
+            process_plane_h_b1_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
+                                    core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp);
+        else if (bandwidth == 3)
             process_plane_h_b3_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                     core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp);
-        else if (core->bandwidth == 7)
+        else if (bandwidth == 7)
             process_plane_h_b7_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                     core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp);
         else
             process_plane_h_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                  core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp);
 
-        descale_aligned_free(temp);
+        descale_scratch_release(mark);
+
+#ifdef DESCALE_X86
+    } else if (core->kernel[dir] == DESCALE_KERNEL_JIT && descale_jit_process_v(core, vector_count, src_stride, dst_stride, srcp, dstp)) {
+        // The generated code did all the work
+#endif
 
     } else {
-        if (core->bandwidth == 3)
+        if (bandwidth == 1)
+            process_plane_v_b1_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
+                                    core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
+        else if (bandwidth == 3)
             process_plane_v_b3_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                     core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
-        else if (core->bandwidth == 7)
+        else if (bandwidth == 7)
             process_plane_v_b7_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                     core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
         else
             process_plane_v_avx2(core->dst_dim, core->src_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx,
                                  core->weights_columns, core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp);
     }
+
+    descale_count_process(core, 1, vector_count, start);
+}
+
+
+static void process_line8_h_any_avx2(struct DescaleCore *core, int current_height, int src_stride, int dst_stride,
+                                     const float * restrict srcp, float * restrict dstp, float * restrict temp, uint16_t * restrict halfp, int half_stride)
+{
+    int bandwidth = core->kernel[DESCALE_DIR_HORIZONTAL] == DESCALE_KERNEL_GENERIC ? 0 : core->bandwidth;
+
+    if (bandwidth == 1)
+        process_line8_h_b1_avx2(core->dst_dim, core->src_dim, current_height, core->weights_left_idx, core->weights_right_idx, core->weights_columns,
+                                core->weights, core->diagonal, src_stride, dst_stride, srcp, dstp, temp, halfp, half_stride);
+    else if (bandwidth == 3)
+        process_line8_h_b3_avx2(core->dst_dim, core->src_dim, current_height, core->weights_left_idx, core->weights_right_idx, core->weights_columns,
+                                core->weights, core->lower[0], core->upper[0], core->diagonal, src_stride, dst_stride, srcp, dstp, temp, halfp, half_stride);
+    else if (bandwidth == 7)
+        process_line8_h_b7_avx2(core->dst_dim, core->src_dim, current_height, core->weights_left_idx, core->weights_right_idx, core->weights_columns,
+                                core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp, halfp, half_stride);
+    else
+        process_line8_h_avx2(core->dst_dim, core->src_dim, current_height, core->bandwidth, core->weights_left_idx, core->weights_right_idx, core->weights_columns,
+                             core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, srcp, dstp, temp, halfp, half_stride);
+}
+
+
+/*
+ * Horizontal solver for several planes sharing a core.
+ * The 8 row blocks of all planes are interleaved, so the weights and
+ * factors of a block are still in cache when the next plane uses them.
+ */
+static void process_planes_h_avx2(struct DescaleCore *core, int current_height, int num_planes, const int *src_strides, const int *dst_strides,
+                                  const float *const *srcps, float *const *dstps, float * restrict temp)
+{
+    for (int i = 0; i < floor_n(current_height, 8); i += 8) {
+        for (int p = 0; p < num_planes; p++)
+            process_line8_h_any_avx2(core, current_height, src_strides[p], dst_strides[p], srcps[p] + i * src_strides[p], dstps[p] + i * dst_strides[p], temp, NULL, 0);
+    }
+
+    if (floor_n(current_height, 8) != current_height) {
+        int i = current_height - 8;
+        for (int p = 0; p < num_planes; p++)
+            process_line8_h_any_avx2(core, current_height, src_strides[p], dst_strides[p], srcps[p] + i * src_strides[p], dstps[p] + i * dst_strides[p], temp, NULL, 0);
+    }
+}
+
+
+void descale_process_vectors_planes_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int num_planes,
+                                         const int *src_strides, const int *dst_strides, const float *const *srcps, float *const *dstps)
+{
+    // Sharing the weight broadcasts between planes made the vertical solver slower than the per-plane
+    // solvers, which also pick the specialized and generated kernels the core was tuned to
+    if (core->upscale || dir == DESCALE_DIR_VERTICAL) {
+        for (int p = 0; p < num_planes; p++)
+            descale_process_vectors_avx2(core, dir, vector_count, src_strides[p], 0, dst_strides[p], srcps[p], NULL, dstps[p]);
+        return;
+    }
+
+    unsigned long long start = descale_time_ns();
+    size_t mark = descale_scratch_mark();
+    float *temp = descale_scratch_alloc(ceil_n(core->src_dim, 8) * 8 * sizeof (float), 32);
+
+    process_planes_h_avx2(core, vector_count, num_planes, src_strides, dst_strides, srcps, dstps, temp);
+
+    descale_scratch_release(mark);
+    descale_count_process(core, num_planes, vector_count, start);
+}
+
+
+static inline __attribute__((always_inline)) simde__m256 load_half_ps(const uint16_t *p)
+{
+    return simde_mm256_cvtph_ps(simde_mm_load_si128((const simde__m128i *)p));
+}
+
+
+/*
+ * Horizontal solver that stores half floats. The solvers still work on
+ * single precision rows in block, only their final transposed stores
+ * convert to halves, so the rows in block never leave the cache.
+ */
+static void process_plane_h_half_avx2(struct DescaleCore *core, int current_height, int src_stride, int dst_stride,
+                                      const float * restrict srcp, uint16_t * restrict dstp, float * restrict temp, float * restrict block)
+{
+    int block_stride = ceil_n(core->dst_dim, 8);
+
+    for (int i = 0; i < current_height; i += 8) {
+        // The last block overlaps the previous one if the height is not a multiple of 8
+        int row = DSMIN(i, current_height - 8);
+        process_line8_h_any_avx2(core, current_height, src_stride, block_stride, srcp + row * src_stride, block, temp, dstp + row * dst_stride, dst_stride);
+    }
+}
+
+
+/*
+ * Vertical solver that loads half floats. Only A' b reads the
+ * intermediate, the substitutions run on the single precision output.
+ * Like the bandwidth 1 solver it shares every weight broadcast between
+ * four vectors, because the conversion adds to the cost of each load.
+ */
+static void process_plane_v_half_avx2(int height, int current_width, int bandwidth, int * restrict weights_left_idx, int * restrict weights_right_idx,
+                                      int weights_columns, float * restrict weights, float * restrict * restrict lower, float * restrict * restrict upper,
+                                      float * restrict diagonal, int src_stride, int dst_stride, const uint16_t * restrict srcp, float * restrict dstp)
+{
+    simde__m256 x0, x1, x2, x3, a0, lo, up, di;
+    int start;
+    int c = bandwidth / 2;
+
+    for (int i = 0; i < height; i++) {
+        const float *w = weights + i * weights_columns - weights_left_idx[i];
+        di = simde_mm256_set1_ps(diagonal[i]);
+        start = DSMAX(0, i - c);
+
+        int j = 0;
+        for (; j + 24 < current_width; j += 32) {
+            x0 = simde_mm256_setzero_ps();
+            x1 = x0;
+            x2 = x0;
+            x3 = x0;
+
+            // A' b
+            for (int k = weights_left_idx[i]; k < weights_right_idx[i]; k++) {
+                const uint16_t *s = srcp + k * src_stride + j;
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, load_half_ps(s), x0);
+                x1 = simde_mm256_fmadd_ps(a0, load_half_ps(s + 8), x1);
+                x2 = simde_mm256_fmadd_ps(a0, load_half_ps(s + 16), x2);
+                x3 = simde_mm256_fmadd_ps(a0, load_half_ps(s + 24), x3);
+            }
+
+            // Solve LD y = A' b
+            for (int k = start; k < i; k++) {
+                const float *d = dstp + k * dst_stride + j;
+                lo = simde_mm256_set1_ps(lower[k - i + c][i]);
+                x0 = simde_mm256_fnmadd_ps(lo, simde_mm256_load_ps(d), x0);
+                x1 = simde_mm256_fnmadd_ps(lo, simde_mm256_load_ps(d + 8), x1);
+                x2 = simde_mm256_fnmadd_ps(lo, simde_mm256_load_ps(d + 16), x2);
+                x3 = simde_mm256_fnmadd_ps(lo, simde_mm256_load_ps(d + 24), x3);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, simde_mm256_mul_ps(x0, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 8, simde_mm256_mul_ps(x1, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 16, simde_mm256_mul_ps(x2, di));
+            simde_mm256_store_ps(dstp + i * dst_stride + j + 24, simde_mm256_mul_ps(x3, di));
+        }
+
+        for (; j < current_width; j += 8) {
+            x0 = simde_mm256_setzero_ps();
+
+            // A' b
+            for (int k = weights_left_idx[i]; k < weights_right_idx[i]; k++) {
+                a0 = simde_mm256_set1_ps(w[k]);
+                x0 = simde_mm256_fmadd_ps(a0, load_half_ps(srcp + k * src_stride + j), x0);
+            }
+
+            // Solve LD y = A' b
+            for (int k = start; k < i; k++) {
+                lo = simde_mm256_set1_ps(lower[k - i + c][i]);
+                x0 = simde_mm256_fnmadd_ps(lo, simde_mm256_load_ps(dstp + k * dst_stride + j), x0);
+            }
+
+            simde_mm256_store_ps(dstp + i * dst_stride + j, simde_mm256_mul_ps(x0, di));
+        }
+    }
+
+    if (bandwidth == 1)
+        return;
+
+    // Solve L' x = y
+    for (int i = height - 2; i >= 0; i--) {
+        start = DSMIN(height - 1, i + c);
+
+        for (int j = 0; j < current_width; j += 8) {
+            x0 = simde_mm256_load_ps(dstp + i * dst_stride + j);
+            for (int k = start; k > i; k--) {
+                up = simde_mm256_set1_ps(upper[k - i - 1][i]);
+                x0 = simde_mm256_fnmadd_ps(up, simde_mm256_load_ps(dstp + k * dst_stride + j), x0);
+            }
+            simde_mm256_store_ps(dstp + i * dst_stride + j, x0);
+        }
+    }
+}
+
+
+void descale_process_vectors_half_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                       int src_stride, int dst_stride, const void *srcp, void *dstp)
+{
+    unsigned long long start = descale_time_ns();
+
+    if (dir == DESCALE_DIR_HORIZONTAL) {
+        size_t mark = descale_scratch_mark();
+        float *temp = descale_scratch_alloc(ceil_n(core->src_dim, 8) * 8 * sizeof (float), 32);
+        float *block = descale_scratch_alloc(ceil_n(core->dst_dim, 8) * 8 * sizeof (float), 32);
+
+        process_plane_h_half_avx2(core, vector_count, src_stride, dst_stride, (const float *)srcp, (uint16_t *)dstp, temp, block);
+
+        descale_scratch_release(mark);
+    } else {
+        process_plane_v_half_avx2(core->dst_dim, vector_count, core->bandwidth, core->weights_left_idx, core->weights_right_idx, core->weights_columns,
+                                  core->weights, core->lower, core->upper, core->diagonal, src_stride, dst_stride, (const uint16_t *)srcp, (float *)dstp);
+    }
+
+    descale_count_process(core, 1, vector_count, start);
+}
+
+
+/*
+ * Transfer functions
+ *
+ * The curves are built from a log2 and an exp2 approximation. log2
+ * splits off the exponent and evaluates the atanh series of the
+ * mantissa in [sqrt(0.5), sqrt(2)) up to t^9, exp2 splits off the
+ * integer part and evaluates the Taylor series of the rest in
+ * [-0.5, 0.5] up to degree 7, both with a truncation error below 1e-8.
+ * What remains is float rounding. Measured over every 7th float of
+ * [1e-6, 1] against the double precision curves, the decoded and
+ * encoded values of sRGB, BT.1886 and HLG stay within 5e-7 relative
+ * error. PQ encodes within 1.5e-5 and decodes within 2.5e-5 to linear
+ * values above 1e-6, 0.01 cd/m2. Its rational part cancels near 1 and
+ * near black, so below that the decoded values lose more digits, up to
+ * 1e-4 relative at 1e-11. Both are far below a code value at 16 bits,
+ * and libm powf in float does no better on PQ.
+ */
+// log2(x) split into the integer exponent, stored to e, and the log2 of the mantissa in [-0.5, 0.5]
+static inline __attribute__((always_inline)) simde__m256 mm256_log2_split_ps(simde__m256 x, simde__m256 *exponent)
+{
+    simde__m256 one = simde_mm256_set1_ps(1.0f);
+    simde__m256i bits = simde_mm256_castps_si256(simde_mm256_max_ps(x, simde_mm256_set1_ps(1.17549435e-38f)));
+    simde__m256i e = simde_mm256_sub_epi32(simde_mm256_srli_epi32(bits, 23), simde_mm256_set1_epi32(127));
+    simde__m256 m = simde_mm256_castsi256_ps(simde_mm256_or_si256(simde_mm256_and_si256(bits, simde_mm256_set1_epi32(0x007fffff)), simde_mm256_castps_si256(one)));
+
+    // Move the mantissa to [sqrt(0.5), sqrt(2)), the mask is -1 where the exponent grows by 1
+    simde__m256 big = simde_mm256_cmp_ps(m, simde_mm256_set1_ps(1.41421356f), SIMDE_CMP_GT_OQ);
+    m = simde_mm256_blendv_ps(m, simde_mm256_mul_ps(m, simde_mm256_set1_ps(0.5f)), big);
+    e = simde_mm256_sub_epi32(e, simde_mm256_castps_si256(big));
+
+    // log2(m) = 2 / ln(2) * atanh(t) with t = (m - 1) / (m + 1)
+    simde__m256 t = simde_mm256_div_ps(simde_mm256_sub_ps(m, one), simde_mm256_add_ps(m, one));
+    simde__m256 t2 = simde_mm256_mul_ps(t, t);
+    simde__m256 p = simde_mm256_fmadd_ps(t2, simde_mm256_set1_ps(0.32059889f), simde_mm256_set1_ps(0.41219857f));
+    p = simde_mm256_fmadd_ps(p, t2, simde_mm256_set1_ps(0.57707801f));
+    p = simde_mm256_fmadd_ps(p, t2, simde_mm256_set1_ps(0.96179669f));
+    p = simde_mm256_fmadd_ps(p, t2, simde_mm256_set1_ps(2.88539008f));
+    *exponent = simde_mm256_cvtepi32_ps(e);
+    return simde_mm256_mul_ps(p, t);
+}
+
+
+static inline __attribute__((always_inline)) simde__m256 mm256_log2_ps(simde__m256 x)
+{
+    simde__m256 e;
+    simde__m256 l = mm256_log2_split_ps(x, &e);
+    return simde_mm256_add_ps(e, l);
+}
+
+
+// 2^(n + f) for an integral n
+static inline __attribute__((always_inline)) simde__m256 mm256_exp2_split_ps(simde__m256 n, simde__m256 f)
+{
+    simde__m256 r = simde_mm256_round_ps(f, SIMDE_MM_FROUND_TO_NEAREST_INT | SIMDE_MM_FROUND_NO_EXC);
+    f = simde_mm256_sub_ps(f, r);
+    n = simde_mm256_min_ps(simde_mm256_max_ps(simde_mm256_add_ps(n, r), simde_mm256_set1_ps(-126.0f)), simde_mm256_set1_ps(127.0f));
+
+    simde__m256 p = simde_mm256_fmadd_ps(f, simde_mm256_set1_ps(1.52527338e-5f), simde_mm256_set1_ps(1.54035304e-4f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(1.33335581e-3f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(9.61812911e-3f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(5.55041087e-2f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(2.40226507e-1f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(6.93147181e-1f));
+    p = simde_mm256_fmadd_ps(p, f, simde_mm256_set1_ps(1.0f));
+
+    simde__m256i scale = simde_mm256_slli_epi32(simde_mm256_add_epi32(simde_mm256_cvtps_epi32(n), simde_mm256_set1_epi32(127)), 23);
+    return simde_mm256_mul_ps(p, simde_mm256_castsi256_ps(scale));
+}
+
+
+static inline __attribute__((always_inline)) simde__m256 mm256_exp2_ps(simde__m256 x)
+{
+    x = simde_mm256_min_ps(simde_mm256_max_ps(x, simde_mm256_set1_ps(-126.0f)), simde_mm256_set1_ps(127.0f));
+    return mm256_exp2_split_ps(simde_mm256_setzero_ps(), x);
+}
+
+
+/*
+ * x^y for x >= 0, 0 for all other x. The exponent is y * (e + l) with
+ * the split log2, y * e is split exactly into an integer and the rest
+ * with an fma and y into a float and its rounding error, so neither the
+ * rounding of a large product nor that of y is scaled up by e.
+ */
+static inline __attribute__((always_inline)) simde__m256 mm256_pow_ps(simde__m256 x, double y)
+{
+    simde__m256 y_hi = simde_mm256_set1_ps((float)y);
+    simde__m256 y_lo = simde_mm256_set1_ps((float)(y - (float)y));
+    simde__m256 e;
+    simde__m256 l = mm256_log2_split_ps(x, &e);
+
+    simde__m256 n = simde_mm256_round_ps(simde_mm256_mul_ps(y_hi, e), SIMDE_MM_FROUND_TO_NEAREST_INT | SIMDE_MM_FROUND_NO_EXC);
+    simde__m256 f = simde_mm256_fmsub_ps(y_hi, e, n);
+    f = simde_mm256_add_ps(f, simde_mm256_fmadd_ps(y_hi, l, simde_mm256_mul_ps(y_lo, simde_mm256_add_ps(e, l))));
+
+    simde__m256 r = mm256_exp2_split_ps(n, f);
+    return simde_mm256_and_ps(r, simde_mm256_cmp_ps(x, simde_mm256_setzero_ps(), SIMDE_CMP_GT_OQ));
+}
+
+
+// sign(x) * |x|^y
+static inline __attribute__((always_inline)) simde__m256 mm256_pow_mirrored_ps(simde__m256 x, double y)
+{
+    simde__m256 sign = simde_mm256_set1_ps(-0.0f);
+    return simde_mm256_or_ps(mm256_pow_ps(simde_mm256_andnot_ps(sign, x), y), simde_mm256_and_ps(x, sign));
+}
+
+
+// Same as descale_to_linear
+static inline __attribute__((always_inline)) simde__m256 mm256_to_linear_ps(simde__m256 v, enum DescaleTransfer transfer)
+{
+    simde__m256 zero = simde_mm256_setzero_ps();
+
+    switch (transfer) {
+        case DESCALE_TRANSFER_SRGB: {
+            simde__m256 curve = mm256_pow_ps(simde_mm256_mul_ps(simde_mm256_add_ps(v, simde_mm256_set1_ps(0.055f)), simde_mm256_set1_ps(1.0f / 1.055f)), 2.4);
+            simde__m256 low = simde_mm256_cmp_ps(v, simde_mm256_set1_ps(0.04045f), SIMDE_CMP_LE_OQ);
+            return simde_mm256_blendv_ps(curve, simde_mm256_mul_ps(v, simde_mm256_set1_ps(1.0f / 12.92f)), low);
+        }
+        case DESCALE_TRANSFER_BT1886:
+            return mm256_pow_mirrored_ps(v, 2.4);
+        case DESCALE_TRANSFER_PQ: {
+            // max_ps returns the second operand for NaN
+            v = simde_mm256_min_ps(simde_mm256_max_ps(v, zero), simde_mm256_set1_ps(1.0f));
+            simde__m256 p = mm256_pow_ps(v, 1.0 / DESCALE_PQ_M2);
+            simde__m256 num = simde_mm256_max_ps(simde_mm256_sub_ps(p, simde_mm256_set1_ps(DESCALE_PQ_C1)), zero);
+            simde__m256 den = simde_mm256_fnmadd_ps(p, simde_mm256_set1_ps(DESCALE_PQ_C3), simde_mm256_set1_ps(DESCALE_PQ_C2));
+            return mm256_pow_ps(simde_mm256_div_ps(num, den), 1.0 / DESCALE_PQ_M1);
+        }
+        case DESCALE_TRANSFER_HLG: {
+            v = simde_mm256_max_ps(v, zero);
+            simde__m256 e = mm256_exp2_ps(simde_mm256_mul_ps(simde_mm256_sub_ps(v, simde_mm256_set1_ps(DESCALE_HLG_C)), simde_mm256_set1_ps(1.44269504f / DESCALE_HLG_A)));
+            simde__m256 curve = simde_mm256_mul_ps(simde_mm256_add_ps(e, simde_mm256_set1_ps(DESCALE_HLG_B)), simde_mm256_set1_ps(1.0f / 12.0f));
+            simde__m256 low = simde_mm256_cmp_ps(v, simde_mm256_set1_ps(0.5f), SIMDE_CMP_LE_OQ);
+            return simde_mm256_blendv_ps(curve, simde_mm256_mul_ps(simde_mm256_mul_ps(v, v), simde_mm256_set1_ps(1.0f / 3.0f)), low);
+        }
+        default:
+            return v;
+    }
+}
+
+
+// Same as descale_from_linear
+static inline __attribute__((always_inline)) simde__m256 mm256_from_linear_ps(simde__m256 v, enum DescaleTransfer transfer)
+{
+    simde__m256 zero = simde_mm256_setzero_ps();
+
+    switch (transfer) {
+        case DESCALE_TRANSFER_SRGB: {
+            simde__m256 curve = simde_mm256_fmsub_ps(mm256_pow_ps(v, 1.0 / 2.4), simde_mm256_set1_ps(1.055f), simde_mm256_set1_ps(0.055f));
+            simde__m256 low = simde_mm256_cmp_ps(v, simde_mm256_set1_ps(0.0031308f), SIMDE_CMP_LE_OQ);
+            return simde_mm256_blendv_ps(curve, simde_mm256_mul_ps(v, simde_mm256_set1_ps(12.92f)), low);
+        }
+        case DESCALE_TRANSFER_BT1886:
+            return mm256_pow_mirrored_ps(v, 1.0 / 2.4);
+        case DESCALE_TRANSFER_PQ: {
+            v = simde_mm256_min_ps(simde_mm256_max_ps(v, zero), simde_mm256_set1_ps(1.0f));
+            simde__m256 y = mm256_pow_ps(v, DESCALE_PQ_M1);
+            simde__m256 num = simde_mm256_fmadd_ps(y, simde_mm256_set1_ps(DESCALE_PQ_C2), simde_mm256_set1_ps(DESCALE_PQ_C1));
+            simde__m256 den = simde_mm256_fmadd_ps(y, simde_mm256_set1_ps(DESCALE_PQ_C3), simde_mm256_set1_ps(1.0f));
+            return mm256_pow_ps(simde_mm256_div_ps(num, den), DESCALE_PQ_M2);
+        }
+        case DESCALE_TRANSFER_HLG: {
+            v = simde_mm256_max_ps(v, zero);
+            simde__m256 l = mm256_log2_ps(simde_mm256_fmsub_ps(v, simde_mm256_set1_ps(12.0f), simde_mm256_set1_ps(DESCALE_HLG_B)));
+            simde__m256 curve = simde_mm256_fmadd_ps(l, simde_mm256_set1_ps(DESCALE_HLG_A * 0.693147181f), simde_mm256_set1_ps(DESCALE_HLG_C));
+            simde__m256 low = simde_mm256_cmp_ps(v, simde_mm256_set1_ps(1.0f / 12.0f), SIMDE_CMP_LE_OQ);
+            return simde_mm256_blendv_ps(curve, simde_mm256_sqrt_ps(simde_mm256_mul_ps(v, simde_mm256_set1_ps(3.0f))), low);
+        }
+        default:
+            return v;
+    }
+}
+
+
+// Converts n samples to or from linear light, the tail goes through the same approximation as the rest
+static inline __attribute__((always_inline)) void transfer_row(const float *srcp, float *dstp, int n, enum DescaleTransfer transfer, bool to_linear)
+{
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        simde__m256 v = simde_mm256_loadu_ps(srcp + x);
+        simde_mm256_storeu_ps(dstp + x, to_linear ? mm256_to_linear_ps(v, transfer) : mm256_from_linear_ps(v, transfer));
+    }
+
+    if (x < n) {
+        float tail[8] = {0};
+        memcpy(tail, srcp + x, (n - x) * sizeof (float));
+        simde__m256 v = simde_mm256_loadu_ps(tail);
+        simde_mm256_storeu_ps(tail, to_linear ? mm256_to_linear_ps(v, transfer) : mm256_from_linear_ps(v, transfer));
+        memcpy(dstp + x, tail, (n - x) * sizeof (float));
+    }
+}
+
+
+// One loop per curve, so that the curve is not chosen again for every vector
+static void transfer_row_avx2(const float *srcp, float *dstp, int n, enum DescaleTransfer transfer, bool to_linear)
+{
+    switch (transfer) {
+        case DESCALE_TRANSFER_SRGB:
+            transfer_row(srcp, dstp, n, DESCALE_TRANSFER_SRGB, to_linear);
+            break;
+        case DESCALE_TRANSFER_BT1886:
+            transfer_row(srcp, dstp, n, DESCALE_TRANSFER_BT1886, to_linear);
+            break;
+        case DESCALE_TRANSFER_PQ:
+            transfer_row(srcp, dstp, n, DESCALE_TRANSFER_PQ, to_linear);
+            break;
+        case DESCALE_TRANSFER_HLG:
+            transfer_row(srcp, dstp, n, DESCALE_TRANSFER_HLG, to_linear);
+            break;
+        default:
+            if (srcp != dstp)
+                memcpy(dstp, srcp, n * sizeof (float));
+    }
+}
+
+
+void descale_load_row_avx2(const void *srcp, float *dstp, int n, const struct DescaleSampleFormat *format)
+{
+    float scale = 1.0f / descale_sample_peak(format);
+    simde__m256 s = simde_mm256_set1_ps(scale);
+    int x = 0;
+
+    if (format->type == DESCALE_SAMPLE_U8) {
+        for (; x + 8 <= n; x += 8) {
+            simde__m128i v = simde_mm_loadl_epi64((const simde__m128i *)((const uint8_t *)srcp + x));
+            simde_mm256_storeu_ps(dstp + x, simde_mm256_mul_ps(simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(v)), s));
+        }
+    } else if (format->type == DESCALE_SAMPLE_U16) {
+        for (; x + 8 <= n; x += 8) {
+            simde__m128i v = simde_mm_loadu_si128((const simde__m128i *)((const uint16_t *)srcp + x));
+            simde_mm256_storeu_ps(dstp + x, simde_mm256_mul_ps(simde_mm256_cvtepi32_ps(simde_mm256_cvtepu16_epi32(v)), s));
+        }
+    } else if (format->type == DESCALE_SAMPLE_HALF) {
+        for (; x + 8 <= n; x += 8)
+            simde_mm256_storeu_ps(dstp + x, simde_mm256_cvtph_ps(simde_mm_loadu_si128((const simde__m128i *)((const uint16_t *)srcp + x))));
+    } else {
+        for (; x + 8 <= n; x += 8)
+            simde_mm256_storeu_ps(dstp + x, simde_mm256_loadu_ps((const float *)srcp + x));
+    }
+
+    for (; x < n; x++)
+        dstp[x] = descale_load_sample(srcp, x, format, scale);
+
+    // The row is still in the cache
+    if (format->transfer != DESCALE_TRANSFER_LINEAR)
+        transfer_row_avx2(dstp, dstp, n, format->transfer, true);
+}
+
+
+#define STORE_BLOCK_SAMPLES 256
+
+/*
+ * Same rounding as the C version: scale, add the dither, clamp and
+ * convert with the default rounding to nearest even. The dither
+ * pattern repeats every 8 columns, so one vector covers all of them.
+ * Samples with a transfer function are encoded in blocks on the stack
+ * first, since srcp must not be changed.
+ */
+void descale_store_row_avx2(const float *srcp, void *dstp, int n, int x0, int y, const struct DescaleSampleFormat *format)
+{
+    if (format->transfer != DESCALE_TRANSFER_LINEAR) {
+        struct DescaleSampleFormat linear = *format;
+        linear.transfer = DESCALE_TRANSFER_LINEAR;
+        float block[STORE_BLOCK_SAMPLES];
+        size_t size = descale_sample_size(format->type);
+        for (int x = 0; x < n; x += STORE_BLOCK_SAMPLES) {
+            int count = DSMIN(STORE_BLOCK_SAMPLES, n - x);
+            transfer_row_avx2(srcp + x, block, count, format->transfer, false);
+            descale_store_row_avx2(block, (unsigned char *)dstp + x * size, count, x0 + x, y, &linear);
+        }
+        return;
+    }
+
+    float peak = descale_sample_peak(format);
+    float dither[8];
+    for (int k = 0; k < 8; k++)
+        dither[k] = format->dither ? descale_dither_offset(x0 + k, y) : 0.0f;
+    int x = 0;
+
+    if (format->type == DESCALE_SAMPLE_HALF) {
+        for (; x + 8 <= n; x += 8) {
+            simde__m128i h = simde_mm256_cvtps_ph(simde_mm256_loadu_ps(srcp + x), SIMDE_MM_FROUND_TO_NEAREST_INT);
+            simde_mm_storeu_si128((simde__m128i *)((uint16_t *)dstp + x), h);
+        }
+    } else if (format->type == DESCALE_SAMPLE_FLOAT) {
+        for (; x + 8 <= n; x += 8)
+            simde_mm256_storeu_ps((float *)dstp + x, simde_mm256_loadu_ps(srcp + x));
+    } else {
+        simde__m256 p = simde_mm256_set1_ps(peak);
+        simde__m256 d = simde_mm256_loadu_ps(dither);
+        simde__m256 zero = simde_mm256_setzero_ps();
+
+        for (; x + 8 <= n; x += 8) {
+            simde__m256 v = simde_mm256_add_ps(simde_mm256_mul_ps(simde_mm256_loadu_ps(srcp + x), p), d);
+            // max_ps returns the second operand for NaN
+            v = simde_mm256_min_ps(simde_mm256_max_ps(v, zero), p);
+            simde__m256i i = simde_mm256_cvtps_epi32(v);
+            simde__m128i w = simde_mm_packus_epi32(simde_mm256_castsi256_si128(i), simde_mm256_extracti128_si256(i, 1));
+            if (format->type == DESCALE_SAMPLE_U8)
+                simde_mm_storel_epi64((simde__m128i *)((uint8_t *)dstp + x), simde_mm_packus_epi16(w, w));
+            else
+                simde_mm_storeu_si128((simde__m128i *)((uint16_t *)dstp + x), w);
+        }
+    }
+
+    for (; x < n; x++)
+        descale_store_sample(dstp, x, srcp[x], format, peak, dither[x & 7]);
+}
+
+
+/*
+ * Up to 8 pairs with the same table offset are processed at once, one
+ * pair per lane. Their input rows are transposed so that every column
+ * entry is one broadcast weight and one aligned load of 8 inputs, which
+ * avoids gathers. The output lanes are transposed back and added to their
+ * rows one lane after the other, since clamped borders can make pairs of
+ * a group share the output row.
+ */
+void descale_ewa_product_avx2(const struct DescaleEwaMap *map, const float *table, int src_stride, const float *srcp, int dst_stride, float *dstp)
+{
+    size_t mark = descale_scratch_mark();
+    float *in_t = descale_scratch_alloc((size_t)ceil_n(map->inputs, 8) * 8 * sizeof (float), 64);
+    float *out_t = descale_scratch_alloc((size_t)ceil_n(map->columns, 8) * 8 * sizeof (float), 64);
+
+    for (int y = 0; y < map->rows; y++)
+        memset(dstp + (size_t)y * dst_stride, 0, map->columns * sizeof (float));
+
+    for (int p = 0; p < map->pair_count;) {
+        const int *pair = map->pairs + 5 * p;
+        int n = 1;
+        while (n < 8 && p + n < map->pair_count && pair[5 * n + 2] == pair[2])
+            n++;
+
+        // Lanes without a pair read the first row and are not stored
+        const float *src[8];
+        for (int l = 0; l < 8; l++)
+            src[l] = srcp + (size_t)pair[5 * (l < n ? l : 0)] * src_stride;
+
+        int i = 0;
+        for (; i + 8 <= map->inputs; i += 8) {
+            simde__m256 x0 = simde_mm256_loadu_ps(src[0] + i);
+            simde__m256 x1 = simde_mm256_loadu_ps(src[1] + i);
+            simde__m256 x2 = simde_mm256_loadu_ps(src[2] + i);
+            simde__m256 x3 = simde_mm256_loadu_ps(src[3] + i);
+            simde__m256 x4 = simde_mm256_loadu_ps(src[4] + i);
+            simde__m256 x5 = simde_mm256_loadu_ps(src[5] + i);
+            simde__m256 x6 = simde_mm256_loadu_ps(src[6] + i);
+            simde__m256 x7 = simde_mm256_loadu_ps(src[7] + i);
+            mm256_transpose8_ps(&x0, &x1, &x2, &x3, &x4, &x5, &x6, &x7);
+            simde_mm256_store_ps(in_t + (i + 0) * 8, x0);
+            simde_mm256_store_ps(in_t + (i + 1) * 8, x1);
+            simde_mm256_store_ps(in_t + (i + 2) * 8, x2);
+            simde_mm256_store_ps(in_t + (i + 3) * 8, x3);
+            simde_mm256_store_ps(in_t + (i + 4) * 8, x4);
+            simde_mm256_store_ps(in_t + (i + 5) * 8, x5);
+            simde_mm256_store_ps(in_t + (i + 6) * 8, x6);
+            simde_mm256_store_ps(in_t + (i + 7) * 8, x7);
+        }
+        for (; i < map->inputs; i++) {
+            for (int l = 0; l < 8; l++)
+                in_t[i * 8 + l] = src[l][i];
+        }
+
+        // Four columns at once, so that the sums do not wait on each other
+        const float *w = table + pair[2];
+        int x = 0;
+        for (; x + 4 <= map->columns; x += 4) {
+            const int *index = map->column_index + (size_t)x * map->entries;
+            const int *weight = map->column_weight + (size_t)x * map->entries;
+            int e = map->entries;
+            simde__m256 sum0 = simde_mm256_setzero_ps();
+            simde__m256 sum1 = simde_mm256_setzero_ps();
+            simde__m256 sum2 = simde_mm256_setzero_ps();
+            simde__m256 sum3 = simde_mm256_setzero_ps();
+            for (int k = pair[3]; k < pair[4]; k++) {
+                sum0 = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[weight[k]]), simde_mm256_load_ps(in_t + index[k] * 8), sum0);
+                sum1 = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[weight[e + k]]), simde_mm256_load_ps(in_t + index[e + k] * 8), sum1);
+                sum2 = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[weight[2 * e + k]]), simde_mm256_load_ps(in_t + index[2 * e + k] * 8), sum2);
+                sum3 = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[weight[3 * e + k]]), simde_mm256_load_ps(in_t + index[3 * e + k] * 8), sum3);
+            }
+            simde_mm256_store_ps(out_t + (x + 0) * 8, sum0);
+            simde_mm256_store_ps(out_t + (x + 1) * 8, sum1);
+            simde_mm256_store_ps(out_t + (x + 2) * 8, sum2);
+            simde_mm256_store_ps(out_t + (x + 3) * 8, sum3);
+        }
+        for (; x < map->columns; x++) {
+            simde__m256 sum = simde_mm256_setzero_ps();
+            for (int k = pair[3]; k < pair[4]; k++) {
+                const float *in = in_t + (size_t)map->column_index[x * map->entries + k] * 8;
+                sum = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[map->column_weight[x * map->entries + k]]), simde_mm256_load_ps(in), sum);
+            }
+            simde_mm256_store_ps(out_t + x * 8, sum);
+        }
+        for (int k = 0; k < map->extra_count; k++) {
+            const int *extra = map->extra + 3 * k;
+            simde__m256 sum = simde_mm256_load_ps(out_t + extra[0] * 8);
+            sum = simde_mm256_fmadd_ps(simde_mm256_set1_ps(w[extra[2]]), simde_mm256_load_ps(in_t + extra[1] * 8), sum);
+            simde_mm256_store_ps(out_t + extra[0] * 8, sum);
+        }
+
+        for (x = 0; x + 8 <= map->columns; x += 8) {
+            simde__m256 out[8];
+            for (int j = 0; j < 8; j++)
+                out[j] = simde_mm256_load_ps(out_t + (x + j) * 8);
+            mm256_transpose8_ps(&out[0], &out[1], &out[2], &out[3], &out[4], &out[5], &out[6], &out[7]);
+            for (int l = 0; l < n; l++) {
+                float *dst = dstp + (size_t)pair[5 * l + 1] * dst_stride + x;
+                simde_mm256_storeu_ps(dst, simde_mm256_add_ps(simde_mm256_loadu_ps(dst), out[l]));
+            }
+        }
+        for (; x < map->columns; x++) {
+            for (int l = 0; l < n; l++)
+                dstp[(size_t)pair[5 * l + 1] * dst_stride + x] += out_t[x * 8 + l];
+        }
+
+        p += n;
+    }
+
+    descale_scratch_release(mark);
 }
 
 
@@ -33,6 +33,18 @@
 void descale_process_vectors_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
                                   int src_stride, int imask_stride, int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp);
 
+void descale_process_vectors_planes_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count, int num_planes,
+                                         const int *src_strides, const int *dst_strides, const float *const *srcps, float *const *dstps);
+
+void descale_process_vectors_half_avx2(struct DescaleCore *core, enum DescaleDir dir, int vector_count,
+                                       int src_stride, int dst_stride, const void *srcp, void *dstp);
+
+void descale_load_row_avx2(const void *srcp, float *dstp, int n, const struct DescaleSampleFormat *format);
+
+void descale_store_row_avx2(const float *srcp, void *dstp, int n, int x, int y, const struct DescaleSampleFormat *format);
+
+void descale_ewa_product_avx2(const struct DescaleEwaMap *map, const float *table, int src_stride, const float *srcp, int dst_stride, float *dstp);
+
 
 #endif  // DESCALE_AVX2_H
 #endif  // DESCALE_X86
@@ -0,0 +1,426 @@
+/*
+ * Generator of straight-line AVX2 code for the vertical solver.
+ *
+ * The static kernels load the weight indices and factors of every row
+ * and reload the previous rows of the substitution from memory. With
+ * the core known in advance, the generated code has all loop bounds
+ * and offsets resolved, reads the coefficients from a constant pool
+ * next to the code, and keeps the last bandwidth / 2 + 1 rows of a
+ * column block in a ring of ymm registers.
+ *
+ * The generated function processes blocks of 8 or 16 columns:
+ *     void f(const float *src, float *dst, intptr_t blocks)
+ * Row offsets are encoded as displacements, so the code is specific to
+ * a pair of strides. A core keeps a few of these variants.
+ */
+
+
+#ifdef DESCALE_X86
+
+
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
+#define _DARWIN_C_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "descale.h"
+#include "x86/jit_x86.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+    #define DESCALE_JIT
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+
+#ifdef DESCALE_JIT
+
+
+#define JIT_MAX_VARIANTS 8
+#define JIT_MAX_CODE_SIZE (16 << 20)
+
+// ModRM base registers
+#define REG_RSI 6
+#define REG_RDI 7
+#define REG_RIP -1
+
+// VEX opcode maps and prefixes
+#define MAP_0F 1
+#define MAP_0F38 2
+#define PP_NONE 0
+#define PP_66 1
+
+
+typedef void (*JitFunc)(const float *srcp, float *dstp, intptr_t blocks);
+
+
+struct JitVariant
+{
+    int src_stride;
+    int dst_stride;
+    int lanes;          // ymm registers per row, the function processes 8 * lanes columns per block
+    JitFunc func;       // NULL if generation failed
+    void *mem;
+    size_t mem_size;
+};
+
+
+struct DescaleJit
+{
+    int count;
+    struct JitVariant variants[JIT_MAX_VARIANTS];
+};
+
+
+struct JitFixup
+{
+    size_t pos;         // position of the disp32 of a rip-relative operand
+    int constant;
+};
+
+
+struct JitBuffer
+{
+    unsigned char *code;
+    size_t size, capacity;
+    float *constants;
+    int num_constants, constants_capacity;
+    struct JitFixup *fixups;
+    int num_fixups, fixups_capacity;
+    bool failed;
+};
+
+
+static pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *grow(void *p, int *capacity, int needed, size_t element_size, bool *failed)
+{
+    if (needed <= *capacity)
+        return p;
+    int new_capacity = DSMAX(needed, *capacity * 2);
+    void *q = realloc(p, (size_t)new_capacity * element_size);
+    if (!q) {
+        *failed = true;
+        return p;
+    }
+    *capacity = new_capacity;
+    return q;
+}
+
+
+static void emit_byte(struct JitBuffer *b, unsigned char byte)
+{
+    if (b->size == b->capacity) {
+        if (b->capacity >= JIT_MAX_CODE_SIZE) {
+            b->failed = true;
+            return;
+        }
+        size_t capacity = b->capacity ? b->capacity * 2 : 65536;
+        unsigned char *code = realloc(b->code, capacity);
+        if (!code) {
+            b->failed = true;
+            return;
+        }
+        b->code = code;
+        b->capacity = capacity;
+    }
+    if (!b->failed)
+        b->code[b->size++] = byte;
+}
+
+
+static void emit_u32(struct JitBuffer *b, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit_byte(b, (value >> (8 * i)) & 0xFF);
+}
+
+
+static int add_constant(struct JitBuffer *b, float value)
+{
+    b->constants = grow(b->constants, &b->constants_capacity, b->num_constants + 1, sizeof (float), &b->failed);
+    if (b->failed)
+        return 0;
+    b->constants[b->num_constants] = value;
+    return b->num_constants++;
+}
+
+
+// Three byte VEX prefix with L = 1 (256 bit) and W = 0
+static void emit_vex(struct JitBuffer *b, int map, int pp, int reg, int vvvv, int rm)
+{
+    emit_byte(b, 0xC4);
+    emit_byte(b, ((reg & 8) ? 0x00 : 0x80) | 0x40 | ((rm >= 0 && (rm & 8)) ? 0x00 : 0x20) | map);
+    emit_byte(b, ((~vvvv & 15) << 3) | 0x04 | pp);
+}
+
+
+// op ymm(reg), ymm(vvvv), ymm(rm)
+static void emit_op_reg(struct JitBuffer *b, int map, int pp, unsigned char opcode, int reg, int vvvv, int rm)
+{
+    emit_vex(b, map, pp, reg, vvvv, rm);
+    emit_byte(b, opcode);
+    emit_byte(b, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+
+// op ymm(reg), ymm(vvvv), [base + disp], or [rip + constant] if base is REG_RIP
+static void emit_op_mem(struct JitBuffer *b, int map, int pp, unsigned char opcode, int reg, int vvvv, int base, int32_t disp)
+{
+    emit_vex(b, map, pp, reg, vvvv, base);
+    emit_byte(b, opcode);
+    if (base == REG_RIP) {
+        emit_byte(b, (reg & 7) << 3 | 5);
+        b->fixups = grow(b->fixups, &b->fixups_capacity, b->num_fixups + 1, sizeof (struct JitFixup), &b->failed);
+        if (!b->failed)
+            b->fixups[b->num_fixups++] = (struct JitFixup){ b->size, disp };
+        emit_u32(b, 0);
+    } else {
+        emit_byte(b, 0x80 | (reg & 7) << 3 | (base & 7));
+        emit_u32(b, (uint32_t)disp);
+    }
+}
+
+
+static void emit_broadcast(struct JitBuffer *b, int reg, float value)
+{
+    emit_op_mem(b, MAP_0F38, PP_66, 0x18, reg, 0, REG_RIP, add_constant(b, value));     // vbroadcastss
+}
+
+
+/*
+ * Registers: accumulators ymm0 .. ymm(lanes - 1), the broadcast
+ * coefficient in ymm(lanes), and the ring of rows in the rest.
+ */
+static int ring_size(int lanes)
+{
+    return (16 - (lanes + 1)) / lanes;
+}
+
+
+static int ring(int row, int lane, int lanes)
+{
+    return lanes + 1 + row % ring_size(lanes) * lanes + lane;
+}
+
+
+static void generate_v(struct JitBuffer *b, const struct DescaleCore *core, int src_stride, int dst_stride, int lanes)
+{
+    int height = core->dst_dim;
+    int c = core->bandwidth / 2;
+    int coef = lanes;
+    int32_t src_row = src_stride * (int32_t)sizeof (float);
+    int32_t dst_row = dst_stride * (int32_t)sizeof (float);
+    size_t loop = b->size;
+
+    // Solve LD y = A' b, y stays in the ring for the next rows
+    for (int i = 0; i < height; i++) {
+        const float *w = core->weights + i * core->weights_columns - core->weights_left_idx[i];
+
+        for (int k = core->weights_left_idx[i]; k < core->weights_right_idx[i]; k++) {
+            emit_broadcast(b, coef, w[k]);
+            for (int l = 0; l < lanes; l++) {
+                if (k == core->weights_left_idx[i])
+                    emit_op_mem(b, MAP_0F, PP_NONE, 0x59, l, coef, REG_RDI, k * src_row + 32 * l);      // vmulps
+                else
+                    emit_op_mem(b, MAP_0F38, PP_66, 0xB8, l, coef, REG_RDI, k * src_row + 32 * l);      // vfmadd231ps
+            }
+        }
+        for (int k = DSMAX(0, i - c); k < i; k++) {
+            emit_broadcast(b, coef, core->lower[k - i + c][i]);
+            for (int l = 0; l < lanes; l++)
+                emit_op_reg(b, MAP_0F38, PP_66, 0xBC, l, coef, ring(k, l, lanes));                      // vfnmadd231ps
+        }
+        emit_broadcast(b, coef, core->diagonal[i]);
+        for (int l = 0; l < lanes; l++) {
+            emit_op_reg(b, MAP_0F, PP_NONE, 0x59, ring(i, l, lanes), l, coef);                          // vmulps
+            emit_op_mem(b, MAP_0F, PP_NONE, 0x29, ring(i, l, lanes), 0, REG_RSI, i * dst_row + 32 * l); // vmovaps store
+        }
+    }
+
+    // Solve L' x = y, the rows below i are still in the ring
+    for (int i = height - 2; c > 0 && i >= 0; i--) {
+        for (int l = 0; l < lanes; l++)
+            emit_op_mem(b, MAP_0F, PP_NONE, 0x28, ring(i, l, lanes), 0, REG_RSI, i * dst_row + 32 * l); // vmovaps load
+        for (int k = DSMIN(height - 1, i + c); k > i; k--) {
+            emit_broadcast(b, coef, core->upper[k - i - 1][i]);
+            for (int l = 0; l < lanes; l++)
+                emit_op_reg(b, MAP_0F38, PP_66, 0xBC, ring(i, l, lanes), coef, ring(k, l, lanes));       // vfnmadd231ps
+        }
+        for (int l = 0; l < lanes; l++)
+            emit_op_mem(b, MAP_0F, PP_NONE, 0x29, ring(i, l, lanes), 0, REG_RSI, i * dst_row + 32 * l); // vmovaps store
+    }
+
+    const unsigned char advance[] = {
+        0x48, 0x83, 0xC7, 32 * lanes,   // add rdi, 32 * lanes
+        0x48, 0x83, 0xC6, 32 * lanes,   // add rsi, 32 * lanes
+        0x48, 0xFF, 0xCA,               // dec rdx
+        0x0F, 0x85                      // jnz loop
+    };
+    for (size_t i = 0; i < sizeof advance; i++)
+        emit_byte(b, advance[i]);
+    emit_u32(b, (uint32_t)(int32_t)(loop - (b->size + 4)));
+
+    emit_byte(b, 0xC5);     // vzeroupper
+    emit_byte(b, 0xF8);
+    emit_byte(b, 0x77);
+    emit_byte(b, 0xC3);     // ret
+}
+
+
+static bool compile_variant(struct JitVariant *v, const struct DescaleCore *core)
+{
+    struct JitBuffer b = {0};
+    generate_v(&b, core, v->src_stride, v->dst_stride, v->lanes);
+
+    size_t code_size = ceil_n((int)b.size, 64);
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mem_size = (code_size + (size_t)b.num_constants * sizeof (float) + page_size - 1) / page_size * page_size;
+    void *mem = MAP_FAILED;
+
+    if (!b.failed && code_size + (size_t)b.num_constants * sizeof (float) <= JIT_MAX_CODE_SIZE)
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem != MAP_FAILED) {
+        unsigned char *code = mem;
+        memcpy(code, b.code, b.size);
+        memset(code + b.size, 0xCC, code_size - b.size);
+        memcpy(code + code_size, b.constants, (size_t)b.num_constants * sizeof (float));
+
+        // rip-relative displacements count from the end of the instruction, which is right after the disp32
+        for (int i = 0; i < b.num_fixups; i++) {
+            int32_t disp = (int32_t)(code_size + (size_t)b.fixups[i].constant * sizeof (float) - (b.fixups[i].pos + 4));
+            memcpy(code + b.fixups[i].pos, &disp, sizeof disp);
+        }
+
+        if (mprotect(mem, mem_size, PROT_READ | PROT_EXEC)) {
+            munmap(mem, mem_size);
+            mem = MAP_FAILED;
+        }
+    }
+
+    free(b.code);
+    free(b.constants);
+    free(b.fixups);
+
+    if (mem == MAP_FAILED)
+        return false;
+    v->mem = mem;
+    v->mem_size = mem_size;
+    v->func = (JitFunc)mem;
+    return true;
+}
+
+
+static struct JitVariant *find_variant(struct DescaleJit *jit, int src_stride, int dst_stride, int lanes)
+{
+    int count = __atomic_load_n(&jit->count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (jit->variants[i].src_stride == src_stride && jit->variants[i].dst_stride == dst_stride && jit->variants[i].lanes == lanes)
+            return &jit->variants[i];
+    }
+    return NULL;
+}
+
+
+static struct JitVariant *get_variant(struct DescaleCore *core, int src_stride, int dst_stride, int lanes)
+{
+    struct DescaleJit *jit = __atomic_load_n((struct DescaleJit **)&core->jit, __ATOMIC_ACQUIRE);
+    struct JitVariant *v = jit ? find_variant(jit, src_stride, dst_stride, lanes) : NULL;
+    if (v)
+        return v;
+
+    // Generation is rare, so all cores share one lock for it
+    pthread_mutex_lock(&jit_lock);
+    if (!jit) {
+        jit = core->jit;
+        if (!jit) {
+            jit = calloc(1, sizeof (struct DescaleJit));
+            __atomic_store_n((struct DescaleJit **)&core->jit, jit, __ATOMIC_RELEASE);
+        }
+    }
+    if (jit && !(v = find_variant(jit, src_stride, dst_stride, lanes)) && jit->count < JIT_MAX_VARIANTS) {
+        v = &jit->variants[jit->count];
+        v->src_stride = src_stride;
+        v->dst_stride = dst_stride;
+        v->lanes = lanes;
+        compile_variant(v, core);
+        __atomic_store_n(&jit->count, jit->count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&jit_lock);
+
+    return v;
+}
+
+
+bool descale_jit_supported(const struct DescaleCore *core, enum DescaleDir dir)
+{
+    return dir == DESCALE_DIR_VERTICAL && !core->upscale && !core->dense && !core->multiplied_weights &&
+           core->bandwidth / 2 + 1 <= ring_size(1);
+}
+
+
+bool descale_jit_process_v(struct DescaleCore *core, int vector_count, int src_stride, int dst_stride, const float *srcp, float *dstp)
+{
+    if (!descale_jit_supported(core, DESCALE_DIR_VERTICAL) || vector_count < 1)
+        return false;
+
+    // All row offsets have to fit into a disp32
+    if ((long long)core->src_dim * src_stride * sizeof (float) > INT32_MAX || (long long)core->dst_dim * dst_stride * sizeof (float) > INT32_MAX)
+        return false;
+
+    // Full cache lines per row if there are enough registers, this may process the padding of the rows
+    int lanes = 1;
+    if (core->bandwidth / 2 + 1 <= ring_size(2) && ceil_n(vector_count, 16) <= DSMIN(src_stride, dst_stride))
+        lanes = 2;
+
+    struct JitVariant *v = get_variant(core, src_stride, dst_stride, lanes);
+    if (!v || !v->func)
+        return false;
+
+    v->func(srcp, dstp, ceil_n(vector_count, 8 * lanes) / (8 * lanes));
+    return true;
+}
+
+
+void descale_jit_free(void *p)
+{
+    struct DescaleJit *jit = p;
+    if (!jit)
+        return;
+    for (int i = 0; i < jit->count; i++) {
+        if (jit->variants[i].func)
+            munmap(jit->variants[i].mem, jit->variants[i].mem_size);
+    }
+    free(jit);
+}
+
+
+#else
+
+
+bool descale_jit_supported(const struct DescaleCore *core, enum DescaleDir dir)
+{
+    return false;
+}
+
+
+bool descale_jit_process_v(struct DescaleCore *core, int vector_count, int src_stride, int dst_stride, const float *srcp, float *dstp)
+{
+    return false;
+}
+
+
+void descale_jit_free(void *jit)
+{
+}
+
+
+#endif  // DESCALE_JIT
+
+#endif  // DESCALE_X86
@@ -0,0 +1,32 @@
+#ifdef DESCALE_X86
+
+#ifndef DESCALE_JIT_X86_H
+#define DESCALE_JIT_X86_H
+
+
+#include <stdbool.h>
+#include "descale.h"
+
+
+/*
+ * Whether a vertical solver can be generated for the core, which
+ * requires x86-64 outside of Windows and a non-dense, non-masked
+ * downscaling core with a bandwidth of at most 27.
+ */
+bool descale_jit_supported(const struct DescaleCore *core, enum DescaleDir dir);
+
+/*
+ * Runs the vertical pass with code generated for the core and strides.
+ * The code is generated on first use and kept with the core.
+ *
+ * @return false if no code could be generated, the caller has to use
+ *         the static kernels then
+ */
+bool descale_jit_process_v(struct DescaleCore *core, int vector_count, int src_stride, int dst_stride, const float *srcp, float *dstp);
+
+void descale_jit_free(void *jit);
+
+
+#endif  // DESCALE_JIT_X86_H
+
+#endif  // DESCALE_X86
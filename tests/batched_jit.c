@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Descales the planes of an RGB frame through process_planes, which
+ * batches them, with the vertical core tuned to the generated code.
+ * The generated code has to run and match the static kernels.
+ */
+
+
+#include <math.h>
+#include <stdio.h>
+#include "plugin.h"
+#include "tests.h"
+
+#ifdef DESCALE_X86
+    #include "x86/cpuinfo_x86.h"
+    #include "x86/jit_x86.h"
+#endif
+
+
+#define SRC_WIDTH 640
+#define SRC_HEIGHT 360
+#define DST_WIDTH 427
+#define DST_HEIGHT 240
+
+
+int main(void)
+{
+#ifndef DESCALE_X86
+    return TEST_SKIP;
+#else
+    struct X86Capabilities caps = query_x86_capabilities();
+    if (!caps.avx2 || !caps.fma)
+        return TEST_SKIP;
+
+    struct DescaleData dd = {0};
+    dd.src_width = SRC_WIDTH;
+    dd.src_height = SRC_HEIGHT;
+    dd.dst_width = DST_WIDTH;
+    dd.dst_height = DST_HEIGHT;
+    dd.num_planes = 3;
+    dd.process_h = dd.process_v = true;
+    dd.active_width = DST_WIDTH;
+    dd.active_height = DST_HEIGHT;
+    dd.format = (struct DescaleSampleFormat){ .type = DESCALE_SAMPLE_FLOAT, .transfer = DESCALE_TRANSFER_LINEAR };
+    dd.params.mode = DESCALE_MODE_LANCZOS;
+    dd.params.taps = 3;
+    dd.params.blur = 1.0;
+    dd.dsapi = get_descale_api(DESCALE_OPT_AVX2);
+    initialize_descale_data(&dd);
+
+    struct DescaleCore *core_v = dd.dscore_v[0];
+    if (!descale_jit_supported(core_v, DESCALE_DIR_VERTICAL)) {
+        free_descale_data(&dd);
+        return TEST_SKIP;
+    }
+
+    int src_stride = ceil_n(SRC_WIDTH, 16);
+    int dst_stride = ceil_n(DST_WIDTH, 16);
+    float *src[3], *jit[3], *ref[3];
+    struct DescalePlane planes[3] = {{0}};
+    for (int i = 0; i < 3; i++) {
+        src[i] = test_plane(src_stride, SRC_HEIGHT, i);
+        jit[i] = test_plane(dst_stride, DST_HEIGHT, -1);
+        ref[i] = test_plane(dst_stride, DST_HEIGHT, -1);
+        planes[i].src_stride = src_stride;
+        planes[i].dst_stride = dst_stride;
+        planes[i].srcp = src[i];
+        planes[i].dstp = jit[i];
+    }
+
+    core_v->kernel[DESCALE_DIR_VERTICAL] = DESCALE_KERNEL_JIT;
+    process_planes(&dd, planes);
+    bool generated = core_v->jit != NULL;
+
+    core_v->kernel[DESCALE_DIR_VERTICAL] = DESCALE_KERNEL_DEFAULT;
+    for (int i = 0; i < 3; i++) {
+        planes[i].dstp = ref[i];
+        process_plane(&dd, &planes[i]);
+    }
+
+    double max_error = 0.0;
+    for (int i = 0; i < 3; i++) {
+        for (int y = 0; y < DST_HEIGHT; y++) {
+            for (int x = 0; x < DST_WIDTH; x++)
+                max_error = DSMAX(max_error, fabs(jit[i][y * dst_stride + x] - ref[i][y * dst_stride + x]));
+        }
+        descale_aligned_free(src[i]);
+        descale_aligned_free(jit[i]);
+        descale_aligned_free(ref[i]);
+    }
+    free_descale_data(&dd);
+
+    printf("generated code %s, max error %g\n", generated ? "used" : "not used", max_error);
+    return generated && max_error < 1e-5 ? TEST_PASS : TEST_FAIL;
+#endif
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Descales an EWA Lanczos upscale of noise, which has the most of the
+ * diagonal detail that converges slowest. The solve has to meet the
+ * residual tolerance within the iteration limit and end up close to the
+ * converged solution, and a mask over 30% of the plane has to be rejected.
+ */
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "descale.h"
+#include "tests.h"
+
+
+#define SRC_WIDTH 480
+#define SRC_HEIGHT 270
+#define DST_WIDTH 320
+#define DST_HEIGHT 180
+#define SRC_STRIDE ceil_n(SRC_WIDTH, 16)
+#define DST_STRIDE ceil_n(DST_WIDTH, 16)
+
+#define ITERATIONS 48
+#define TOLERANCE 1e-5
+#define MAX_RMS_ERROR 1e-3     // against the converged solution
+
+
+static bool run(enum DescaleOpt opt)
+{
+    struct DescaleAPI api = get_descale_api(opt);
+    struct DescaleParams params_h = {0};
+    params_h.mode = DESCALE_MODE_EWA_LANCZOS;
+    params_h.taps = 3;
+    params_h.blur = 1.0;
+    params_h.border_handling = DESCALE_BORDER_MIRROR;
+    params_h.active_dim = DST_WIDTH;
+    struct DescaleParams params_v = params_h;
+    params_v.active_dim = DST_HEIGHT;
+    struct DescaleEwaCore *core = api.create_ewa_core(SRC_WIDTH, SRC_HEIGHT, DST_WIDTH, DST_HEIGHT, &params_h, &params_v);
+
+    params_h.upscale = params_v.upscale = true;
+    struct DescaleEwaCore *up = api.create_ewa_core(DST_WIDTH, DST_HEIGHT, SRC_WIDTH, SRC_HEIGHT, &params_h, &params_v);
+
+    float *truth = test_plane(DST_STRIDE, DST_HEIGHT, -1);
+    float *src = test_plane(SRC_STRIDE, SRC_HEIGHT, -1);
+    float *dst = test_plane(DST_STRIDE, DST_HEIGHT, -1);
+    float *converged = test_plane(DST_STRIDE, DST_HEIGHT, -1);
+    unsigned char *mask = calloc((size_t)SRC_STRIDE * SRC_HEIGHT, 1);
+    if (!mask)
+        abort();
+
+    srand(3);
+    for (int y = 0; y < DST_HEIGHT; y++) {
+        for (int x = 0; x < DST_WIDTH; x++)
+            truth[y * DST_STRIDE + x] = (float)rand() / RAND_MAX;
+    }
+    api.process_plane_ewa(up, 0, 0.0, false, DST_STRIDE, 0, SRC_STRIDE, truth, NULL, src);
+
+    // A tolerance of 0 iterates until the residual reaches the float precision
+    int converged_iterations = api.process_plane_ewa(core, 400, 0.0, false, SRC_STRIDE, 0, DST_STRIDE, src, NULL, converged);
+    int iterations = api.process_plane_ewa(core, ITERATIONS, TOLERANCE, false, SRC_STRIDE, 0, DST_STRIDE, src, NULL, dst);
+
+    double error = 0.0;
+    for (int y = 0; y < DST_HEIGHT; y++) {
+        for (int x = 0; x < DST_WIDTH; x++) {
+            double d = dst[y * DST_STRIDE + x] - converged[y * DST_STRIDE + x];
+            error += d * d;
+        }
+    }
+    error = sqrt(error / (DST_WIDTH * DST_HEIGHT));
+
+    for (int y = 0; y < SRC_HEIGHT; y++) {
+        for (int x = 0; x < SRC_WIDTH; x++)
+            mask[y * SRC_STRIDE + x] = rand() < 0.3 * RAND_MAX ? 255 : 0;
+    }
+    int dense_iterations = api.process_plane_ewa(core, ITERATIONS, TOLERANCE, false, SRC_STRIDE, SRC_STRIDE, DST_STRIDE, src, mask, dst);
+
+    printf("%s: %d iterations, rms error %g, converged after %d, 30%% mask %d\n", opt == DESCALE_OPT_NONE ? "c" : "auto",
+           iterations, error, converged_iterations, dense_iterations);
+
+    descale_aligned_free(truth);
+    descale_aligned_free(src);
+    descale_aligned_free(dst);
+    descale_aligned_free(converged);
+    free(mask);
+    api.free_ewa_core(core);
+    api.free_ewa_core(up);
+
+    return iterations > 0 && iterations < ITERATIONS && converged_iterations < 400 && error < MAX_RMS_ERROR && dense_iterations == -1;
+}
+
+
+int main(void)
+{
+    bool ok = run(DESCALE_OPT_NONE);
+#ifdef DESCALE_X86
+    ok &= run(DESCALE_OPT_AUTO);
+#endif
+    return ok ? TEST_PASS : TEST_FAIL;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Descales an upscaled plane with an ignore mask along both axes.
+ * A mask over 10% of the plane has to meet the residual tolerance
+ * within the default iteration limit and end up close to the fully
+ * converged solution, a mask over 30% has to be rejected.
+ */
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "descale.h"
+#include "tests.h"
+
+
+#define SRC_WIDTH 640
+#define SRC_HEIGHT 360
+#define DST_WIDTH 427
+#define DST_HEIGHT 240
+#define SRC_STRIDE ceil_n(SRC_WIDTH, 16)
+#define DST_STRIDE ceil_n(DST_WIDTH, 16)
+
+#define ITERATIONS 32
+#define TOLERANCE 1e-5
+#define MAX_RMS_ERROR 5e-4     // against the converged solution
+
+
+static void random_mask(unsigned char *mask, float *srcp, double fraction)
+{
+    srand(5);
+    memset(mask, 0, (size_t)SRC_STRIDE * SRC_HEIGHT);
+    for (int y = 0; y < SRC_HEIGHT; y++) {
+        for (int x = 0; x < SRC_WIDTH; x++) {
+            if (rand() < fraction * RAND_MAX) {
+                mask[y * SRC_STRIDE + x] = 255;
+                srcp[y * SRC_STRIDE + x] = 1.0f;
+            }
+        }
+    }
+}
+
+
+static bool run(enum DescaleOpt opt)
+{
+    struct DescaleAPI api = get_descale_api(opt);
+    struct DescaleParams params = {0};
+    params.mode = DESCALE_MODE_BICUBIC;
+    params.param2 = 0.5;
+    params.blur = 1.0;
+
+    params.active_dim = DST_WIDTH;
+    struct DescaleCore *core_h = api.create_core(SRC_WIDTH, DST_WIDTH, &params);
+    params.active_dim = DST_HEIGHT;
+    struct DescaleCore *core_v = api.create_core(SRC_HEIGHT, DST_HEIGHT, &params);
+
+    // The input is the upscale of a known plane
+    params.upscale = 1;
+    params.active_dim = DST_WIDTH;
+    struct DescaleCore *up_h = api.create_core(DST_WIDTH, SRC_WIDTH, &params);
+    params.active_dim = DST_HEIGHT;
+    struct DescaleCore *up_v = api.create_core(DST_HEIGHT, SRC_HEIGHT, &params);
+
+    float *truth = test_plane(DST_STRIDE, DST_HEIGHT, 1);
+    float *mid = test_plane(DST_STRIDE, SRC_HEIGHT, -1);
+    float *src = test_plane(SRC_STRIDE, SRC_HEIGHT, -1);
+    float *dst = test_plane(DST_STRIDE, DST_HEIGHT, -1);
+    float *converged = test_plane(DST_STRIDE, DST_HEIGHT, -1);
+    unsigned char *mask = malloc((size_t)SRC_STRIDE * SRC_HEIGHT);
+    if (!mask)
+        abort();
+
+    api.process_vectors(up_v, DESCALE_DIR_VERTICAL, DST_WIDTH, DST_STRIDE, 0, DST_STRIDE, truth, NULL, mid);
+    api.process_vectors(up_h, DESCALE_DIR_HORIZONTAL, SRC_HEIGHT, DST_STRIDE, 0, SRC_STRIDE, mid, NULL, src);
+
+    random_mask(mask, src, 0.1);
+    api.process_plane_masked(core_h, core_v, 400, 0.0, false, SRC_STRIDE, SRC_STRIDE, DST_STRIDE, src, mask, converged);
+    int iterations = api.process_plane_masked(core_h, core_v, ITERATIONS, TOLERANCE, false, SRC_STRIDE, SRC_STRIDE, DST_STRIDE, src, mask, dst);
+
+    double error = 0.0;
+    for (int y = 0; y < DST_HEIGHT; y++) {
+        for (int x = 0; x < DST_WIDTH; x++) {
+            double d = dst[y * DST_STRIDE + x] - converged[y * DST_STRIDE + x];
+            error += d * d;
+        }
+    }
+    error = sqrt(error / (DST_WIDTH * DST_HEIGHT));
+
+    random_mask(mask, src, 0.3);
+    int dense_iterations = api.process_plane_masked(core_h, core_v, ITERATIONS, TOLERANCE, false, SRC_STRIDE, SRC_STRIDE, DST_STRIDE, src, mask, dst);
+
+    printf("%s: 10%% mask %d iterations, rms error %g, 30%% mask %d\n", opt == DESCALE_OPT_NONE ? "c" : "auto", iterations, error, dense_iterations);
+
+    descale_aligned_free(truth);
+    descale_aligned_free(mid);
+    descale_aligned_free(src);
+    descale_aligned_free(dst);
+    descale_aligned_free(converged);
+    free(mask);
+    api.free_core(core_h);
+    api.free_core(core_v);
+    api.free_core(up_h);
+    api.free_core(up_v);
+
+    return iterations > 0 && iterations < ITERATIONS && error < MAX_RMS_ERROR && dense_iterations == -1;
+}
+
+
+int main(void)
+{
+    bool ok = run(DESCALE_OPT_NONE);
+#ifdef DESCALE_X86
+    ok &= run(DESCALE_OPT_AUTO);
+#endif
+    return ok ? TEST_PASS : TEST_FAIL;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright © 2021-2022 Frechdachs <frechdachs@rekt.cc>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Descales the planes of an RGB frame through process_planes, which
+ * batches them, with the vertical core tuned to the generated code.
+ * The generated code has to run and match the static kernels.
+ */
+
+
+/*
+ * Descales a few frames of 1080p through the frame-level API and checks
+ * that the scratch arenas do not go to the heap anymore after the first
+ * frame, also when the intermediate is larger than what an arena keeps
+ * without a reservation.
+ */
+
+
+#include <stdio.h>
+#include "descale.h"
+#include "tests.h"
+
+
+#define FRAMES 4
+
+
+struct Config
+{
+    const char *name;
+    int num_planes;
+    int subsampling;
+    bool half_intermediate;
+    bool upscale;
+};
+
+
+static bool run(const struct Config *config)
+{
+    struct DescaleFrameParams params = {0};
+    params.src_width = config->upscale ? 1280 : 1920;
+    params.src_height = config->upscale ? 720 : 1080;
+    params.dst_width = config->upscale ? 1920 : 1280;
+    params.dst_height = config->upscale ? 1080 : 720;
+    params.num_planes = config->num_planes;
+    params.subsampling_h = params.subsampling_v = config->subsampling;
+    params.half_intermediate = config->half_intermediate;
+    params.params.mode = DESCALE_MODE_BICUBIC;
+    params.params.param2 = 0.5;
+    params.params.upscale = config->upscale;
+
+    struct DescaleContext *ctx = descale_context_create(&params);
+    if (!ctx) {
+        printf("%s: no context\n", config->name);
+        return false;
+    }
+
+    float *src[3], *dst[3];
+    int src_strides[3], dst_strides[3];
+    for (int i = 0; i < config->num_planes; i++) {
+        int shift = i ? config->subsampling : 0;
+        src_strides[i] = ceil_n(params.src_width >> shift, 16);
+        dst_strides[i] = ceil_n(params.dst_width >> shift, 16);
+        src[i] = test_plane(src_strides[i], params.src_height >> shift, i);
+        dst[i] = test_plane(dst_strides[i], params.dst_height >> shift, -1);
+    }
+
+    struct DescaleScratchStats first, last;
+    descale_context_process(ctx, (const float *const *)src, src_strides, dst, dst_strides);
+    descale_get_scratch_stats(&first);
+    for (int n = 1; n < FRAMES; n++)
+        descale_context_process(ctx, (const float *const *)src, src_strides, dst, dst_strides);
+    descale_get_scratch_stats(&last);
+
+    for (int i = 0; i < config->num_planes; i++) {
+        descale_aligned_free(src[i]);
+        descale_aligned_free(dst[i]);
+    }
+    descale_context_free(ctx);
+
+    printf("%s: high water %zu bytes, %llu heap allocations after the first frame\n",
+           config->name, last.high_water, last.allocations - first.allocations);
+    return last.allocations == first.allocations;
+}
+
+
+int main(void)
+{
+    static const struct Config configs[] = {
+        { "gray", 1, 0, false, false },
+        { "rgb batched", 3, 0, false, false },
+        { "yuv420", 3, 1, false, false },
+        { "gray half intermediate", 1, 0, true, false },
+        { "gray upscale", 1, 0, false, true },
+    };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof configs / sizeof configs[0]; i++)
+        ok &= run(&configs[i]);
+
+    return ok ? TEST_PASS : TEST_FAIL;
+}
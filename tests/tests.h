@@ -0,0 +1,36 @@
+#ifndef DESCALE_TESTS_H
+#define DESCALE_TESTS_H
+
+
+#include <math.h>
+#include <stddef.h>
+#include "common.h"
+
+
+// Exit codes of the test programs, 77 makes meson report a skipped test
+#define TEST_PASS 0
+#define TEST_FAIL 1
+#define TEST_SKIP 77
+
+
+/*
+ * Allocates a plane of the given stride and height like the plugins do.
+ * A seed of at least 0 fills it with a smooth pattern that differs
+ * between seeds, a negative seed leaves it zeroed.
+ */
+static inline float *test_plane(int stride, int height, int seed)
+{
+    float *p;
+    size_t size = (size_t)stride * height;
+    descale_aligned_malloc((void **)&p, size * sizeof (float), 64);
+    if (!p)
+        abort();
+    for (size_t i = 0; i < size; i++) {
+        int x = (int)(i % stride), y = (int)(i / stride);
+        p[i] = seed < 0 ? 0.0f : 0.5f + 0.2f * sinf(0.071f * x + seed) * cosf(0.053f * y) + 0.1f * sinf(0.37f * (x + 2 * y) + seed);
+    }
+    return p;
+}
+
+
+#endif  // DESCALE_TESTS_H
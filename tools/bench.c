@@ -0,0 +1,473 @@
+/*
+ * Kernel benchmark for the descale library.
+ *
+ * Sweeps kernels, geometries, directions, ignore masks, upscaling and all
+ * available opt tiers (plus the generated vertical solvers as "jit")
+ * directly through get_descale_api() and writes one
+ * JSON object with all results to stdout (or the file given with --output).
+ *
+ * Usage: descale-bench [--quick] [--perf] [--filter substring] [--min-time seconds] [--output file]
+ *
+ * --perf adds cycles, instructions per cycle and cache misses of the
+ * process pass per case. It needs perf_event_open, so it only works on
+ * Linux with a permissive enough perf_event_paranoid setting.
+ *
+ * The "half" tier runs the descaling passes through process_vectors_half,
+ * with the intermediate side of each pass stored as half floats, and
+ * adds the largest deviation from the single precision result as
+ * "max_error".
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE     // syscall()
+#endif
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "common.h"
+#include "descale.h"
+
+
+struct BenchKernel
+{
+    const char *name;
+    enum DescaleMode mode;
+    int taps;
+    double b, c;
+    int post_conv_size;
+    double *post_conv;
+};
+
+
+struct BenchGeometry
+{
+    const char *name;
+    int src_width, src_height;
+    int dst_width, dst_height;
+    bool upscale;
+    bool quick;     // part of the reduced --quick sweep
+};
+
+
+struct BenchTier
+{
+    const char *name;
+    struct DescaleAPI dsapi;
+    enum DescaleKernel kernel;
+    bool half;      // use process_vectors_half
+};
+
+
+struct BenchOptions
+{
+    bool quick;
+    bool perf;
+    const char *filter;
+    double min_time;
+    FILE *out;
+};
+
+
+struct BenchPerf
+{
+    bool valid;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+};
+
+
+static double post_conv_blur[] = {0.25, 0.5, 0.25};
+
+static struct BenchKernel kernels[] = {
+    {"bilinear", DESCALE_MODE_BILINEAR, 0, 0.0, 0.0, 0, NULL},
+    {"bicubic_0_0.5", DESCALE_MODE_BICUBIC, 0, 0.0, 0.5, 0, NULL},
+    {"bicubic_0.333_0.333", DESCALE_MODE_BICUBIC, 0, 1.0 / 3.0, 1.0 / 3.0, 0, NULL},
+    {"lanczos2", DESCALE_MODE_LANCZOS, 2, 0.0, 0.0, 0, NULL},
+    {"lanczos3", DESCALE_MODE_LANCZOS, 3, 0.0, 0.0, 0, NULL},
+    {"lanczos4", DESCALE_MODE_LANCZOS, 4, 0.0, 0.0, 0, NULL},
+    {"spline16", DESCALE_MODE_SPLINE16, 0, 0.0, 0.0, 0, NULL},
+    {"spline36", DESCALE_MODE_SPLINE36, 0, 0.0, 0.0, 0, NULL},
+    {"spline64", DESCALE_MODE_SPLINE64, 0, 0.0, 0.0, 0, NULL},
+    {"bilinear_post_conv", DESCALE_MODE_BILINEAR, 0, 0.0, 0.0, 3, post_conv_blur}
+};
+
+static struct BenchGeometry geometries[] = {
+    {"1080p_to_720p", 1920, 1080, 1280, 720, false, true},
+    {"1080p_to_810p", 1920, 1080, 1440, 810, false, false},
+    {"1080p_to_864p", 1920, 1080, 1536, 864, false, false},
+    {"2160p_to_1080p", 3840, 2160, 1920, 1080, false, false},
+    {"720p_to_1080p", 1280, 720, 1920, 1080, true, true}
+};
+
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+// Peak resident set size of the whole process in KiB, -1 if unknown
+static long get_peak_rss(void)
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return -1;
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static float *alloc_plane(int width, int height, int *stride, uint32_t seed)
+{
+    *stride = ceil_n(width, 16);
+    size_t size = (size_t)*stride * height;
+    float *p;
+    descale_aligned_malloc((void **)&p, size * sizeof (float), 64);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        p[i] = (float)(seed >> 8) / (float)(1 << 24);
+    }
+    return p;
+}
+
+
+// Runs one pass of a case, the half tier reads or writes halves in halfp instead of srcp or dstp
+static void process_case(const struct BenchTier *tier, struct DescaleCore *core, enum DescaleDir dir, int vector_count, int src_stride, int imask_stride,
+                         int dst_stride, const float *srcp, const unsigned char *imaskp, float *dstp, uint16_t *halfp)
+{
+    if (!tier->half)
+        tier->dsapi.process_vectors(core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp);
+    else if (dir == DESCALE_DIR_HORIZONTAL)
+        tier->dsapi.process_vectors_half(core, dir, vector_count, src_stride, dst_stride, srcp, halfp);
+    else
+        tier->dsapi.process_vectors_half(core, dir, vector_count, src_stride, dst_stride, halfp, dstp);
+}
+
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+
+struct BenchPerfGroup
+{
+    int fds[3];
+};
+
+
+static bool perf_start(struct BenchPerfGroup *group)
+{
+#ifdef __linux__
+    group->fds[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (group->fds[0] < 0)
+        return false;
+    group->fds[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, group->fds[0]);
+    group->fds[2] = perf_open(PERF_COUNT_HW_CACHE_MISSES, group->fds[0]);
+    if (group->fds[1] < 0 || group->fds[2] < 0) {
+        for (int i = 0; i < 3; i++) {
+            if (group->fds[i] >= 0)
+                close(group->fds[i]);
+        }
+        return false;
+    }
+    ioctl(group->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    (void)group;
+    return false;
+#endif
+}
+
+
+static void perf_stop(struct BenchPerfGroup *group, struct BenchPerf *perf)
+{
+#ifdef __linux__
+    uint64_t values[4] = {0};
+    ioctl(group->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    perf->valid = read(group->fds[0], values, sizeof values) == (ssize_t)sizeof values && values[0] == 3;
+    perf->cycles = values[1];
+    perf->instructions = values[2];
+    perf->cache_misses = values[3];
+    for (int i = 0; i < 3; i++)
+        close(group->fds[i]);
+#else
+    (void)group;
+    perf->valid = false;
+#endif
+}
+
+
+static void run_case(const struct BenchOptions *opts, const struct BenchTier *tier, const struct BenchKernel *kernel,
+                     const struct BenchGeometry *geometry, enum DescaleDir dir, bool masked, bool *first)
+{
+    char name[256];
+    snprintf(name, sizeof name, "%s/%s/%s/%s%s/%s", geometry->upscale ? "upscale" : "descale", geometry->name, kernel->name,
+             dir == DESCALE_DIR_HORIZONTAL ? "h" : "v", masked ? "_masked" : "", tier->name);
+    if (opts->filter && !strstr(name, opts->filter))
+        return;
+
+    int src_dim = dir == DESCALE_DIR_HORIZONTAL ? geometry->src_width : geometry->src_height;
+    int dst_dim = dir == DESCALE_DIR_HORIZONTAL ? geometry->dst_width : geometry->dst_height;
+    int src_width = geometry->src_width;
+    int src_height = geometry->src_height;
+    int dst_width = dir == DESCALE_DIR_HORIZONTAL ? geometry->dst_width : geometry->src_width;
+    int dst_height = dir == DESCALE_DIR_HORIZONTAL ? geometry->src_height : geometry->dst_height;
+    int vector_count = dir == DESCALE_DIR_HORIZONTAL ? src_height : src_width;
+
+    struct DescaleParams params = {0};
+    params.mode = kernel->mode;
+    params.upscale = geometry->upscale;
+    params.taps = kernel->taps;
+    params.param1 = kernel->b;
+    params.param2 = kernel->c;
+    params.blur = 1.0;
+    params.post_conv_size = kernel->post_conv_size;
+    params.post_conv = kernel->post_conv;
+    params.active_dim = geometry->upscale ? src_dim : dst_dim;
+    params.has_ignore_mask = masked;
+    params.border_handling = DESCALE_BORDER_MIRROR;
+
+    double build_start = get_time();
+    struct DescaleCore *core = tier->dsapi.create_core(src_dim, dst_dim, &params);
+    double build_time = get_time() - build_start;
+    core->kernel[dir] = tier->kernel;
+
+    int src_stride, dst_stride;
+    float *srcp = alloc_plane(src_width, src_height, &src_stride, 1);
+    float *dstp = alloc_plane(dst_width, dst_height, &dst_stride, 2);
+
+    unsigned char *imaskp = NULL;
+    int imask_stride = 0;
+    if (masked) {
+        // Ignore about 2% of the pixels
+        imask_stride = ceil_n(src_width, 64);
+        imaskp = calloc((size_t)imask_stride * src_height, 1);
+        uint32_t seed = 3;
+        for (size_t i = 0; i < (size_t)imask_stride * src_height; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            imaskp[i] = (seed >> 24) < 5 ? 255 : 0;
+        }
+    }
+
+    uint16_t *halfp = NULL;
+    if (tier->half) {
+        // The intermediate side of the pass, which is the output of the horizontal one and the input of the vertical one
+        size_t size = dir == DESCALE_DIR_HORIZONTAL ? (size_t)dst_stride * dst_height : (size_t)src_stride * src_height;
+        descale_aligned_malloc((void **)&halfp, size * sizeof (uint16_t), 64);
+        if (!halfp) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (dir == DESCALE_DIR_VERTICAL) {
+            for (size_t i = 0; i < size; i++)
+                halfp[i] = descale_float_to_half(srcp[i]);
+        }
+    }
+
+    // Warm up the caches and the scratch arena
+    process_case(tier, core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp, halfp);
+
+    int capacity = 64;
+    int runs = 0;
+    double *times = malloc(capacity * sizeof (double));
+    double total = 0.0;
+    while (runs < 3 || total < opts->min_time) {
+        double start = get_time();
+        process_case(tier, core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp, halfp);
+        double t = get_time() - start;
+        if (runs == capacity) {
+            capacity *= 2;
+            times = realloc(times, capacity * sizeof (double));
+        }
+        times[runs++] = t;
+        total += t;
+    }
+    qsort(times, runs, sizeof (double), &compare_double);
+    double median = times[runs / 2];
+
+    struct BenchPerf perf = {0};
+    if (opts->perf) {
+        struct BenchPerfGroup group;
+        if (perf_start(&group)) {
+            process_case(tier, core, dir, vector_count, src_stride, imask_stride, dst_stride, srcp, imaskp, dstp, halfp);
+            perf_stop(&group, &perf);
+        }
+    }
+
+    double max_error = 0.0;
+    if (tier->half) {
+        int ref_stride;
+        float *refp = alloc_plane(dst_width, dst_height, &ref_stride, 4);
+        tier->dsapi.process_vectors(core, dir, vector_count, src_stride, 0, ref_stride, srcp, NULL, refp);
+        for (int y = 0; y < dst_height; y++) {
+            for (int x = 0; x < dst_width; x++) {
+                size_t i = (size_t)y * dst_stride + x;
+                float value = dir == DESCALE_DIR_HORIZONTAL ? descale_half_to_float(halfp[i]) : dstp[i];
+                max_error = DSMAX(max_error, fabs((double)value - (double)refp[(size_t)y * ref_stride + x]));
+            }
+        }
+        descale_aligned_free(refp);
+    }
+
+    struct DescaleScratchStats scratch;
+    descale_get_scratch_stats(&scratch);
+
+    double mpix = (double)dst_width * dst_height / median * 1e-6;
+
+    fprintf(opts->out, "%s\n    {\"name\": \"%s\", \"mode\": \"%s\", \"geometry\": \"%s\", \"kernel\": \"%s\", \"dir\": \"%s\", \"masked\": %s, \"opt\": \"%s\",\n",
+            *first ? "" : ",", name, geometry->upscale ? "upscale" : "descale", geometry->name, kernel->name,
+            dir == DESCALE_DIR_HORIZONTAL ? "h" : "v", masked ? "true" : "false", tier->name);
+    fprintf(opts->out, "     \"src\": [%d, %d], \"dst\": [%d, %d], \"bandwidth\": %d, \"runs\": %d,\n",
+            src_width, src_height, dst_width, dst_height, core->bandwidth, runs);
+    fprintf(opts->out, "     \"build_ms\": %.4f, \"median_ms\": %.4f, \"best_ms\": %.4f, \"mpix_per_s\": %.2f,\n",
+            build_time * 1e3, median * 1e3, times[0] * 1e3, mpix);
+    fprintf(opts->out, "     \"peak_rss_kib\": %ld, \"scratch_high_water\": %zu", get_peak_rss(), scratch.high_water);
+    if (tier->half)
+        fprintf(opts->out, ", \"max_error\": %.3g", max_error);
+    if (perf.valid) {
+        fprintf(opts->out, ",\n     \"cycles\": %llu, \"instructions\": %llu, \"ipc\": %.3f, \"cache_misses\": %llu",
+                (unsigned long long)perf.cycles, (unsigned long long)perf.instructions,
+                perf.cycles ? (double)perf.instructions / (double)perf.cycles : 0.0, (unsigned long long)perf.cache_misses);
+    } else if (opts->perf) {
+        fprintf(opts->out, ",\n     \"cycles\": null, \"instructions\": null, \"ipc\": null, \"cache_misses\": null");
+    }
+    fprintf(opts->out, "}");
+    fflush(opts->out);
+    *first = false;
+
+    fprintf(stderr, "%-64s %9.2f Mpix/s\n", name, mpix);
+
+    free(times);
+    free(imaskp);
+    descale_aligned_free(halfp);
+    descale_aligned_free(srcp);
+    descale_aligned_free(dstp);
+    tier->dsapi.free_core(core);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--quick] [--perf] [--filter substring] [--min-time seconds] [--output file]\n", argv0);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct BenchOptions opts = {false, false, NULL, 0.2, stdout};
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--quick")) {
+            opts.quick = true;
+        } else if (!strcmp(argv[i], "--perf")) {
+            opts.perf = true;
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            opts.min_time = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            opts.out = fopen(argv[++i], "w");
+            if (!opts.out) {
+                fprintf(stderr, "Could not open %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.quick && opts.min_time > 0.02)
+        opts.min_time = 0.02;
+
+    // An opt tier is only listed if the automatic choice differs from the plain C version
+    struct BenchTier tiers[4];
+    int num_tiers = 0;
+    tiers[num_tiers++] = (struct BenchTier){"none", get_descale_api(DESCALE_OPT_NONE), DESCALE_KERNEL_DEFAULT, false};
+    struct DescaleAPI auto_api = get_descale_api(DESCALE_OPT_AUTO);
+    if (auto_api.process_vectors != tiers[0].dsapi.process_vectors) {
+        tiers[num_tiers++] = (struct BenchTier){"avx2", get_descale_api(DESCALE_OPT_AVX2), DESCALE_KERNEL_DEFAULT, false};
+        tiers[num_tiers++] = (struct BenchTier){"jit", get_descale_api(DESCALE_OPT_AVX2), DESCALE_KERNEL_JIT, false};
+    }
+    if (auto_api.process_vectors_half)
+        tiers[num_tiers++] = (struct BenchTier){"half", auto_api, DESCALE_KERNEL_DEFAULT, true};
+
+    fprintf(opts.out, "{\n  \"opt_tiers\": [");
+    for (int t = 0; t < num_tiers; t++)
+        fprintf(opts.out, "%s\"%s\"", t ? ", " : "", tiers[t].name);
+    fprintf(opts.out, "],\n  \"results\": [");
+
+    bool first = true;
+    int num_kernels = sizeof kernels / sizeof kernels[0];
+    int num_geometries = sizeof geometries / sizeof geometries[0];
+    for (int g = 0; g < num_geometries; g++) {
+        if (opts.quick && !geometries[g].quick)
+            continue;
+        for (int k = 0; k < num_kernels; k++) {
+            for (int dir = 0; dir < 2; dir++) {
+                for (int t = 0; t < num_tiers; t++) {
+                    // Code is only generated for the vertical solver
+                    if (tiers[t].kernel == DESCALE_KERNEL_JIT && (dir == DESCALE_DIR_HORIZONTAL || geometries[g].upscale))
+                        continue;
+                    // Half floats are only used for the intermediate of descales
+                    if (tiers[t].half && geometries[g].upscale)
+                        continue;
+                    run_case(&opts, &tiers[t], &kernels[k], &geometries[g], dir, false, &first);
+                }
+
+                // Only the C version supports ignore masks and they make no sense for upscaling
+                if (!geometries[g].upscale && kernels[k].mode == DESCALE_MODE_BICUBIC)
+                    run_case(&opts, &tiers[0], &kernels[k], &geometries[g], dir, true, &first);
+            }
+        }
+    }
+
+    fprintf(opts.out, "\n  ]\n}\n");
+    if (opts.out != stdout)
+        fclose(opts.out);
+
+    return 0;
+}
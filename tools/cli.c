@@ -0,0 +1,706 @@
+/*
+ * Streaming descaler for y4m and raw planar video.
+ *
+ * Reads frames from a file or stdin, descales them with the frame-level
+ * library API and writes them to a file or stdout, for example between
+ * ffmpeg and an encoder:
+ *
+ *   ffmpeg -i in.mkv -f yuv4mpegpipe - | descale-cli --width 1280 --height 720 | x264 --demuxer y4m -o out.264 -
+ *
+ * Usage: descale-cli --width W --height H [--kernel bicubic] [--b 0.0] [--c 0.5] [--taps 3] [--blur 1.0]
+ *                    [--src-left X] [--src-top Y] [--src-width W] [--src-height H] [--border 0|1|2]
+ *                    [--raw WxH] [--format gray|yuv420|yuv422|yuv444] [--depth 8|10|12|16|32]
+ *                    [--output-format y4m|raw] [--threads N] [--queue N] [--opt N] [--input file] [--output file]
+ *                    [--out-of-core] [--memory MiB] [--half-intermediate]
+ *
+ * Without --raw the input is y4m. Raw input is planar with 16 bit little
+ * endian samples above 8 bits, or 32 bit floats with --depth 32, and the
+ * output uses the same sample format. Integer samples are descaled as
+ * values between 0 and 1.
+ *
+ * The frames run through a bounded pipeline: the main thread reads into
+ * a ring of --queue frame slots (default twice the number of threads),
+ * --threads workers (default all cores) descale them, and a writer
+ * thread writes them in input order. The solvers are built once and
+ * every slot owns its buffers, so nothing is allocated after the first
+ * few frames.
+ *
+ * --out-of-core is meant for raw images that don't fit into memory. The
+ * input and output files are memory-mapped and descaled in row blocks
+ * and column strips with buffers of about --memory MiB (default 256),
+ * see descale_context_process_file().
+ *
+ * --half-intermediate stores the intermediate of two-axis descales as
+ * half floats, see the half_intermediate parameter of the plugin.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "common.h"
+#include "descale.h"
+
+
+#define Y4M_HEADER_SIZE 256
+
+
+enum CliSlotState
+{
+    SLOT_FREE = 0,      // may be filled by the reader
+    SLOT_READ = 1,      // holds an input frame
+    SLOT_DONE = 2       // holds an output frame
+};
+
+
+struct CliFormat
+{
+    int width, height;
+    int num_planes;
+    int subsampling_h, subsampling_v;
+    int depth;          // bits per sample, 32 for float
+};
+
+
+struct CliSlot
+{
+    enum CliSlotState state;
+    unsigned char *in;      // packed input frame
+    unsigned char *out;     // packed output frame
+    float *src[3], *dst[3];
+    int src_stride[3], dst_stride[3];
+};
+
+
+struct CliPipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct CliSlot *slots;
+    int num_slots;
+    long long frames_read;      // frames handed to the workers so far
+    long long next_frame;       // next frame a worker picks up
+    long long frames_written;
+    bool eof;
+    bool failed;
+
+    struct DescaleContext *ctx;
+    struct CliFormat in_format, out_format;
+    bool y4m_out;
+    FILE *out;
+};
+
+
+struct CliKernel
+{
+    const char *name;
+    enum DescaleMode mode;
+};
+
+
+static const struct CliKernel kernels[] = {
+    {"bilinear", DESCALE_MODE_BILINEAR},
+    {"bicubic", DESCALE_MODE_BICUBIC},
+    {"lanczos", DESCALE_MODE_LANCZOS},
+    {"spline16", DESCALE_MODE_SPLINE16},
+    {"spline36", DESCALE_MODE_SPLINE36},
+    {"spline64", DESCALE_MODE_SPLINE64},
+    {"point", DESCALE_MODE_POINT}
+};
+
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+static int get_num_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#endif
+}
+
+
+static int bytes_per_sample(int depth)
+{
+    return depth == 8 ? 1 : depth <= 16 ? 2 : 4;
+}
+
+
+static int plane_width(const struct CliFormat *f, int plane)
+{
+    return f->width >> (plane ? f->subsampling_h : 0);
+}
+
+
+static int plane_height(const struct CliFormat *f, int plane)
+{
+    return f->height >> (plane ? f->subsampling_v : 0);
+}
+
+
+static size_t frame_size(const struct CliFormat *f)
+{
+    size_t size = 0;
+    for (int plane = 0; plane < f->num_planes; plane++)
+        size += (size_t)plane_width(f, plane) * plane_height(f, plane) * bytes_per_sample(f->depth);
+    return size;
+}
+
+
+static bool parse_size(const char *s, int *width, int *height)
+{
+    return sscanf(s, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+
+static bool parse_format(const char *s, struct CliFormat *f)
+{
+    f->num_planes = 3;
+    f->subsampling_h = 0;
+    f->subsampling_v = 0;
+    if (!strcmp(s, "gray")) {
+        f->num_planes = 1;
+    } else if (!strcmp(s, "yuv420")) {
+        f->subsampling_h = 1;
+        f->subsampling_v = 1;
+    } else if (!strcmp(s, "yuv422")) {
+        f->subsampling_h = 1;
+    } else if (strcmp(s, "yuv444")) {
+        return false;
+    }
+    return true;
+}
+
+
+static bool valid_depth(int depth)
+{
+    return depth == 8 || depth == 10 || depth == 12 || depth == 14 || depth == 16 || depth == 32;
+}
+
+
+// Colorspace tags like 420jpeg, 420p10, 444p16, mono or mono16
+static bool parse_y4m_colorspace(const char *tag, struct CliFormat *f)
+{
+    const char *rest;
+    if (!strncmp(tag, "mono", 4)) {
+        parse_format("gray", f);
+        rest = tag + 4;
+        f->depth = *rest ? atoi(rest) : 8;
+        return valid_depth(f->depth) && f->depth <= 16;
+    } else if (!strncmp(tag, "420", 3)) {
+        parse_format("yuv420", f);
+    } else if (!strncmp(tag, "422", 3)) {
+        parse_format("yuv422", f);
+    } else if (!strncmp(tag, "444", 3)) {
+        parse_format("yuv444", f);
+    } else {
+        return false;
+    }
+    rest = tag + 3;
+    // 420jpeg, 420mpeg2 and 420paldv only differ in chroma siting
+    if (!*rest || !strcmp(rest, "jpeg") || !strcmp(rest, "mpeg2") || !strcmp(rest, "paldv"))
+        f->depth = 8;
+    else if (*rest == 'p')
+        f->depth = atoi(rest + 1);
+    else
+        return false;
+    return valid_depth(f->depth) && f->depth <= 16;
+}
+
+
+static const char *y4m_colorspace(const struct CliFormat *f, char *buffer, size_t size)
+{
+    const char *base = f->num_planes == 1 ? "mono" : f->subsampling_v ? "420" : f->subsampling_h ? "422" : "444";
+    if (f->depth == 8)
+        snprintf(buffer, size, "%s%s", base, f->subsampling_v ? "jpeg" : "");
+    else
+        snprintf(buffer, size, f->num_planes == 1 ? "%s%d" : "%sp%d", base, f->depth);
+    return buffer;
+}
+
+
+static bool read_line(FILE *in, char *buffer, size_t size)
+{
+    size_t i = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n') {
+        if (i + 1 < size)
+            buffer[i++] = (char)c;
+    }
+    buffer[i] = '\0';
+    return c == '\n';
+}
+
+
+/*
+ * Parses the stream header. The descaled stream keeps the format, so
+ * all tags other than the size are passed through to the output header.
+ */
+static bool read_y4m_header(FILE *in, struct CliFormat *f, char *tags, size_t tags_size)
+{
+    char header[Y4M_HEADER_SIZE];
+    if (!read_line(in, header, sizeof header) || strncmp(header, "YUV4MPEG2 ", 10))
+        return false;
+
+    tags[0] = '\0';
+    parse_y4m_colorspace("420", f);
+    f->width = f->height = 0;
+    for (char *token = strtok(header + 10, " "); token; token = strtok(NULL, " ")) {
+        if (token[0] == 'W') {
+            f->width = atoi(token + 1);
+        } else if (token[0] == 'H') {
+            f->height = atoi(token + 1);
+        } else if (token[0] == 'C' && !parse_y4m_colorspace(token + 1, f)) {
+            return false;
+        } else if (strlen(tags) + strlen(token) + 2 < tags_size) {
+            strcat(tags, " ");
+            strcat(tags, token);
+        }
+    }
+    return f->width > 0 && f->height > 0;
+}
+
+
+// Returns 1 for a frame, 0 at the end of the stream and -1 on errors
+static int read_frame(FILE *in, bool y4m, unsigned char *frame, size_t size)
+{
+    if (y4m) {
+        char header[Y4M_HEADER_SIZE];
+        int c = fgetc(in);
+        if (c == EOF)
+            return 0;
+        ungetc(c, in);
+        if (!read_line(in, header, sizeof header) || strncmp(header, "FRAME", 5))
+            return -1;
+    }
+
+    size_t n = fread(frame, 1, size, in);
+    if (n == 0 && !y4m)
+        return 0;
+    return n == size ? 1 : -1;
+}
+
+
+static void unpack_plane(const unsigned char *src, int width, int height, int depth, float *dstp, int dst_stride)
+{
+    float scale = 1.0f / (float)((1 << depth) - 1);
+    for (int y = 0; y < height; y++) {
+        float *row = dstp + (size_t)y * dst_stride;
+        if (depth == 8) {
+            for (int x = 0; x < width; x++)
+                row[x] = src[x] * scale;
+        } else if (depth <= 16) {
+            for (int x = 0; x < width; x++)
+                row[x] = (src[2 * x] | src[2 * x + 1] << 8) * scale;
+        } else {
+            memcpy(row, src, width * sizeof (float));
+        }
+        src += (size_t)width * bytes_per_sample(depth);
+    }
+}
+
+
+static void pack_plane(const float *srcp, int src_stride, int width, int height, int depth, unsigned char *dst)
+{
+    struct DescaleSampleFormat format = { depth == 8 ? DESCALE_SAMPLE_U8 : DESCALE_SAMPLE_U16, depth };
+    float peak = descale_sample_peak(&format);
+    for (int y = 0; y < height; y++) {
+        const float *row = srcp + (size_t)y * src_stride;
+        if (depth == 8) {
+            for (int x = 0; x < width; x++)
+                descale_store_sample(dst, x, row[x], &format, peak, 0.0f);
+        } else if (depth <= 16) {
+            for (int x = 0; x < width; x++) {
+                uint16_t v;
+                descale_store_sample(&v, 0, row[x], &format, peak, 0.0f);
+                dst[2 * x] = (unsigned char)v;
+                dst[2 * x + 1] = (unsigned char)(v >> 8);
+            }
+        } else {
+            memcpy(dst, row, width * sizeof (float));
+        }
+        dst += (size_t)width * bytes_per_sample(depth);
+    }
+}
+
+
+static void process_slot(struct CliPipeline *p, struct CliSlot *slot)
+{
+    const unsigned char *in = slot->in;
+    for (int plane = 0; plane < p->in_format.num_planes; plane++) {
+        int width = plane_width(&p->in_format, plane), height = plane_height(&p->in_format, plane);
+        unpack_plane(in, width, height, p->in_format.depth, slot->src[plane], slot->src_stride[plane]);
+        in += (size_t)width * height * bytes_per_sample(p->in_format.depth);
+    }
+
+    descale_context_process(p->ctx, (const float *const *)slot->src, slot->src_stride, slot->dst, slot->dst_stride);
+
+    unsigned char *out = slot->out;
+    for (int plane = 0; plane < p->out_format.num_planes; plane++) {
+        int width = plane_width(&p->out_format, plane), height = plane_height(&p->out_format, plane);
+        pack_plane(slot->dst[plane], slot->dst_stride[plane], width, height, p->out_format.depth, out);
+        out += (size_t)width * height * bytes_per_sample(p->out_format.depth);
+    }
+}
+
+
+static void *worker_main(void *arg)
+{
+    struct CliPipeline *p = (struct CliPipeline *)arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->next_frame >= p->frames_read && !p->eof && !p->failed)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->next_frame >= p->frames_read || p->failed)
+            break;
+
+        struct CliSlot *slot = &p->slots[p->next_frame++ % p->num_slots];
+        pthread_mutex_unlock(&p->lock);
+
+        process_slot(p, slot);
+
+        pthread_mutex_lock(&p->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+
+// Writes the frames in input order as soon as they are done
+static void *writer_main(void *arg)
+{
+    struct CliPipeline *p = (struct CliPipeline *)arg;
+    size_t size = frame_size(&p->out_format);
+
+    for (long long n = 0;; n++) {
+        struct CliSlot *slot = &p->slots[n % p->num_slots];
+
+        pthread_mutex_lock(&p->lock);
+        while (!(n < p->frames_read && slot->state == SLOT_DONE) && !(p->eof && n >= p->frames_read) && !p->failed)
+            pthread_cond_wait(&p->cond, &p->lock);
+        bool done = n >= p->frames_read || p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (done)
+            break;
+
+        bool ok = (!p->y4m_out || fputs("FRAME\n", p->out) >= 0) && fwrite(slot->out, 1, size, p->out) == size;
+
+        pthread_mutex_lock(&p->lock);
+        if (ok) {
+            slot->state = SLOT_FREE;
+            p->frames_written++;
+        } else {
+            p->failed = true;
+        }
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+
+static float *alloc_plane(int width, int height, int *stride)
+{
+    *stride = ceil_n(width, 16);
+    float *p;
+    descale_aligned_malloc((void **)&p, (size_t)*stride * height * sizeof (float), 64);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+
+static void init_slot(struct CliSlot *slot, const struct CliFormat *in_format, const struct CliFormat *out_format)
+{
+    slot->state = SLOT_FREE;
+    slot->in = malloc(frame_size(in_format));
+    slot->out = malloc(frame_size(out_format));
+    if (!slot->in || !slot->out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (int plane = 0; plane < in_format->num_planes; plane++) {
+        slot->src[plane] = alloc_plane(plane_width(in_format, plane), plane_height(in_format, plane), &slot->src_stride[plane]);
+        slot->dst[plane] = alloc_plane(plane_width(out_format, plane), plane_height(out_format, plane), &slot->dst_stride[plane]);
+    }
+}
+
+
+static void free_slot(struct CliSlot *slot, int num_planes)
+{
+    free(slot->in);
+    free(slot->out);
+    for (int plane = 0; plane < num_planes; plane++) {
+        descale_aligned_free(slot->src[plane]);
+        descale_aligned_free(slot->dst[plane]);
+    }
+}
+
+
+static int run_out_of_core(struct DescaleContext *ctx, const char *input, const char *output, int depth, int memory)
+{
+    double start = get_time();
+    long long frames = descale_context_process_file(ctx, input, output, depth, (size_t)memory << 20);
+    double elapsed = get_time() - start;
+    descale_context_free(ctx);
+
+    if (frames < 0) {
+        fprintf(stderr, "Could not descale %s into %s, is the input a whole number of frames?\n", input, output);
+        return 1;
+    }
+    fprintf(stderr, "%lld frames in %.2f s (%.2f fps)\n", frames, elapsed, frames / elapsed);
+    return 0;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s --width W --height H [--kernel bicubic] [--b 0.0] [--c 0.5] [--taps 3] [--blur 1.0]\n"
+                    "       [--src-left X] [--src-top Y] [--src-width W] [--src-height H] [--border 0|1|2]\n"
+                    "       [--raw WxH] [--format gray|yuv420|yuv422|yuv444] [--depth 8|10|12|16|32]\n"
+                    "       [--output-format y4m|raw] [--threads N] [--queue N] [--opt N] [--input file] [--output file]\n"
+                    "       [--out-of-core] [--memory MiB] [--half-intermediate]\n", argv0);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct DescaleFrameParams params = {0};
+    struct CliFormat in_format = {0, 0, 3, 1, 1, 8};
+    const char *input = "-", *output = "-", *output_format = NULL;
+    bool raw = false, out_of_core = false;
+    int memory = 0;
+    int threads = get_num_cpus(), queue = 0;
+    params.params.mode = DESCALE_MODE_BICUBIC;
+    params.params.param2 = 0.5;
+    params.params.taps = 3;
+
+    for (int i = 1; i < argc; i++) {
+        bool ok = true;
+        if (!strcmp(argv[i], "--out-of-core")) {
+            out_of_core = true;
+        } else if (!strcmp(argv[i], "--half-intermediate")) {
+            params.half_intermediate = true;
+        } else if (i + 1 >= argc) {
+            ok = false;
+        } else if (!strcmp(argv[i], "--width")) {
+            params.dst_width = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--height")) {
+            params.dst_height = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--kernel")) {
+            ok = false;
+            i++;
+            for (size_t k = 0; k < sizeof kernels / sizeof kernels[0]; k++) {
+                if (!strcmp(argv[i], kernels[k].name)) {
+                    params.params.mode = kernels[k].mode;
+                    ok = true;
+                }
+            }
+        } else if (!strcmp(argv[i], "--b")) {
+            params.params.param1 = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--c")) {
+            params.params.param2 = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--taps")) {
+            params.params.taps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--blur")) {
+            params.params.blur = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--src-left")) {
+            params.shift_h = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--src-top")) {
+            params.shift_v = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--src-width")) {
+            params.active_width = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--src-height")) {
+            params.active_height = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--border")) {
+            params.params.border_handling = (enum DescaleBorder)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--raw")) {
+            raw = true;
+            ok = parse_size(argv[++i], &in_format.width, &in_format.height);
+        } else if (!strcmp(argv[i], "--format")) {
+            ok = parse_format(argv[++i], &in_format);
+        } else if (!strcmp(argv[i], "--depth")) {
+            ok = valid_depth(in_format.depth = atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--output-format")) {
+            output_format = argv[++i];
+            ok = !strcmp(output_format, "y4m") || !strcmp(output_format, "raw");
+        } else if (!strcmp(argv[i], "--threads")) {
+            ok = (threads = atoi(argv[++i])) > 0;
+        } else if (!strcmp(argv[i], "--memory")) {
+            ok = (memory = atoi(argv[++i])) > 0;
+        } else if (!strcmp(argv[i], "--queue")) {
+            ok = (queue = atoi(argv[++i])) > 0;
+        } else if (!strcmp(argv[i], "--opt")) {
+            params.opt = (enum DescaleOpt)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--input")) {
+            input = argv[++i];
+        } else if (!strcmp(argv[i], "--output")) {
+            output = argv[++i];
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (params.dst_width < 1 || params.dst_height < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (out_of_core && (!raw || !strcmp(input, "-") || !strcmp(output, "-") || (output_format && strcmp(output_format, "raw")))) {
+        fprintf(stderr, "--out-of-core needs --raw input and output files\n");
+        return 1;
+    }
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    // The out-of-core mode maps the files itself
+    FILE *in = NULL, *out = NULL;
+    if (!out_of_core) {
+        in = strcmp(input, "-") ? fopen(input, "rb") : stdin;
+        out = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+        if (!in || !out) {
+            fprintf(stderr, "Could not open %s\n", in ? output : input);
+            return 1;
+        }
+    }
+
+    char tags[Y4M_HEADER_SIZE] = "";
+    if (!raw && !read_y4m_header(in, &in_format, tags, sizeof tags)) {
+        fprintf(stderr, "Unsupported or broken y4m header, use --raw for raw input\n");
+        return 1;
+    }
+
+    struct CliPipeline p = {0};
+    p.in_format = in_format;
+    p.out_format = in_format;
+    p.out_format.width = params.dst_width;
+    p.out_format.height = params.dst_height;
+    p.y4m_out = output_format ? !strcmp(output_format, "y4m") : !raw;
+    p.out = out;
+    if (p.y4m_out && in_format.depth == 32) {
+        fprintf(stderr, "y4m can not store float samples, use --output-format raw\n");
+        return 1;
+    }
+
+    params.src_width = in_format.width;
+    params.src_height = in_format.height;
+    params.num_planes = in_format.num_planes;
+    params.subsampling_h = in_format.subsampling_h;
+    params.subsampling_v = in_format.subsampling_v;
+    p.ctx = descale_context_create(&params);
+    if (!p.ctx) {
+        fprintf(stderr, "Invalid descale parameters for a %dx%d input\n", in_format.width, in_format.height);
+        return 1;
+    }
+    if (out_of_core)
+        return run_out_of_core(p.ctx, input, output, in_format.depth, memory);
+
+    if (p.y4m_out) {
+        char colorspace[16];
+        if (raw)
+            snprintf(tags, sizeof tags, " C%s", y4m_colorspace(&p.out_format, colorspace, sizeof colorspace));
+        fprintf(out, "YUV4MPEG2 W%d H%d%s\n", p.out_format.width, p.out_format.height, tags);
+    }
+
+    p.num_slots = queue ? queue : 2 * threads;
+    p.slots = calloc(p.num_slots, sizeof (struct CliSlot));
+    for (int i = 0; i < p.num_slots; i++)
+        init_slot(&p.slots[i], &p.in_format, &p.out_format);
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    double start = get_time();
+    pthread_t writer;
+    pthread_t *workers = malloc(threads * sizeof (pthread_t));
+    pthread_create(&writer, NULL, &writer_main, &p);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&workers[t], NULL, &worker_main, &p);
+
+    size_t size = frame_size(&in_format);
+    bool read_error = false;
+    for (long long n = 0;; n++) {
+        struct CliSlot *slot = &p.slots[n % p.num_slots];
+
+        pthread_mutex_lock(&p.lock);
+        while (slot->state != SLOT_FREE && !p.failed)
+            pthread_cond_wait(&p.cond, &p.lock);
+        bool failed = p.failed;
+        pthread_mutex_unlock(&p.lock);
+        if (failed)
+            break;
+
+        int status = read_frame(in, !raw, slot->in, size);
+        read_error = status < 0;
+        if (status <= 0)
+            break;
+
+        pthread_mutex_lock(&p.lock);
+        slot->state = SLOT_READ;
+        p.frames_read = n + 1;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.eof = true;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+
+    for (int t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+    pthread_join(writer, NULL);
+    double elapsed = get_time() - start;
+
+    if (read_error)
+        fprintf(stderr, "Truncated or broken input frame %lld\n", p.frames_read);
+    if (p.failed)
+        fprintf(stderr, "Could not write frame %lld\n", p.frames_written);
+    fprintf(stderr, "%lld frames in %.2f s (%.2f fps)\n", p.frames_written, elapsed, p.frames_written / elapsed);
+
+    fflush(out);
+    if (in != stdin)
+        fclose(in);
+    if (out != stdout)
+        fclose(out);
+    for (int i = 0; i < p.num_slots; i++)
+        free_slot(&p.slots[i], in_format.num_planes);
+    free(p.slots);
+    free(workers);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    descale_context_free(p.ctx);
+
+    return read_error || p.failed;
+}
@@ -0,0 +1,913 @@
+/*
+ * Frame scheduling harness for the VapourSynth plugin.
+ *
+ * Loads the plugin through VapourSynthPluginInit2() against a small
+ * in-process stand-in for the VapourSynth API and lets N worker threads
+ * pull frames through the filter's getFrame function, like VapourSynth
+ * does for fmParallel filters. This includes the lazy core initialization,
+ * the per-frame allocations and the memory bandwidth of all threads
+ * running at once, which a single-call benchmark does not see.
+ *
+ * For every thread count from 1 to --threads (default: all cores) a fresh
+ * filter instance is created, and the time of its first frame as well as
+ * the steady-state frames/s and per-thread efficiency relative to one
+ * thread are written as JSON to stdout.
+ *
+ * Usage: descale-vs-harness [--function Debicubic] [--format gray|yuv420|yuv444|rgb]
+ *                           [--src WxH] [--dst WxH] [--frames N] [--threads N]
+ *                           [--opt N] [--parallel-planes] [--stats] [--autotune] [--cache N]
+ *                           [--roi X,Y,WxH] [--frame-props] [--ignore-mask] [--transfer srgb|bt1886|pq|hlg]
+ *
+ * Source frames come from a pool of a few random frames instead of a
+ * real source filter, and output frames are allocated with malloc,
+ * so frame buffer reuse of a real core is not modelled. The pool
+ * repeats every 8 frames, so with --cache 8 or more every later frame
+ * is a duplicate. With --frame-props the second half of the pool carries
+ * a shifted descale geometry, so the filter switches between two sets
+ * of cores every 4 frames. --ignore-mask passes a mask that hides a
+ * box in the lower part of the frame, which moves from frame to frame.
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <VapourSynth4.h>
+#include "common.h"
+
+
+#define SOURCE_POOL_SIZE 8
+#define MAX_FUNCTIONS 32
+
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi);
+
+
+/*
+ * Minimal implementations of the opaque VapourSynth types
+ */
+
+enum HarnessValueType
+{
+    VALUE_INT,
+    VALUE_FLOAT,
+    VALUE_NODE,
+    VALUE_FUNCTION,
+    VALUE_DATA
+};
+
+
+struct MapEntry
+{
+    char *key;
+    enum HarnessValueType type;
+    int size;
+    union {
+        int64_t *i;
+        double *f;
+        VSNode **node;
+        VSFunction **func;
+        char **data;
+    } v;
+};
+
+
+struct VSMap
+{
+    int num_entries;
+    struct MapEntry entries[32];
+    char *error;
+};
+
+
+struct VSFrame
+{
+    VSVideoFormat format;
+    int width[3], height[3];
+    ptrdiff_t stride[3];
+    uint8_t *data[3];
+    VSMap *props;
+    int refcount;
+    bool pooled;    // owned by the source pool, never freed by freeFrame
+};
+
+
+struct VSNode
+{
+    VSVideoInfo vi;
+    int refcount;
+
+    // Source nodes hand out frames of the pool
+    VSFrame *pool[SOURCE_POOL_SIZE];
+
+    // Filter nodes created by the plugin
+    VSFilterGetFrame get_frame;
+    VSFilterFree free;
+    void *instance_data;
+};
+
+
+struct VSFrameContext
+{
+    int n;
+};
+
+
+struct VSCore
+{
+    int unused;
+};
+
+
+struct VSPlugin
+{
+    int num_functions;
+    const char *names[MAX_FUNCTIONS];
+    VSPublicFunction funcs[MAX_FUNCTIONS];
+    void *data[MAX_FUNCTIONS];
+};
+
+
+static VSAPI api;
+static VSCore core;
+
+
+static struct MapEntry *map_find(const VSMap *map, const char *key)
+{
+    for (int i = 0; i < map->num_entries; i++) {
+        if (!strcmp(map->entries[i].key, key))
+            return (struct MapEntry *)&map->entries[i];
+    }
+    return NULL;
+}
+
+
+static void map_free_values(struct MapEntry *e)
+{
+    if (e->type == VALUE_DATA) {
+        for (int i = 0; i < e->size; i++)
+            free(e->v.data[i]);
+    }
+    free(e->v.i);
+}
+
+
+static struct MapEntry *map_set(VSMap *map, const char *key, enum HarnessValueType type, int size)
+{
+    struct MapEntry *e = map_find(map, key);
+    if (!e) {
+        e = &map->entries[map->num_entries++];
+        e->key = strdup(key);
+    } else {
+        map_free_values(e);
+    }
+    e->type = type;
+    e->size = size;
+    e->v.i = calloc(size, sizeof (int64_t));
+    return e;
+}
+
+
+static const struct MapEntry *map_get(const VSMap *map, const char *key, enum HarnessValueType type, int index, int *error)
+{
+    const struct MapEntry *e = map_find(map, key);
+    int err = 0;
+    if (!e)
+        err = peUnset;
+    else if (e->type != type)
+        err = peType;
+    else if (index >= e->size)
+        err = peIndex;
+    if (error)
+        *error = err;
+    else if (err)
+        abort();
+    return err ? NULL : e;
+}
+
+
+static VSMap *VS_CC create_map(void)
+{
+    return calloc(1, sizeof (VSMap));
+}
+
+
+static void VS_CC free_map(VSMap *map)
+{
+    if (!map)
+        return;
+    for (int i = 0; i < map->num_entries; i++) {
+        free(map->entries[i].key);
+        map_free_values(&map->entries[i]);
+    }
+    free(map->error);
+    free(map);
+}
+
+
+static void VS_CC map_set_error(VSMap *map, const char *error)
+{
+    free(map->error);
+    map->error = strdup(error);
+}
+
+
+static const char *VS_CC map_get_error(const VSMap *map)
+{
+    return map->error;
+}
+
+
+static int VS_CC map_num_elements(const VSMap *map, const char *key)
+{
+    const struct MapEntry *e = map_find(map, key);
+    return e ? e->size : -1;
+}
+
+
+static int64_t VS_CC map_get_int(const VSMap *map, const char *key, int index, int *error)
+{
+    const struct MapEntry *e = map_get(map, key, VALUE_INT, index, error);
+    return e ? e->v.i[index] : 0;
+}
+
+
+static int VS_CC map_get_int_saturated(const VSMap *map, const char *key, int index, int *error)
+{
+    int64_t i = map_get_int(map, key, index, error);
+    return i > INT32_MAX ? INT32_MAX : i < INT32_MIN ? INT32_MIN : (int)i;
+}
+
+
+static int VS_CC map_set_int(VSMap *map, const char *key, int64_t i, int append)
+{
+    map_set(map, key, VALUE_INT, 1)->v.i[0] = i;
+    return 0;
+}
+
+
+static int VS_CC map_set_int_array(VSMap *map, const char *key, const int64_t *i, int size)
+{
+    memcpy(map_set(map, key, VALUE_INT, size)->v.i, i, size * sizeof (int64_t));
+    return 0;
+}
+
+
+static double VS_CC map_get_float(const VSMap *map, const char *key, int index, int *error)
+{
+    const struct MapEntry *e = map_get(map, key, VALUE_FLOAT, index, error);
+    return e ? e->v.f[index] : 0.0;
+}
+
+
+static int VS_CC map_set_float(VSMap *map, const char *key, double d, int append)
+{
+    map_set(map, key, VALUE_FLOAT, 1)->v.f[0] = d;
+    return 0;
+}
+
+
+static int VS_CC map_set_float_array(VSMap *map, const char *key, const double *d, int size)
+{
+    memcpy(map_set(map, key, VALUE_FLOAT, size)->v.f, d, size * sizeof (double));
+    return 0;
+}
+
+
+static const char *VS_CC map_get_data(const VSMap *map, const char *key, int index, int *error)
+{
+    const struct MapEntry *e = map_get(map, key, VALUE_DATA, index, error);
+    return e ? e->v.data[index] : NULL;
+}
+
+
+static int VS_CC map_set_data(VSMap *map, const char *key, const char *data, int size, int type, int append)
+{
+    struct MapEntry *e = map_find(map, key);
+    int old_size = e && e->type == VALUE_DATA && append ? e->size : 0;
+    char **values = calloc(old_size + 1, sizeof (char *));
+    for (int i = 0; i < old_size; i++)
+        values[i] = strdup(e->v.data[i]);
+    values[old_size] = size < 0 ? strdup(data) : strndup(data, size);
+
+    e = map_set(map, key, VALUE_DATA, 0);
+    free(e->v.i);
+    e->v.data = values;
+    e->size = old_size + 1;
+    return 0;
+}
+
+
+static int VS_CC map_delete_key(VSMap *map, const char *key)
+{
+    struct MapEntry *e = map_find(map, key);
+    if (!e)
+        return 0;
+    free(e->key);
+    map_free_values(e);
+    *e = map->entries[--map->num_entries];
+    return 1;
+}
+
+
+static VSNode *VS_CC map_get_node(const VSMap *map, const char *key, int index, int *error)
+{
+    const struct MapEntry *e = map_get(map, key, VALUE_NODE, index, error);
+    if (!e)
+        return NULL;
+    e->v.node[index]->refcount++;
+    return e->v.node[index];
+}
+
+
+static int VS_CC map_set_node(VSMap *map, const char *key, VSNode *node, int append)
+{
+    node->refcount++;
+    map_set(map, key, VALUE_NODE, 1)->v.node[0] = node;
+    return 0;
+}
+
+
+static VSFunction *VS_CC map_get_function(const VSMap *map, const char *key, int index, int *error)
+{
+    const struct MapEntry *e = map_get(map, key, VALUE_FUNCTION, index, error);
+    return e ? e->v.func[index] : NULL;
+}
+
+
+static void VS_CC call_function(VSFunction *func, const VSMap *in, VSMap *out)
+{
+    map_set_error(out, "Custom kernels are not supported by the harness");
+}
+
+
+static void VS_CC free_function(VSFunction *func)
+{
+}
+
+
+static VSFrame *VS_CC new_video_frame(const VSVideoFormat *format, int width, int height, const VSFrame *prop_src, VSCore *c)
+{
+    VSFrame *f = calloc(1, sizeof (VSFrame));
+    f->format = *format;
+    for (int plane = 0; plane < format->numPlanes; plane++) {
+        f->width[plane] = width >> (plane ? format->subSamplingW : 0);
+        f->height[plane] = height >> (plane ? format->subSamplingH : 0);
+        f->stride[plane] = ceil_n(f->width[plane] * format->bytesPerSample, 64);
+        descale_aligned_malloc((void **)&f->data[plane], f->stride[plane] * f->height[plane], 64);
+    }
+    f->props = create_map();
+    f->refcount = 1;
+    return f;
+}
+
+
+static void VS_CC free_frame(const VSFrame *f)
+{
+    if (!f || f->pooled || __atomic_sub_fetch(&((VSFrame *)f)->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (int plane = 0; plane < f->format.numPlanes; plane++)
+        descale_aligned_free(f->data[plane]);
+    free_map(f->props);
+    free((VSFrame *)f);
+}
+
+
+static const VSFrame *VS_CC add_frame_ref(const VSFrame *f)
+{
+    __atomic_add_fetch(&((VSFrame *)f)->refcount, 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+
+static VSMap *VS_CC get_frame_properties_rw(VSFrame *f)
+{
+    return f->props;
+}
+
+
+static const VSMap *VS_CC get_frame_properties_ro(const VSFrame *f)
+{
+    return f->props;
+}
+
+
+static void VS_CC clear_map(VSMap *map)
+{
+    for (int i = 0; i < map->num_entries; i++) {
+        free(map->entries[i].key);
+        map_free_values(&map->entries[i]);
+    }
+    map->num_entries = 0;
+}
+
+
+static void VS_CC copy_map(const VSMap *src, VSMap *dst)
+{
+    for (int i = 0; i < src->num_entries; i++) {
+        const struct MapEntry *e = &src->entries[i];
+        if (e->type == VALUE_DATA) {
+            for (int j = 0; j < e->size; j++)
+                map_set_data(dst, e->key, e->v.data[j], -1, dtUtf8, j > 0);
+        } else if (e->type == VALUE_NODE) {
+            for (int j = 0; j < e->size; j++)
+                map_set_node(dst, e->key, e->v.node[j], j > 0);
+        } else {
+            // Ints, floats and function pointers all have 8 bytes
+            memcpy(map_set(dst, e->key, e->type, e->size)->v.i, e->v.i, e->size * sizeof (int64_t));
+        }
+    }
+}
+
+
+// Real frames share their data copy-on-write, here it is simply copied
+static VSFrame *VS_CC copy_frame(const VSFrame *f, VSCore *c)
+{
+    VSFrame *copy = new_video_frame(&f->format, f->width[0], f->height[0], NULL, c);
+    for (int plane = 0; plane < f->format.numPlanes; plane++)
+        memcpy(copy->data[plane], f->data[plane], f->stride[plane] * f->height[plane]);
+    copy_map(f->props, copy->props);
+    return copy;
+}
+
+
+static ptrdiff_t VS_CC get_stride(const VSFrame *f, int plane)
+{
+    return f->stride[plane];
+}
+
+
+static const uint8_t *VS_CC get_read_ptr(const VSFrame *f, int plane)
+{
+    return f->data[plane];
+}
+
+
+static uint8_t *VS_CC get_write_ptr(VSFrame *f, int plane)
+{
+    return f->data[plane];
+}
+
+
+static const VSVideoInfo *VS_CC get_video_info(VSNode *node)
+{
+    return &node->vi;
+}
+
+
+static void VS_CC free_node(VSNode *node)
+{
+    if (!node || --node->refcount > 0)
+        return;
+    if (node->free)
+        node->free(node->instance_data, &core, &api);
+    for (int i = 0; i < SOURCE_POOL_SIZE; i++) {
+        if (node->pool[i]) {
+            node->pool[i]->pooled = false;
+            free_frame(node->pool[i]);
+        }
+    }
+    free(node);
+}
+
+
+static void VS_CC create_video_filter(VSMap *out, const char *name, const VSVideoInfo *vi, VSFilterGetFrame get_frame, VSFilterFree free_func,
+                                      int filter_mode, const VSFilterDependency *dependencies, int num_deps, void *instance_data, VSCore *c)
+{
+    VSNode *node = calloc(1, sizeof (VSNode));
+    node->vi = *vi;
+    node->get_frame = get_frame;
+    node->free = free_func;
+    node->instance_data = instance_data;
+    map_set_node(out, "clip", node, 0);
+}
+
+
+static void VS_CC request_frame_filter(int n, VSNode *node, VSFrameContext *frame_ctx)
+{
+}
+
+
+// The harness only has source nodes as dependencies, so requested frames are always ready
+static const VSFrame *VS_CC get_frame_filter(int n, VSNode *node, VSFrameContext *frame_ctx)
+{
+    return node->pool[n % SOURCE_POOL_SIZE];
+}
+
+
+// Source frames are always ready, so the callback runs right away. Pooled frames ignore freeFrame, so no reference is added.
+static void VS_CC get_frame_async(int n, VSNode *node, VSFrameDoneCallback callback, void *user_data)
+{
+    callback(user_data, node->pool[n % SOURCE_POOL_SIZE], n, node, NULL);
+}
+
+
+static int VS_CC config_plugin(const char *identifier, const char *plugin_namespace, const char *name, int plugin_version, int api_version, int flags, VSPlugin *plugin)
+{
+    return 1;
+}
+
+
+static int VS_CC register_function(const char *name, const char *args, const char *return_type, VSPublicFunction args_func, void *function_data, VSPlugin *plugin)
+{
+    if (plugin->num_functions < MAX_FUNCTIONS) {
+        plugin->names[plugin->num_functions] = name;
+        plugin->funcs[plugin->num_functions] = args_func;
+        plugin->data[plugin->num_functions] = function_data;
+        plugin->num_functions++;
+    }
+    return 1;
+}
+
+
+static void init_api(void)
+{
+    api.createVideoFilter = &create_video_filter;
+    api.newVideoFrame = &new_video_frame;
+    api.freeFrame = &free_frame;
+    api.addFrameRef = &add_frame_ref;
+    api.copyFrame = &copy_frame;
+    api.getFramePropertiesRO = &get_frame_properties_ro;
+    api.clearMap = &clear_map;
+    api.copyMap = &copy_map;
+    api.getFramePropertiesRW = &get_frame_properties_rw;
+    api.getStride = &get_stride;
+    api.getReadPtr = &get_read_ptr;
+    api.getWritePtr = &get_write_ptr;
+    api.getVideoInfo = &get_video_info;
+    api.freeNode = &free_node;
+    api.callFunction = &call_function;
+    api.freeFunction = &free_function;
+    api.requestFrameFilter = &request_frame_filter;
+    api.getFrameFilter = &get_frame_filter;
+    api.getFrameAsync = &get_frame_async;
+    api.createMap = &create_map;
+    api.freeMap = &free_map;
+    api.mapSetError = &map_set_error;
+    api.mapGetError = &map_get_error;
+    api.mapNumElements = &map_num_elements;
+    api.mapGetInt = &map_get_int;
+    api.mapGetIntSaturated = &map_get_int_saturated;
+    api.mapSetInt = &map_set_int;
+    api.mapSetIntArray = &map_set_int_array;
+    api.mapGetFloat = &map_get_float;
+    api.mapSetFloat = &map_set_float;
+    api.mapSetFloatArray = &map_set_float_array;
+    api.mapGetData = &map_get_data;
+    api.mapSetData = &map_set_data;
+    api.mapDeleteKey = &map_delete_key;
+    api.mapGetNode = &map_get_node;
+    api.mapSetNode = &map_set_node;
+    api.mapGetFunction = &map_get_function;
+}
+
+
+/*
+ * The benchmark itself
+ */
+
+struct HarnessOptions
+{
+    const char *function;
+    VSVideoFormat format;
+    int src_width, src_height;
+    int dst_width, dst_height;
+    int frames;
+    int max_threads;
+    int opt;
+    bool parallel_planes;
+    bool stats;
+    bool autotune;
+    int cache_size;
+    int roi[4];     // left, top, width, height, unused if the width is 0
+    bool frame_props;
+    bool ignore_mask;
+    const char *transfer;   // NULL for the default
+};
+
+
+struct HarnessRun
+{
+    VSNode *filter;
+    int frames;
+    int next_frame;
+    int failed;
+};
+
+
+static double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+static int get_num_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#endif
+}
+
+
+static bool parse_size(const char *s, int *width, int *height)
+{
+    return sscanf(s, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+
+static bool parse_format(const char *s, VSVideoFormat *format)
+{
+    VSVideoFormat f = {cfYUV, stFloat, 32, 4, 0, 0, 3};
+    if (!strcmp(s, "gray")) {
+        f.colorFamily = cfGray;
+        f.numPlanes = 1;
+    } else if (!strcmp(s, "yuv420")) {
+        f.subSamplingW = 1;
+        f.subSamplingH = 1;
+    } else if (!strcmp(s, "rgb")) {
+        f.colorFamily = cfRGB;
+    } else if (strcmp(s, "yuv444")) {
+        return false;
+    }
+    *format = f;
+    return true;
+}
+
+
+static VSVideoInfo source_info(const struct HarnessOptions *opts)
+{
+    VSVideoInfo vi;
+    vi.format = opts->format;
+    vi.fpsNum = 24000;
+    vi.fpsDen = 1001;
+    vi.width = opts->src_width;
+    vi.height = opts->src_height;
+    vi.numFrames = opts->frames;
+    return vi;
+}
+
+
+static VSNode *create_source(const struct HarnessOptions *opts)
+{
+    VSNode *node = calloc(1, sizeof (VSNode));
+    node->refcount = 1;
+    node->vi = source_info(opts);
+
+    uint32_t seed = 1;
+    for (int i = 0; i < SOURCE_POOL_SIZE; i++) {
+        VSFrame *f = new_video_frame(&opts->format, opts->src_width, opts->src_height, NULL, &core);
+        for (int plane = 0; plane < opts->format.numPlanes; plane++) {
+            for (int y = 0; y < f->height[plane]; y++) {
+                float *row = (float *)(f->data[plane] + y * f->stride[plane]);
+                for (int x = 0; x < f->width[plane]; x++) {
+                    seed = seed * 1664525u + 1013904223u;
+                    row[x] = (float)(seed >> 8) / (float)(1 << 24);
+                }
+            }
+        }
+        if (opts->frame_props && i >= SOURCE_POOL_SIZE / 2) {
+            map_set_float(f->props, "DescaleSrcLeft", 0.25, 0);
+            map_set_float(f->props, "DescaleSrcTop", 0.25, 0);
+        }
+        f->pooled = true;
+        node->pool[i] = f;
+    }
+    return node;
+}
+
+
+static VSNode *create_mask(const struct HarnessOptions *opts)
+{
+    VSVideoFormat format = opts->format;
+    format.sampleType = stInteger;
+    format.bitsPerSample = 8;
+    format.bytesPerSample = 1;
+
+    VSNode *node = calloc(1, sizeof (VSNode));
+    node->refcount = 1;
+    node->vi = source_info(opts);
+    node->vi.format = format;
+
+    for (int i = 0; i < SOURCE_POOL_SIZE; i++) {
+        VSFrame *f = new_video_frame(&format, opts->src_width, opts->src_height, NULL, &core);
+        for (int plane = 0; plane < format.numPlanes; plane++) {
+            int width = f->width[plane], height = f->height[plane];
+            for (int y = 0; y < height; y++) {
+                uint8_t *row = f->data[plane] + y * f->stride[plane];
+                for (int x = 0; x < width; x++)
+                    row[x] = y > height * 3 / 4 && y < height * 7 / 8 && x > width / 4 + i && x < width * 3 / 4 + i ? 255 : 0;
+            }
+        }
+        f->pooled = true;
+        node->pool[i] = f;
+    }
+    return node;
+}
+
+
+static VSNode *create_filter(const struct HarnessOptions *opts, VSPlugin *plugin, VSNode *source, VSNode *mask)
+{
+    VSPublicFunction func = NULL;
+    void *data = NULL;
+    for (int i = 0; i < plugin->num_functions; i++) {
+        if (!strcmp(plugin->names[i], opts->function)) {
+            func = plugin->funcs[i];
+            data = plugin->data[i];
+        }
+    }
+    if (!func) {
+        fprintf(stderr, "Unknown function %s\n", opts->function);
+        return NULL;
+    }
+
+    VSMap *in = create_map();
+    VSMap *out = create_map();
+    map_set_node(in, "src", source, 0);
+    map_set_int(in, "width", opts->dst_width, 0);
+    map_set_int(in, "height", opts->dst_height, 0);
+    map_set_int(in, "opt", opts->opt, 0);
+    map_set_int(in, "parallel_planes", opts->parallel_planes, 0);
+    map_set_int(in, "stats", opts->stats, 0);
+    map_set_int(in, "autotune", opts->autotune, 0);
+    map_set_int(in, "cache_size", opts->cache_size, 0);
+    if (opts->roi[2] > 0) {
+        int64_t roi[4] = {opts->roi[0], opts->roi[1], opts->roi[2], opts->roi[3]};
+        map_set_int_array(in, "roi", roi, 4);
+    }
+    map_set_int(in, "frame_props", opts->frame_props, 0);
+    if (mask)
+        map_set_node(in, "ignore_mask", mask, 0);
+    if (opts->transfer)
+        map_set_data(in, "transfer", opts->transfer, -1, dtUtf8, 0);
+
+    func(in, out, data, &core, &api);
+
+    VSNode *filter = NULL;
+    if (map_get_error(out))
+        fprintf(stderr, "%s\n", map_get_error(out));
+    else
+        filter = map_get_node(out, "clip", 0, NULL);
+
+    // The maps hold references of their own
+    source->refcount--;
+    if (mask)
+        mask->refcount--;
+    if (filter)
+        filter->refcount--;
+    free_map(in);
+    free_map(out);
+
+    return filter;
+}
+
+
+static bool process_frame(VSNode *filter, int n)
+{
+    struct VSFrameContext frame_ctx = {n};
+    void *frame_data = NULL;
+
+    filter->get_frame(n, arInitial, filter->instance_data, &frame_data, &frame_ctx, &core, &api);
+    const VSFrame *dst = filter->get_frame(n, arAllFramesReady, filter->instance_data, &frame_data, &frame_ctx, &core, &api);
+    free_frame(dst);
+
+    return dst != NULL;
+}
+
+
+static void *worker_main(void *arg)
+{
+    struct HarnessRun *run = (struct HarnessRun *)arg;
+    int n;
+    while ((n = __atomic_fetch_add(&run->next_frame, 1, __ATOMIC_RELAXED)) < run->frames) {
+        if (!process_frame(run->filter, n))
+            __atomic_add_fetch(&run->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [--function Debicubic] [--format gray|yuv420|yuv444|rgb] [--src WxH] [--dst WxH]\n"
+                    "       [--frames N] [--threads N] [--opt N] [--parallel-planes] [--stats] [--autotune] [--cache N]\n"
+                    "       [--roi X,Y,WxH] [--frame-props] [--ignore-mask] [--transfer srgb|bt1886|pq|hlg]\n", argv0);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct HarnessOptions opts = {"Debicubic", {cfYUV, stFloat, 32, 4, 1, 1, 3}, 1920, 1080, 1280, 720, 240, get_num_cpus(), 0, false, false};
+
+    for (int i = 1; i < argc; i++) {
+        bool ok = true;
+        if (!strcmp(argv[i], "--parallel-planes"))
+            opts.parallel_planes = true;
+        else if (!strcmp(argv[i], "--stats"))
+            opts.stats = true;
+        else if (!strcmp(argv[i], "--autotune"))
+            opts.autotune = true;
+        else if (!strcmp(argv[i], "--frame-props"))
+            opts.frame_props = true;
+        else if (!strcmp(argv[i], "--ignore-mask"))
+            opts.ignore_mask = true;
+        else if (i + 1 >= argc)
+            ok = false;
+        else if (!strcmp(argv[i], "--function"))
+            opts.function = argv[++i];
+        else if (!strcmp(argv[i], "--format"))
+            ok = parse_format(argv[++i], &opts.format);
+        else if (!strcmp(argv[i], "--src"))
+            ok = parse_size(argv[++i], &opts.src_width, &opts.src_height);
+        else if (!strcmp(argv[i], "--dst"))
+            ok = parse_size(argv[++i], &opts.dst_width, &opts.dst_height);
+        else if (!strcmp(argv[i], "--frames"))
+            ok = (opts.frames = atoi(argv[++i])) > 0;
+        else if (!strcmp(argv[i], "--threads"))
+            ok = (opts.max_threads = atoi(argv[++i])) > 0;
+        else if (!strcmp(argv[i], "--opt"))
+            opts.opt = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cache"))
+            ok = (opts.cache_size = atoi(argv[++i])) >= 0;
+        else if (!strcmp(argv[i], "--transfer"))
+            opts.transfer = argv[++i];
+        else if (!strcmp(argv[i], "--roi"))
+            ok = sscanf(argv[++i], "%d,%d,%dx%d", &opts.roi[0], &opts.roi[1], &opts.roi[2], &opts.roi[3]) == 4 && opts.roi[2] > 0 && opts.roi[3] > 0;
+        else
+            ok = false;
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    init_api();
+    VSPlugin plugin = {0};
+    VSPLUGINAPI plugin_api = {0};
+    plugin_api.configPlugin = &config_plugin;
+    plugin_api.registerFunction = &register_function;
+    VapourSynthPluginInit2(&plugin, &plugin_api);
+
+    VSNode *source = create_source(&opts);
+    VSNode *mask = opts.ignore_mask ? create_mask(&opts) : NULL;
+
+    printf("{\n  \"function\": \"%s\", \"src\": [%d, %d], \"dst\": [%d, %d], \"planes\": %d, \"frames\": %d, \"parallel_planes\": %s,\n  \"results\": [",
+           opts.function, opts.src_width, opts.src_height, opts.dst_width, opts.dst_height, opts.format.numPlanes, opts.frames,
+           opts.parallel_planes ? "true" : "false");
+
+    double single_fps = 0.0;
+    for (int threads = 1; threads <= opts.max_threads; threads++) {
+        VSNode *filter = create_filter(&opts, &plugin, source, mask);
+        if (!filter)
+            return 1;
+
+        // The first frame initializes the cores
+        double start = get_time();
+        process_frame(filter, 0);
+        double first_frame = get_time() - start;
+
+        struct HarnessRun run = {filter, opts.frames, 0, 0};
+        pthread_t *workers = malloc(threads * sizeof (pthread_t));
+        start = get_time();
+        for (int t = 0; t < threads; t++)
+            pthread_create(&workers[t], NULL, &worker_main, &run);
+        for (int t = 0; t < threads; t++)
+            pthread_join(workers[t], NULL);
+        double elapsed = get_time() - start;
+        free(workers);
+
+        double fps = opts.frames / elapsed;
+        if (threads == 1)
+            single_fps = fps;
+        double efficiency = fps / (single_fps * threads);
+
+        printf("%s\n    {\"threads\": %d, \"first_frame_ms\": %.3f, \"fps\": %.2f, \"speedup\": %.3f, \"efficiency\": %.3f, \"failed\": %d}",
+               threads == 1 ? "" : ",", threads, first_frame * 1e3, fps, fps / single_fps, efficiency, run.failed);
+        fflush(stdout);
+        fprintf(stderr, "%3d threads: %8.2f fps, efficiency %5.1f%%\n", threads, fps, efficiency * 100.0);
+
+        free_node(filter);
+    }
+
+    printf("\n  ]\n}\n");
+
+    free_node(source);
+    free_node(mask);
+
+    return 0;
+}